@@ -18,8 +18,38 @@
 
 #define MSL 8192 /* MAX_STRING_LENGTH */
 #define MAX_LLEN 2048
+#define DETECT_QUIET		100	/* milliseconds of silence before probing for telnet, see -tp */
+#define DETECT_TIMEOUT		2	/* seconds of silence before assuming telnet */
+#define HANDSHAKE_TIMEOUT	10
+#define KEEPALIVE_TIMEOUT	15	/* seconds an HTTP connection may sit between requests */
+#define WS_PING_INTERVAL	30	/* seconds between pings to an RFC 6455 client */
+#define MENU_TIMEOUT		300
+#define CONNECT_TIMEOUT		15
+#define TOKEN_LENGTH		16	/* hex digits in a resume token */
+#define CONNECT_STAGGER		250	/* milliseconds between parallel attempts, RFC 8305 */
+#define MAX_ATTEMPTS		4	/* connection attempts in flight per node */
+#define FAILURE_LIMIT		3	/* failed connects in a row before a backend is dead */
+#define DEAD_RETRY			30	/* seconds a dead backend is avoided without health checks */
+#define ACCEPT_BATCH		64	/* connections taken off the backlog per wakeup */
+#define QUEUE_TIMEOUT		600	/* seconds a client may wait for a free slot */
+#define UPGRADE_TIMEOUT		10	/* seconds the new process gets to take over */
+#define UPGRADE_VERSION		7	/* of what goes over the handoff socket */
+#define WATCH_LAG			262144	/* bytes a spectator may fall behind by */
+#define TELNET_PROBE		"\xFF\xFD\x06"	/* IAC DO TIMING-MARK */
+#define WS_CONTROL_MAX		127		/* longest RFC 6455 control frame */
+#define WS_GUID				"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define MENU_PAGE			20		/* entries the menu shows at a time */
+#define SEARCH_MAX			64		/* longest menu search that is looked at */
+#define RESOLVE_AT_LOAD		64		/* bigger catalogs resolve names on first use */
+#define RESOLVE_INFLIGHT	8		/* lookups handed to the resolver at a time */
+#define PROBE_BATCH			64		/* backends health-checked per round */
+#define MAX_LISTENERS		8		/* ports besides -lp, see -pd */
 /* #define SYSLOG */
 
+#if defined( __linux__ ) && !defined( _GNU_SOURCE )
+# define _GNU_SOURCE	/* accept4() */
+#endif
+
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
@@ -36,11 +66,26 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <locale.h>
 #include <limits.h>
 #include "md5.h"
+#include "sha1.h"
+#include "ansi.h"
 #include "ini.h"
 #include "log.h"
+#include "http.h"
+#include "timer.h"
+#include "tls.h"
+#include "acl.h"
+#include "handoff.h"
+#include "webroot.h"
+#include "rec.h"
+#include "proxy.h"
+#include "tunnel.h"
+#include "h2.h"
 
 
 #if CHAR_BIT != 8
@@ -71,22 +116,92 @@
 #define SEND_TO_SERVER( node ) empty_buffer \
 		( node, node->server.socket_fd, node->server.buffer, &node->server.length );
 
-#define SEND_TO_CLIENT( node ) empty_buffer \
-		( node, node->client.socket_fd, node->client.buffer, &node->client.length );
+#define SEND_TO_CLIENT( node ) ( node->framing >= FRAME_TEXT ? ws_send( node ) : empty_buffer \
+		( node, node->client.socket_fd, node->client.buffer, &node->client.length ) );
+
+#if defined( TLS )
+# define CLIENT_TLS( node, file ) ( ( node )->ssl && ( file ) == ( node )->client.socket_fd )
+# define PEER_READ( node, file, buf, len ) ( CLIENT_TLS( node, file ) \
+		? tls_read( ( node )->ssl, buf, len ) : read( file, buf, len ) )
+# define PEER_WRITE( node, file, buf, len ) ( CLIENT_TLS( node, file ) \
+		? tls_write( ( node )->ssl, buf, len ) : write( file, buf, len ) )
+/* Decrypted bytes OpenSSL holds on to do not make the socket readable. */
+# define TLS_PENDING( node ) ( ( node )->ssl && SSL_pending( ( node )->ssl ) > 0 )
+# define TLS_HANDSHAKING( node ) ( ( node )->ssl && ( node )->tls_state != TLS_DONE )
+# define TLS_WANTS_WRITE( node ) ( ( node )->ssl && ( node )->tls_state == TLS_WANT_WRITE )
+# define SECURE( node ) ( ( node )->ssl != NULL )
+#else
+# define PEER_READ( node, file, buf, len ) read( file, buf, len )
+# define PEER_WRITE( node, file, buf, len ) write( file, buf, len )
+# define TLS_PENDING( node ) 0
+# define TLS_HANDSHAKING( node ) 0
+# define TLS_WANTS_WRITE( node ) 0
+# define SECURE( node ) 0
+#endif
+
+#if defined( RECORD )
+# define RECORD_DATA( node, kind, data, len ) \
+		( ( node )->rec ? record( node, kind, data, len ) : (void) 0 )
+#else
+# define RECORD_DATA( node, kind, data, len ) ( (void) 0 )
+#endif
+
+/* Static tracepoints for bpftrace and the like, provider "whitelantern"
+   (make usdt). Each is a single nop until something attaches to it, and
+   nothing at all in other builds. The first two arguments are the node's
+   id and the socket the event is about:
+
+	accept			id, fd
+	handshake		id, fd, "tls", "websocket" or "proxy"
+	classify		id, fd, "telnet", "websocket", "http" or "h2"
+	connect_start	id, fd, backend name
+	connect_end		id, fd, errno or 0
+	read			id, fd, bytes
+	write_partial	id, fd, bytes written, bytes still held
+	stall			id, fd, bytes held: no more is read from fd until they go
+	disconnect		id, fd, reason, see disconnect() */
+#if defined( USDT )
+# include <sys/sdt.h>
+# define STALL_CLIENT	1
+# define STALL_SERVER	2
+# define TRACE2( name, a, b ) DTRACE_PROBE2( whitelantern, name, a, b )
+# define TRACE3( name, a, b, c ) DTRACE_PROBE3( whitelantern, name, a, b, c )
+# define TRACE4( name, a, b, c, d ) DTRACE_PROBE4( whitelantern, name, a, b, c, d )
+/* Fires once as reading from the socket stops, not on every pass. */
+# define TRACE_STALL( node, side, fd, held ) \
+		( ( node )->stalled & ( side ) ? (void) 0 \
+		: ( ( node )->stalled |= ( side ), TRACE3( stall, ( node )->id, fd, held ) ) )
+# define TRACE_FLOWING( node, side ) ( ( node )->stalled &= ~( side ) )
+#else
+# define TRACE2( name, a, b ) ( (void) 0 )
+# define TRACE3( name, a, b, c ) ( (void) 0 )
+# define TRACE4( name, a, b, c, d ) ( (void) 0 )
+# define TRACE_STALL( node, side, fd, held ) ( (void) 0 )
+# define TRACE_FLOWING( node, side ) ( (void) 0 )
+#endif
 
-#define WRITE( fildes, buf ) \
+#define WRITE( node, buf ) \
 do { \
-	ssize_t w = write( fildes, buf, strlen( buf ) ); \
+	ssize_t w = PEER_WRITE( node, ( node )->client.socket_fd, buf, strlen( buf ) ); \
 	if ( w > 0 ) \
 		bytes_sent += (unsigned long int) w; \
 } while ( 0 );
 
-#define UPPER( c ) ( ( c ) >= 'a' && ( c ) <= 'z' ? ( c ) + 'A' - 'a' : ( c ) )
-
 
 typedef struct mud_entry_data MUD_ENTRY;
+typedef struct backend_data BACKEND;
+typedef struct source_data SOURCE;
+typedef struct source_load_data SOURCE_LOAD;
+typedef struct attempt_data ATTEMPT;
+typedef struct probe_data PROBE;
+typedef struct lookup_data LOOKUP;
+typedef struct handoff_node_data HANDOFF_NODE;
+typedef struct chunk_data CHUNK;
+typedef struct catalog_data CATALOG;
+typedef struct canned_data CANNED;
 typedef struct node_data NODE;
 typedef struct peer_data PEER;
+typedef struct listener_data LISTENER;
 
 enum ConnectionType
 {
@@ -95,12 +210,239 @@ enum ConnectionType
 	WEB_SOCKETS
 };
 
+/* How text goes out to a client; also the index into pre-rendered responses */
+enum Framing
+{
+	FRAME_RAW,		/* telnet */
+	FRAME_HIXIE,	/* draft-hixie-thewebsocketprotocol-76, Latin-1 as UTF-8 */
+	FRAME_TEXT,		/* RFC 6455 text frames, Latin-1 as UTF-8 */
+	FRAME_BINARY,	/* RFC 6455 binary frames, the game's bytes as they are */
+	FRAME_SPANS,	/* RFC 6455 text frames of style runs, see ansi.h */
+	FRAMINGS
+};
+
+/* Room frame_text() needs for len bytes, whatever the framing */
+#define FRAMED_MAX( len ) ( ANSI_SPANS_MAX( len ) + 10 )
+
+/* RFC 6455 opcodes */
+#define WS_CONTINUATION	0x0
+#define WS_TEXT			0x1
+#define WS_BINARY		0x2
+#define WS_CLOSE		0x8
+#define WS_PING			0x9
+#define WS_PONG			0xA
+
+/* Whether the buffer the next read from either side goes to has room left.
+   A side we have no room for is not read from, so TCP pushes back on it. */
+#define CLIENT_ROOM( node ) ( ( node )->type == TELNET \
+		? ( node )->server.length < MSL - 1 : ( node )->server.prelen < MSL - 1 )
+#define SERVER_ROOM( node ) ( ( node )->detached || ( RAW_OUTPUT( node ) \
+		? ( node )->client.length < MSL - 1 : ( node )->client.prelen < MSL - 1 ) )
+
+/* Game output goes to client.buffer as it is, not through client.prebuf. */
+#define RAW_OUTPUT( node ) ( ( node )->type == TELNET || ( node )->framing == FRAME_BINARY )
+
+#define FRAMING( node ) ( ( node )->framing )
+
+/* The default game, from -mh and -mp, has no key. */
+#define ENTRY_NAME( entry ) ( ( entry )->key ? ( entry )->key : ( entry )->host )
+
+/* How long a new client may stay quiet before deadline_expired() looks at it */
+#define DETECT_DELAY ( probe_delay ? (unsigned long int) probe_delay : DETECT_TIMEOUT * 1000UL )
+
+/* Part of an RFC 6455 frame has gone out; nothing else may until the rest has. */
+#define MID_FRAME( node ) ( ( node )->head_off < ( node )->head_len || ( node )->frame_left > 0 )
+
+/* A spectator has shared game output it has not been sent yet. */
+#define WATCH_PENDING( node ) ( ( node )->cursor \
+		&& ( ( node )->cursor_off < ( node )->cursor->length || ( node )->cursor->next ) )
+
+#define MENU_PROMPT "\x1b[38;5;2mSelect a mud, or Q to quit\x1b[38;5;8m:\x1b[0m "
+#define MENU_HINT "Enter + or - to turn the page, or /name to search.\n"
+
+/* A response rendered once and shared, read-only, by every node sending it */
+struct canned_data
+{
+	char *data;
+	size_t length;
+};
+
+/* One resolved address of a MUD, with what we know about its health */
+struct backend_data
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char name[ sizeof( ( (struct sockaddr_un *) 0 )->sun_path ) + 8 ];	/* [2001:db8::1]:4000 */
+	unsigned int failures;	/* in a row */
+	int dead;
+	unsigned long int dead_until;	/* timer_now(), when health checks are off */
+	int probing;
+};
+
+/* A local address connections to a MUD may come from. Thousands of
+   sessions to one backend would run one address out of ephemeral ports,
+   or into the MUD's limit on connections per address. */
+struct source_data
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char name[ INET6_ADDRSTRLEN ];
+	SOURCE_LOAD *load;
+};
+
+/* Game connections made from a source address. Catalogs come and go with
+   SIGHUP but the connections stay, so the count lives outside them, one
+   per address for good, shared by every entry listing it. */
+struct source_load_data
+{
+	SOURCE_LOAD *next;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	unsigned long int count;
+};
+
 struct mud_entry_data
 {
-	char *host;
+	char *key;	/* section name without "host:" */
+	char *host;	/* one or more names or addresses, comma separated */
 	char *port;
 	char *name;
-	MUD_ENTRY *next;
+	int pass_client;	/* telnet clients go to a unix: backend for good */
+	int send_proxy;		/* the game gets a PROXY header with the client's address */
+	char *tunnel;		/* host:port of the hub sessions go through, see tunnel.h;
+						   host and port are then the hub's, and so are backends */
+	SOURCE *sources;
+	size_t source_count;
+	size_t next_source;	/* where the search for the least loaded starts */
+	BACKEND *backends;	/* in the order they are tried */
+	size_t backend_count;
+	int resolving;		/* a lookup for it is queued or with the resolver */
+};
+
+/* The list of MUDs and the access rules as read from the configuration
+   file. A catalog is never changed once loaded; SIGHUP builds a new one and
+   swaps it in, while nodes keep a reference to the one they were shown. */
+struct catalog_data
+{
+	unsigned int refs;
+	unsigned int version;
+	size_t count;
+	size_t size;
+	MUD_ENTRY *entries;
+	uint32_t *by_key;	/* entry numbers sorted by key, see catalog_find() */
+	uint32_t *by_name;	/* and by lowercased name, for prefix search */
+	char *folded;		/* every name lowercased, NUL after each */
+	uint32_t *folded_at;	/* where each entry's is */
+	CANNED banner[ FRAMINGS ];	/* with the first page of the menu */
+	ACL *acl;		/* NULL lets everyone in */
+	ACL *tunnel_from;	/* edges that may open tunnel links, NULL for none */
+	int deny_default;	/* for addresses no rule matches */
+	unsigned long int per_ip;		/* open connections per address */
+	unsigned long int accept_rate;	/* new connections per second per address */
+	unsigned long int accept_burst;
+	unsigned long int input_rate;	/* bytes per second from a player to the game */
+	unsigned long int input_burst;
+};
+
+/* Another port we listen on, whose clients go straight to one entry */
+struct listener_data
+{
+	int socket_fd;
+	uint16_t port;
+	const char *path;	/* of a Unix socket, instead of the port */
+	const char *key;
+	int tunnel;		/* takes links from edge proxies, not clients */
+};
+
+struct attempt_data
+{
+	int socket_fd;
+	BACKEND *backend;
+	SOURCE *source;		/* NULL when the system picks the address */
+};
+
+/* A health check: a connection opened to a backend and closed right away */
+struct probe_data
+{
+	PROBE *next;
+	int socket_fd;
+	BACKEND *backend;
+	CATALOG *catalog;	/* keeps the backend around */
+	TIMER timeout;
+};
+
+/* An entry whose names the resolver is to look up, see start_resolver() */
+struct lookup_data
+{
+	LOOKUP *next;
+	uint32_t id;
+	int sent;
+	MUD_ENTRY *entry;
+	CATALOG *catalog;	/* keeps the entry around; NULL for default_entry */
+};
+
+/* What goes over a handoff socket: to the new process on upgrade, to a
+   game on a unix: backend, and to and from the resolver */
+enum HandoffKind
+{
+	HO_LISTEN,		/* a listening socket, -lp first; the payload is UPGRADE_VERSION */
+	HO_NODE,		/* client and server socket, a HANDOFF_NODE and buffers */
+	HO_END,			/* bytes received and sent so far */
+	HO_CLIENT,		/* to a game on a unix: backend: the client's socket; the
+					   payload is its address, a newline and what it typed ahead */
+	HO_LOOKUP		/* to the resolver: an id, the names and the port; back: the
+					   id and the BACKENDs found */
+};
+
+#define HN_CLIENT		0x01	/* a client socket comes with it */
+#define HN_SERVER		0x02	/* a server socket comes with it, after the client */
+#define HN_MENU			0x04
+#define HN_DETACHED		0x08
+#define HN_CONNECTING	0x10	/* the new process starts connecting over */
+#define HN_QUEUED		0x20
+#define HN_WAITING		0x40
+#define HN_ROUTED		0x80	/* entry is where it goes once admitted */
+
+/* Followed by the server buffer and prebuffer, the client buffer and
+   prebuffer, what is left of the canned response and the resume ring. */
+struct handoff_node_data
+{
+	uint32_t type;
+	uint32_t flags;
+	uint32_t server_length;
+	uint32_t server_prelen;
+	uint32_t client_length;
+	uint32_t client_prelen;
+	uint32_t canned_len;
+	uint32_t ring_length;
+	char host[ 40 ];
+	char token[ TOKEN_LENGTH + 1 ];
+	char watch_token[ TOKEN_LENGTH + 1 ];
+	char entry[ 256 ];	/* key of the entry being connected to, or routed to;
+					   sections are up to MAX_SECTION in ini.c, "host:" and all */
+	char front[ PROXY_V1_MAX ];	/* empty unless it came through a balancer */
+	uint32_t framing;
+	uint32_t ws_opcode;
+	uint32_t head_len;
+	uint32_t head_off;
+	uint32_t frame_left;
+	uint32_t control_len;
+	char head[ WS_CONTROL_MAX ];
+	char control[ WS_CONTROL_MAX ];
+	ANSI sgr;
+};
+
+/* Game output framed once for everyone watching a session. A chunk is
+   held by the session while it is the newest, by the chunk before it and by
+   every spectator about to be sent it, so the list goes away behind the
+   slowest spectator. */
+struct chunk_data
+{
+	CHUNK *next;
+	unsigned int refs;
+	unsigned long int offset;	/* of its first byte in everything framed */
+	size_t length;
+	char *data;					/* right after the structure */
 };
 
 struct peer_data
@@ -115,59 +457,365 @@ struct peer_data
 struct node_data
 {
 	NODE *next;
+	unsigned long int id;	/* for tracing, unique in this process */
 	PEER server;
 	PEER client;
 	char host[ 40 ]; /* 2001:0db8:85a3:0000:0000:8a2e:0370:7334 */
 	enum ConnectionType type;
+	enum Framing framing;
+	int ws_opcode;		/* of the message coming in, for its continuations */
+	char head[ WS_CONTROL_MAX ];	/* header of the frame going out, or a control frame */
+	size_t head_len;
+	size_t head_off;
+	size_t frame_left;	/* bytes of client.buffer the frame going out still covers */
+	char control[ WS_CONTROL_MAX ];	/* goes out after that frame */
+	size_t control_len;
+	ANSI sgr;			/* where FRAME_SPANS output stopped parsing */
+	int probed;			/* sent TELNET_PROBE while still unknown */
 	int menu;
-	time_t date;
+	size_t menu_page;	/* shown last, counting from 0 */
+	MUD_ENTRY *route;	/* chosen by path or port, instead of the menu */
+	int connecting;
+	MUD_ENTRY *resolving;	/* waiting for the resolver before connecting to it */
+	MUD_ENTRY *entry;	/* being connected to */
+	SOURCE_LOAD *bound;	/* counts the game connection, if it came from a source */
+	int tunneled;		/* the server socket is a stream of a tunnel to a hub */
+	char *origin;		/* at a hub, the PROXY line the stream came with */
+	char *via;			/* the PROXY line of the HTTP/2 connection the client is a stream of */
+	char *front;		/* the PROXY line of the balancer the client came through */
+	int expect_proxy;	/* and the header saying so has not been read yet */
+	size_t next_backend;
+	ATTEMPT attempt[ MAX_ATTEMPTS ];
+	int attempts;		/* in flight */
+	TIMER stagger;
+	CATALOG *catalog;
+	const char *canned;	/* goes out before client.buffer */
+	size_t canned_len;
+	TIMER deadline;	/* detection, handshake, menu or connect, by state */
+	TIMER idle;
+	TIMER ping;			/* keeps an RFC 6455 connection from looking abandoned */
+	unsigned long int last_input;
+	HTTP_REQUEST request;
+	char *replay;		/* owned by the node, canned points into it */
+	size_t replay_size;
+	char *ring;			/* recent game output, for resuming */
+	size_t ring_total;	/* bytes ever put in the ring */
+	int detached;		/* client gone, waiting to be resumed */
+	ACL_HOST *source;	/* counts this connection against its address */
+	BUCKET input;		/* flood limit on what goes to the game */
+	TIMER throttle;
+	int throttled;		/* not reading from the client until it expires */
+	int admitted;		/* counts against max_connections */
+	int queued;			/* waiting in the admission queue */
+	int waiting;		/* was told it is queued, the banner comes later */
+	NODE *queue_next;
+	unsigned long int created;	/* timer_now() when accepted */
+	char token[ TOKEN_LENGTH + 1 ];
+	char watch_token[ TOKEN_LENGTH + 1 ];	/* for spectators, once connected */
+	CHUNK *watch_tail[ FRAMINGS ];	/* newest output framed for spectators */
+	unsigned int framed_for[ FRAMINGS ];	/* spectators wanting each framing */
+	ANSI watch_sgr;		/* the same for spectators' FRAME_SPANS chunks */
+	unsigned int watchers;
+	NODE *watching;		/* the session a spectator follows, until it ends */
+	CHUNK *cursor;		/* set for spectators: what goes out next, from */
+	size_t cursor_off;	/* this offset on */
+	unsigned long int http;	/* requests answered with files */
+	int responding;		/* an HTTP response is going out */
+	int keep_alive;		/* and the connection stays open after it */
+	WEB_FILE *file;		/* its body, from */
+	size_t file_off;	/* this offset on */
+	RECORDER *rec;		/* while the connection is being recorded */
+#if defined( USDT )
+	int stalled;		/* STALL_CLIENT, STALL_SERVER: traced as not being read */
+#endif
+#if defined( TLS )
+	SSL *ssl;
+	enum TlsResult tls_state;	/* TLS_DONE once the handshake is over */
+#endif
 };
 
 
 static void gentle_exit( int sig );
+static void request_reload( int sig );
+static void request_upgrade( int sig );
+static void request_stats( int sig );
+static void log_stats( void );
+static void begin_upgrade( void );
+static void exec_successor( int sock );
+static int handoff_possible( const NODE *node );
+static int send_node( int sock, NODE *node );
+static void take_over( void );
+static int restore_node( const char *data, size_t length, const int *fds, int nfds );
+static void handoff_connect( void *data );
+static int load_catalog( const char *file );
+static CATALOG *catalog_acquire( CATALOG *cat );
+static void render_catalog( CATALOG *cat );
+static void index_catalog( CATALOG *cat );
+static int by_key( const void *a, const void *b );
+static int by_name( const void *a, const void *b );
+static MUD_ENTRY *catalog_find( const CATALOG *cat, const char *key, size_t length );
+static void show_page( NODE *node, size_t page );
+static void search_catalog( NODE *node, const char *term );
+static size_t list_entry( char *out, const CATALOG *cat, size_t i );
+static void send_text( NODE *node, const char *text, size_t length );
+static void render_canned( CANNED *c, const char *text, size_t length );
+static void prepare_responses( void );
+static int send_canned( NODE *node );
+static void catalog_release( CATALOG *cat );
 static void start_listening( void );
-static void disconnect( NODE *node );
+static int open_listener( uint16_t port );
+static int open_unix_listener( const char *path );
+static MUD_ENTRY *find_route( const CATALOG *cat, const char *path, size_t length );
+static int trusted_origin( const NODE *node );
+static void disconnect( NODE *node, const char *reason );
+static void release_node( NODE *node );
+static NODE *new_node( void );
+static int node_room( void );
+static int relieve_pressure( void );
+static NODE *shed_candidate( void );
+static char *replay_alloc( NODE *node, size_t size );
+static void replay_free( NODE *node );
 static void connect_to_mud( NODE *node, MUD_ENTRY *entry );
-static void accept_connection( void );
+static void resolve_entry( MUD_ENTRY *entry );
+static int numeric_names( const char *host );
+static void hub_names( MUD_ENTRY *entry );
+static void start_resolver( void );
+static void resolver_main( int sock );
+static void lookup( MUD_ENTRY *entry, CATALOG *cat );
+static void send_lookups( void );
+static void on_resolver( void );
+static int open_connection( BACKEND *backend, SOURCE *source );
+static SOURCE *pick_source( MUD_ENTRY *entry, int family );
+static int parse_sources( MUD_ENTRY *e, const char *value );
+static SOURCE_LOAD *source_load( const SOURCE *source );
+static int send_proxy_header( NODE *node );
+static size_t client_origin( const NODE *node, char *out );
+static int game_connected( NODE *node, int local );
+#if defined( TUNNEL )
+static void tunnel_connect( NODE *node );
+static int tunnel_stream( int fd, const char *key, const char *origin );
+static int tunnel_peer( const char *host );
+#endif
+static int backend_alive( const BACKEND *backend );
+static void backend_failed( BACKEND *backend );
+static void backend_ok( BACKEND *backend );
+static int next_attempt( NODE *node );
+static int unix_backend( BACKEND *backend, const char *path );
+static int pass_client( NODE *node );
+static void stagger_expired( void *data );
+static void health_check( void *data );
+static void start_probe( BACKEND *backend, CATALOG *cat );
+static void probe_expired( void *data );
+static void probe_done( PROBE *probe, int error );
+static void accept_connection( int listener, const char *key, int local );
+static NODE *new_connection( int socket_fd, const struct sockaddr_in6 *sock, const char *key,
+							 const char *origin );
+static void await_proxy( int socket_fd, const struct sockaddr_in6 *sock, const char *key );
+static int open_allowed( int socket_fd, const struct sockaddr_in6 *sock, char *host );
+static int admit_client( int socket_fd, const struct sockaddr_in6 *sock, const char *host,
+						 ACL_HOST **source );
+static NODE *open_node( int socket_fd, const char *host, const char *key );
+static void enter_node( NODE *node, const char *how, const char *through );
+static int read_proxy( NODE *node );
+static int proxy_received( NODE *node, struct sockaddr_in6 *src, const struct sockaddr_in6 *dst );
+static int host_address( const char *host, struct sockaddr_in6 *sock );
+static void queue_notice( NODE *node );
+static void admit_next( void );
+static int admit( const unsigned char *addr, const char *host, ACL_HOST **source );
+static size_t input_allowance( NODE *node, size_t room );
+static void throttle_input( NODE *node, size_t bytes );
+static void throttle_expired( void *data );
+static void deadline_expired( void *data );
+static void idle_expired( void *data );
+static void start_pings( NODE *node );
+static void ping_due( void *data );
+static int finish_connect( NODE *node, fd_set *out_set );
+static void drop_client( NODE *node );
+static void new_token( char *token );
+static NODE *find_session( const char *token, size_t length );
+static NODE *find_watched( const char *token, size_t length );
+static void watch_session( NODE *node, NODE *target );
+static void watch_append( NODE *node, const char *data, size_t length );
+static int send_watch( NODE *node );
+static void chunk_release( CHUNK *chunk );
+static void resume_session( NODE *node, NODE *old );
+static void ring_append( NODE *node, const char *data, size_t length );
+static size_t ring_copy( const NODE *node, char *out );
+#if defined( TLS )
+static int tls_detect( NODE *node );
+static int tls_handshake( NODE *node );
+#endif
+#if defined( RECORD )
+static void record( NODE *node, int kind, const char *data, size_t length );
+static void record_stop( NODE *node );
+#endif
 static int fill_buffer( NODE *node, int file, char *inbuf, size_t bufsize, size_t *len );
 static void empty_buffer( NODE *node, int file, char *outbuf, size_t *len );
 static int on_server_data( NODE *node );
 static int on_client_data( NODE *node );
 static void the_main_loop( void );
 static int read_menu_choice( NODE *node );
+static int handshake_prefix( const NODE *node );
+static int telnet_detected( NODE *node );
+static int start_h2( NODE *node );
+static int h2_request( int fd, const char *key, const struct sockaddr_in6 *peer, const char *origin );
 static int determine_connection_type( NODE *node );
 static void banner( NODE *node );
 static int parse_headers( NODE *node );
+static int serve_file( NODE *node );
+static int send_file( NODE *node );
+static int hixie_key( NODE *node, char *out );
+static void ws_accept( const char *key, size_t length, char *out );
 static int ws_encode( NODE *node );
+static int ws_encode_text( NODE *node );
+static int ws_encode_spans( NODE *node );
+static size_t frame_text( enum Framing framing, ANSI *sgr, char *out, const char *in, size_t len );
+static size_t ws_frame( char *out, const char *in, size_t len );
+static size_t ws_header( char *out, int opcode, size_t length );
 static int ws_decode( NODE *node );
+static int ws_decode_6455( NODE *node );
+static void ws_send( NODE *node );
+static ssize_t peer_writev( NODE *node, const struct iovec *iov, int count );
 static void parse_options( int argc, char **argv );
 static int parse_ini_entry( const char *section, const char *name, const char *value );
-static char *stristr( char *String, const char *Pattern, int end );
+static int parse_access( const char *name, const char *value );
 
 
 /* Globals */
 int keep_running = 1;
+volatile sig_atomic_t reload_pending;
+volatile sig_atomic_t upgrade_pending;
+volatile sig_atomic_t stats_pending;
+char **saved_argv;
+int upgrade_fd = -1;
 NODE *node_list;
 NODE *reuse_list;
-MUD_ENTRY *mud_entries;
-int listen_socket;
+CATALOG *catalog;
+CATALOG *loading;
+CATALOG *sorting;	/* for qsort() in index_catalog() */
+size_t health_cursor;	/* where the last round of health checks stopped */
+const char *config_file;
+int listen_socket = -1;
 uint16_t listen_port = 8017;
+LISTENER listeners[ MAX_LISTENERS ];
+int listener_count;
+int listeners_taken;	/* of those, from the process we took over from */
+int expect_proxy;		/* clients come through a balancer, PROXY header first */
+unsigned long int proxy_pending;	/* connections still waiting for theirs */
 const char *default_port = "4000";
 const char *default_host = "127.0.0.1";
 unsigned long int bytes_recv, bytes_sent;
 unsigned long int nodes_allocated;
+unsigned long int nodes_created;	/* the last node id handed out */
 unsigned long int node_count;
+unsigned long int idle_timeout;
+unsigned long int resume_grace;
+size_t resume_ring = 16384;
+unsigned long int health_interval;	/* off unless -hc asks: probes look like logins to a MUD */
+long int probe_delay = -1;	/* milliseconds, 0 never probes; -1 until main() decides */
+int listen_backlog = 128;
+unsigned long int max_connections;
+unsigned long int queue_size = 32;
+unsigned long int spectator_limit;
+const char *record_dir;
+const char *web_origins;	/* besides the proxy's own, see trusted_origin() */
+size_t memory_budget;	/* 0 for none */
+size_t memory_used;		/* by nodes, free or not, rings, replays and chunks */
+unsigned long int admitted_count;
+unsigned long int queued_count;
+NODE *queue_head;
+NODE *queue_tail;
+MUD_ENTRY default_entry;
+PROBE *probe_list;
+int resolver_fd = -1;
+pid_t resolver_pid;
+LOOKUP *lookup_list;	/* oldest first */
+uint32_t lookup_serial;
+TIMER health_timer;
+#if defined( TLS )
+const char *tls_cert;
+const char *tls_key;
+SSL_CTX *tls_ctx;
+#endif
+int urandom = -1;
+CANNED policy;
+CANNED prompt[ FRAMINGS ];
 
 
 int main( int argc, char **argv )
 {
 	setlocale( LC_CTYPE, "en_US.UTF-8" );
 	OPENLOG( "WhiteLantern", LOG_PID, LOG_LOCAL4 ); /* Caution: LOG_LOCAL4 */
+	saved_argv = argv;
 	parse_options( argc, argv );
+
+	if ( !http_init( ) )
+	{
+		wraplog( "Bug: HTTP header names collide in the hash table." );
+		exit( 1 );
+	}
+
+#if defined( TLS )
+	if ( tls_cert && !( tls_ctx = tls_init( tls_cert, tls_key ? tls_key : tls_cert ) ) )
+	{
+		wraplog( "Cannot set up TLS with %s.", tls_cert );
+		exit( 1 );
+	}
+#endif
+
+	/* A TLS client or browser slow to send its first bytes would take the
+	   probe for garbage, so where they are expected telnet clients that
+	   wait for the game to speak first get the banner at DETECT_TIMEOUT. */
+	if ( probe_delay < 0 )
+	{
+		probe_delay = webroot_active( ) ? 0 : DETECT_QUIET;
+#if defined( TLS )
+		if ( tls_ctx )
+			probe_delay = 0;
+#endif
+	}
+
+	prepare_responses( );
+
+#if defined( TUNNEL )
+	tunnel_init( tunnel_stream, tunnel_peer );
+#endif
+	h2_init( h2_request );
+
+	if ( ( resume_grace || spectator_limit ) && ( urandom = open( "/dev/urandom", O_RDONLY ) ) < 0 )
+	{
+		wraperror( "main: /dev/urandom" );
+		exit( 1 );
+	}
+
+	start_resolver( );
+
 	signal( SIGINT, gentle_exit );
-	start_listening( );
+	signal( SIGHUP, request_reload );
+	signal( SIGUSR2, request_upgrade );
+	signal( SIGUSR1, request_stats );
+	timer_init( );
+
+	if ( health_interval )
+		timer_set( &health_timer, health_interval * 1000UL, health_check, NULL );
+
+	if ( upgrade_fd >= 0 )
+		take_over( );
+	else
+		start_listening( );
+
 	the_main_loop( );
 
+#if defined( RECORD )
+	{
+		NODE *node;
+
+		/* Half-full blocks would be lost otherwise. */
+		for ( node = node_list; node; node = node->next )
+			record_stop( node );
+	}
+#endif
+
 	wraplog( "Bytes received: %lu, sent: %lu.", bytes_recv, bytes_sent );
 	wraplog( "Nodes allocated: %lu.", nodes_allocated );
 
@@ -184,608 +832,4692 @@ static void gentle_exit( int sig )
 }
 
 
-static void start_listening( void )
+static void request_reload( int sig )
 {
-	static struct sockaddr_in6 sa_zero;
-		   struct sockaddr_in6 sa;
-	int x = 1;
+	reload_pending = 1;
+
+	return;
+}
+
+
+static void request_upgrade( int sig )
+{
+	upgrade_pending = 1;
+
+	return;
+}
+
+
+static void request_stats( int sig )
+{
+	stats_pending = 1;
+
+	return;
+}
+
+
+static void log_stats( void )
+{
+	unsigned long int free_nodes = 0;
+	NODE *node;
+
+	for ( node = reuse_list; node; node = node->next )
+		free_nodes++;
+
+	wraplog( "SIGUSR1: memory %lu of %lu bytes, nodes %lu in use and %lu free, "
+			 "%lu admitted, %lu queued, %lu awaiting a PROXY header.",
+			 (unsigned long int) memory_used, (unsigned long int) memory_budget,
+			 node_count, free_nodes, admitted_count, queued_count, proxy_pending );
+	wraplog( "SIGUSR1: bytes received: %lu, sent: %lu, files cached: %lu.",
+			 bytes_recv, bytes_sent, (unsigned long int) webroot_cached( ) );
+
+	return;
+}
 
-	listen_socket = socket( AF_INET6, SOCK_STREAM, 0 );
+
+/* Starts the binary on disk with the same options and hands it the
+   listening socket and every session it can carry on with. Until the new
+   process says it has everything, nothing is given up here, so a failed
+   upgrade leaves things as they were. Sessions that cannot move (TLS ones
+   still in OpenSSL's hands) stay with this process, which exits once the
+   last of them ends. */
+static void begin_upgrade( void )
+{
+	struct timeval tv;
+	NODE *node, *next_node;
+	unsigned long int stats[ 2 ];
+	uint32_t version = UPGRADE_VERSION;
+	int sv[ 2 ], moved = 0, kept = 0, i;
+	char ack;
+	pid_t pid;
 
 	if ( listen_socket < 0 )
 	{
-		wraperror( "start_listening: socket" );
-		exit( 1 );
+		wraplog( "SIGUSR2: already handed over, ignored." );
+		return;
 	}
 
-	if ( setsockopt( listen_socket, SOL_SOCKET, SO_REUSEADDR,
-					 (char *) &x, sizeof( x ) ) < 0 )
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
 	{
-		wraperror( "start_listening: SO_REUSEADDR" );
-		close( listen_socket );
-		exit( 1 );
+		wraperror( "begin_upgrade: socketpair" );
+		return;
 	}
 
-	sa			    = sa_zero;
-	sa.sin6_family  = AF_INET6;
-	sa.sin6_port	= htons( listen_port );
+	if ( ( pid = fork( ) ) < 0 )
+	{
+		wraperror( "begin_upgrade: fork" );
+		close( sv[ 0 ] );
+		close( sv[ 1 ] );
+		return;
+	}
 
-	if ( bind( listen_socket, (struct sockaddr *) &sa, sizeof( sa ) ) < 0 )
+	if ( pid == 0 )
+		exec_successor( sv[ 1 ] );
+
+	close( sv[ 1 ] );
+
+	tv.tv_sec = UPGRADE_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt( sv[ 0 ], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+	setsockopt( sv[ 0 ], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof( tv ) );
+
+	if ( !handoff_send( sv[ 0 ], HO_LISTEN, &listen_socket, 1, &version, sizeof( version ) ) )
+		goto failed;
+
+	/* The new process has the same options, so it knows them by order. */
+	for ( i = 0; i < listener_count; i++ )
+		if ( !handoff_send( sv[ 0 ], HO_LISTEN, &listeners[ i ].socket_fd, 1,
+							&version, sizeof( version ) ) )
+			goto failed;
+
+	for ( node = node_list; node; node = node->next )
+		if ( handoff_possible( node ) && !send_node( sv[ 0 ], node ) )
+			goto failed;
+
+	stats[ 0 ] = bytes_recv;
+	stats[ 1 ] = bytes_sent;
+
+	if ( !handoff_send( sv[ 0 ], HO_END, NULL, 0, stats, sizeof( stats ) )
+	  || read( sv[ 0 ], &ack, 1 ) != 1 )
+		goto failed;
+
+	close( sv[ 0 ] );
+
+	/* They are the new process's now; let go of our copies quietly. */
+	for ( node = node_list; node; node = next_node )
 	{
-		wraperror( "start_listening: bind" );
-		close( listen_socket );
-		exit( 1 );
+		next_node = node->next;
+
+		if ( handoff_possible( node ) )
+		{
+			release_node( node );
+			moved++;
+		}
+		else
+			kept++;
 	}
 
-	if ( listen( listen_socket, 5 ) < 0 )
+	close( listen_socket );
+	listen_socket = -1;
+
+	for ( i = 0; i < listener_count; i++ )
 	{
-		wraperror( "start_listening: listen" );
-		close( listen_socket );
-		exit( 1 );
+		close( listeners[ i ].socket_fd );
+		listeners[ i ].socket_fd = -1;
 	}
 
-	fcntl( listen_socket, F_SETFL, O_NONBLOCK );
-	wraplog( "WhiteLantern: listening on port %d.", listen_port );
+	wraplog( "SIGUSR2: process %d took over with %d sessions, %d stay here.",
+			 (int) pid, moved, kept );
 
-	if ( !mud_entries )
-		wraplog( "WhiteLantern: default host: %s:%s.", default_host, default_port );
+#if defined( TUNNEL )
+	tunnel_drain( );
+#endif
+	h2_drain( );
+
+	return;
+
+failed:
+	wraperror( "SIGUSR2: upgrade failed, carrying on" );
+	close( sv[ 0 ] );
+	kill( pid, SIGKILL );
+	waitpid( pid, NULL, 0 );
 
 	return;
 }
 
 
-static void disconnect( NODE *node )
+/* In the child: nothing but the handoff socket survives exec. */
+static void exec_successor( int sock )
 {
-	NODE *node2;
+	static char uf[] = "-uf";
+	char fd[ 16 ], **argv;
+	int argc, i, n = 0;
 
-	wraplog( "Disconnecting client: %s/%d, current node count: %lu",
-			 node->host, node->client.socket_fd, node_count );
-
-	if ( node->server.socket_fd )
-		close( node->server.socket_fd );
+	for ( i = 3; i < FD_SETSIZE; i++ )
+		if ( i != sock )
+			close( i );
 
-	if ( node->client.socket_fd )
-		close( node->client.socket_fd );
+	for ( argc = 0; saved_argv[ argc ]; argc++ )
+		;
 
-	node->server.socket_fd = node->client.socket_fd = 0;
+	argv = malloc( (size_t) ( argc + 3 ) * sizeof( char * ) );
 
-	if ( node_list == node )
-		node_list = node->next;
-	else
-		for ( node2 = node_list; node2; node2 = node2->next )
-			if ( node2->next == node )
-			{
-				node2->next = node->next;
-				break;
-			}
+	for ( i = 0; i < argc; i++ )
+		if ( !strcmp( saved_argv[ i ], "-uf" ) && i + 1 < argc )
+			i++;
+		else
+			argv[ n++ ] = saved_argv[ i ];
 
-	node->next = reuse_list;
-	reuse_list = node;
-	node_count--;
+	sprintf( fd, "%d", sock );
+	argv[ n++ ] = uf;
+	argv[ n++ ] = fd;
+	argv[ n ] = NULL;
 
-	return;
+	execvp( argv[ 0 ], argv );
+	wraperror( "exec_successor: %s", argv[ 0 ] );
+	_exit( 1 );
 }
 
 
-static void connect_to_mud( NODE *node, MUD_ENTRY *entry )
+static int handoff_possible( const NODE *node )
 {
-	struct addrinfo hints, *res;
-	const char *host, *port;
+#if defined( TLS )
+	if ( node->ssl )
+		return 0;
+#endif
 
-	memset( &hints, 0, sizeof( hints ) );
+	/* Spectators hold on to output that was framed here; browsers fetching
+	   files just open another connection. Tunnel links and HTTP/2
+	   connections stay here too, and so does a balancer's connection that
+	   has not sent its PROXY header yet. */
+	return !node->cursor && !node->http && !node->tunneled && !node->origin && !node->via
+		&& !node->expect_proxy && !node->resolving;
+}
 
-	hints.ai_family = AF_UNSPEC; /* IPv4 or IPv6 */
-	hints.ai_socktype = SOCK_STREAM;
 
-	if ( !entry )
+static int send_node( int sock, NODE *node )
+{
+	HANDOFF_NODE rec;
+	char *payload, *p;
+	size_t length;
+	int fds[ 2 ], nfds = 0, ok;
+
+	memset( &rec, 0, sizeof( rec ) );
+	rec.type = (uint32_t) node->type;
+	rec.server_length = (uint32_t) node->server.length;
+	rec.server_prelen = (uint32_t) node->server.prelen;
+	rec.client_length = (uint32_t) node->client.length;
+	rec.client_prelen = (uint32_t) node->client.prelen;
+	rec.canned_len = (uint32_t) node->canned_len;
+	rec.ring_length = (uint32_t) ( node->ring
+		? ( node->ring_total < resume_ring ? node->ring_total : resume_ring ) : 0 );
+	strcpy( rec.host, node->host );
+	strcpy( rec.token, node->token );
+	strcpy( rec.watch_token, node->watch_token );
+	if ( node->front )
+		strcpy( rec.front, node->front );
+	rec.framing = (uint32_t) node->framing;
+	rec.ws_opcode = (uint32_t) node->ws_opcode;
+	rec.sgr = node->sgr;
+	rec.head_len = (uint32_t) node->head_len;
+	rec.head_off = (uint32_t) node->head_off;
+	rec.frame_left = (uint32_t) node->frame_left;
+	rec.control_len = (uint32_t) node->control_len;
+	memcpy( rec.head, node->head, sizeof( rec.head ) );
+	memcpy( rec.control, node->control, sizeof( rec.control ) );
+
+	if ( node->client.socket_fd )
 	{
-		host = default_host;
-		port = default_port;
+		rec.flags |= HN_CLIENT;
+		fds[ nfds++ ] = node->client.socket_fd;
 	}
-	else
+
+	if ( node->server.socket_fd )
 	{
-		host = entry->host;
-		port = entry->port;
+		rec.flags |= HN_SERVER;
+		fds[ nfds++ ] = node->server.socket_fd;
 	}
 
-	if ( getaddrinfo( host, port, &hints, &res ) )
+	if ( node->connecting )
 	{
-		WRITE( node->client.socket_fd, "Wrong host.\n\r" );
-		wraplog( "Wrong host!" );
-		disconnect( node );
-		return;
+		rec.flags |= HN_CONNECTING;
+		if ( node->entry != &default_entry )
+			strncpy( rec.entry, node->entry->key, sizeof( rec.entry ) - 1 );
 	}
+	else if ( node->route )
+	{
+		rec.flags |= HN_ROUTED;
+		strncpy( rec.entry, node->route->key, sizeof( rec.entry ) - 1 );
+	}
+
+	rec.flags |= ( node->menu ? HN_MENU : 0 ) | ( node->detached ? HN_DETACHED : 0 )
+			   | ( node->queued ? HN_QUEUED : 0 ) | ( node->waiting ? HN_WAITING : 0 );
+
+	length = sizeof( rec ) + node->server.length + node->server.prelen
+		   + node->client.length + node->client.prelen + node->canned_len + rec.ring_length;
+	p = payload = malloc( length );
+
+	memcpy( p, &rec, sizeof( rec ) );
+	p += sizeof( rec );
+	memcpy( p, node->server.buffer, node->server.length );
+	p += node->server.length;
+	memcpy( p, node->server.prebuf, node->server.prelen );
+	p += node->server.prelen;
+	memcpy( p, node->client.buffer, node->client.length );
+	p += node->client.length;
+	memcpy( p, node->client.prebuf, node->client.prelen );
+	p += node->client.prelen;
+	if ( node->canned_len )
+		memcpy( p, node->canned, node->canned_len );
+	p += node->canned_len;
+
+	if ( node->ring )
+		ring_copy( node, p );
+
+	ok = handoff_send( sock, HO_NODE, fds, nfds, payload, length );
+	free( payload );
+
+	return ok;
+}
+
+
+/* In the new process: takes everything begin_upgrade() sends and tells it
+   we are ready. Any trouble before that, and we just go away. */
+static void take_over( void )
+{
+	int fds[ HANDOFF_MAX_FDS ], nfds;
+	unsigned long int sessions = 0;
+	unsigned int kind;
+	size_t length;
+	void *data;
+	char ack = 'k';
 
-	node->server.socket_fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
-	if ( node->server.socket_fd < 0 )
+	for ( ;; )
 	{
-		WRITE( node->client.socket_fd, "Wrong socket.\n\r" );
-		wraplog( "Wrong socket!" );
-		disconnect( node );
-		freeaddrinfo( res );
-		return;
+		if ( !handoff_recv( upgrade_fd, &kind, fds, &nfds, &data, &length ) )
+		{
+			wraperror( "take_over: handoff_recv" );
+			exit( 1 );
+		}
+
+		if ( kind == HO_LISTEN && nfds == 1 && length == sizeof( uint32_t )
+		  && *(uint32_t *) data == UPGRADE_VERSION && listen_socket < 0 )
+			listen_socket = fds[ 0 ];
+		else if ( kind == HO_LISTEN && nfds == 1 && length == sizeof( uint32_t )
+			   && *(uint32_t *) data == UPGRADE_VERSION && listeners_taken < listener_count )
+			listeners[ listeners_taken++ ].socket_fd = fds[ 0 ];
+		else if ( kind == HO_NODE && listen_socket >= 0
+			   && restore_node( data, length, fds, nfds ) )
+			sessions++;
+		else if ( kind == HO_END && listen_socket >= 0 && listeners_taken == listener_count
+			   && length == 2 * sizeof( unsigned long int ) )
+		{
+			memcpy( &bytes_recv, data, sizeof( unsigned long int ) );
+			memcpy( &bytes_sent, (char *) data + sizeof( unsigned long int ),
+					sizeof( unsigned long int ) );
+			free( data );
+			break;
+		}
+		else
+		{
+			wraplog( "take_over: unexpected message %u, giving up.", kind );
+			exit( 1 );
+		}
+
+		free( data );
 	}
 
-	if ( connect( node->server.socket_fd, res->ai_addr, res->ai_addrlen ) < 0 )
+	if ( write( upgrade_fd, &ack, 1 ) != 1 )
 	{
-		WRITE( node->client.socket_fd, "Could not connect to game.\n\r" );
-		wraplog( "Could not connect to game." );
-		disconnect( node );
-		freeaddrinfo( res );
-		return;
+		wraperror( "take_over: write" );
+		exit( 1 );
 	}
 
-	freeaddrinfo( res );
+	close( upgrade_fd );
+	upgrade_fd = -1;
+
+	wraplog( "WhiteLantern: took over port %d and %lu sessions.", listen_port, sessions );
 
 	return;
 }
 
 
-static void accept_connection( void )
+/* Rebuilds a node from what send_node() wrote. Timers start over for
+   whatever state the node is in. A partial request head is parsed over again
+   when the rest of it arrives. Connecting starts over from the main loop,
+   once the old process has let go. */
+static int restore_node( const char *data, size_t length, const int *fds, int nfds )
 {
-	NODE *node;
-	struct sockaddr_in6 sock;
-	unsigned int socksize = sizeof( sock );
-	char buf[ 128 ];
-	int socket_fd = accept( listen_socket, (struct sockaddr *) &sock, &socksize);
+	HANDOFF_NODE rec;
+	const char *p = data + sizeof( rec );
+	unsigned char addr[ 16 ];
+	NODE *node, *tail;
+	int f = 0;
 
-	if ( socket_fd < 0 )
-	{
-		wraperror( "accept_connection: accept" );
-		return;
-	}
+	if ( length < sizeof( rec ) )
+		return 0;
+
+	memcpy( &rec, data, sizeof( rec ) );
+
+	if ( rec.server_length >= MSL || rec.server_prelen >= MSL
+	  || rec.client_length >= MSL || rec.client_prelen >= MSL
+	  || length != sizeof( rec ) + rec.server_length + rec.server_prelen + rec.client_length
+				  + rec.client_prelen + rec.canned_len + rec.ring_length
+	  || nfds != !!( rec.flags & HN_CLIENT ) + !!( rec.flags & HN_SERVER )
+	  || rec.framing >= FRAMINGS || rec.head_off > rec.head_len
+	  || rec.head_len > WS_CONTROL_MAX || rec.control_len > WS_CONTROL_MAX
+	  || rec.frame_left > rec.client_length
+	  || rec.sgr.fg > 255 || rec.sgr.bg > 255
+	  || rec.sgr.params < 0 || rec.sgr.params >= ANSI_MAX_PARAMS )
+		return 0;
+
+	node = new_node( );
 
-	if ( ( fcntl( socket_fd, F_SETFL, O_NONBLOCK ) ) < 0 )
+	/* Keep the order the old process had. */
+	for ( tail = node_list; tail && tail->next; tail = tail->next )
+		;
+
+	if ( tail )
+		tail->next = node;
+	else
+		node_list = node;
+
+	if ( rec.flags & HN_CLIENT )
+		node->client.socket_fd = fds[ f++ ];
+	if ( rec.flags & HN_SERVER )
+		node->server.socket_fd = fds[ f++ ];
+
+	node->type = (enum ConnectionType) rec.type;
+	node->menu = !!( rec.flags & HN_MENU );
+	node->detached = !!( rec.flags & HN_DETACHED );
+	node->waiting = !!( rec.flags & HN_WAITING );
+	memcpy( node->host, rec.host, sizeof( node->host ) - 1 );
+	memcpy( node->token, rec.token, TOKEN_LENGTH );
+	memcpy( node->watch_token, rec.watch_token, TOKEN_LENGTH );
+	if ( rec.front[ 0 ] && memchr( rec.front, '\0', sizeof( rec.front ) ) )
+		node->front = strdup( rec.front );
+	node->framing = (enum Framing) rec.framing;
+	node->ws_opcode = (int) rec.ws_opcode;
+	node->sgr = rec.sgr;
+	node->head_len = rec.head_len;
+	node->head_off = rec.head_off;
+	node->frame_left = rec.frame_left;
+	node->control_len = rec.control_len;
+	memcpy( node->head, rec.head, sizeof( node->head ) );
+	memcpy( node->control, rec.control, sizeof( node->control ) );
+	node->catalog = catalog_acquire( catalog );
+	http_reset( &node->request );
+	node->last_input = node->created = timer_now( );
+
+	node->server.length = rec.server_length;
+	memcpy( node->server.buffer, p, rec.server_length );
+	p += rec.server_length;
+	node->server.prelen = rec.server_prelen;
+	memcpy( node->server.prebuf, p, rec.server_prelen );
+	p += rec.server_prelen;
+	node->client.length = rec.client_length;
+	memcpy( node->client.buffer, p, rec.client_length );
+	p += rec.client_length;
+	node->client.prelen = rec.client_prelen;
+	memcpy( node->client.prebuf, p, rec.client_prelen );
+	p += rec.client_prelen;
+
+	if ( rec.canned_len )
 	{
-		wraperror( "accept_connection: fcntl" );
-		return;
+		replay_alloc( node, rec.canned_len );
+		memcpy( node->replay, p, rec.canned_len );
+		node->canned = node->replay;
+		node->canned_len = rec.canned_len;
+		p += rec.canned_len;
 	}
 
-	if ( ( getpeername( socket_fd, (struct sockaddr *) &sock, &socksize ) ) < 0 )
+	if ( resume_grace && ( rec.ring_length || node->server.socket_fd || rec.flags & HN_CONNECTING ) )
 	{
-		wraperror( "accept_connection: getpeername" );
-		return;
+		node->ring = malloc( resume_ring );
+		memory_used += resume_ring;
+		ring_append( node, p, rec.ring_length );
 	}
 
-	if ( !reuse_list )
+	if ( rec.flags & HN_QUEUED )
 	{
-		nodes_allocated++;
-		node = calloc( sizeof( NODE ), 1 );
+		node->queued = 1;
+		queued_count++;
+
+		if ( queue_tail )
+			queue_tail->queue_next = node;
+		else
+			queue_head = node;
+
+		queue_tail = node;
 	}
 	else
 	{
-		node = reuse_list;
-		reuse_list = reuse_list->next;
-		memset( node, 0, sizeof( NODE ) );
+		node->admitted = 1;
+		admitted_count++;
 	}
 
-	node_count++;
-	node->client.socket_fd = socket_fd;
-	node->next = node_list;
-	node->type = UNKNOWN;
-	time( &node->date );
-	node_list = node;
-
-	if ( !inet_ntop( sock.sin6_family, &sock.sin6_addr, buf, sizeof( buf ) ) )
+	if ( catalog && ( catalog->per_ip || catalog->accept_rate ) )
 	{
-		wraperror( "accept_connection: inet_ntop" );
-		disconnect( node );
-		return;
+		memset( addr, 0, sizeof( addr ) );
+
+		if ( inet_pton( AF_INET, node->host, addr + 12 ) == 1 )
+			addr[ 10 ] = addr[ 11 ] = 0xFF;
+		else if ( inet_pton( AF_INET6, node->host, addr ) != 1 )
+			memset( addr, 0, sizeof( addr ) );
+
+		node->source = acl_host( addr, catalog->accept_burst, timer_now( ) );
+		node->source->count++;
 	}
 
-	buf[ 39 ] = '\0';
-	if ( !strncmp( buf, "::ffff:", 7 ) )
-		strcpy( node->host, buf + 7 );
-	else
-		strcpy( node->host, buf );
+	if ( rec.flags & HN_ROUTED )
+		node->route = catalog_find( node->catalog, rec.entry, strlen( rec.entry ) );
 
-	wraplog( "Accepted connection from %s/%d, current node count: %lu",
-			 node->host, node->client.socket_fd, node_count );
+	if ( rec.flags & HN_CONNECTING )
+	{
+		if ( !( node->entry = catalog_find( catalog, rec.entry, strlen( rec.entry ) ) ) )
+			node->entry = &default_entry;
 
-	return;
+		timer_set( &node->deadline, 0, handoff_connect, node );
+	}
+	else if ( node->detached )
+		timer_set( &node->deadline, resume_grace * 1000UL, deadline_expired, node );
+	else if ( node->waiting )
+		timer_set( &node->deadline, QUEUE_TIMEOUT * 1000UL, deadline_expired, node );
+	else if ( node->menu )
+		timer_set( &node->deadline, MENU_TIMEOUT * 1000UL, deadline_expired, node );
+	else if ( node->type == UNKNOWN )
+		timer_set( &node->deadline, ( node->server.prelen ? HANDSHAKE_TIMEOUT : DETECT_TIMEOUT )
+				   * 1000UL, deadline_expired, node );
+
+	if ( idle_timeout && node->client.socket_fd )
+		timer_set( &node->idle, idle_timeout * 1000UL, idle_expired, node );
+
+	if ( node->client.socket_fd )
+		start_pings( node );
+
+	return 1;
 }
 
 
-static int fill_buffer( NODE *node, int file, char *inbuf, size_t bufsize, size_t *len )
+static void handoff_connect( void *data )
 {
-	size_t llen = *len;
-	ssize_t count = read( file, inbuf + llen, bufsize - llen );
-	unsigned long int ucount = (unsigned long int) count;
+	NODE *node = data;
 
-	if ( count > 0 )
-	{
-		inbuf[ llen + ucount ] = '\0';
-		*len = llen + ucount;
-		bytes_recv += ucount;
-		return 1;
-	}
-	else if ( count == 0 )
-	{
-		wraplog( "Client %s disconnected (EOF)", node->host );
-		return 0;
-	}
-	else if ( errno == EWOULDBLOCK || errno == EAGAIN )
-		return 1;
-	else
-	{
-		wraperror( "fill_buffer (%s)", node->host );
-		return 0;
-	}
+	connect_to_mud( node, node->entry );
+
+	return;
 }
 
 
-static void empty_buffer( NODE *node, int file, char *outbuf, size_t *len )
+/* Parses the configuration file into a fresh catalog and makes it current.
+   On error the old catalog stays in place. */
+static int load_catalog( const char *file )
 {
-	size_t llen = *len;
-	size_t count;
-	ssize_t scount;
+	CATALOG *cat;
+	MUD_ENTRY tmp;
+	size_t i;
+	int line;
 
-	while ( llen )
+	loading = calloc( sizeof( CATALOG ), 1 );
+	line = ini_parse( file, parse_ini_entry );
+	cat = loading;
+	loading = NULL;
+
+	if ( line != 0 )
 	{
-		if ( llen <= MAX_LLEN )
-		{
-			scount = write( file, outbuf, llen );
+		catalog_release( cat );
+		return line;
+	}
 
-			if ( scount < 0 )
-			{
-				if ( errno == EWOULDBLOCK || errno == EAGAIN )
-					return;
+	/* Menu numbers have always counted from the last section up. */
+	for ( i = 0; i < cat->count / 2; i++ )
+	{
+		tmp = cat->entries[ i ];
+		cat->entries[ i ] = cat->entries[ cat->count - 1 - i ];
+		cat->entries[ cat->count - 1 - i ] = tmp;
+	}
 
-				wraperror( "empty_buffer (%s)", node->host );
-				disconnect( node );
-				return;
-			}
+	for ( i = 0; i < cat->count; i++ )
+	{
+		if ( !cat->entries[ i ].name )
+			cat->entries[ i ].name = strdup( cat->entries[ i ].key );
+		if ( cat->entries[ i ].tunnel )
+			hub_names( &cat->entries[ i ] );
+		if ( !cat->entries[ i ].host )
+			cat->entries[ i ].host = strdup( default_host );
+		if ( !cat->entries[ i ].port )
+			cat->entries[ i ].port = strdup( default_port );
+
+		/* Resolving thousands of names would hold up the start for minutes;
+		   connect_to_mud() looks the rest up when they are first chosen.
+		   Once the main loop runs, the resolver does it, see lookup(). */
+		if ( cat->count <= RESOLVE_AT_LOAD && resolver_fd < 0 )
+			resolve_entry( &cat->entries[ i ] );
+	}
 
-			count = (size_t) scount;
-			bytes_sent += count;
+	if ( cat->accept_rate && !cat->accept_burst )
+		cat->accept_burst = cat->accept_rate;
+	if ( cat->input_rate && !cat->input_burst )
+		cat->input_burst = cat->input_rate;
 
-			if ( count < llen )
-			{
-				memmove( &outbuf[ 0 ], &outbuf[ count ], *len - count );
-				*len -= count;
-				return;
-			}
+	cat->refs = 1;
+	cat->version = catalog ? catalog->version + 1 : 1;
+	index_catalog( cat );
+	render_catalog( cat );
 
-			break;
-		}
+	if ( catalog )
+		catalog_release( catalog );
 
-		scount = write( file, outbuf, MAX_LLEN );
+	catalog = cat;
 
-		if ( scount < 0 )
+	if ( resolver_fd >= 0 )
+		for ( i = 0; i < cat->count; i++ )
 		{
-			if ( errno == EWOULDBLOCK || errno == EAGAIN )
-					return;
-
-			wraperror( "empty_buffer (%s)", node->host );
-			disconnect( node );
-			return;
+			if ( numeric_names( cat->entries[ i ].host ) )
+				resolve_entry( &cat->entries[ i ] );
+			else if ( cat->count <= RESOLVE_AT_LOAD )
+				lookup( &cat->entries[ i ], cat );
 		}
 
-		count = (size_t) scount;
-		bytes_sent += count;
-
-		if ( count < MAX_LLEN )
-		{
-			memmove( &outbuf[ 0 ], &outbuf[ count ], *len - count );
-			*len -= count;
-			return;
-		}
+	return 0;
+}
 
-		*len = llen -= MAX_LLEN;
-		memmove( &outbuf[ 0 ], &outbuf[ MAX_LLEN ], *len );
-	}
 
-	outbuf[ 0 ] = '\0';
-	*len = 0;
+static CATALOG *catalog_acquire( CATALOG *cat )
+{
+	if ( cat )
+		cat->refs++;
 
-	return;
+	return cat;
 }
 
 
-static int on_server_data( NODE *node )
+static void catalog_release( CATALOG *cat )
 {
-	if ( node->type == TELNET )
-		return FILL_SERVER_BUFFER( node );
+	size_t i;
 
-	if ( !FILL_SERVER_PREBUFFER( node ) )
-		return 0;
+	if ( !cat || ( cat->refs && --cat->refs ) )
+		return;
 
-	if ( node->type == WEB_SOCKETS )
-		return ws_encode( node );
+	for ( i = 0; i < cat->count; i++ )
+	{
+		free( cat->entries[ i ].key );
+		free( cat->entries[ i ].host );
+		free( cat->entries[ i ].port );
+		free( cat->entries[ i ].name );
+		free( cat->entries[ i ].backends );
+		free( cat->entries[ i ].sources );
+		free( cat->entries[ i ].tunnel );
+	}
 
-	wraplog( "on_server_data: Bug: unknown connection type %d, client %s/%d",
-			 node->type, node->host, node->client.socket_fd );
+	free( cat->entries );
+	free( cat->by_key );
+	free( cat->by_name );
+	free( cat->folded );
+	free( cat->folded_at );
+	acl_free( cat->acl );
+	acl_free( cat->tunnel_from );
+	for ( i = 0; i < FRAMINGS; i++ )
+		free( cat->banner[ i ].data );
+	free( cat );
 
-	return 0;
+	return;
 }
 
 
-static int on_client_data( NODE *node )
+/* Renders the banner once per catalog, both raw and as a WebSocket frame,
+   so a new connection costs no formatting at all. */
+static void render_catalog( CATALOG *cat )
 {
-	if ( node->menu == 1 )
-		return read_menu_choice( node );
+	/* You're free to remove or replace the following sentence: */
+	static const char greeting[] =
+		"This is WhiteLantern, written by Vigud@lac.pl and Lam@lac.pl\n";
+	size_t i, shown, size = sizeof( greeting ) + sizeof( MENU_HINT ) + sizeof( MENU_PROMPT ) + 48;
+	char *text, *p;
 
-	if ( node->type == TELNET )
-		return FILL_CLIENT_BUFFER( node );
+	/* The rest of a long list is rendered a page at a time, when asked for. */
+	shown = cat->count < MENU_PAGE ? cat->count : MENU_PAGE;
 
-	if ( !FILL_CLIENT_PREBUFFER( node ) )
-		return 0;
+	for ( i = 0; i < shown; i++ )
+		size += strlen( cat->entries[ i ].name ) + 24;
 
-	if ( node->type == WEB_SOCKETS )
-		return ws_decode( node );
+	p = text = malloc( size );
+	p += sprintf( p, "%s", greeting );
 
-	if ( node->type == UNKNOWN )
-		return determine_connection_type( node );
+	for ( i = 0; i < shown; i++ )
+		p += list_entry( p, cat, i );
 
-	wraplog( "on_client_data: Bug: unknown connection type %d, client %s/%d",
-			 node->type, node->host, node->client.socket_fd );
+	if ( cat->count > MENU_PAGE )
+		p += sprintf( p, "Page 1 of %lu. %s",
+					  (unsigned long int) ( cat->count + MENU_PAGE - 1 ) / MENU_PAGE, MENU_HINT );
 
-	return 0;
+	p += sprintf( p, "%s", MENU_PROMPT );
+
+	render_canned( cat->banner, text, (size_t) ( p - text ) );
+	free( text );
+
+	return;
 }
 
 
-static void the_main_loop( void )
+static size_t list_entry( char *out, const CATALOG *cat, size_t i )
 {
-	struct timeval tv;
-	fd_set in_set, out_set, exc_set;
-	int maxdsc, outgoing;
-	NODE *node, *next_node;
-	time_t now;
+	return (size_t) sprintf( out, "%lu. %s\n", (unsigned long int) i + 1, cat->entries[ i ].name );
+}
 
-	signal( SIGPIPE, SIG_IGN );
 
-	while ( keep_running )
-	{
-		FD_ZERO( &in_set );
-		FD_ZERO( &out_set );
-		FD_ZERO( &exc_set );
+/* Sorts entry numbers by key and by lowercased name, so that finding an
+   entry by key or listing names by prefix is a binary search however long
+   the catalog gets. */
+static void index_catalog( CATALOG *cat )
+{
+	size_t i, size = 0;
+	char *p;
 
-		maxdsc = listen_socket;
+	if ( !cat->count )
+		return;
 
-		/* Are you getting "conversion to 'unsigned int' from 'int' may change
-		   the sign of the result" warning?
-		   See https://bugzilla.novell.com/show_bug.cgi?id=651597 */
-		FD_SET( listen_socket, &in_set );
-		outgoing = 0;
-		time( &now );
+	cat->by_key = malloc( cat->count * sizeof( uint32_t ) );
+	cat->by_name = malloc( cat->count * sizeof( uint32_t ) );
+	cat->folded_at = malloc( cat->count * sizeof( uint32_t ) );
 
-		for ( node = node_list; node; node = node->next )
-		{
-			if ( node->type == UNKNOWN
-			  && difftime( now, node->date ) > 2 )
-			{
-				node->type = TELNET;
-				banner( node );
-			}
+	for ( i = 0; i < cat->count; i++ )
+		size += strlen( cat->entries[ i ].name ) + 1;
 
-			if ( node->server.socket_fd )
-			{
-				outgoing = 1;
-				if ( maxdsc < node->server.socket_fd )
-					maxdsc = node->server.socket_fd;
-				FD_SET( node->server.socket_fd, &in_set );
-				FD_SET( node->server.socket_fd, &out_set );
-				FD_SET( node->server.socket_fd, &exc_set );
-			}
+	p = cat->folded = malloc( size );
 
-			if ( node->client.socket_fd )
-			{
-				outgoing = 1;
-				if ( maxdsc < node->client.socket_fd )
-					maxdsc = node->client.socket_fd;
-				FD_SET( node->client.socket_fd, &in_set );
-				FD_SET( node->client.socket_fd, &out_set );
-				FD_SET( node->client.socket_fd, &exc_set );
-			}
-		}
+	for ( i = 0; i < cat->count; i++ )
+	{
+		const char *name = cat->entries[ i ].name;
 
-		if ( outgoing )
-		{
-			tv.tv_usec = 0;
-			tv.tv_sec  = 1;
-			select( maxdsc + 1, &in_set, NULL, &exc_set, &tv );
-			select( maxdsc + 1, NULL, &out_set, NULL, NULL );
-		}
-		else
-			select( maxdsc + 1, &in_set, NULL, &exc_set, NULL );
+		cat->by_key[ i ] = cat->by_name[ i ] = (uint32_t) i;
+		cat->folded_at[ i ] = (uint32_t) ( p - cat->folded );
 
-		if ( FD_ISSET( listen_socket, &in_set ) && keep_running )
-			accept_connection( );
+		while ( *name )
+			*p++ = (char) tolower( (unsigned char) *name++ );
 
-		for ( node = node_list; node; node = next_node )
-		{
-			next_node = node->next;
+		*p++ = '\0';
+	}
 
-			if ( FD_ISSET( node->server.socket_fd, &exc_set )
-			  || FD_ISSET( node->client.socket_fd, &exc_set ) )
-			{
-				wraplog( "Disconnecting: %s/%d (exception)", node->host,
-						 node->client.socket_fd );
-				disconnect( node );
-				continue;
-			}
+	sorting = cat;
+	qsort( cat->by_key, cat->count, sizeof( uint32_t ), by_key );
+	qsort( cat->by_name, cat->count, sizeof( uint32_t ), by_name );
+	sorting = NULL;
 
-			if ( FD_ISSET( node->server.socket_fd, &in_set )
-			  && !on_server_data( node ) )
-			{
-				disconnect( node );
-				continue;
-			}
+	for ( i = 1; i < cat->count; i++ )
+		if ( !strcmp( cat->entries[ cat->by_key[ i - 1 ] ].key, cat->entries[ cat->by_key[ i ] ].key ) )
+			wraplog( "Entry \"%s\" is listed more than once.", cat->entries[ cat->by_key[ i ] ].key );
 
-			if ( FD_ISSET( node->client.socket_fd, &in_set )
-			  && !on_client_data( node ) )
-			{
-				disconnect( node );
-				continue;
-			}
+	return;
+}
 
-			if ( node->server.length > 0
-			  && FD_ISSET( node->server.socket_fd, &out_set ) )
-			{
-				SEND_TO_SERVER( node );
-			}
 
-			if ( node->client.length > 0
-			  && FD_ISSET( node->client.socket_fd, &out_set ) )
-			{
-				SEND_TO_CLIENT( node );
-			}
-		}
-	}
+static int by_key( const void *a, const void *b )
+{
+	const uint32_t *x = a, *y = b;
 
-	return;
+	return strcmp( sorting->entries[ *x ].key, sorting->entries[ *y ].key );
 }
 
 
-static int read_menu_choice( NODE *node )
+static int by_name( const void *a, const void *b )
 {
-	int resp;
-	char buf[ MSL ];
-	MUD_ENTRY *e = mud_entries;
+	const uint32_t *x = a, *y = b;
+	int c = strcmp( sorting->folded + sorting->folded_at[ *x ],
+					sorting->folded + sorting->folded_at[ *y ] );
 
-	if ( node->type == TELNET
-	  && !FILL_CLIENT_BUFFER( node ) )
-	{
-		return 0;
-	}
+	/* Same names keep menu order. */
+	return c ? c : ( *x > *y ) - ( *x < *y );
+}
 
-	if ( node->type == WEB_SOCKETS
-	  && ( !FILL_CLIENT_PREBUFFER( node ) || !ws_decode( node ) ) )
-	{
-		return 0;
-	}
 
-	strcpy( buf, node->server.buffer );
-	node->server.length = 0;
-	node->server.buffer[ 0 ] = '\0';
+/* The entry with the given key, the first listed if there are more. */
+static MUD_ENTRY *catalog_find( const CATALOG *cat, const char *key, size_t length )
+{
+	size_t low = 0, high, mid;
+	const char *k;
+	int c;
 
-	if ( buf[ 0 ] == 'Q' || buf[ 0 ] == 'q' )
-		return 0;
+	if ( !cat )
+		return NULL;
 
-	if ( ( resp = atoi( buf ) ) > 0 )
+	for ( high = cat->count; low < high; )
 	{
-		for ( --resp; resp && e; resp-- )
-			e = e->next;
+		mid = low + ( high - low ) / 2;
+		k = cat->entries[ cat->by_key[ mid ] ].key;
 
-		if ( e )
-		{
-			node->menu = 0;
-			connect_to_mud( node, e );
-			return 1;
-		}
+		if ( ( c = strncmp( k, key, length ) ) == 0 )
+			c = k[ length ] != '\0';
+
+		if ( c < 0 )
+			low = mid + 1;
+		else
+			high = mid;
 	}
 
-	sprintf( node->client.buffer,
-			 "\x1b[38;5;2mSelect a mud, or Q to quit\x1b[38;5;8m:\x1b[0m " );
-	node->client.length = strlen( node->client.buffer );
+	if ( low == cat->count )
+		return NULL;
 
-	return 1;
+	k = cat->entries[ cat->by_key[ low ] ].key;
+
+	return !strncmp( k, key, length ) && k[ length ] == '\0' ? &cat->entries[ cat->by_key[ low ] ] : NULL;
 }
 
 
-static int determine_connection_type( NODE *node )
+/* Numbers stay those of the whole list, so choosing works the same from
+   any page or search result. */
+static void show_page( NODE *node, size_t page )
 {
-	if ( !strncmp( node->server.prebuf, "GET ", 4 ) )
-	{
-		char *rnrn = strstr( node->server.prebuf, "\r\n\r\n" );
+	const CATALOG *cat = node->catalog;
+	size_t pages = ( cat->count + MENU_PAGE - 1 ) / MENU_PAGE, i, size, end;
+	char *text, *p;
 
-		if ( !rnrn && node->server.prelen > 1024 )
-		{
-			wraplog( "Over 1024 bytes of headers, disconnecting." );
-			return 0;
-		}
+	if ( page >= pages )
+		page = pages - 1;
 
-		if ( !rnrn || strlen( rnrn ) < 12 )
-			return 1;
+	node->menu_page = page;
+	end = ( page + 1 ) * MENU_PAGE < cat->count ? ( page + 1 ) * MENU_PAGE : cat->count;
+	size = sizeof( MENU_HINT ) + sizeof( MENU_PROMPT ) + 48;
 
-		return parse_headers( node );
-	}
+	for ( i = page * MENU_PAGE; i < end; i++ )
+		size += strlen( cat->entries[ i ].name ) + 24;
 
-	if ( node->server.prelen < 23 )
-		return 1;
+	p = text = malloc( size );
 
-	if ( !strncmp( node->server.prebuf,
-				   "<policy-file-request/>\x00", 23 ) )
-	{
-		sprintf( node->client.buffer,
-				 "<?xml version=\"1.0\"?>\n"
-				 "<!DOCTYPE cross-domain-policy SYSTEM \"/xml/dtds/cross-domain-policy.dtd\">\n"
-				 "<cross-domain-policy>\n"
-				 "    <allow-access-from domain=\"*\" to-ports=\"%d\" />\n"
-				 "</cross-domain-policy>",
-				 listen_port );
-		
-		WRITE( node->client.socket_fd, node->client.buffer );
-		return 0;
-	}
+	for ( i = page * MENU_PAGE; i < end; i++ )
+		p += list_entry( p, cat, i );
 
-	wraplog( "Couldn't determine connection type from %s/%d",
-			 node->host, node->client.socket_fd );
+	p += sprintf( p, "Page %lu of %lu. %s%s", (unsigned long int) page + 1,
+				  (unsigned long int) pages, MENU_HINT, MENU_PROMPT );
 
-	return 0;
+	send_text( node, text, (size_t) ( p - text ) );
+	free( text );
+
+	return;
 }
 
 
-static void banner( NODE *node )
+/* Lists up to a page of entries whose names start with the term, then ones
+   that merely contain it. */
+static void search_catalog( NODE *node, const char *term )
 {
-	int i = 1;
-	char *buf;
-	size_t *len;
-	MUD_ENTRY *e;
+	const CATALOG *cat = node->catalog;
+	char folded[ SEARCH_MAX + 1 ], *text, *p;
+	size_t i, len, low, high, mid, found = 0, size;
+	uint32_t hits[ MENU_PAGE ];
+	int more = 0;
+
+	for ( len = 0; term[ len ] && term[ len ] != '\r' && term[ len ] != '\n' && len < SEARCH_MAX; len++ )
+		folded[ len ] = (char) tolower( (unsigned char) term[ len ] );
+
+	folded[ len ] = '\0';
 
-	if ( !mud_entries )
+	for ( low = 0, high = cat->count; low < high; )
 	{
-		connect_to_mud( node, NULL );
-		return;
+		mid = low + ( high - low ) / 2;
+
+		if ( strncmp( cat->folded + cat->folded_at[ cat->by_name[ mid ] ], folded, len ) < 0 )
+			low = mid + 1;
+		else
+			high = mid;
 	}
 
-	if ( node->type == TELNET )
+	for ( ; low < cat->count && !strncmp( cat->folded + cat->folded_at[ cat->by_name[ low ] ], folded, len ); low++ )
 	{
-		buf = node->client.buffer;
-		len = &node->client.length;
+		if ( found == MENU_PAGE )
+		{
+			more = 1;
+			break;
+		}
+
+		hits[ found++ ] = cat->by_name[ low ];
 	}
+
+	/* Names the term starts are already listed. */
+	for ( i = 0; i < cat->count && !more && len; i++ )
+	{
+		const char *name = cat->folded + cat->folded_at[ i ], *at = strstr( name, folded );
+
+		if ( !at || at == name )
+			continue;
+
+		if ( found == MENU_PAGE )
+			more = 1;
+		else
+			hits[ found++ ] = (uint32_t) i;
+	}
+
+	size = sizeof( MENU_PROMPT ) + SEARCH_MAX + 96;
+
+	for ( i = 0; i < found; i++ )
+		size += strlen( cat->entries[ hits[ i ] ].name ) + 24;
+
+	p = text = malloc( size );
+
+	if ( !found )
+		p += sprintf( p, "Nothing matches \"%s\".\n", folded );
+
+	for ( i = 0; i < found; i++ )
+		p += list_entry( p, cat, hits[ i ] );
+
+	if ( more )
+		p += sprintf( p, "There are more, try a longer name.\n" );
+
+	p += sprintf( p, "%s", MENU_PROMPT );
+
+	send_text( node, text, (size_t) ( p - text ) );
+	free( text );
+
+	return;
+}
+
+
+/* Queues text made for this node alone, framed as it needs. */
+static void send_text( NODE *node, const char *text, size_t length )
+{
+	replay_alloc( node, FRAMED_MAX( length ) );
+	node->canned_len = frame_text( FRAMING( node ), NULL, node->replay, text, length );
+	node->canned = node->replay;
+
+	return;
+}
+
+
+static void render_canned( CANNED *c, const char *text, size_t length )
+{
+	int f;
+
+	for ( f = 0; f < FRAMINGS; f++ )
+	{
+		c[ f ].data = malloc( FRAMED_MAX( length ) + 1 );
+		c[ f ].length = frame_text( (enum Framing) f, NULL, c[ f ].data, text, length );
+		c[ f ].data[ c[ f ].length ] = '\0';
+
+		if ( !c[ f ].length && length )
+			wraplog( "Bug: cannot frame \"%s\" for WebSocket clients.", text );
+	}
+
+	return;
+}
+
+
+static void prepare_responses( void )
+{
+	char buf[ 512 ];
+	int len;
+
+	render_canned( prompt, MENU_PROMPT, strlen( MENU_PROMPT ) );
+
+	len = sprintf( buf,
+			"<?xml version=\"1.0\"?>\n"
+			"<!DOCTYPE cross-domain-policy SYSTEM \"/xml/dtds/cross-domain-policy.dtd\">\n"
+			"<cross-domain-policy>\n"
+			"    <allow-access-from domain=\"*\" to-ports=\"%d\" />\n"
+			"</cross-domain-policy>",
+			listen_port );
+
+	policy.data = strdup( buf );
+	policy.length = (size_t) len;
+
+	return;
+}
+
+
+/* Writes as much of the pending shared response as the socket takes. */
+static int send_canned( NODE *node )
+{
+	ssize_t w = PEER_WRITE( node, node->client.socket_fd, node->canned, node->canned_len );
+
+	if ( w < 0 )
+	{
+		if ( errno == EWOULDBLOCK || errno == EAGAIN )
+			return 1;
+
+		wraperror( "send_canned (%s)", node->host );
+		return 0;
+	}
+
+	bytes_sent += (unsigned long int) w;
+	node->canned += w;
+	node->canned_len -= (size_t) w;
+
+	if ( !node->canned_len )
+		replay_free( node );
+
+	return 1;
+}
+
+
+static void start_listening( void )
+{
+	int i;
+
+	listen_socket = open_listener( listen_port );
+	wraplog( "WhiteLantern: listening on port %d.", listen_port );
+
+	for ( i = 0; i < listener_count; i++ )
+		if ( listeners[ i ].path )
+		{
+			listeners[ i ].socket_fd = open_unix_listener( listeners[ i ].path );
+			wraplog( "WhiteLantern: listening on %s.", listeners[ i ].path );
+		}
+		else
+		{
+			listeners[ i ].socket_fd = open_listener( listeners[ i ].port );
+			wraplog( "WhiteLantern: listening on port %d for %s.", listeners[ i ].port,
+					 listeners[ i ].tunnel ? "tunnels" : listeners[ i ].key );
+		}
+
+	if ( expect_proxy )
+		wraplog( "WhiteLantern: clients come with a PROXY header." );
+
+	if ( !catalog || !catalog->count )
+		wraplog( "WhiteLantern: default host: %s:%s.", default_host, default_port );
+
+	return;
+}
+
+
+static int open_listener( uint16_t port )
+{
+	static struct sockaddr_in6 sa_zero;
+		   struct sockaddr_in6 sa;
+	int fd, x = 1;
+
+	fd = socket( AF_INET6, SOCK_STREAM, 0 );
+
+	if ( fd < 0 )
+	{
+		wraperror( "start_listening: socket" );
+		exit( 1 );
+	}
+
+	if ( setsockopt( fd, SOL_SOCKET, SO_REUSEADDR,
+					 (char *) &x, sizeof( x ) ) < 0 )
+	{
+		wraperror( "start_listening: SO_REUSEADDR" );
+		close( fd );
+		exit( 1 );
+	}
+
+	sa			    = sa_zero;
+	sa.sin6_family  = AF_INET6;
+	sa.sin6_port	= htons( port );
+
+	if ( bind( fd, (struct sockaddr *) &sa, sizeof( sa ) ) < 0 )
+	{
+		wraperror( "start_listening: bind port %d", port );
+		close( fd );
+		exit( 1 );
+	}
+
+	if ( listen( fd, listen_backlog ) < 0 )
+	{
+		wraperror( "start_listening: listen" );
+		close( fd );
+		exit( 1 );
+	}
+
+	fcntl( fd, F_SETFL, O_NONBLOCK );
+
+	return fd;
+}
+
+
+/* For a front end on the same machine. A socket file left behind by a
+   process that is gone is replaced. */
+static int open_unix_listener( const char *path )
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	memset( &sa, 0, sizeof( sa ) );
+	sa.sun_family = AF_UNIX;
+
+	if ( strlen( path ) >= sizeof( sa.sun_path ) )
+	{
+		wraplog( "start_listening: socket path %s is too long.", path );
+		exit( 1 );
+	}
+
+	strcpy( sa.sun_path, path );
+	unlink( path );
+
+	if ( ( fd = socket( AF_UNIX, SOCK_STREAM, 0 ) ) < 0 )
+	{
+		wraperror( "start_listening: socket" );
+		exit( 1 );
+	}
+
+	if ( bind( fd, (struct sockaddr *) &sa, sizeof( sa ) ) < 0 )
+	{
+		wraperror( "start_listening: bind %s", path );
+		close( fd );
+		exit( 1 );
+	}
+
+	if ( listen( fd, listen_backlog ) < 0 )
+	{
+		wraperror( "start_listening: listen" );
+		close( fd );
+		exit( 1 );
+	}
+
+	fcntl( fd, F_SETFL, O_NONBLOCK );
+
+	return fd;
+}
+
+
+/* reason is for the disconnect tracepoint, the log has said why by now:
+   "client" or "server" for trouble on either socket, "timeout", "idle",
+   "queue", "memory", "unreachable", "config", "overflow" (typed ahead
+   more than fits with a PROXY header), "done" (an HTTP client that asked
+   for nothing more) or "resumed" (another connection took the session
+   over). */
+static void disconnect( NODE *node, const char *reason )
+{
+#if defined( USDT )
+	TRACE3( disconnect, node->id, node->client.socket_fd, reason );
+#else
+	(void) reason;
+#endif
+	wraplog( "Disconnecting client: %s/%d, current node count: %lu",
+			 node->host, node->client.socket_fd, node_count );
+
+	release_node( node );
+
+	return;
+}
+
+
+/* Closes everything the node holds and puts it on the reuse list. */
+static void release_node( NODE *node )
+{
+	NODE *node2;
+	int i;
+
+	if ( node->server.socket_fd )
+		close( node->server.socket_fd );
+
+	if ( node->bound )
+		node->bound->count--;
+	node->bound = NULL;
+	node->resolving = NULL;
+	free( node->origin );
+	node->origin = NULL;
+	free( node->via );
+	node->via = NULL;
+	free( node->front );
+	node->front = NULL;
+
+	if ( node->expect_proxy )
+		proxy_pending--;
+	node->expect_proxy = 0;
+
+#if defined( TLS )
+	if ( node->ssl )
+		tls_close( node->ssl );
+	node->ssl = NULL;
+#endif
+
+	if ( node->client.socket_fd )
+		close( node->client.socket_fd );
+
+	while ( node->attempts > 0 )
+		close( node->attempt[ --node->attempts ].socket_fd );
+
+	node->server.socket_fd = node->client.socket_fd = 0;
+	timer_cancel( &node->deadline );
+	timer_cancel( &node->stagger );
+	timer_cancel( &node->idle );
+	timer_cancel( &node->ping );
+	timer_cancel( &node->throttle );
+	acl_host_release( node->source );
+	node->source = NULL;
+
+	if ( node->cursor )
+	{
+		if ( node->watching )
+		{
+			node->watching->watchers--;
+			node->watching->framed_for[ FRAMING( node ) ]--;
+		}
+		chunk_release( node->cursor );
+		node->cursor = NULL;
+		node->watching = NULL;
+	}
+
+	/* Its spectators get what was framed so far, then they are let go. */
+	if ( node->watchers )
+		for ( node2 = node_list; node2; node2 = node2->next )
+			if ( node2->watching == node )
+				node2->watching = NULL;
+
+	for ( i = 0; i < FRAMINGS; i++ )
+	{
+		chunk_release( node->watch_tail[ i ] );
+		node->watch_tail[ i ] = NULL;
+		node->framed_for[ i ] = 0;
+	}
+
+	node->watchers = 0;
+
+	if ( node->queued )
+	{
+		if ( queue_head == node )
+		{
+			if ( !( queue_head = node->queue_next ) )
+				queue_tail = NULL;
+		}
+		else
+			for ( node2 = queue_head; node2; node2 = node2->queue_next )
+				if ( node2->queue_next == node )
+				{
+					if ( !( node2->queue_next = node->queue_next ) )
+						queue_tail = node2;
+					break;
+				}
+
+		node->queued = 0;
+		queued_count--;
+	}
+	else if ( node->admitted )
+	{
+		node->admitted = 0;
+		admitted_count--;
+		admit_next( );
+	}
+	catalog_release( node->catalog );
+	node->catalog = NULL;
+	replay_free( node );
+	webroot_release( node->file );
+	node->file = NULL;
+	node->responding = 0;
+#if defined( RECORD )
+	record_stop( node );
+#endif
+
+	if ( node->ring )
+		memory_used -= resume_ring;
+	free( node->ring );
+	node->ring = NULL;
+
+	if ( node_list == node )
+		node_list = node->next;
+	else
+		for ( node2 = node_list; node2; node2 = node2->next )
+			if ( node2->next == node )
+			{
+				node2->next = node->next;
+				break;
+			}
+
+	node->next = reuse_list;
+	reuse_list = node;
+	node_count--;
+
+	return;
+}
+
+
+/* Starts connecting to the backends of an entry, see next_attempt(). */
+static void connect_to_mud( NODE *node, MUD_ENTRY *entry )
+{
+	if ( !entry )
+	{
+		entry = &default_entry;
+
+		if ( !entry->host )
+		{
+			entry->host = strdup( default_host );
+			entry->port = strdup( default_port );
+		}
+	}
+
+	/* Names not looked up yet, or that did not resolve before, get another
+	   chance; the node waits for the resolver, see on_resolver(). */
+	if ( !entry->backend_count && resolver_fd >= 0 && !numeric_names( entry->host ) )
+	{
+		lookup( entry, node->catalog );
+		node->resolving = entry;
+		timer_set( &node->deadline, CONNECT_TIMEOUT * 1000UL, deadline_expired, node );
+		return;
+	}
+
+	if ( !entry->backend_count )
+		resolve_entry( entry );
+
+	if ( !entry->backend_count )
+	{
+		WRITE( node, "Wrong host.\n\r" );
+		wraplog( "Wrong host!" );
+		disconnect( node, "config" );
+		return;
+	}
+
+	/* Sessions come back to the edge, not to the hub. */
+	if ( resume_grace && !node->ring && !node->origin )
+	{
+		node->ring = malloc( resume_ring );
+		memory_used += resume_ring;
+	}
+
+	node->entry = entry;
+
+#if defined( TUNNEL )
+	if ( entry->tunnel )
+	{
+		tunnel_connect( node );
+		return;
+	}
+#endif
+
+	node->next_backend = 0;
+	node->connecting = 1;
+	timer_set( &node->deadline, CONNECT_TIMEOUT * 1000UL, deadline_expired, node );
+
+	if ( !next_attempt( node ) )
+	{
+		WRITE( node, "Could not connect to game.\n\r" );
+		wraplog( "No usable address for %s (%s).", entry->key ? entry->key : entry->host,
+				 node->host );
+		disconnect( node, "unreachable" );
+	}
+
+	return;
+}
+
+
+/* Resolves every name in entry->host into the list of backends. Addresses
+   are interleaved by family, starting with the one the resolver put first,
+   so a broken IPv6 path costs one stagger delay and not a whole timeout. */
+static void resolve_entry( MUD_ENTRY *entry )
+{
+	struct addrinfo hints, *res, *ai;
+	BACKEND *found = NULL, *b;
+	size_t count = 0, size = 0, i, j, first, other;
+	char *names, *name, *save;
+	char addr[ INET6_ADDRSTRLEN ];
+	int family = AF_UNSPEC;
+	void *sa;
+
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_UNSPEC; /* IPv4 or IPv6 */
+	hints.ai_socktype = SOCK_STREAM;
+
+	names = strdup( entry->host );
+
+	for ( name = strtok_r( names, ", \t", &save ); name; name = strtok_r( NULL, ", \t", &save ) )
+	{
+		if ( name[ 0 ] == '[' && name[ strlen( name ) - 1 ] == ']' )
+		{
+			name[ strlen( name ) - 1 ] = '\0';
+			name++;
+		}
+
+		if ( !strncmp( name, "unix:", 5 ) )
+		{
+			if ( count == size )
+			{
+				size = size ? size * 2 : 4;
+				found = realloc( found, size * sizeof( BACKEND ) );
+			}
+
+			if ( unix_backend( &found[ count ], name + 5 ) )
+				count++;
+			else
+				wraplog( "Socket path %s is too long.", name + 5 );
+			continue;
+		}
+
+		if ( getaddrinfo( name, entry->port, &hints, &res ) )
+		{
+			wraplog( "Cannot resolve %s.", name );
+			continue;
+		}
+
+		for ( ai = res; ai; ai = ai->ai_next )
+		{
+			for ( i = 0; i < count; i++ )
+				if ( found[ i ].addrlen == ai->ai_addrlen
+				  && !memcmp( &found[ i ].addr, ai->ai_addr, ai->ai_addrlen ) )
+					break;
+
+			if ( i < count || ai->ai_addrlen > sizeof( found[ 0 ].addr ) )
+				continue;
+
+			if ( count == size )
+			{
+				size = size ? size * 2 : 4;
+				found = realloc( found, size * sizeof( BACKEND ) );
+			}
+
+			b = &found[ count++ ];
+			memset( b, 0, sizeof( BACKEND ) );
+			memcpy( &b->addr, ai->ai_addr, ai->ai_addrlen );
+			b->addrlen = ai->ai_addrlen;
+
+			if ( family == AF_UNSPEC )
+				family = ai->ai_family;
+
+			if ( ai->ai_family == AF_INET6 )
+				sa = &( (struct sockaddr_in6 *) ai->ai_addr )->sin6_addr;
+			else
+				sa = &( (struct sockaddr_in *) ai->ai_addr )->sin_addr;
+
+			if ( !inet_ntop( ai->ai_family, sa, addr, sizeof( addr ) ) )
+				strcpy( addr, "?" );
+
+			sprintf( b->name, ai->ai_family == AF_INET6 ? "[%s]:%s" : "%s:%s",
+					 addr, entry->port );
+		}
+
+		freeaddrinfo( res );
+	}
+
+	free( names );
+	free( entry->backends );
+	entry->backends = count ? malloc( count * sizeof( BACKEND ) ) : NULL;
+	entry->backend_count = count;
+
+	for ( i = first = other = 0; i < count; i++ )
+	{
+		/* Take from the preferred family on even turns, while it lasts. */
+		int want = ( i % 2 == 0 ) ? family : AF_UNSPEC;
+
+		for ( j = want == family ? first : other; j < count; j++ )
+			if ( ( found[ j ].addr.ss_family == family ) == ( want == family ) )
+				break;
+
+		if ( j == count )
+			for ( j = want == family ? other : first; j < count; j++ )
+				if ( ( found[ j ].addr.ss_family == family ) != ( want == family ) )
+					break;
+
+		entry->backends[ i ] = found[ j ];
+
+		if ( found[ j ].addr.ss_family == family )
+			first = j + 1;
+		else
+			other = j + 1;
+	}
+
+	free( found );
+
+	return;
+}
+
+
+/* Whether every name in a host list is an address or a unix: path, which
+   resolve_entry() handles without asking DNS. */
+static int numeric_names( const char *host )
+{
+	struct in6_addr addr;
+	char *names, *name, *save;
+	int numeric = 1;
+
+	names = strdup( host );
+
+	for ( name = strtok_r( names, ", \t", &save ); name && numeric;
+		  name = strtok_r( NULL, ", \t", &save ) )
+	{
+		if ( name[ 0 ] == '[' && name[ strlen( name ) - 1 ] == ']' )
+		{
+			name[ strlen( name ) - 1 ] = '\0';
+			name++;
+		}
+
+		numeric = !strncmp( name, "unix:", 5 ) || inet_pton( AF_INET, name, &addr ) == 1
+			|| inet_pton( AF_INET6, name, &addr ) == 1;
+	}
+
+	free( names );
+
+	return numeric;
+}
+
+
+/* A tunnel entry's sessions go to the hub, so its host and port are those
+   of the hub, which then resolves like any game's. An IPv6 address keeps
+   its brackets; resolve_entry() takes them off. */
+static void hub_names( MUD_ENTRY *entry )
+{
+	const char *colon = strrchr( entry->tunnel, ':' );
+
+	free( entry->host );
+	free( entry->port );
+	entry->host = malloc( (size_t) ( colon - entry->tunnel ) + 1 );
+	memcpy( entry->host, entry->tunnel, (size_t) ( colon - entry->tunnel ) );
+	entry->host[ colon - entry->tunnel ] = '\0';
+	entry->port = strdup( colon + 1 );
+
+	return;
+}
+
+
+/* getaddrinfo() blocks for as long as DNS takes, and the main loop must not,
+   so once it runs names are looked up by a child process. The child closes
+   whatever else it inherits; the upgrade exec does not inherit its socket. */
+static void start_resolver( void )
+{
+	int sv[ 2 ];
+
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+	{
+		wraperror( "start_resolver: socketpair" );
+		return;
+	}
+
+	if ( ( resolver_pid = fork( ) ) < 0 )
+	{
+		wraperror( "start_resolver: fork" );
+		close( sv[ 0 ] );
+		close( sv[ 1 ] );
+		return;
+	}
+
+	if ( resolver_pid == 0 )
+	{
+		close( sv[ 0 ] );
+		resolver_main( sv[ 1 ] );
+	}
+
+	close( sv[ 1 ] );
+	fcntl( sv[ 0 ], F_SETFD, FD_CLOEXEC );
+	resolver_fd = sv[ 0 ];
+
+	return;
+}
+
+
+/* The resolver: answers lookups in the order they come until the proxy
+   goes away. */
+static void resolver_main( int sock )
+{
+	MUD_ENTRY entry;
+	unsigned int kind;
+	int fds[ HANDOFF_MAX_FDS ], nfds, i;
+	size_t length, size;
+	uint32_t id;
+	char *data, *reply;
+
+	signal( SIGINT, SIG_IGN );
+	signal( SIGHUP, SIG_IGN );
+
+	for ( i = 3; i < FD_SETSIZE; i++ )
+		if ( i != sock )
+			close( i );
+
+	memset( &entry, 0, sizeof( entry ) );
+
+	while ( handoff_recv( sock, &kind, fds, &nfds, (void **) &data, &length ) )
+	{
+		for ( i = 0; i < nfds; i++ )
+			close( fds[ i ] );
+
+		/* id, host, NUL, port, NUL */
+		if ( kind != HO_LOOKUP || length < sizeof( id ) + 2 || data[ length - 1 ]
+		  || strlen( data + sizeof( id ) ) + sizeof( id ) + 1 >= length )
+		{
+			free( data );
+			continue;
+		}
+
+		memcpy( &id, data, sizeof( id ) );
+		entry.host = data + sizeof( id );
+		entry.port = entry.host + strlen( entry.host ) + 1;
+		resolve_entry( &entry );
+
+		size = entry.backend_count * sizeof( BACKEND );
+		reply = malloc( sizeof( id ) + size );
+		memcpy( reply, &id, sizeof( id ) );
+		if ( size )
+			memcpy( reply + sizeof( id ), entry.backends, size );
+
+		i = handoff_send( sock, HO_LOOKUP, NULL, 0, reply, sizeof( id ) + size );
+		free( reply );
+		free( data );
+
+		if ( !i )
+			break;
+	}
+
+	_exit( 0 );
+}
+
+
+/* Queues a lookup for the names of an entry that has no backends, unless
+   one is on its way already. */
+static void lookup( MUD_ENTRY *entry, CATALOG *cat )
+{
+	LOOKUP *l, **tail;
+
+	if ( entry->resolving )
+		return;
+
+	l = calloc( 1, sizeof( LOOKUP ) );
+	l->id = ++lookup_serial;
+	l->entry = entry;
+	l->catalog = entry == &default_entry ? NULL : catalog_acquire( cat );
+	entry->resolving = 1;
+
+	for ( tail = &lookup_list; *tail; tail = &( *tail )->next )
+		;
+	*tail = l;
+
+	send_lookups( );
+
+	return;
+}
+
+
+/* Keeps up to RESOLVE_INFLIGHT lookups with the resolver, so a burst of them
+   never fills the socket and blocks the loop on the write. */
+static void send_lookups( void )
+{
+	LOOKUP *l;
+	char *payload;
+	size_t host_len, port_len;
+	int sent = 0;
+
+	for ( l = lookup_list; l && resolver_fd >= 0; l = l->next )
+	{
+		if ( l->sent )
+		{
+			sent++;
+			continue;
+		}
+
+		if ( sent >= RESOLVE_INFLIGHT )
+			break;
+
+		host_len = strlen( l->entry->host ) + 1;
+		port_len = strlen( l->entry->port ) + 1;
+		payload = malloc( sizeof( l->id ) + host_len + port_len );
+		memcpy( payload, &l->id, sizeof( l->id ) );
+		memcpy( payload + sizeof( l->id ), l->entry->host, host_len );
+		memcpy( payload + sizeof( l->id ) + host_len, l->entry->port, port_len );
+
+		if ( !handoff_send( resolver_fd, HO_LOOKUP, NULL, 0, payload,
+							sizeof( l->id ) + host_len + port_len ) )
+			wraperror( "send_lookups: handoff_send" );
+
+		free( payload );
+		l->sent = 1;
+		sent++;
+	}
+
+	return;
+}
+
+
+/* The resolver answered: the entry gets its backends, and the nodes waiting
+   for them go on connecting. If it died, it is started again and whatever
+   it was looking up is asked again. */
+static void on_resolver( void )
+{
+	LOOKUP *l, **prev;
+	MUD_ENTRY *entry;
+	NODE *node, *next_node;
+	int fds[ HANDOFF_MAX_FDS ], nfds, i;
+	unsigned int kind;
+	size_t length;
+	uint32_t id;
+	char *data;
+
+	if ( !handoff_recv( resolver_fd, &kind, fds, &nfds, (void **) &data, &length ) )
+	{
+		wraplog( "The resolver went away, starting another." );
+		close( resolver_fd );
+		resolver_fd = -1;
+		waitpid( resolver_pid, NULL, 0 );
+		start_resolver( );
+
+		for ( l = lookup_list; l; l = l->next )
+			l->sent = 0;
+		send_lookups( );
+		return;
+	}
+
+	for ( i = 0; i < nfds; i++ )
+		close( fds[ i ] );
+
+	if ( kind != HO_LOOKUP || length < sizeof( id )
+	  || ( length - sizeof( id ) ) % sizeof( BACKEND ) )
+	{
+		wraplog( "Bug: unexpected message %u from the resolver.", kind );
+		free( data );
+		return;
+	}
+
+	memcpy( &id, data, sizeof( id ) );
+
+	for ( prev = &lookup_list; ( l = *prev ); prev = &l->next )
+		if ( l->id == id )
+			break;
+
+	if ( !l )
+	{
+		free( data );
+		return;
+	}
+
+	*prev = l->next;
+	entry = l->entry;
+	entry->resolving = 0;
+
+	/* Nodes connecting to the entry hold on to its backends; it only gets
+	   new ones when it had none. */
+	if ( !entry->backend_count && length > sizeof( id ) )
+	{
+		entry->backend_count = ( length - sizeof( id ) ) / sizeof( BACKEND );
+		entry->backends = malloc( length - sizeof( id ) );
+		memcpy( entry->backends, data + sizeof( id ), length - sizeof( id ) );
+	}
+
+	free( data );
+
+	for ( node = node_list; node; node = next_node )
+	{
+		next_node = node->next;
+
+		if ( node->resolving != entry )
+			continue;
+
+		node->resolving = NULL;
+
+		if ( entry->backend_count )
+			connect_to_mud( node, entry );
+		else
+		{
+			WRITE( node, "Wrong host.\n\r" );
+			wraplog( "Wrong host!" );
+			disconnect( node, "config" );
+		}
+	}
+
+	if ( l->catalog )
+		catalog_release( l->catalog );
+	free( l );
+
+	send_lookups( );
+
+	return;
+}
+
+
+/* A MUD on this host, behind a Unix stream socket. Returns 0 if the path
+   does not fit. */
+static int unix_backend( BACKEND *backend, const char *path )
+{
+	struct sockaddr_un *local = (struct sockaddr_un *) &backend->addr;
+
+	if ( strlen( path ) >= sizeof( local->sun_path ) )
+		return 0;
+
+	memset( backend, 0, sizeof( BACKEND ) );
+	local->sun_family = AF_UNIX;
+	strcpy( local->sun_path, path );
+	backend->addrlen = (socklen_t) ( offsetof( struct sockaddr_un, sun_path ) + strlen( path ) + 1 );
+	sprintf( backend->name, "unix:%s", path );
+
+	return 1;
+}
+
+
+/* Returns the socket of a connection on its way, or -1. */
+static int open_connection( BACKEND *backend, SOURCE *source )
+{
+	int fd = socket( backend->addr.ss_family, SOCK_STREAM, 0 );
+#if defined( IP_BIND_ADDRESS_NO_PORT )
+	int on = 1;
+#endif
+
+	if ( fd < 0 )
+	{
+		wraperror( "open_connection: socket" );
+		return -1;
+	}
+
+	if ( fd >= FD_SETSIZE )
+	{
+		wraplog( "open_connection: descriptor %d is too big for select().", fd );
+		close( fd );
+		return -1;
+	}
+
+	fcntl( fd, F_SETFL, O_NONBLOCK );
+
+	/* Binding would take a port for the address alone; the kernel can share
+	   one between destinations if it picks it at connect() instead. */
+	if ( source )
+	{
+#if defined( IP_BIND_ADDRESS_NO_PORT )
+		setsockopt( fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof( on ) );
+#endif
+
+		if ( bind( fd, (struct sockaddr *) &source->addr, source->addrlen ) < 0 )
+		{
+			wraperror( "Could not bind to %s for %s", source->name, backend->name );
+			close( fd );
+			return -1;
+		}
+	}
+
+	if ( connect( fd, (struct sockaddr *) &backend->addr, backend->addrlen ) == 0
+	  || errno == EINPROGRESS )
+		return fd;
+
+	wraperror( "Could not connect to %s", backend->name );
+	backend_failed( backend );
+	close( fd );
+
+	return -1;
+}
+
+
+/* The source address of the entry's family carrying the fewest game
+   connections, ties going round robin. NULL if it has none of that family. */
+static SOURCE *pick_source( MUD_ENTRY *entry, int family )
+{
+	SOURCE *best = NULL, *s;
+	size_t i, at = 0;
+
+	for ( i = 0; i < entry->source_count; i++ )
+	{
+		s = &entry->sources[ ( entry->next_source + i ) % entry->source_count ];
+
+		if ( s->addr.ss_family == family && ( !best || s->load->count < best->load->count ) )
+		{
+			best = s;
+			at = ( entry->next_source + i ) % entry->source_count;
+		}
+	}
+
+	if ( best )
+		entry->next_source = at + 1;
+
+	return best;
+}
+
+
+/* Without health checks a dead backend gets tried again after a while;
+   with them, only a successful check brings it back. */
+static int backend_alive( const BACKEND *backend )
+{
+	return !backend->dead
+		|| ( !health_interval && timer_now( ) >= backend->dead_until );
+}
+
+
+static void backend_failed( BACKEND *backend )
+{
+	if ( ++backend->failures < FAILURE_LIMIT )
+		return;
+
+	if ( !backend->dead )
+		wraplog( "Backend %s is down.", backend->name );
+
+	backend->dead = 1;
+	backend->dead_until = timer_now( ) + DEAD_RETRY * 1000UL;
+
+	return;
+}
+
+
+static void backend_ok( BACKEND *backend )
+{
+	if ( backend->dead )
+		wraplog( "Backend %s is up again.", backend->name );
+
+	backend->failures = 0;
+	backend->dead = 0;
+
+	return;
+}
+
+
+/* Opens a connection to the next live backend of the node's entry and
+   arms the stagger timer for the one after it. Returns 0 when nothing is in
+   flight and nothing is left to try. */
+static int next_attempt( NODE *node )
+{
+	MUD_ENTRY *entry = node->entry;
+	BACKEND *backend;
+	SOURCE *source;
+	int fd;
+
+	while ( node->next_backend < entry->backend_count && node->attempts < MAX_ATTEMPTS )
+	{
+		backend = &entry->backends[ node->next_backend++ ];
+
+		if ( !backend_alive( backend ) )
+			continue;
+
+		source = pick_source( entry, backend->addr.ss_family );
+
+		if ( ( fd = open_connection( backend, source ) ) < 0 )
+			continue;
+
+		TRACE3( connect_start, node->id, fd, backend->name );
+		node->attempt[ node->attempts ].socket_fd = fd;
+		node->attempt[ node->attempts ].backend = backend;
+		node->attempt[ node->attempts ].source = source;
+		node->attempts++;
+
+		if ( node->next_backend < entry->backend_count )
+			timer_set( &node->stagger, CONNECT_STAGGER, stagger_expired, node );
+
+		return 1;
+	}
+
+	return node->attempts > 0;
+}
+
+
+/* The attempts in flight are taking a while; race another one against them. */
+static void stagger_expired( void *data )
+{
+	NODE *node = data;
+
+	if ( !next_attempt( node ) )
+	{
+		WRITE( node, "Could not connect to game.\n\r" );
+		disconnect( node, "unreachable" );
+	}
+
+	return;
+}
+
+
+static void health_check( void *data )
+{
+	size_t i, j, probed = 0;
+	MUD_ENTRY *e;
+
+	/* A long catalog is checked a batch per round, so the probes do not
+	   take every descriptor select() can watch. */
+	if ( catalog && catalog->count )
+		for ( i = 0; i < catalog->count && probed < PROBE_BATCH; i++ )
+		{
+			e = &catalog->entries[ health_cursor++ % catalog->count ];
+
+			/* A hub would take a probe for an edge opening a link. */
+			if ( e->tunnel )
+				continue;
+
+			for ( j = 0; j < e->backend_count; j++ )
+				start_probe( &e->backends[ j ], catalog );
+
+			probed += e->backend_count;
+		}
+
+	if ( catalog && catalog->count )
+		health_cursor %= catalog->count;
+
+	for ( j = 0; j < default_entry.backend_count; j++ )
+		start_probe( &default_entry.backends[ j ], NULL );
+
+	timer_set( &health_timer, health_interval * 1000UL, health_check, NULL );
+
+	return;
+}
+
+
+static void start_probe( BACKEND *backend, CATALOG *cat )
+{
+	PROBE *probe;
+	int fd;
+
+	if ( backend->probing || ( fd = open_connection( backend, NULL ) ) < 0 )
+		return;
+
+	probe = calloc( sizeof( PROBE ), 1 );
+	probe->socket_fd = fd;
+	probe->backend = backend;
+	probe->catalog = catalog_acquire( cat );
+	probe->next = probe_list;
+	probe_list = probe;
+	backend->probing = 1;
+	timer_set( &probe->timeout, CONNECT_TIMEOUT * 1000UL, probe_expired, probe );
+
+	return;
+}
+
+
+static void probe_expired( void *data )
+{
+	probe_done( data, ETIMEDOUT );
+
+	return;
+}
+
+
+static void probe_done( PROBE *probe, int error )
+{
+	PROBE *p;
+
+	if ( error )
+	{
+		/* Backends known to be down are not worth a line every round. */
+		if ( !probe->backend->dead )
+		{
+			errno = error;
+			wraperror( "Health check of %s failed", probe->backend->name );
+		}
+
+		backend_failed( probe->backend );
+	}
+	else
+		backend_ok( probe->backend );
+
+	probe->backend->probing = 0;
+	close( probe->socket_fd );
+	timer_cancel( &probe->timeout );
+	catalog_release( probe->catalog );
+
+	if ( probe_list == probe )
+		probe_list = probe->next;
+	else
+		for ( p = probe_list; p; p = p->next )
+			if ( p->next == probe )
+			{
+				p->next = probe->next;
+				break;
+			}
+
+	free( probe );
+
+	return;
+}
+
+
+/* Drains the backlog, so a reconnect storm after a MUD reboot does not
+   overflow it, but takes no more than a batch before serving the rest.
+   Clients of a Unix socket have no address of their own; without a PROXY
+   header they all count as ::1. */
+static void accept_connection( int listener, const char *key, int local )
+{
+	struct sockaddr_in6 sock;
+	socklen_t socksize;
+	int socket_fd, i;
+
+	for ( i = 0; i < ACCEPT_BATCH && node_room( ); i++ )
+	{
+		socksize = sizeof( sock );
+
+#if defined( __linux__ )
+		socket_fd = accept4( listener, (struct sockaddr *) &sock, &socksize,
+							 SOCK_NONBLOCK | SOCK_CLOEXEC );
+#else
+		socket_fd = accept( listener, (struct sockaddr *) &sock, &socksize );
+
+		if ( socket_fd >= 0 && fcntl( socket_fd, F_SETFL, O_NONBLOCK ) < 0 )
+		{
+			wraperror( "accept_connection: fcntl" );
+			close( socket_fd );
+			continue;
+		}
+#endif
+
+		if ( socket_fd < 0 )
+		{
+			if ( errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR )
+				wraperror( "accept_connection: accept" );
+			return;
+		}
+
+		if ( local )
+		{
+			memset( &sock, 0, sizeof( sock ) );
+			sock.sin6_family = AF_INET6;
+			sock.sin6_addr.s6_addr[ 15 ] = 1;
+		}
+
+		if ( expect_proxy )
+			await_proxy( socket_fd, &sock, key );
+		else
+			new_connection( socket_fd, &sock, key, NULL );
+	}
+
+	return;
+}
+
+
+/* origin is set for a stream from a tunnel, which is known to be telnet.
+   Returns NULL if the connection was refused and closed. */
+static NODE *new_connection( int socket_fd, const struct sockaddr_in6 *sock, const char *key,
+							 const char *origin )
+{
+	NODE *node;
+	ACL_HOST *source;
+	char host[ 40 ];
+
+	if ( !open_allowed( socket_fd, sock, host )
+	  || !admit_client( socket_fd, sock, host, &source ) )
+	{
+		close( socket_fd );
+		return NULL;
+	}
+
+	node = open_node( socket_fd, host, key );
+	node->type = origin ? TELNET : UNKNOWN;
+	node->source = source;
+
+	if ( origin && strlen( origin ) < PROXY_V1_MAX )
+		node->origin = strdup( origin );
+	else if ( !origin )
+		timer_set( &node->deadline, DETECT_DELAY, deadline_expired, node );
+
+	enter_node( node, origin ? "tunneled " : "", NULL );
+
+	if ( origin )
+	{
+		TRACE3( classify, node->id, socket_fd, "telnet" );
+		banner( node );
+	}
+
+	return node;
+}
+
+
+/* A connection from the balancer in front of us is only a client once its
+   PROXY header says whose it is. Until then it has a node to wait in, under
+   the balancer's address, but is neither admitted nor counted against
+   anyone, see proxy_received(). */
+static void await_proxy( int socket_fd, const struct sockaddr_in6 *sock, const char *key )
+{
+	NODE *node;
+	char host[ 40 ];
+
+	if ( !open_allowed( socket_fd, sock, host ) )
+	{
+		close( socket_fd );
+		return;
+	}
+
+	node = open_node( socket_fd, host, key );
+	node->type = UNKNOWN;
+	node->expect_proxy = 1;
+	proxy_pending++;
+	timer_set( &node->deadline, HANDSHAKE_TIMEOUT * 1000UL, deadline_expired, node );
+
+	return;
+}
+
+
+/* Puts the address in host, without the ::ffff: of IPv4 clients. */
+static int open_allowed( int socket_fd, const struct sockaddr_in6 *sock, char *host )
+{
+	char buf[ 128 ];
+
+	if ( socket_fd >= FD_SETSIZE )
+	{
+		wraplog( "Refused a connection: descriptor %d is too big for select().", socket_fd );
+		return 0;
+	}
+
+	if ( !inet_ntop( sock->sin6_family, &sock->sin6_addr, buf, sizeof( buf ) ) )
+	{
+		wraperror( "new_connection: inet_ntop" );
+		return 0;
+	}
+
+	buf[ 39 ] = '\0';
+	strcpy( host, strncmp( buf, "::ffff:", 7 ) ? buf : buf + 7 );
+
+	return 1;
+}
+
+
+/* Shed it before it gets a node or a single buffer. */
+static int admit_client( int socket_fd, const struct sockaddr_in6 *sock, const char *host,
+						 ACL_HOST **source )
+{
+	if ( !admit( sock->sin6_addr.s6_addr, host, source ) )
+		return 0;
+
+	if ( max_connections && admitted_count >= max_connections && queued_count >= queue_size )
+	{
+		static const char full[] = "Server is full, please try again later.\n\r";
+
+		if ( write( socket_fd, full, sizeof( full ) - 1 ) > 0 )
+			bytes_sent += sizeof( full ) - 1;
+
+		wraplog( "Refused %s: server and queue are full.", host );
+		acl_host_release( *source );
+		*source = NULL;
+		return 0;
+	}
+
+	return 1;
+}
+
+
+static NODE *open_node( int socket_fd, const char *host, const char *key )
+{
+	NODE *node = new_node( );
+
+	node->client.socket_fd = socket_fd;
+	node->next = node_list;
+	node->catalog = catalog_acquire( catalog );
+	strcpy( node->host, host );
+	http_reset( &node->request );
+	node->last_input = node->created = timer_now( );
+
+	/* An entry that went away in a reload leaves the port showing the menu. */
+	if ( key && !( node->route = catalog_find( node->catalog, key, strlen( key ) ) ) )
+		wraplog( "No entry \"%s\" for %s, showing the menu.", key, host );
+
+	if ( resume_grace )
+		new_token( node->token );
+
+	if ( idle_timeout )
+		timer_set( &node->idle, idle_timeout * 1000UL, idle_expired, node );
+
+	node_list = node;
+	TRACE2( accept, node->id, socket_fd );
+
+	return node;
+}
+
+
+/* The node becomes a client: it is admitted or queued, and recorded. */
+static void enter_node( NODE *node, const char *how, const char *through )
+{
+#if defined( RECORD )
+	if ( record_dir )
+	{
+		if ( ( node->rec = rec_open( record_dir, node->host ) ) )
+			memory_used += sizeof( RECORDER );
+		else
+			wraperror( "new_connection: cannot record %s", node->host );
+	}
+#endif
+
+	/* Over the limit it still gets detected, so the notice can be sent in
+	   whatever it speaks, but the banner waits for a free slot. */
+	if ( max_connections && admitted_count >= max_connections )
+	{
+		node->queued = 1;
+		queued_count++;
+
+		if ( queue_tail )
+			queue_tail->queue_next = node;
+		else
+			queue_head = node;
+
+		queue_tail = node;
+	}
+	else
+	{
+		node->admitted = 1;
+		admitted_count++;
+	}
+
+	wraplog( "Accepted %sconnection from %s/%d%s%s, current node count: %lu%s",
+			 how, node->host, node->client.socket_fd, through ? " through " : "",
+			 through ? through : "", node_count, node->queued ? " (queued)" : "" );
+
+	return;
+}
+
+
+/* Takes the PROXY header off the front of the connection, never a byte
+   past it, so what follows (a TLS handshake in particular) is read as if
+   the client had connected to us directly. What arrived of the header so
+   far waits in server.prebuf. Balancers checking on us tend to connect and
+   hang up without a word, and are let go just as quietly. */
+static int read_proxy( NODE *node )
+{
+	struct sockaddr_in6 src, dst;
+	PEER *p = &node->server;
+	ssize_t count;
+	size_t take;
+	int length;
+
+	count = recv( node->client.socket_fd, p->prebuf + p->prelen, PROXY_MAX - p->prelen, MSG_PEEK );
+
+	if ( count == 0 && p->prelen == 0 )
+	{
+		release_node( node );
+		return 1;
+	}
+
+	if ( count <= 0 )
+	{
+		if ( count < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN ) )
+			return 1;
+
+		if ( count < 0 )
+			wraperror( "read_proxy (%s)", node->host );
+		else
+			wraplog( "Client %s disconnected (EOF)", node->host );
+
+		return 0;
+	}
+
+	length = proxy_parse( p->prebuf, p->prelen + (size_t) count, &src, &dst );
+
+	if ( length < 0 || ( length == 0 && p->prelen + (size_t) count == PROXY_MAX ) )
+	{
+		wraplog( "Bad PROXY header from %s/%d.", node->host, node->client.socket_fd );
+		return 0;
+	}
+
+	take = length ? (size_t) length - p->prelen : (size_t) count;
+
+	if ( recv( node->client.socket_fd, p->prebuf + p->prelen, take, 0 ) != (ssize_t) take )
+	{
+		wraperror( "read_proxy (%s)", node->host );
+		return 0;
+	}
+
+	bytes_recv += (unsigned long int) take;
+	p->prelen += take;
+
+	if ( !length )
+		return 1;
+
+	p->prelen = 0;
+
+	return proxy_received( node, &src, &dst );
+}
+
+
+/* The header is in: the node becomes the client it names, and goes through
+   admission as if that client had connected. A header that names no one
+   (the balancer checking on us, or UNKNOWN) leaves the balancer's address. */
+static int proxy_received( NODE *node, struct sockaddr_in6 *src, const struct sockaddr_in6 *dst )
+{
+	char host[ 40 ], balancer[ 40 ], line[ PROXY_V1_MAX ];
+	ACL_HOST *source;
+
+	strcpy( balancer, node->host );
+
+	if ( src->sin6_family == AF_UNSPEC )
+		host_address( balancer, src );
+	else
+	{
+		proxy_v1( line, (const struct sockaddr *) src, (const struct sockaddr *) dst );
+		node->front = strdup( line );
+	}
+
+	if ( !open_allowed( node->client.socket_fd, src, host )
+	  || !admit_client( node->client.socket_fd, src, host, &source ) )
+	{
+		release_node( node );
+		return 1;
+	}
+
+	node->expect_proxy = 0;
+	proxy_pending--;
+	TRACE3( handshake, node->id, node->client.socket_fd, "proxy" );
+	node->source = source;
+	strcpy( node->host, host );
+	timer_set( &node->deadline, DETECT_DELAY, deadline_expired, node );
+	enter_node( node, "", node->front ? balancer : NULL );
+
+	return 1;
+}
+
+
+/* The address a node's host stands for, IPv4 mapped into IPv6. */
+static int host_address( const char *host, struct sockaddr_in6 *sock )
+{
+	struct in_addr in4;
+
+	memset( sock, 0, sizeof( *sock ) );
+	sock->sin6_family = AF_INET6;
+
+	if ( inet_pton( AF_INET6, host, &sock->sin6_addr ) == 1 )
+		return 1;
+
+	if ( inet_pton( AF_INET, host, &in4 ) != 1 )
+		return 0;
+
+	sock->sin6_addr.s6_addr[ 10 ] = sock->sin6_addr.s6_addr[ 11 ] = 0xFF;
+	memcpy( sock->sin6_addr.s6_addr + 12, &in4, 4 );
+
+	return 1;
+}
+
+
+static NODE *new_node( void )
+{
+	NODE *node;
+
+	if ( !reuse_list )
+	{
+		nodes_allocated++;
+		node = calloc( sizeof( NODE ), 1 );
+		memory_used += sizeof( NODE );
+	}
+	else
+	{
+		node = reuse_list;
+		reuse_list = reuse_list->next;
+		memset( node, 0, sizeof( NODE ) );
+	}
+
+	node->id = ++nodes_created;
+	node_count++;
+
+	return node;
+}
+
+
+/* Whether another connection fits in the memory budget */
+static int node_room( void )
+{
+	return !memory_budget || reuse_list || memory_used + sizeof( NODE ) <= memory_budget;
+}
+
+
+/* Brings memory_used back within the budget. Free nodes go first, then
+   sessions that are not in a game, oldest first, see shed_candidate().
+   Sessions in a game are never dropped here. While no new node fits, the
+   main loop stops accepting; the kernel keeps the backlog meanwhile.
+   Returns node_room(). */
+static int relieve_pressure( void )
+{
+	NODE *node;
+
+	if ( !memory_budget )
+		return 1;
+
+	for ( ;; )
+	{
+		while ( reuse_list && memory_used + sizeof( NODE ) > memory_budget )
+		{
+			node = reuse_list;
+			reuse_list = node->next;
+			free( node );
+			memory_used -= sizeof( NODE );
+		}
+
+		if ( memory_used <= memory_budget || !( node = shed_candidate( ) ) )
+			break;
+
+		wraplog( "Over the memory budget (%lu of %lu bytes), dropping %s/%d.",
+				 (unsigned long int) memory_used, (unsigned long int) memory_budget,
+				 node->host, node->client.socket_fd );
+		disconnect( node, "memory" );
+	}
+
+	return node_room( );
+}
+
+
+/* The oldest of the sessions that cost the least to lose: still being
+   detected, then spectators, then queued, at the menu or connecting, and
+   last those waiting to be resumed. */
+static NODE *shed_candidate( void )
+{
+	NODE *node, *best = NULL;
+	int rank, best_rank = 5;
+
+	for ( node = node_list; node; node = node->next )
+	{
+		if ( node->detached )
+			rank = 4;
+		else if ( node->queued || node->waiting || node->menu || node->connecting )
+			rank = 3;
+		else if ( node->cursor )
+			rank = 1;
+		else if ( node->type == UNKNOWN )
+			rank = 0;
+		else
+			continue;
+
+		if ( rank < best_rank || ( rank == best_rank && node->created <= best->created ) )
+		{
+			best = node;
+			best_rank = rank;
+		}
+	}
+
+	return best;
+}
+
+
+/* Replaces the node's replay with size bytes for the caller to fill. */
+static char *replay_alloc( NODE *node, size_t size )
+{
+	replay_free( node );
+	node->replay = malloc( size );
+	node->replay_size = size;
+	memory_used += size;
+
+	return node->replay;
+}
+
+
+static void replay_free( NODE *node )
+{
+	if ( !node->replay )
+		return;
+
+	free( node->replay );
+	memory_used -= node->replay_size;
+	node->replay = NULL;
+	node->replay_size = 0;
+
+	return;
+}
+
+
+/* Tells a queued client where it stands; the banner follows once
+   admit_next() lets it in. */
+static void queue_notice( NODE *node )
+{
+	char text[ 128 ];
+	unsigned long int position = 1;
+	size_t len;
+	NODE *n;
+
+	for ( n = queue_head; n && n != node; n = n->queue_next )
+		position++;
+
+	len = (size_t) sprintf( text, "Server busy, you are number %lu in the queue.\n\r", position );
+
+	send_text( node, text, len );
+	node->waiting = 1;
+	timer_set( &node->deadline, QUEUE_TIMEOUT * 1000UL, deadline_expired, node );
+
+	return;
+}
+
+
+/* Moves clients from the queue into free slots. Their banner goes out
+   from the timer, not from here: this runs inside disconnect(), which the
+   main loop may call while it holds on to the next node. */
+static void admit_next( void )
+{
+	NODE *node;
+
+	while ( queue_head && admitted_count < max_connections )
+	{
+		node = queue_head;
+
+		if ( !( queue_head = node->queue_next ) )
+			queue_tail = NULL;
+
+		node->queue_next = NULL;
+		node->queued = 0;
+		queued_count--;
+		node->admitted = 1;
+		admitted_count++;
+
+		if ( node->waiting )
+			timer_set( &node->deadline, 0, deadline_expired, node );
+	}
+
+	return;
+}
+
+
+/* Checks a new connection against the access list, the per address limit
+   and the accept rate of the current configuration. On success the
+   connection is counted against *source, if any limit needs it. */
+static int admit( const unsigned char *addr, const char *host, ACL_HOST **source )
+{
+	ACL_HOST *h;
+	unsigned long int now;
+	int action;
+
+	*source = NULL;
+
+	if ( !catalog )
+		return 1;
+
+	if ( catalog->acl )
+	{
+		action = acl_lookup( catalog->acl, addr );
+
+		if ( action == ACL_DENY || ( action == ACL_NONE && catalog->deny_default ) )
+		{
+			wraplog( "Refused %s: access denied.", host );
+			return 0;
+		}
+	}
+
+	if ( !catalog->per_ip && !catalog->accept_rate )
+		return 1;
+
+	now = timer_now( );
+	h = acl_host( addr, catalog->accept_burst, now );
+
+	if ( catalog->per_ip && h->count >= catalog->per_ip )
+	{
+		wraplog( "Refused %s: %u connections open already.", host, h->count );
+		return 0;
+	}
+
+	if ( catalog->accept_rate )
+	{
+		bucket_refill( &h->accepts, catalog->accept_rate, catalog->accept_burst, now );
+
+		if ( h->accepts.level < 1000 )
+		{
+			wraplog( "Refused %s: connecting too fast.", host );
+			return 0;
+		}
+
+		h->accepts.level -= 1000;
+	}
+
+	h->count++;
+	*source = h;
+
+	return 1;
+}
+
+
+/* How much of room the client may fill with its next read */
+static size_t input_allowance( NODE *node, size_t room )
+{
+	const CATALOG *cat = node->catalog;
+	size_t tokens;
+
+	bucket_refill( &node->input, cat->input_rate, cat->input_burst, timer_now( ) );
+	tokens = node->input.level > 1000 ? (size_t) node->input.level / 1000 : 1;
+
+	return tokens < room ? tokens : room;
+}
+
+
+/* Charges what the client sent towards the game. Once the bucket runs dry
+   the client is not read from until it refills, and TCP slows it down. */
+static void throttle_input( NODE *node, size_t bytes )
+{
+	const CATALOG *cat = node->catalog;
+	BUCKET *b = &node->input;
+
+	bucket_refill( b, cat->input_rate, cat->input_burst, timer_now( ) );
+	b->level -= (long int) bytes * 1000L;
+
+	if ( b->level < 0 )
+	{
+		node->throttled = 1;
+		timer_set( &node->throttle, (unsigned long int) -b->level / cat->input_rate + 1,
+				   throttle_expired, node );
+	}
+
+	return;
+}
+
+
+static void throttle_expired( void *data )
+{
+	NODE *node = data;
+
+	node->throttled = 0;
+
+	return;
+}
+
+
+/* Whatever the node is waiting for did not happen in time. */
+static void deadline_expired( void *data )
+{
+	NODE *node = data;
+
+	if ( node->expect_proxy )
+	{
+		wraplog( "No PROXY header from %s/%d in time.", node->host, node->client.socket_fd );
+		disconnect( node, "timeout" );
+		return;
+	}
+
+	if ( node->detached )
+	{
+		wraplog( "Session of %s was not resumed in time.", node->host );
+		disconnect( node, "timeout" );
+		return;
+	}
+
+	if ( node->waiting )
+	{
+		if ( node->queued )
+		{
+			WRITE( node, "Server is still busy, please try again later.\n\r" );
+			wraplog( "Client %s/%d gave up waiting in the queue.",
+					 node->host, node->client.socket_fd );
+			disconnect( node, "queue" );
+			return;
+		}
+
+		wraplog( "Client %s/%d left the queue.", node->host, node->client.socket_fd );
+		node->waiting = 0;
+		banner( node );
+		return;
+	}
+
+	if ( node->resolving )
+	{
+		WRITE( node, "Could not connect to game.\n\r" );
+		wraplog( "Looking up %s timed out for %s/%d.", ENTRY_NAME( node->resolving ),
+				 node->host, node->client.socket_fd );
+		disconnect( node, "timeout" );
+		return;
+	}
+
+	if ( node->connecting )
+	{
+		int i;
+
+		for ( i = 0; i < node->attempts; i++ )
+			backend_failed( node->attempt[ i ].backend );
+
+		WRITE( node, "Could not connect to game.\n\r" );
+		wraplog( "Connecting to game timed out for %s/%d.",
+				 node->host, node->client.socket_fd );
+		disconnect( node, "timeout" );
+		return;
+	}
+
+	if ( node->http && node->server.prelen == 0 )
+	{
+		disconnect( node, "done" );
+		return;
+	}
+
+	/* Browsers, Flash and TLS clients speak first, so a client still quiet
+	   after probe_delay is asked whether it talks telnet. TIMING-MARK
+	   changes no option either way, and whatever the client answers settles
+	   it; netcat answers nothing and gets the banner at DETECT_TIMEOUT. */
+	if ( node->type == UNKNOWN && node->server.prelen == 0 && !TLS_HANDSHAKING( node )
+	  && !node->probed && probe_delay )
+	{
+		node->probed = 1;
+		node->canned = TELNET_PROBE;
+		node->canned_len = sizeof( TELNET_PROBE ) - 1;
+		timer_set( &node->deadline, DETECT_TIMEOUT * 1000UL - (unsigned long int) probe_delay,
+				   deadline_expired, node );
+		return;
+	}
+
+	if ( node->type == UNKNOWN && node->server.prelen == 0 && !TLS_HANDSHAKING( node ) )
+	{
+		node->type = TELNET;
+		TRACE3( classify, node->id, node->client.socket_fd, "telnet" );
+		banner( node );
+		return;
+	}
+
+	wraplog( "%s timed out for %s/%d.",
+			 node->type == UNKNOWN ? "Handshake" : "Menu",
+			 node->host, node->client.socket_fd );
+	disconnect( node, "timeout" );
+
+	return;
+}
+
+
+/* Reading from the client only stamps last_input, so busy sessions never
+   touch the wheel; the timer re-arms itself for whatever time remains. */
+static void idle_expired( void *data )
+{
+	NODE *node = data;
+	unsigned long int idle = timer_now( ) - node->last_input;
+
+	if ( idle < idle_timeout * 1000UL )
+	{
+		timer_set( &node->idle, idle_timeout * 1000UL - idle, idle_expired, node );
+		return;
+	}
+
+	WRITE( node, "\n\rIdle timeout.\n\r" );
+	wraplog( "Client %s/%d idle for %lu seconds.",
+			 node->host, node->client.socket_fd, idle / 1000 );
+	disconnect( node, "idle" );
+
+	return;
+}
+
+
+/* Proxies and NAT boxes drop connections that carry nothing for a while,
+   and a game can be quiet for minutes. RFC 6455 clients get a ping every
+   WS_PING_INTERVAL; ws_decode_6455() takes the pong. Spectators are left
+   out, as a control frame could land inside the chunk send_watch() is
+   writing. */
+static void start_pings( NODE *node )
+{
+	if ( node->type == WEB_SOCKETS && node->framing != FRAME_HIXIE && !node->cursor )
+		timer_set( &node->ping, WS_PING_INTERVAL * 1000UL, ping_due, node );
+	else
+		timer_cancel( &node->ping );
+
+	return;
+}
+
+
+/* A pong that is still queued does the job as well. */
+static void ping_due( void *data )
+{
+	NODE *node = data;
+
+	if ( !node->control_len )
+		node->control_len = ws_header( node->control, WS_PING, 0 );
+
+	timer_set( &node->ping, WS_PING_INTERVAL * 1000UL, ping_due, node );
+
+	return;
+}
+
+
+/* Looks at the attempts select() found writable. The first one that has
+   connected becomes the server socket and the others are abandoned. */
+static int finish_connect( NODE *node, fd_set *out_set )
+{
+	ATTEMPT *a;
+	int error, i, local;
+	socklen_t len;
+
+	for ( i = 0; i < node->attempts; )
+	{
+		a = &node->attempt[ i ];
+
+		if ( !FD_ISSET( a->socket_fd, out_set ) )
+		{
+			i++;
+			continue;
+		}
+
+		error = 0;
+		len = sizeof( error );
+
+		if ( getsockopt( a->socket_fd, SOL_SOCKET, SO_ERROR, &error, &len ) < 0 )
+			error = errno;
+
+		if ( !error )
+			break;
+
+		TRACE3( connect_end, node->id, a->socket_fd, error );
+		errno = error;
+		wraperror( "Could not connect to %s (%s)", a->backend->name, node->host );
+		backend_failed( a->backend );
+		close( a->socket_fd );
+		*a = node->attempt[ --node->attempts ];
+	}
+
+	if ( i == node->attempts )
+	{
+		/* Whatever was in flight failed; no point waiting for the stagger. */
+		if ( node->attempts || next_attempt( node ) )
+			return 1;
+
+		WRITE( node, "Could not connect to game.\n\r" );
+		return 0;
+	}
+
+	TRACE3( connect_end, node->id, a->socket_fd, 0 );
+	node->server.socket_fd = a->socket_fd;
+	local = a->backend->addr.ss_family == AF_UNIX;
+	backend_ok( a->backend );
+
+	if ( a->source )
+		( node->bound = a->source->load )->count++;
+
+	wraplog( "Client %s/%d connected to %s%s%s.", node->host,
+			 node->client.socket_fd, a->backend->name,
+			 a->source ? " from " : "", a->source ? a->source->name : "" );
+	RECORD_DATA( node, REC_GAME, ENTRY_NAME( node->entry ), strlen( ENTRY_NAME( node->entry ) ) );
+
+	*a = node->attempt[ --node->attempts ];
+
+	while ( node->attempts > 0 )
+		close( node->attempt[ --node->attempts ].socket_fd );
+
+	return game_connected( node, local );
+}
+
+
+/* Whatever a session needs once the game is on the other end, however it
+   got there. Returns 1, even if pass_client() took the node away. */
+static int game_connected( NODE *node, int local )
+{
+	node->connecting = 0;
+	timer_cancel( &node->deadline );
+	timer_cancel( &node->stagger );
+
+	if ( local && node->entry->pass_client && pass_client( node ) )
+		return 1;
+
+	if ( node->entry->send_proxy && !send_proxy_header( node ) )
+	{
+		WRITE( node, "Could not connect to game.\n\r" );
+		wraplog( "No room for a PROXY header ahead of the %lu bytes %s/%d typed.",
+				 (unsigned long int) node->server.length, node->host, node->client.socket_fd );
+		disconnect( node, "overflow" );
+		return 1;
+	}
+
+	if ( node->catalog && node->catalog->input_rate )
+		bucket_fill( &node->input, node->catalog->input_burst, timer_now( ) );
+
+	if ( node->ring && node->type == TELNET )
+		node->client.length += (size_t) sprintf( node->client.buffer + node->client.length,
+			"\x1b[38;5;8mResume token: %s\x1b[0m\n\r", node->token );
+
+	/* WebSocket clients get it framed along with the game output. */
+	if ( spectator_limit && !node->origin )
+	{
+		new_token( node->watch_token );
+
+		if ( RAW_OUTPUT( node ) )
+			node->client.length += (size_t) sprintf( node->client.buffer + node->client.length,
+				"\x1b[38;5;8mWatch token: %s\x1b[0m\n\r", node->watch_token );
+		else
+			node->client.prelen += (size_t) sprintf( node->client.prebuf + node->client.prelen,
+				"\x1b[38;5;8mWatch token: %s\x1b[0m\n\r", node->watch_token );
+	}
+
+	return 1;
+}
+
+
+#if defined( TUNNEL )
+/* The session goes to the hub as one more stream on a link that is
+   already up, so it costs no handshake across the long haul. */
+static void tunnel_connect( NODE *node )
+{
+	char origin[ PROXY_V1_MAX ];
+	int fd;
+
+	client_origin( node, origin );
+
+	if ( ( fd = tunnel_open( node->entry->tunnel, (struct sockaddr *) &node->entry->backends[ 0 ].addr,
+							 node->entry->backends[ 0 ].addrlen, node->entry->key, origin ) ) < 0 )
+	{
+		WRITE( node, "Could not connect to game.\n\r" );
+		wraplog( "No tunnel to %s for %s.", node->entry->tunnel, node->host );
+		disconnect( node, "unreachable" );
+		return;
+	}
+
+	TRACE3( connect_start, node->id, fd, node->entry->tunnel );
+	TRACE3( connect_end, node->id, fd, 0 );
+	node->server.socket_fd = fd;
+	node->tunneled = 1;
+	wraplog( "Client %s/%d connected to %s through %s.", node->host,
+			 node->client.socket_fd, node->entry->key, node->entry->tunnel );
+	RECORD_DATA( node, REC_GAME, ENTRY_NAME( node->entry ), strlen( ENTRY_NAME( node->entry ) ) );
+	game_connected( node, 0 );
+
+	return;
+}
+
+
+/* The hub admits each stream under the address in its PROXY line, so only
+   the edges [access] tunnel_from names may open links at all. */
+static int tunnel_peer( const char *host )
+{
+	struct sockaddr_in6 sock;
+
+	if ( !catalog || !catalog->tunnel_from )
+	{
+		wraplog( "Refused a tunnel link from %s: no tunnel_from in [access].", host );
+		return 0;
+	}
+
+	if ( !host_address( host, &sock )
+	  || acl_lookup( catalog->tunnel_from, sock.sin6_addr.s6_addr ) != ACL_ALLOW )
+	{
+		wraplog( "Refused a tunnel link from %s: not in tunnel_from.", host );
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/* A stream an edge opened becomes a telnet client here, admitted by the
+   address of the player behind it and going straight to the entry. */
+static int tunnel_stream( int fd, const char *key, const char *origin )
+{
+	struct sockaddr_in6 sock;
+	char addr[ INET6_ADDRSTRLEN ];
+
+	if ( listen_socket < 0 )
+		return 0;
+
+	if ( !catalog_find( catalog, key, strlen( key ) ) )
+	{
+		wraplog( "Tunnel stream for unknown entry %s refused.", key );
+		return 0;
+	}
+
+	if ( sscanf( origin, "PROXY %*s %45s", addr ) != 1 )
+		addr[ 0 ] = '\0';
+
+	host_address( addr, &sock );
+
+	new_connection( fd, &sock, key, origin );
+
+	return 1;
+}
+#endif
+
+
+/* A game behind a unix: backend with pass_client gets a HO_CLIENT message
+   first. A telnet client's socket goes with it and the node is forgotten,
+   so the proxy is off the path of that session. A client whose socket
+   cannot go (TLS, WebSocket, output still on its way) comes without one
+   and is proxied over the same connection. Returns 1 once the node is gone. */
+static int pass_client( NODE *node )
+{
+	char data[ sizeof( node->host ) + MSL ];
+	size_t length;
+	int passing;
+
+	passing = node->type == TELNET && !node->canned_len && !node->client.length
+		   && !node->client.prelen && !node->watchers;
+#if defined( TLS )
+	passing = passing && !node->ssl;
+#endif
+
+	length = (size_t) sprintf( data, "%s\n", node->host );
+
+	if ( passing )
+	{
+		memcpy( data + length, node->server.buffer, node->server.length );
+		length += node->server.length;
+
+		/* It arrives the way accept() would have returned it. */
+		fcntl( node->client.socket_fd, F_SETFL, 0 );
+	}
+
+	if ( !handoff_send( node->server.socket_fd, HO_CLIENT, &node->client.socket_fd,
+						passing, data, length ) )
+	{
+		wraperror( "Could not pass %s/%d to %s", node->host, node->client.socket_fd,
+				   node->entry->key ? node->entry->key : node->entry->host );
+		WRITE( node, "Could not connect to game.\n\r" );
+		disconnect( node, "unreachable" );
+		return 1;
+	}
+
+	if ( !passing )
+		return 0;
+
+	wraplog( "Client %s/%d passed to %s.", node->host, node->client.socket_fd,
+			 node->entry->key ? node->entry->key : node->entry->host );
+	release_node( node );
+
+	return 1;
+}
+
+
+/* Puts a PROXY header ahead of anything the client typed ahead, so the game
+   sees the player's address and not one of the proxy's. Returns 0 if the
+   typing leaves no room for it; none of it may go before the header. */
+static int send_proxy_header( NODE *node )
+{
+	char header[ PROXY_V1_MAX ];
+	size_t n = client_origin( node, header );
+
+	if ( node->server.length + n >= sizeof( node->server.buffer ) )
+		return 0;
+
+	memmove( node->server.buffer + n, node->server.buffer, node->server.length );
+	memcpy( node->server.buffer, header, n );
+	node->server.length += n;
+	node->server.buffer[ node->server.length ] = '\0';
+
+	return 1;
+}
+
+
+/* The PROXY line for the client: the one its tunnel, balancer or HTTP/2
+   connection came with, if it did. */
+static size_t client_origin( const NODE *node, char *out )
+{
+	struct sockaddr_storage src, dst;
+	socklen_t srclen = sizeof( src ), dstlen = sizeof( dst );
+
+	if ( node->origin || node->front || node->via )
+	{
+		strcpy( out, node->origin ? node->origin : node->front ? node->front : node->via );
+		return strlen( out );
+	}
+
+	memset( &src, 0, sizeof( src ) );
+	memset( &dst, 0, sizeof( dst ) );
+
+	if ( getpeername( node->client.socket_fd, (struct sockaddr *) &src, &srclen ) < 0
+	  || getsockname( node->client.socket_fd, (struct sockaddr *) &dst, &dstlen ) < 0 )
+		src.ss_family = AF_UNSPEC;
+
+	return proxy_v1( out, (struct sockaddr *) &src, (struct sockaddr *) &dst );
+}
+
+
+/* The client went away. If the session can be resumed, keep the game
+   connection open for the grace period and go on recording its output. */
+static void drop_client( NODE *node )
+{
+	if ( !node->ring || node->connecting || !node->server.socket_fd )
+	{
+		disconnect( node, "client" );
+		return;
+	}
+
+	wraplog( "Client %s/%d detached, keeping the session for %lu seconds.",
+			 node->host, node->client.socket_fd, resume_grace );
+
+#if defined( TLS )
+	if ( node->ssl )
+		tls_close( node->ssl );
+	node->ssl = NULL;
+#endif
+
+	close( node->client.socket_fd );
+	node->client.socket_fd = 0;
+	node->detached = 1;
+	node->client.length = node->client.prelen = 0;
+	node->server.length = node->server.prelen = 0;
+	node->head_len = node->head_off = node->frame_left = node->control_len = 0;
+	node->canned_len = 0;
+	replay_free( node );
+	timer_cancel( &node->idle );
+	timer_cancel( &node->ping );
+	timer_set( &node->deadline, resume_grace * 1000UL, deadline_expired, node );
+
+	return;
+}
+
+
+static void new_token( char *token )
+{
+	unsigned char raw[ TOKEN_LENGTH / 2 ];
+	int i;
+
+	if ( read( urandom, raw, sizeof( raw ) ) != (ssize_t) sizeof( raw ) )
+		wraperror( "new_token: read" );
+
+	for ( i = 0; i < TOKEN_LENGTH / 2; i++ )
+		sprintf( token + 2 * i, "%02x", raw[ i ] );
+
+	return;
+}
+
+
+static NODE *find_session( const char *token, size_t length )
+{
+	NODE *node;
+
+	if ( length != TOKEN_LENGTH )
+		return NULL;
+
+	for ( node = node_list; node; node = node->next )
+		if ( node->detached && !strncmp( node->token, token, TOKEN_LENGTH ) )
+			return node;
+
+	return NULL;
+}
+
+
+static NODE *find_watched( const char *token, size_t length )
+{
+	NODE *node;
+
+	if ( length != TOKEN_LENGTH )
+		return NULL;
+
+	for ( node = node_list; node; node = node->next )
+		if ( node->watch_token[ 0 ] && node->server.socket_fd
+		  && !strncmp( node->watch_token, token, TOKEN_LENGTH ) )
+			return node;
+
+	return NULL;
+}
+
+
+/* Makes a freshly handshaken WebSocket node a read-only spectator of
+   target. It is sent the recorded output first, if there is any, and from
+   then on the same frames as every other spectator of the session. */
+static void watch_session( NODE *node, NODE *target )
+{
+	enum Framing f = FRAMING( node );
+	char *raw;
+	size_t n;
+
+	wraplog( "Client %s/%d is watching the session of %s.",
+			 node->host, node->client.socket_fd, target->host );
+
+	if ( !target->watch_tail[ f ] )
+	{
+		target->watch_tail[ f ] = malloc( sizeof( CHUNK ) );
+		memset( target->watch_tail[ f ], 0, sizeof( CHUNK ) );
+		memory_used += sizeof( CHUNK );
+		target->watch_tail[ f ]->refs = 1;
+	}
+
+	node->watching = target;
+	node->cursor = target->watch_tail[ f ];
+	node->cursor->refs++;
+	node->cursor_off = node->cursor->length;
+	target->watchers++;
+
+	if ( !target->framed_for[ f ]++ )
+		ansi_init( &target->watch_sgr );
+
+	timer_cancel( &node->deadline );
+	timer_cancel( &node->idle );
+
+	if ( target->ring )
+	{
+		raw = malloc( resume_ring + 1 );
+		n = ring_copy( target, raw );
+		replay_alloc( node, FRAMED_MAX( n ) );
+		node->canned_len = frame_text( f, NULL, node->replay, raw, n );
+		node->canned = node->replay;
+		free( raw );
+	}
+
+	return;
+}
+
+
+/* Frames game output once for all the spectators of a session that want
+   it framed the same way. */
+static void watch_append( NODE *node, const char *data, size_t length )
+{
+	CHUNK *chunk, *tail;
+	int f;
+
+	if ( !node->watchers || !length )
+		return;
+
+	for ( f = FRAME_HIXIE; f < FRAMINGS; f++ )
+	{
+		if ( !node->framed_for[ f ] )
+			continue;
+
+		chunk = malloc( sizeof( CHUNK ) + FRAMED_MAX( length ) );
+		chunk->data = (char *) ( chunk + 1 );
+
+		if ( !( chunk->length = frame_text( (enum Framing) f, &node->watch_sgr,
+											chunk->data, data, length ) ) )
+		{
+			free( chunk );
+			continue;
+		}
+
+		/* Mostly ASCII, so it is usually close to half the worst case. */
+		chunk = realloc( chunk, sizeof( CHUNK ) + chunk->length );
+		chunk->data = (char *) ( chunk + 1 );
+		memory_used += sizeof( CHUNK ) + chunk->length;
+
+		tail = node->watch_tail[ f ];
+		chunk->next = NULL;
+		chunk->refs = 2;	/* the session and the chunk before */
+		chunk->offset = tail->offset + tail->length;
+		tail->next = chunk;
+		node->watch_tail[ f ] = chunk;
+		chunk_release( tail );
+	}
+
+	return;
+}
+
+
+/* Sends a spectator what it has not been sent yet, as far as the socket
+   takes it. Returns 0 once it should go: the session it watched ended and
+   everything is out, or it fell too far behind. */
+static int send_watch( NODE *node )
+{
+	CHUNK *next;
+	ssize_t count;
+
+	for ( ;; )
+	{
+		if ( node->cursor_off == node->cursor->length )
+		{
+			if ( !( next = node->cursor->next ) )
+				break;
+
+			next->refs++;
+			chunk_release( node->cursor );
+			node->cursor = next;
+			node->cursor_off = 0;
+			continue;
+		}
+
+		count = PEER_WRITE( node, node->client.socket_fd, node->cursor->data + node->cursor_off,
+							node->cursor->length - node->cursor_off );
+
+		if ( count < 0 && errno != EWOULDBLOCK && errno != EAGAIN )
+		{
+			wraperror( "send_watch (%s)", node->host );
+			return 0;
+		}
+
+		if ( count > 0 )
+		{
+			bytes_sent += (unsigned long int) count;
+			node->cursor_off += (size_t) count;
+		}
+
+		/* The socket is full; it may have been for a while. */
+		if ( node->cursor_off < node->cursor->length )
+		{
+			if ( node->watching
+			  && node->watching->watch_tail[ FRAMING( node ) ]->offset
+				 + node->watching->watch_tail[ FRAMING( node ) ]->length
+				 - node->cursor->offset - node->cursor_off > WATCH_LAG )
+			{
+				wraplog( "Spectator %s/%d fell behind, disconnecting.",
+						 node->host, node->client.socket_fd );
+				return 0;
+			}
+
+			return 1;
+		}
+	}
+
+	if ( !node->watching )
+	{
+		wraplog( "Session watched by %s/%d ended.", node->host, node->client.socket_fd );
+		return 0;
+	}
+
+	return 1;
+}
+
+
+static void chunk_release( CHUNK *chunk )
+{
+	CHUNK *next;
+
+	while ( chunk && --chunk->refs == 0 )
+	{
+		next = chunk->next;
+		memory_used -= sizeof( CHUNK ) + chunk->length;
+		free( chunk );
+		chunk = next;
+	}
+
+	return;
+}
+
+
+/* Moves the client of a freshly accepted node over to a detached session,
+   replays the recorded output and lets the new node go. */
+static void resume_session( NODE *node, NODE *old )
+{
+	size_t n;
+	char *raw;
+
+	wraplog( "Client %s/%d resumed the session of %s.",
+			 node->host, node->client.socket_fd, old->host );
+
+	old->client.socket_fd = node->client.socket_fd;
+	old->type = node->type;
+	old->framing = node->framing;
+#if defined( TLS )
+	old->ssl = node->ssl;
+	old->tls_state = node->tls_state;
+	node->ssl = NULL;
+#endif
+	old->detached = 0;
+	old->last_input = timer_now( );
+	strcpy( old->host, node->host );
+	timer_cancel( &old->deadline );
+
+	if ( idle_timeout )
+		timer_set( &old->idle, idle_timeout * 1000UL, idle_expired, old );
+	start_pings( old );
+
+	raw = malloc( resume_ring + 1 );
+	n = ring_copy( old, raw );
+
+	/* Replaying the ring brings the parser to where the game is. */
+	ansi_init( &old->sgr );
+	old->canned_len = frame_text( FRAMING( old ), &old->sgr,
+								  replay_alloc( old, FRAMED_MAX( n ) ), raw, n );
+	free( raw );
+
+	old->canned = old->replay;
+
+	node->client.socket_fd = 0;
+	disconnect( node, "resumed" );
+
+	return;
+}
+
+
+/* Writes what the ring holds, oldest first, and returns its length. */
+static size_t ring_copy( const NODE *node, char *out )
+{
+	size_t n = node->ring_total < resume_ring ? node->ring_total : resume_ring;
+	size_t start = ( node->ring_total - n ) % resume_ring;
+
+	memcpy( out, node->ring + start, n < resume_ring - start ? n : resume_ring - start );
+	if ( n > resume_ring - start )
+		memcpy( out + resume_ring - start, node->ring, n - ( resume_ring - start ) );
+
+	return n;
+}
+
+
+static void ring_append( NODE *node, const char *data, size_t length )
+{
+	size_t pos, chunk;
+
+	if ( length > resume_ring )
+	{
+		node->ring_total += length - resume_ring;
+		data += length - resume_ring;
+		length = resume_ring;
+	}
+
+	while ( length )
+	{
+		pos = node->ring_total % resume_ring;
+		chunk = resume_ring - pos < length ? resume_ring - pos : length;
+		memcpy( node->ring + pos, data, chunk );
+		node->ring_total += chunk;
+		data += chunk;
+		length -= chunk;
+	}
+
+	return;
+}
+
+
+#if defined( TLS )
+/* Peeks at the first byte without taking it off the socket: 0x16 starts
+   a TLS handshake record, which no telnet client or HTTP request does. */
+static int tls_detect( NODE *node )
+{
+	unsigned char c;
+
+	if ( recv( node->client.socket_fd, &c, 1, MSG_PEEK ) != 1 || c != 0x16 )
+		return 0;
+
+	if ( !( node->ssl = tls_new( tls_ctx, node->client.socket_fd ) ) )
+		return 0;
+
+	node->tls_state = TLS_WANT_READ;
+	timer_set( &node->deadline, HANDSHAKE_TIMEOUT * 1000UL, deadline_expired, node );
+
+	return 1;
+}
+
+
+/* Once the handshake is done the node starts over as an unknown client,
+   speaking whatever it speaks through the encrypted channel. */
+static int tls_handshake( NODE *node )
+{
+	int ktls;
+
+	node->tls_state = tls_accept( node->ssl );
+
+	if ( node->tls_state == TLS_ERROR )
+	{
+		wraplog( "TLS handshake with %s/%d failed.", node->host, node->client.socket_fd );
+		return 0;
+	}
+
+	if ( node->tls_state != TLS_DONE )
+		return 1;
+
+	ktls = tls_ktls( node->ssl );
+	TRACE3( handshake, node->id, node->client.socket_fd, "tls" );
+
+	wraplog( "Client %s/%d negotiated %s with %s%s%s.",
+			 node->host, node->client.socket_fd,
+			 SSL_get_version( node->ssl ), SSL_get_cipher_name( node->ssl ),
+			 ktls & TLS_KTLS_SEND ? ", kernel TLS send" : "",
+			 ktls & TLS_KTLS_RECV ? ", kernel TLS receive" : "" );
+
+	timer_set( &node->deadline, DETECT_DELAY, deadline_expired, node );
+
+	return 1;
+}
+#endif
+
+
+#if defined( RECORD )
+static void record( NODE *node, int kind, const char *data, size_t length )
+{
+	if ( !rec_write( node->rec, kind, data, length ) )
+	{
+		wraperror( "record (%s)", node->host );
+		record_stop( node );
+	}
+
+	return;
+}
+
+
+static void record_stop( NODE *node )
+{
+	if ( !node->rec )
+		return;
+
+	if ( !rec_close( node->rec ) )
+		wraperror( "record_stop (%s)", node->host );
+
+	node->rec = NULL;
+	memory_used -= sizeof( RECORDER );
+
+	return;
+}
+#endif
+
+
+static int fill_buffer( NODE *node, int file, char *inbuf, size_t bufsize, size_t *len )
+{
+	size_t llen = *len, room;
+	ssize_t count;
+	unsigned long int ucount;
+	int limited = file == node->client.socket_fd && node->server.socket_fd
+				  && node->catalog && node->catalog->input_rate;
+
+	/* Reading nothing would look like the end of the stream. */
+	if ( llen + 1 >= bufsize )
+		return 1;
+
+	room = bufsize - llen - 1;
+
+	if ( limited )
+		room = input_allowance( node, room );
+
+	count = PEER_READ( node, file, inbuf + llen, room );
+	ucount = (unsigned long int) count;
+
+	if ( count > 0 )
+	{
+		TRACE3( read, node->id, file, ucount );
+		inbuf[ llen + ucount ] = '\0';
+		*len = llen + ucount;
+		bytes_recv += ucount;
+		RECORD_DATA( node, file == node->client.socket_fd ? REC_CLIENT : REC_SERVER,
+					 inbuf + llen, (size_t) ucount );
+
+		if ( file == node->client.socket_fd )
+		{
+			node->last_input = timer_now( );
+
+			if ( limited )
+				throttle_input( node, (size_t) ucount );
+		}
+
+		return 1;
+	}
+	else if ( count == 0 )
+	{
+		wraplog( "Client %s disconnected (EOF)", node->host );
+		return 0;
+	}
+	else if ( errno == EWOULDBLOCK || errno == EAGAIN )
+		return 1;
+	else
+	{
+		wraperror( "fill_buffer (%s)", node->host );
+		return 0;
+	}
+}
+
+
+static void empty_buffer( NODE *node, int file, char *outbuf, size_t *len )
+{
+	size_t llen = *len;
+	size_t count;
+	ssize_t scount;
+
+	while ( llen )
+	{
+		if ( llen <= MAX_LLEN )
+		{
+			scount = PEER_WRITE( node, file, outbuf, llen );
+
+			if ( scount < 0 )
+			{
+				if ( errno == EWOULDBLOCK || errno == EAGAIN )
+					return;
+
+				wraperror( "empty_buffer (%s)", node->host );
+				if ( file == node->client.socket_fd )
+					drop_client( node );
+				else
+					disconnect( node, "server" );
+				return;
+			}
+
+			count = (size_t) scount;
+			bytes_sent += count;
+
+			if ( count < llen )
+			{
+				memmove( &outbuf[ 0 ], &outbuf[ count ], *len - count );
+				*len -= count;
+				TRACE4( write_partial, node->id, file, count, *len );
+				return;
+			}
+
+			break;
+		}
+
+		scount = PEER_WRITE( node, file, outbuf, MAX_LLEN );
+
+		if ( scount < 0 )
+		{
+			if ( errno == EWOULDBLOCK || errno == EAGAIN )
+					return;
+
+			wraperror( "empty_buffer (%s)", node->host );
+			if ( file == node->client.socket_fd )
+				drop_client( node );
+			else
+				disconnect( node, "server" );
+			return;
+		}
+
+		count = (size_t) scount;
+		bytes_sent += count;
+
+		if ( count < MAX_LLEN )
+		{
+			memmove( &outbuf[ 0 ], &outbuf[ count ], *len - count );
+			*len -= count;
+			TRACE4( write_partial, node->id, file, count, *len );
+			return;
+		}
+
+		*len = llen -= MAX_LLEN;
+		memmove( &outbuf[ 0 ], &outbuf[ MAX_LLEN ], *len );
+	}
+
+	outbuf[ 0 ] = '\0';
+	*len = 0;
+
+	return;
+}
+
+
+static int on_server_data( NODE *node )
+{
+	size_t before;
+
+	if ( node->detached )
+	{
+		char buf[ MSL ];
+		size_t len = 0;
+
+		if ( !fill_buffer( node, node->server.socket_fd, buf, sizeof( buf ), &len ) )
+			return 0;
+
+		ring_append( node, buf, len );
+		watch_append( node, buf, len );
+		return 1;
+	}
+
+	if ( RAW_OUTPUT( node ) )
+	{
+		before = node->client.length;
+
+		if ( !FILL_SERVER_BUFFER( node ) )
+			return 0;
+
+		if ( node->ring )
+			ring_append( node, node->client.buffer + before, node->client.length - before );
+
+		watch_append( node, node->client.buffer + before, node->client.length - before );
+
+		return 1;
+	}
+
+	before = node->client.prelen;
+
+	if ( !FILL_SERVER_PREBUFFER( node ) )
+		return 0;
+
+	if ( node->ring )
+		ring_append( node, node->client.prebuf + before, node->client.prelen - before );
+
+	watch_append( node, node->client.prebuf + before, node->client.prelen - before );
+
+	if ( node->type == WEB_SOCKETS )
+		return ws_encode( node );
+
+	wraplog( "on_server_data: Bug: unknown connection type %d, client %s/%d",
+			 node->type, node->host, node->client.socket_fd );
+
+	return 0;
+}
+
+
+static int on_client_data( NODE *node )
+{
+	if ( node->expect_proxy )
+		return read_proxy( node );
+
+	/* Whatever a queued client types would end up in the menu later, and
+	   spectators only get to watch. */
+	if ( node->waiting || node->cursor )
+	{
+		char junk[ 512 ];
+		size_t len = 0;
+
+		return fill_buffer( node, node->client.socket_fd, junk, sizeof( junk ), &len );
+	}
+
+	if ( node->menu == 1 )
+		return read_menu_choice( node );
+
+	if ( node->type == TELNET )
+		return FILL_CLIENT_BUFFER( node );
+
+	if ( node->type == UNKNOWN && node->server.prelen == 0 )
+	{
+#if defined( TLS )
+		if ( TLS_HANDSHAKING( node ) || ( tls_ctx && !node->ssl && tls_detect( node ) ) )
+			return tls_handshake( node );
+#endif
+
+		if ( !FILL_CLIENT_PREBUFFER( node ) )
+			return 0;
+
+		/* Pipelined requests wait for the response going out. */
+		if ( node->responding )
+			return 1;
+
+		/* It spoke first, so it gets a while to finish the handshake. */
+		if ( node->server.prelen > 0 )
+			timer_set( &node->deadline, HANDSHAKE_TIMEOUT * 1000UL, deadline_expired, node );
+
+		return determine_connection_type( node );
+	}
+
+	if ( !FILL_CLIENT_PREBUFFER( node ) )
+		return 0;
+
+	if ( node->responding )
+		return 1;
+
+	if ( node->type == WEB_SOCKETS )
+		return ws_decode( node );
+
+	if ( node->type == UNKNOWN )
+		return determine_connection_type( node );
+
+	wraplog( "on_client_data: Bug: unknown connection type %d, client %s/%d",
+			 node->type, node->host, node->client.socket_fd );
+
+	return 0;
+}
+
+
+static void the_main_loop( void )
+{
+	struct timeval tv;
+	fd_set in_set, out_set, exc_set;
+	int maxdsc, i, pending;
+	long int next;
+	NODE *node, *next_node;
+	PROBE *probe, *next_probe;
+
+	signal( SIGPIPE, SIG_IGN );
+
+	while ( keep_running )
+	{
+		if ( reload_pending )
+		{
+			int line;
+
+			reload_pending = 0;
+
+			if ( !config_file )
+				wraplog( "SIGHUP: no configuration file to reload." );
+			else if ( ( line = load_catalog( config_file ) ) != 0 )
+				wraplog( "SIGHUP: error in config file on line %d, keeping the old one.", line );
+			else
+				wraplog( "SIGHUP: loaded %lu hosts from %s.",
+						 (unsigned long int) catalog->count, config_file );
+		}
+
+		if ( upgrade_pending )
+		{
+			upgrade_pending = 0;
+			begin_upgrade( );
+		}
+
+		if ( stats_pending )
+		{
+			stats_pending = 0;
+			log_stats( );
+		}
+
+		/* Handed over, and the sessions that could not go have ended. */
+		if ( listen_socket < 0 && !node_list )
+			break;
+
+		timer_run( );
+
+		FD_ZERO( &in_set );
+		FD_ZERO( &out_set );
+		FD_ZERO( &exc_set );
+
+		maxdsc = listen_socket;
+		pending = 0;
+
+		/* Are you getting "conversion to 'unsigned int' from 'int' may change
+		   the sign of the result" warning?
+		   See https://bugzilla.novell.com/show_bug.cgi?id=651597 */
+		if ( listen_socket >= 0 && relieve_pressure( ) )
+		{
+			FD_SET( listen_socket, &in_set );
+
+			for ( i = 0; i < listener_count; i++ )
+			{
+				if ( maxdsc < listeners[ i ].socket_fd )
+					maxdsc = listeners[ i ].socket_fd;
+				FD_SET( listeners[ i ].socket_fd, &in_set );
+			}
+		}
+
+		for ( node = node_list; node; node = node->next )
+		{
+			if ( node->server.socket_fd )
+			{
+				if ( maxdsc < node->server.socket_fd )
+					maxdsc = node->server.socket_fd;
+				if ( SERVER_ROOM( node ) )
+				{
+					FD_SET( node->server.socket_fd, &in_set );
+					TRACE_FLOWING( node, STALL_SERVER );
+				}
+				else
+					TRACE_STALL( node, STALL_SERVER, node->server.socket_fd,
+								 node->client.length + node->client.prelen );
+				if ( node->server.length > 0 )
+					FD_SET( node->server.socket_fd, &out_set );
+				FD_SET( node->server.socket_fd, &exc_set );
+			}
+
+			for ( i = 0; i < node->attempts; i++ )
+			{
+				if ( maxdsc < node->attempt[ i ].socket_fd )
+					maxdsc = node->attempt[ i ].socket_fd;
+				FD_SET( node->attempt[ i ].socket_fd, &out_set );
+			}
+
+			if ( node->client.socket_fd )
+			{
+				if ( maxdsc < node->client.socket_fd )
+					maxdsc = node->client.socket_fd;
+				if ( !node->throttled && CLIENT_ROOM( node ) )
+				{
+					FD_SET( node->client.socket_fd, &in_set );
+					TRACE_FLOWING( node, STALL_CLIENT );
+					if ( TLS_PENDING( node ) )
+						pending = 1;
+				}
+				else if ( !node->throttled )
+					TRACE_STALL( node, STALL_CLIENT, node->client.socket_fd,
+								 node->server.length + node->server.prelen );
+				if ( node->client.length > 0 || node->canned_len > 0 || TLS_WANTS_WRITE( node )
+				  || node->control_len > 0 || MID_FRAME( node )
+				  || WATCH_PENDING( node ) || ( node->cursor && !node->watching )
+				  || node->responding )
+					FD_SET( node->client.socket_fd, &out_set );
+				FD_SET( node->client.socket_fd, &exc_set );
+			}
+		}
+
+		for ( probe = probe_list; probe; probe = probe->next )
+		{
+			if ( maxdsc < probe->socket_fd )
+				maxdsc = probe->socket_fd;
+			FD_SET( probe->socket_fd, &out_set );
+		}
+
+		if ( resolver_fd >= 0 )
+		{
+			if ( maxdsc < resolver_fd )
+				maxdsc = resolver_fd;
+			FD_SET( resolver_fd, &in_set );
+		}
+
+#if defined( TUNNEL )
+		maxdsc = tunnel_select( &in_set, &out_set, maxdsc );
+#endif
+		maxdsc = h2_select( &in_set, &out_set, maxdsc, &pending );
+
+		/* Sleep until there is I/O or the nearest timer is due. */
+		next = pending ? 0 : timer_next( );
+		tv.tv_sec  = next / 1000;
+		tv.tv_usec = ( next % 1000 ) * 1000;
+		if ( select( maxdsc + 1, &in_set, &out_set, &exc_set, next < 0 ? NULL : &tv ) < 0 )
+		{
+			/* Signals such as SIGHUP land here; the sets are garbage then. */
+			if ( errno != EINTR )
+				wraperror( "the_main_loop: select" );
+			continue;
+		}
+
+		if ( listen_socket >= 0 && FD_ISSET( listen_socket, &in_set ) && keep_running )
+			accept_connection( listen_socket, NULL, 0 );
+
+		for ( i = 0; i < listener_count; i++ )
+			if ( listeners[ i ].socket_fd >= 0 && FD_ISSET( listeners[ i ].socket_fd, &in_set )
+			  && keep_running )
+			{
+#if defined( TUNNEL )
+				if ( listeners[ i ].tunnel )
+				{
+					tunnel_accept( listeners[ i ].socket_fd );
+					continue;
+				}
+#endif
+				accept_connection( listeners[ i ].socket_fd, listeners[ i ].key,
+								   listeners[ i ].path != NULL );
+			}
+
+#if defined( TUNNEL )
+		tunnel_io( &in_set, &out_set );
+#endif
+		h2_io( &in_set, &out_set );
+
+		if ( resolver_fd >= 0 && FD_ISSET( resolver_fd, &in_set ) )
+			on_resolver( );
+
+		for ( probe = probe_list; probe; probe = next_probe )
+		{
+			int error = 0;
+			socklen_t len = sizeof( error );
+
+			next_probe = probe->next;
+
+			if ( !FD_ISSET( probe->socket_fd, &out_set ) )
+				continue;
+
+			if ( getsockopt( probe->socket_fd, SOL_SOCKET, SO_ERROR, &error, &len ) < 0 )
+				error = errno;
+
+			probe_done( probe, error );
+		}
+
+		for ( node = node_list; node; node = next_node )
+		{
+			next_node = node->next;
+
+			if ( node->server.socket_fd && FD_ISSET( node->server.socket_fd, &exc_set ) )
+			{
+				wraplog( "Disconnecting: %s/%d (exception)", node->host,
+						 node->client.socket_fd );
+				disconnect( node, "server" );
+				continue;
+			}
+
+			if ( node->client.socket_fd && FD_ISSET( node->client.socket_fd, &exc_set ) )
+			{
+				wraplog( "Dropping client: %s/%d (exception)", node->host,
+						 node->client.socket_fd );
+				drop_client( node );
+				continue;
+			}
+
+			if ( node->connecting )
+			{
+				if ( !finish_connect( node, &out_set ) )
+				{
+					disconnect( node, "unreachable" );
+					continue;
+				}
+			}
+			else if ( node->server.socket_fd
+				   && FD_ISSET( node->server.socket_fd, &in_set )
+				   && !on_server_data( node ) )
+			{
+				disconnect( node, "server" );
+				continue;
+			}
+
+			if ( node->client.socket_fd
+			  && ( FD_ISSET( node->client.socket_fd, &in_set )
+				|| ( TLS_PENDING( node ) && !node->throttled && CLIENT_ROOM( node ) )
+				|| ( TLS_WANTS_WRITE( node ) && FD_ISSET( node->client.socket_fd, &out_set ) ) )
+			  && !on_client_data( node ) )
+			{
+				drop_client( node );
+				continue;
+			}
+
+			/* Either handler may have disconnected the node by now. */
+			if ( !node->client.socket_fd )
+				continue;
+
+			/* Sockets are non-blocking, so write what we have right away
+			   instead of waiting for select() to report them writable. */
+			if ( node->server.length > 0 && node->server.socket_fd )
+			{
+				SEND_TO_SERVER( node );
+			}
+
+			if ( node->canned_len > 0 && !MID_FRAME( node ) && !send_canned( node ) )
+			{
+				drop_client( node );
+				continue;
+			}
+
+			if ( ( node->client.length > 0 || node->control_len > 0 || MID_FRAME( node ) )
+			  && ( node->canned_len == 0 || MID_FRAME( node ) ) && node->client.socket_fd )
+			{
+				SEND_TO_CLIENT( node );
+			}
+
+			if ( node->cursor && node->canned_len == 0 && !send_watch( node ) )
+			{
+				disconnect( node, "client" );
+				continue;
+			}
+
+			if ( node->responding && node->canned_len == 0 && !send_file( node ) )
+			{
+				disconnect( node, "client" );
+				continue;
+			}
+
+			/* Game output that did not fit in the last frame */
+			if ( node->type == WEB_SOCKETS && node->client.prelen > 0
+			  && node->client.socket_fd && !ws_encode( node ) )
+			{
+				disconnect( node, "client" );
+				continue;
+			}
+		}
+	}
+
+	return;
+}
+
+
+static int read_menu_choice( NODE *node )
+{
+	int resp;
+	char buf[ MSL ];
+
+	if ( node->type == TELNET
+	  && !FILL_CLIENT_BUFFER( node ) )
+	{
+		return 0;
+	}
+
+	if ( node->type == WEB_SOCKETS
+	  && ( !FILL_CLIENT_PREBUFFER( node ) || !ws_decode( node ) ) )
+	{
+		return 0;
+	}
+
+	strcpy( buf, node->server.buffer );
+	node->server.length = 0;
+	node->server.buffer[ 0 ] = '\0';
+
+	if ( buf[ 0 ] == 'Q' || buf[ 0 ] == 'q' )
+		return 0;
+
+	if ( ( buf[ 0 ] == 'R' || buf[ 0 ] == 'r' ) && resume_grace )
+	{
+		char *token = buf + 1;
+		size_t len;
+		NODE *old;
+
+		while ( *token == ' ' )
+			token++;
+
+		for ( len = 0; isxdigit( (unsigned char) token[ len ] ); len++ )
+			;
+
+		if ( ( old = find_session( token, len ) ) )
+		{
+			resume_session( node, old );
+			return 1;
+		}
+	}
+
+	if ( ( resp = atoi( buf ) ) > 0 && (size_t) resp <= node->catalog->count )
+	{
+		node->menu = 0;
+		connect_to_mud( node, &node->catalog->entries[ resp - 1 ] );
+		return 1;
+	}
+
+	if ( ( buf[ 0 ] == '+' || buf[ 0 ] == '-' ) && node->catalog->count )
+	{
+		show_page( node, buf[ 0 ] == '+' ? node->menu_page + 1
+				   : node->menu_page ? node->menu_page - 1 : 0 );
+		return 1;
+	}
+
+	if ( buf[ 0 ] == '/' && node->catalog->count )
+	{
+		search_catalog( node, buf + 1 );
+		return 1;
+	}
+
+	node->canned = prompt[ FRAMING( node ) ].data;
+	node->canned_len = prompt[ FRAMING( node ) ].length;
+
+	return 1;
+}
+
+
+/* Whether what the client sent so far could still become a handshake this
+   proxy understands. */
+static int handshake_prefix( const NODE *node )
+{
+	static const char policy_request[] = "<policy-file-request/>";
+	size_t n = node->server.prelen;
+
+	return !memcmp( node->server.prebuf, "GET ", n < 4 ? n : 4 )
+		|| !memcmp( node->server.prebuf, policy_request,
+					n < sizeof( policy_request ) ? n : sizeof( policy_request ) )
+		|| !memcmp( node->server.prebuf, H2_PREFACE, n < H2_PREFACE_LEN ? n : H2_PREFACE_LEN );
+}
+
+
+/* The answer to TELNET_PROBE is not passed on to the game, which never
+   asked. Anything typed ahead goes there when the route skips the menu. */
+static int telnet_detected( NODE *node )
+{
+	PEER *p = &node->server;
+	const unsigned char *in = (const unsigned char *) p->prebuf;
+
+	if ( in[ 0 ] == IAC && ( p->prelen < 2 || in[ 1 ] == WILL || in[ 1 ] == WONT )
+	  && ( p->prelen < 3 || in[ 2 ] == TELOPT_TM ) )
+	{
+		if ( p->prelen < 3 )
+			return 1;
+
+		p->prelen -= 3;
+		memmove( p->prebuf, p->prebuf + 3, p->prelen );
+	}
+
+	memcpy( p->buffer, p->prebuf, p->prelen );
+	p->length = p->prelen;
+	p->buffer[ p->length ] = '\0';
+	p->prebuf[ 0 ] = '\0';
+	p->prelen = 0;
+
+	node->type = TELNET;
+	TRACE3( classify, node->id, node->client.socket_fd, "telnet" );
+	banner( node );
+
+	if ( node->menu )
+	{
+		p->length = 0;
+		p->buffer[ 0 ] = '\0';
+	}
+
+	return 1;
+}
+
+
+/* A client that opened with the HTTP/2 preface goes over to h2.c with its
+   socket and whatever followed the preface. Its streams come back through
+   h2_request() as nodes of their own; this one is done with. */
+static int start_h2( NODE *node )
+{
+	struct sockaddr_in6 peer;
+	char origin[ PROXY_V1_MAX ];
+	void *ssl = NULL;
+
+	/* Streams count against the address the connection was admitted
+	   under, the one a balancer in front of us named if there is one. */
+	host_address( node->host, &peer );
+	client_origin( node, origin );
+#if defined( TLS )
+	ssl = node->ssl;
+#endif
+
+	if ( !h2_start( node->client.socket_fd, ssl, node->route ? node->route->key : NULL, &peer,
+					origin, node->server.prebuf + H2_PREFACE_LEN,
+					node->server.prelen - H2_PREFACE_LEN ) )
+		return 0;
+
+	TRACE3( classify, node->id, node->client.socket_fd, "h2" );
+	wraplog( "Client %s/%d speaks HTTP/2%s.", node->host, node->client.socket_fd,
+			 ssl ? " over TLS" : "" );
+
+	node->client.socket_fd = 0;
+#if defined( TLS )
+	node->ssl = NULL;
+#endif
+	release_node( node );
+
+	return 1;
+}
+
+
+/* A stream comes as the HTTP/1.1 request it stands for, and is detected
+   and answered like any other client. */
+static int h2_request( int fd, const char *key, const struct sockaddr_in6 *peer, const char *origin )
+{
+	NODE *node;
+
+	if ( listen_socket < 0 )
+		return 0;
+
+	if ( ( node = new_connection( fd, peer, key, NULL ) ) )
+		node->via = strdup( origin );
+
+	return 1;
+}
+
+static int determine_connection_type( NODE *node )
+{
+	/* Between HTTP requests only another request may come. */
+	if ( !node->http && !handshake_prefix( node ) )
+		return telnet_detected( node );
+
+	if ( !node->http && !strncmp( node->server.prebuf, "PRI ", 4 ) )
+		return node->server.prelen < H2_PREFACE_LEN || start_h2( node );
+
+	if ( !strncmp( node->server.prebuf, "GET ", 4 ) )
+	{
+		switch ( http_parse( &node->request, node->server.prebuf, node->server.prelen ) )
+		{
+			case HTTP_MORE:
+				return 1;
+
+			case HTTP_BAD:
+				wraplog( "Bad or oversized request head from %s/%d, disconnecting.",
+						 node->host, node->client.socket_fd );
+				return 0;
+
+			case HTTP_COMPLETE:
+				break;
+		}
+
+		/* Anything but a WebSocket handshake is a file, if there are any. */
+		if ( webroot_active( )
+		  && !http_equals( node->server.prebuf, &node->request.field[ HTTP_UPGRADE ], "WebSocket" ) )
+			return serve_file( node );
+
+		/* The eight bytes of Sec-WebSocket-Key3 follow the head, unless it
+		   is an RFC 6455 handshake. */
+		if ( !node->request.field[ HTTP_SEC_WEBSOCKET_KEY ].length
+		  && node->server.prelen < node->request.end + 8 )
+			return 1;
+
+		return parse_headers( node );
+	}
+
+	if ( node->server.prelen < 23 )
+		return 1;
+
+	if ( !strncmp( node->server.prebuf,
+				   "<policy-file-request/>\x00", 23 ) )
+	{
+		WRITE( node, policy.data );
+		return 0;
+	}
+
+	wraplog( "Couldn't determine connection type from %s/%d",
+			 node->host, node->client.socket_fd );
+
+	return 0;
+}
+
+
+/* Answers a GET for a file under the document root. The head is taken out
+   of the prebuffer, so a request pipelined behind it is looked at once this
+   response has gone out. */
+static int serve_file( NODE *node )
+{
+	const HTTP_REQUEST *req = &node->request;
+	const HTTP_FIELD *etag = &req->field[ HTTP_IF_NONE_MATCH ];
+	const char *header = node->server.prebuf;
+	WEB_FILE *file;
+	char *response;
+	int encodings = 0, status;
+	size_t n;
+
+	if ( http_has_token( header, &req->field[ HTTP_ACCEPT_ENCODING ], "br" ) )
+		encodings |= WEB_BR;
+	if ( http_has_token( header, &req->field[ HTTP_ACCEPT_ENCODING ], "gzip" ) )
+		encodings |= WEB_GZIP;
+
+	node->keep_alive = http_equals( header, &req->version, "HTTP/1.1" )
+		? !http_has_token( header, &req->field[ HTTP_CONNECTION ], "close" )
+		: http_has_token( header, &req->field[ HTTP_CONNECTION ], "keep-alive" );
+
+	file = webroot_find( header + req->path.offset, req->path.length, encodings, &status );
+
+	if ( file )
+		status = etag->length && ( http_has_token( header, etag, file->etag )
+								|| http_equals( header, etag, "*" ) ) ? 304 : 200;
+
+	response = replay_alloc( node, 512 );
+
+	if ( status == 200 )
+		n = (size_t) sprintf( response,
+			"HTTP/1.1 200 OK\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %lu\r\n"
+			"ETag: %s\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Vary: Accept-Encoding\r\n"
+			"%s%s%s"
+			"Connection: %s\r\n"
+			"\r\n",
+			file->type, (unsigned long int) file->size, file->etag,
+			file->encoding ? "Content-Encoding: " : "",
+			file->encoding ? file->encoding : "",
+			file->encoding ? "\r\n" : "",
+			node->keep_alive ? "keep-alive" : "close" );
+	else if ( status == 304 )
+		n = (size_t) sprintf( response,
+			"HTTP/1.1 304 Not Modified\r\n"
+			"ETag: %s\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Vary: Accept-Encoding\r\n"
+			"Connection: %s\r\n"
+			"\r\n",
+			file->etag, node->keep_alive ? "keep-alive" : "close" );
+	else
+		n = (size_t) sprintf( response,
+			"HTTP/1.1 %s\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: %lu\r\n"
+			"Connection: %s\r\n"
+			"\r\n"
+			"%s\n",
+			status == 400 ? "400 Bad Request" : "404 Not Found",
+			(unsigned long int) ( status == 400 ? 12 : 10 ),
+			node->keep_alive ? "keep-alive" : "close",
+			status == 400 ? "Bad request" : "Not found" );
+
+	wraplog( "Client %s/%d asked for %.*s: %d.", node->host, node->client.socket_fd,
+			 (int) req->path.length, header + req->path.offset, status );
+
+	if ( status == 200 && file->size )
+	{
+		node->file = file;
+		node->file_off = 0;
+	}
+	else
+		webroot_release( file );
+
+	node->canned = response;
+	node->canned_len = n;
+	node->responding = 1;
+
+	if ( !node->http++ )
+		TRACE3( classify, node->id, node->client.socket_fd, "http" );
+
+	timer_cancel( &node->deadline );
+
+	/* What follows the head is the next request. */
+	node->server.prelen -= req->end;
+	memmove( node->server.prebuf, node->server.prebuf + req->end, node->server.prelen );
+	node->server.prebuf[ node->server.prelen ] = '\0';
+	http_reset( &node->request );
+
+	return 1;
+}
+
+
+/* Sends the body once the head is out, then waits for the next request.
+   Returns 0 once the connection is to be closed. */
+static int send_file( NODE *node )
+{
+	ssize_t count;
+
+	while ( node->file && node->file_off < node->file->size )
+	{
+		count = PEER_WRITE( node, node->client.socket_fd, node->file->data + node->file_off,
+							node->file->size - node->file_off );
+
+		if ( count < 0 )
+		{
+			if ( errno == EWOULDBLOCK || errno == EAGAIN )
+				return 1;
+
+			wraperror( "send_file (%s)", node->host );
+			return 0;
+		}
+
+		bytes_sent += (unsigned long int) count;
+		node->file_off += (size_t) count;
+	}
+
+	webroot_release( node->file );
+	node->file = NULL;
+	node->responding = 0;
+
+	if ( !node->keep_alive )
+		return 0;
+
+	if ( node->server.prelen > 0 )
+	{
+		timer_set( &node->deadline, HANDSHAKE_TIMEOUT * 1000UL, deadline_expired, node );
+		return determine_connection_type( node );
+	}
+
+	timer_set( &node->deadline, KEEPALIVE_TIMEOUT * 1000UL, deadline_expired, node );
+
+	return 1;
+}
+
+
+static void banner( NODE *node )
+{
+	const CANNED *c;
+
+	if ( node->queued )
+	{
+		queue_notice( node );
+		return;
+	}
+
+	if ( !node->catalog || !node->catalog->count || node->route )
+	{
+		connect_to_mud( node, node->route );
+		return;
+	}
+
+	node->menu = 1;
+	node->menu_page = 0;
+	timer_set( &node->deadline, MENU_TIMEOUT * 1000UL, deadline_expired, node );
+
+	c = &node->catalog->banner[ FRAMING( node ) ];
+	node->canned = c->data;
+	node->canned_len = c->length;
+
+	return;
+}
+
+
+static int parse_headers( NODE *node )
+{
+	const HTTP_REQUEST *req = &node->request;
+	const HTTP_FIELD *origin, *host, *key;
+	HTTP_FIELD token;
+	NODE *old, *target;
+	MUD_ENTRY *route = NULL;
+	const char *header;
+	enum Framing framing;
+	char cookie[ 96 ], protocol[ 48 ];
+	int trusted;
+	char *response;
+	char buffer[ 32 ];
+
+	header = node->server.prebuf;
+	response = node->client.buffer;
+
+	origin   = &req->field[ HTTP_ORIGIN ];
+	host     = &req->field[ HTTP_HOST ];
+	key      = &req->field[ HTTP_SEC_WEBSOCKET_KEY ];
+
+	/* RFC 6455 clients send Sec-WebSocket-Key, older ones the two numbered
+	   keys and an Origin. */
+	if ( !http_equals( header, &req->version, "HTTP/1.1" )
+	  || !http_equals( header, &req->field[ HTTP_UPGRADE ], "WebSocket" )
+	  || !http_has_token( header, &req->field[ HTTP_CONNECTION ], "Upgrade" )
+	  || !host->length
+	  || ( !key->length && ( !req->field[ HTTP_SEC_WEBSOCKET_KEY1 ].length
+						  || !req->field[ HTTP_SEC_WEBSOCKET_KEY2 ].length
+						  || !origin->length ) ) )
+	{
+		wraplog( "Something is missing. This is what I got:\n%.*s",
+				 (int) req->end, header );
+		/* FIXME: HTTP 400 */
+		return 0;
+	}
+
+	/* Anything but /menu names an entry; the client goes straight there. */
+	if ( !http_equals( header, &req->path, "/menu" )
+	  && !( route = find_route( node->catalog, header + req->path.offset, req->path.length ) ) )
+	{
+		wraplog( "Client %s/%d asked for %.*s, which is no game here.", node->host,
+				 node->client.socket_fd, (int) req->path.length, header + req->path.offset );
+		WRITE( node, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n" );
+		return 0;
+	}
+
+	protocol[ 0 ] = '\0';
+
+	if ( !key->length )
+	{
+		framing = FRAME_HIXIE;
+
+		if ( !hixie_key( node, buffer ) )
+			return 0;
+	}
+	else if ( !http_equals( header, &req->field[ HTTP_SEC_WEBSOCKET_VERSION ], "13" ) )
+	{
+		wraplog( "Unsupported WebSocket version from %s/%d.",
+				 node->host, node->client.socket_fd );
+		return 0;
+	}
+	else
+	{
+		ws_accept( header + key->offset, key->length, buffer );
+
+		/* Clients that do their own telnet and character set handling ask
+		   for the bytes as they are, by subprotocol or in the URL; those
+		   that would rather not parse colours ask for style runs. */
+		if ( http_has_token( header, &req->field[ HTTP_SEC_WEBSOCKET_PROTOCOL ], "binary" ) )
+		{
+			framing = FRAME_BINARY;
+			strcpy( protocol, "Sec-WebSocket-Protocol: binary\r\n" );
+		}
+		else if ( http_has_token( header, &req->field[ HTTP_SEC_WEBSOCKET_PROTOCOL ], "spans" ) )
+		{
+			framing = FRAME_SPANS;
+			strcpy( protocol, "Sec-WebSocket-Protocol: spans\r\n" );
+		}
+		else if ( http_param( header, &req->query, '&', "binary", &token )
+			   && !http_equals( header, &token, "0" ) )
+			framing = FRAME_BINARY;
+		else if ( http_param( header, &req->query, '&', "spans", &token )
+			   && !http_equals( header, &token, "0" ) )
+			framing = FRAME_SPANS;
+		else
+			framing = FRAME_TEXT;
+	}
+
+	old = NULL;
+	trusted = trusted_origin( node );
+
+	/* Browsers attach the cookie to WebSockets any page opens, so it only
+	   counts from pages the proxy trusts; a token in the URL was put there
+	   by the page itself. */
+	if ( resume_grace && http_param( header, &req->query, '&', "resume", &token ) )
+		old = find_session( header + token.offset, token.length );
+	else if ( resume_grace
+		   && http_param( header, &req->field[ HTTP_COOKIE ], ';', "wl_resume", &token ) )
+	{
+		if ( trusted )
+			old = find_session( header + token.offset, token.length );
+		else
+			wraplog( "Client %s/%d sent a resume cookie from origin %.*s, ignored.",
+					 node->host, node->client.socket_fd, (int) origin->length,
+					 header + origin->offset );
+	}
+
+	target = NULL;
+
+	if ( !old && spectator_limit && !node->queued
+	  && http_param( header, &req->query, '&', "watch", &token ) )
+	{
+		target = find_watched( header + token.offset, token.length );
+
+		if ( !target || target->watchers >= spectator_limit )
+		{
+			wraplog( "Client %s/%d cannot watch %.*s: %s.",
+					 node->host, node->client.socket_fd, (int) token.length,
+					 header + token.offset, target ? "too many spectators" : "no such session" );
+			return 0;
+		}
+	}
+
+	/* Browsers send the cookie again when the page reloads, which is all
+	   it takes for them to get back into a session that is still kept.
+	   Spectators have nothing to come back to, and a page from elsewhere
+	   must not replace the player's cookie. */
+	if ( resume_grace && !target && trusted )
+		sprintf( cookie, "Set-Cookie: wl_resume=%s; Path=/; HttpOnly; SameSite=Strict%s\r\n",
+				 old ? old->token : node->token, SECURE( node ) ? "; Secure" : "" );
 	else
+		cookie[ 0 ] = '\0';
+
+	if ( framing == FRAME_HIXIE )
+		sprintf( response,
+			"HTTP/1.1 101 WebSocket Protocol Handshake\r\n"
+			"Upgrade: WebSocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Origin: %.*s\r\n"
+			"Sec-WebSocket-Location: %s://%.*s%.*s\r\n"
+			"%s"
+			"\r\n"
+			"%s",
+			(int) origin->length, header + origin->offset,
+			SECURE( node ) ? "wss" : "ws",
+			(int) host->length, header + host->offset,
+			(int) req->path.length, header + req->path.offset,
+			cookie,
+			buffer );
+	else
+		sprintf( response,
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n"
+			"%s"
+			"%s"
+			"\r\n",
+			buffer, protocol, cookie );
+
+	wraplog( "Client %s/%d started WebSocket connection%s.",
+			 node->host, node->client.socket_fd,
+			 framing == FRAME_BINARY ? ", binary" : framing == FRAME_SPANS ? ", style runs"
+			 : framing == FRAME_TEXT ? ", RFC 6455" : "" );
+
+	WRITE( node, response );
+	TRACE3( handshake, node->id, node->client.socket_fd, "websocket" );
+	TRACE3( classify, node->id, node->client.socket_fd, "websocket" );
+
+	node->server.buffer[ 0 ] = node->server.prebuf[ 0 ] = '\0';
+	node->client.length = node->server.prelen = 0;
+	node->type = WEB_SOCKETS;
+	node->framing = framing;
+	ansi_init( &node->sgr );
+
+	if ( old )
+	{
+		resume_session( node, old );
+		return 1;
+	}
+
+	if ( target )
 	{
-		buf = node->client.prebuf;
-		len = &node->client.prelen;
+		watch_session( node, target );
+		return 1;
 	}
 
-	node->menu = 1;
+	/* The connect goes out in the same pass as the 101, so the game's
+	   greeting is often on its way before the client has read it. */
+	if ( route )
+		node->route = route;
 
-	/* You're free to remove or replace the following sentence: */
-	buf += sprintf( buf,
-					"This is WhiteLantern,"
-					" written by Vigud@lac.pl and Lam@lac.pl\n" );
+	start_pings( node );
+	banner( node );
+
+	return 1;
+}
 
-	for ( e = mud_entries; e; e = e->next )
-		buf += sprintf( buf, "%d. %s\n", i++, e->name );
 
-	sprintf( buf,
-			 "\x1b[38;5;2mSelect a mud, or Q to quit\x1b[38;5;8m:\x1b[0m " );
+/* Whether the page that opened the WebSocket came from this proxy, as Host
+   names it, or from one of the origins given with -wo. */
+static int trusted_origin( const NODE *node )
+{
+	const HTTP_FIELD *origin = &node->request.field[ HTTP_ORIGIN ];
+	const HTTP_FIELD *host = &node->request.field[ HTTP_HOST ];
+	const char *header = node->server.prebuf, *scheme;
+	char name[ 256 ], *list, *item, *save;
+	HTTP_FIELD authority;
+	int found = 0;
+
+	if ( !origin->length )
+		return 0;
 
-	*len = strlen( node->client.buffer );
+	scheme = memchr( header + origin->offset, ':', origin->length );
 
-	if ( node->type == WEB_SOCKETS )
-		ws_encode( node );
+	if ( scheme && host->length < sizeof( name )
+	  && (size_t) ( scheme - header - origin->offset ) + 3 < origin->length
+	  && !strncmp( scheme, "://", 3 ) )
+	{
+		authority.offset = (unsigned short) ( scheme + 3 - header );
+		authority.length = (unsigned short) ( origin->length - ( authority.offset - origin->offset ) );
+		memcpy( name, header + host->offset, host->length );
+		name[ host->length ] = '\0';
 
-	return;
+		if ( http_equals( header, &authority, name ) )
+			return 1;
+	}
+
+	if ( !web_origins )
+		return 0;
+
+	list = strdup( web_origins );
+
+	for ( item = strtok_r( list, ", \t", &save ); item && !found;
+		  item = strtok_r( NULL, ", \t", &save ) )
+		found = http_equals( header, origin, item );
+
+	free( list );
+
+	return found;
 }
 
 
-static int parse_headers( NODE *node )
+/* The entry a WebSocket path names: "/key", or "/port_4000" for the first
+   entry on that port of this host, as RedLantern has it. */
+static MUD_ENTRY *find_route( const CATALOG *cat, const char *path, size_t length )
+{
+	size_t i;
+
+	if ( !cat || length < 2 || path[ 0 ] != '/' )
+		return NULL;
+
+	path++;
+	length--;
+
+	if ( length > 5 && !strncmp( path, "port_", 5 ) )
+		for ( i = 0; i < cat->count; i++ )
+			if ( strlen( cat->entries[ i ].port ) == length - 5
+			  && !strncmp( cat->entries[ i ].port, path + 5, length - 5 )
+			  && ( !strcmp( cat->entries[ i ].host, "localhost" )
+				|| !strcmp( cat->entries[ i ].host, "127.0.0.1" ) ) )
+				return &cat->entries[ i ];
+
+	return catalog_find( cat, path, length );
+}
+
+
+/* The draft-76 handshake answer: MD5 over both keys and the eight bytes
+   after the head. out needs 17 bytes. */
+static int hixie_key( NODE *node, char *out )
 {
-	char *swk[ 3 ];
+	const HTTP_REQUEST *req = &node->request;
+	const HTTP_FIELD *swk[ 2 ];
+	const char *header, *c, *end;
 	uint32_t key[ 2 ];
 	unsigned long int spaces[ 2 ];
-	char *origin, *host;
-	char *onr, *htr;
-	char *header, *response;
 	char buffer[ 17 ];
 	int idx, i;
 	MD5_CTX mdContext;
 
 	header = node->server.prebuf;
-	response = node->client.buffer;
 
 /* These headers are based on the original example from the RFC. If you copy
    this into server buffer, you'll see if calculated response is ok, comparing
@@ -803,186 +5535,643 @@ static int parse_headers( NODE *node )
 		"WjN}|M(6\r\n" );
 #endif
 
-	if ( !stristr( header, "GET /menu HTTP/1.1\r\n", 0 )
-	  || !stristr( header, "\r\nUpgrade: WebSocket\r\n", 0 )
-	  || !stristr( header, "\r\nConnection: Upgrade\r\n", 0 )
-	  || !( swk[ 0 ] = stristr( header, "\r\nSec-WebSocket-Key1: ", 1 ) )
-	  || !( swk[ 1 ] = stristr( header, "\r\nSec-WebSocket-Key2: ", 1 ) )
-	  || !( swk[ 2 ] = stristr( header, "\r\n\r\n", 1 ) )
-	  || !( origin   = stristr( header, "\r\nOrigin: ", 1 ) )
-	  || !( host     = stristr( header, "\r\nHost: ", 1 ) )
-	  || !( onr = strchr( origin, '\r' ) )
-	  || !( htr = strchr( host, '\r' ) ) )
-	{
-		wraplog( "Something is missing. This is what I got:\n%s", header );
-		/* FIXME: HTTP 400 */
-		return 0;
-	}
-
-	*onr = *htr = '\0';
+	swk[ 0 ] = &req->field[ HTTP_SEC_WEBSOCKET_KEY1 ];
+	swk[ 1 ] = &req->field[ HTTP_SEC_WEBSOCKET_KEY2 ];
 
 	/* Regarding the cast to unsigned char in isdigit(): it seems that on NetBSD
 	   isdigit() is a macro retrieving the value it returns from an array, and
 	   its parameter is used as index in that array. GCC reports that it's not
 	   safe to use variable of signed type as an array index, hence the cast. */
 
-	for ( i = 0; i < 2; i++ )
-	{
-		key[ i ] = spaces[ i ] = 0;
+	for ( i = 0; i < 2; i++ )
+	{
+		key[ i ] = spaces[ i ] = 0;
+		c = header + swk[ i ]->offset;
+		end = c + swk[ i ]->length;
+
+		for ( idx = 0; c < end; c++ )
+		{
+			if ( *c == ' ' )
+			{
+				spaces[ i ]++;
+				continue;
+			}
+
+			if ( *c < 0 || !isdigit( (unsigned char) *c ) )
+				continue;
+
+			buffer[ idx ] = *c;
+
+			if ( ++idx > 10 )
+				return 0;
+		}
+
+		buffer[ idx ] = '\0';
+		key[ i ] = strtoul( buffer, (char **) NULL, 10 );
+
+		if ( spaces[ i ] == 0 || key[ i ] % spaces[ i ] != 0 )
+			return 0;
+
+		key[ i ] = htonl( key[ i ] / spaces[ i ] );
+	}
+
+	memcpy( &buffer[ 0 ], &key[ 0 ], 4 );
+	memcpy( &buffer[ 4 ], &key[ 1 ], 4 );
+	memcpy( &buffer[ 8 ], header + req->end, 8 );
+
+	MD5Init( &mdContext );
+	MD5Update( &mdContext, (unsigned char *) buffer, 16 );
+	MD5Final( &mdContext );
+
+	memcpy( out, mdContext.digest, 16 );
+	out[ 16 ] = '\0';
+
+	return 1;
+}
+
+
+/* Sec-WebSocket-Accept: base64 of the SHA-1 of the key and the GUID from
+   RFC 6455. out needs 29 bytes. */
+static void ws_accept( const char *key, size_t length, char *out )
+{
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned char digest[ SHA1_DIGEST_LENGTH + 1 ];
+	SHA1_CTX ctx;
+	unsigned long int v;
+	int i;
+
+	sha1_init( &ctx );
+	sha1_update( &ctx, key, length );
+	sha1_update( &ctx, WS_GUID, sizeof( WS_GUID ) - 1 );
+	sha1_final( &ctx, digest );
+	digest[ SHA1_DIGEST_LENGTH ] = 0;
+
+	/* 20 bytes are six full groups and two bytes, padded with one '=' */
+	for ( i = 0; i < 21; i += 3 )
+	{
+		v = (unsigned long int) digest[ i ] << 16 | (unsigned long int) digest[ i + 1 ] << 8
+		  | digest[ i + 2 ];
+		*out++ = alphabet[ ( v >> 18 ) & 63 ];
+		*out++ = alphabet[ ( v >> 12 ) & 63 ];
+		*out++ = alphabet[ ( v >> 6 ) & 63 ];
+		*out++ = i + 3 <= SHA1_DIGEST_LENGTH ? alphabet[ v & 63 ] : '=';
+	}
+
+	*out = '\0';
+
+	return;
+}
+
+
+/* Frames as much of the game output as fits after what is already queued
+   for the client, and leaves the rest for later. */
+static int ws_encode( NODE *node )
+{
+	size_t space = sizeof( node->client.buffer ) - node->client.length;
+	size_t n = node->client.prelen, framed;
+
+	if ( node->framing == FRAME_TEXT )
+		return ws_encode_text( node );
+
+	if ( node->framing == FRAME_SPANS )
+		return ws_encode_spans( node );
+
+	if ( 2 * n + 3 > space )
+		n = space < 5 ? 0 : ( space - 3 ) / 2;
+
+	if ( !n )
+		return 1;
+
+	framed = ws_frame( node->client.buffer + node->client.length, node->client.prebuf, n );
+
+	if ( !framed )
+		return 0;
+
+	node->client.length += framed;
+	node->client.prelen -= n;
+	memmove( node->client.prebuf, node->client.prebuf + n, node->client.prelen );
+	node->client.prebuf[ node->client.prelen ] = '\0';
+
+	return 1;
+}
+
+
+/* RFC 6455 text: converts as many whole characters as fit into client.buffer.
+   ws_send() puts the frame header in front when it goes out. */
+static int ws_encode_text( NODE *node )
+{
+	const unsigned char *in = (const unsigned char *) node->client.prebuf;
+	char *out = node->client.buffer + node->client.length;
+	size_t space = sizeof( node->client.buffer ) - 1 - node->client.length;
+	size_t i;
+
+	for ( i = 0; i < node->client.prelen; i++ )
+	{
+		if ( in[ i ] < 0x80 )
+		{
+			if ( space < 1 )
+				break;
+
+			*out++ = (char) in[ i ];
+			space--;
+			continue;
+		}
+
+		if ( space < 2 )
+			break;
+
+		*out++ = (char) ( 0xC0 | in[ i ] >> 6 );
+		*out++ = (char) ( 0x80 | ( in[ i ] & 0x3F ) );
+		space -= 2;
+	}
+
+	*out = '\0';
+	node->client.length = (size_t) ( out - node->client.buffer );
+	node->client.prelen -= i;
+	memmove( node->client.prebuf, node->client.prebuf + i, node->client.prelen );
+	node->client.prebuf[ node->client.prelen ] = '\0';
+
+	return 1;
+}
+
+
+/* The same for style runs; the parser keeps its place between calls. */
+static int ws_encode_spans( NODE *node )
+{
+	size_t used;
+
+	node->client.length += ansi_spans( &node->sgr, node->client.buffer + node->client.length,
+									   sizeof( node->client.buffer ) - 1 - node->client.length,
+									   node->client.prebuf, node->client.prelen, &used );
+	node->client.buffer[ node->client.length ] = '\0';
+	node->client.prelen -= used;
+	memmove( node->client.prebuf, node->client.prebuf + used, node->client.prelen );
+	node->client.prebuf[ node->client.prelen ] = '\0';
+
+	return 1;
+}
+
+
+/* Frames len bytes of text the way a client of the given framing expects
+   them. out needs room for FRAMED_MAX( len ) bytes. Style runs are parsed on
+   from sgr, or from scratch if it is NULL. Returns the length written, or 0
+   if the text could not be converted. */
+static size_t frame_text( enum Framing framing, ANSI *sgr, char *out, const char *in, size_t len )
+{
+	size_t head, i, n;
+	ANSI fresh;
+
+	switch ( framing )
+	{
+		case FRAME_HIXIE:
+			return ws_frame( out, in, len );
+
+		case FRAME_TEXT:
+			for ( i = 0, n = len; i < len; i++ )
+				if ( (unsigned char) in[ i ] >= 0x80 )
+					n++;
+
+			out += head = ws_header( out, WS_TEXT, n );
+
+			for ( i = 0; i < len; i++ )
+			{
+				if ( (unsigned char) in[ i ] < 0x80 )
+					*out++ = in[ i ];
+				else
+				{
+					*out++ = (char) ( 0xC0 | (unsigned char) in[ i ] >> 6 );
+					*out++ = (char) ( 0x80 | ( (unsigned char) in[ i ] & 0x3F ) );
+				}
+			}
+
+			return head + n;
+
+		case FRAME_SPANS:
+			if ( !sgr )
+				ansi_init( sgr = &fresh );
+
+			/* The header goes in front once the length is known. */
+			n = ansi_spans( sgr, out + 10, ANSI_SPANS_MAX( len ), in, len, &i );
+			head = ws_header( out, WS_TEXT, n );
+			memmove( out + head, out + 10, n );
+			return head + n;
+
+		case FRAME_BINARY:
+			head = ws_header( out, WS_BINARY, len );
+			memcpy( out + head, in, len );
+			return head + len;
+
+		default:
+			memcpy( out, in, len );
+			return len;
+	}
+}
+
+
+/* Wraps len bytes in a single text frame, converting them to UTF-8 as if
+   they were Latin-1. out needs room for 2 * len + 3 bytes. Returns the length
+   of the frame, or 0 if a character could not be converted. */
+static size_t ws_frame( char *out, const char *in, size_t len )
+{
+	char *buffer = out;
+	size_t i;
+	int wclen;
+
+	*buffer++ = 0x00;
+	for ( i = 0; i < len; i++ )
+	{
+		wclen = wctomb( buffer, (unsigned char) in[ i ] );
+		if ( wclen == -1 )
+		{
+			wraplog( "wctomb returned -1" );
+			return 0;
+		}
+		else if ( wclen == 0 )
+		{
+			buffer++;
+			continue;
+		}
+		buffer += wclen;
+	}
+	*buffer++ = ~0;
+	*buffer   = '\0';
+
+	return (size_t) ( buffer - out );
+}
+
+
+/* An unmasked RFC 6455 frame header, as servers send them. Returns its
+   length, at most 10 bytes. */
+static size_t ws_header( char *out, int opcode, size_t length )
+{
+	unsigned char *h = (unsigned char *) out;
+	int i;
+
+	h[ 0 ] = (unsigned char) ( 0x80 | opcode );
+
+	if ( length < 126 )
+	{
+		h[ 1 ] = (unsigned char) length;
+		return 2;
+	}
+
+	if ( length < 65536 )
+	{
+		h[ 1 ] = 126;
+		h[ 2 ] = (unsigned char) ( length >> 8 );
+		h[ 3 ] = (unsigned char) length;
+		return 4;
+	}
+
+	h[ 1 ] = 127;
+	h[ 2 ] = h[ 3 ] = h[ 4 ] = h[ 5 ] = 0;
+
+	for ( i = 0; i < 4; i++ )
+		h[ 9 - i ] = (unsigned char) ( length >> ( 8 * i ) );
+
+	return 10;
+}
+
+
+static int ws_decode( NODE *node )
+{
+	char *prebuf = node->server.prebuf;
+	size_t *prelen = &node->server.prelen;
+	char *buffer = node->server.buffer + node->server.length;
+	char *limit = node->server.buffer + sizeof( node->server.buffer ) - 1;
+	char *p = prebuf, *end = prebuf + *prelen;
+	char *msgstart, *ff;
+	int mbclen;
+	wchar_t mbc;
+
+	if ( node->framing != FRAME_HIXIE )
+		return ws_decode_6455( node );
+
+	/* Regarding the cast of mbc: casting to signed char gives undefined
+	   behavior while casting to unsigned char always works (ISO/IEC 9899:TC,
+	   6.3.1.3 Signed and unsigned integers). Therefore I cast to unsigned char
+	   before casting to char. Probably it would be better to change buffer's
+	   type to unsigned char, but I'm too lazy to think about it. */
+
+	while ( p < end )
+	{
+		if ( *p != 0x00 )
+		{
+			wraplog( "Unexpected frame type 0x%02X from %s/%d",
+					 (unsigned char) *p, node->host, node->client.socket_fd );
+			return 0;
+		}
+
+		/* Leave incomplete frames, and those that would not fit, for later. */
+		if ( !( ff = memchr( p + 1, 0xFF, (size_t) ( end - p - 1 ) ) )
+		  || ff - p - 1 > limit - buffer )
+			break;
+
+		mbtowc( (wchar_t *) NULL, NULL, 0 );
+
+		for ( msgstart = p + 1; msgstart < ff; )
+		{
+			mbclen = mbtowc( &mbc, msgstart, (size_t) ( ff - msgstart ) );
+			if ( mbclen < 0 )
+			{
+				wraplog( "mbtowc() returned %d", mbclen );
+				return 0;
+			}
+			else if ( mbclen == 0 )
+			{
+				*buffer++ = 0;
+				msgstart++;
+				continue;
+			}
+
+			*buffer++ = (char) (unsigned char) mbc;
+			msgstart += mbclen;
+		}
+
+		p = ff + 1;
+	}
+
+	/* Nothing was taken out of a full prebuffer and nothing is in the way:
+	   the frame in front is too long to ever fit. */
+	if ( p == prebuf && *prelen + 1 >= sizeof( node->server.prebuf )
+	  && buffer == node->server.buffer )
+	{
+		wraplog( "Frame too long from %s/%d", node->host, node->client.socket_fd );
+		return 0;
+	}
+
+	*buffer = '\0';
+	node->server.length = (size_t) ( buffer - node->server.buffer );
+	*prelen = (size_t) ( end - p );
+	memmove( prebuf, p, *prelen );
+	prebuf[ *prelen ] = '\0';
+
+	return 1;
+}
+
+
+/* Takes the complete RFC 6455 frames out of server.prebuf. Text becomes
+   Latin-1 for the game unless the client asked for the bytes as they are;
+   pings are answered after the frame going out. */
+static int ws_decode_6455( NODE *node )
+{
+	unsigned char *prebuf = (unsigned char *) node->server.prebuf;
+	size_t prelen = node->server.prelen;
+	char *buffer = node->server.buffer + node->server.length;
+	char *limit = node->server.buffer + sizeof( node->server.buffer ) - 1;
+	unsigned char *f, *data;
+	size_t used = 0, left, head, length, i;
+	int opcode, fin;
+
+	while ( ( left = prelen - used ) >= 2 )
+	{
+		f = prebuf + used;
+		fin = f[ 0 ] & 0x80;
+		opcode = f[ 0 ] & 0x0F;
+		length = f[ 1 ] & 0x7F;
+		head = 2;
+
+		if ( !( f[ 1 ] & 0x80 ) || ( f[ 0 ] & 0x70 ) )
+		{
+			wraplog( "Unmasked or extended frame from %s/%d",
+					 node->host, node->client.socket_fd );
+			return 0;
+		}
+
+		if ( length == 126 )
+		{
+			if ( left < 4 )
+				break;
+
+			length = (size_t) f[ 2 ] << 8 | f[ 3 ];
+			head = 4;
+		}
+		else if ( length == 127 )
+		{
+			if ( left < 10 )
+				break;
+
+			for ( length = 0, i = 2; i < 10; i++ )
+				length = length << 8 | f[ i ];
+
+			head = 10;
+		}
+
+		if ( length > sizeof( node->server.prebuf ) - 1 - head - 4 )
+		{
+			wraplog( "Frame too long from %s/%d", node->host, node->client.socket_fd );
+			return 0;
+		}
+
+		if ( left < head + 4 + length )
+			break;
+
+		data = f + head + 4;
 
-		for ( idx = 0; *swk[ i ] != '\r'; swk[ i ]++ )
+		if ( opcode & 0x8 )
 		{
-			if ( *swk[ i ] == ' ' )
+			if ( !fin || length > 125 )
 			{
-				spaces[ i ]++;
-				continue;
+				wraplog( "Bad control frame from %s/%d", node->host, node->client.socket_fd );
+				return 0;
 			}
 
-			if ( *swk[ i ] < 0 || !isdigit( (unsigned char) *swk[ i ] ) )
-				continue;
+			if ( opcode == WS_CLOSE )
+			{
+				/* Answered only if it would not land inside a frame */
+				if ( !MID_FRAME( node ) )
+				{
+					char close[ 2 ];
 
-			buffer[ idx ] = *swk[ i ];
+					ws_header( close, WS_CLOSE, 0 );
+					if ( PEER_WRITE( node, node->client.socket_fd, close, 2 ) > 0 )
+						bytes_sent += 2;
+				}
 
-			if ( ++idx > 10 )
+				wraplog( "Client %s/%d closed the WebSocket.", node->host, node->client.socket_fd );
 				return 0;
-		}
+			}
 
-		buffer[ idx ] = '\0';
-		key[ i ] = strtoul( buffer, (char **) NULL, 10 );
+			/* One pong is enough for any number of pings. */
+			if ( opcode == WS_PING && !node->control_len )
+			{
+				node->control_len = ws_header( node->control, WS_PONG, length );
 
-		if ( spaces[ i ] == 0 || key[ i ] % spaces[ i ] != 0 )
-			return 0;
+				for ( i = 0; i < length; i++ )
+					node->control[ node->control_len++ ] = (char) ( data[ i ] ^ f[ head + i % 4 ] );
+			}
+			else if ( opcode != WS_PING && opcode != WS_PONG )
+			{
+				wraplog( "Unexpected frame type 0x%02X from %s/%d",
+						 (unsigned int) opcode, node->host, node->client.socket_fd );
+				return 0;
+			}
 
-		key[ i ] = htonl( key[ i ] / spaces[ i ] );
-	}
+			used += head + 4 + length;
+			continue;
+		}
 
-	memcpy( &buffer[ 0 ], &key[ 0 ], 4 );
-	memcpy( &buffer[ 4 ], &key[ 1 ], 4 );
-	memcpy( &buffer[ 8 ],  swk[ 2 ], 8 );
+		if ( opcode == WS_CONTINUATION ? !node->ws_opcode
+		  : node->ws_opcode || ( opcode != WS_TEXT && opcode != WS_BINARY ) )
+		{
+			wraplog( "Unexpected frame type 0x%02X from %s/%d",
+					 (unsigned int) opcode, node->host, node->client.socket_fd );
+			return 0;
+		}
 
-	MD5Init( &mdContext );
-	MD5Update( &mdContext, (unsigned char *) buffer, 16 );
-	MD5Final( &mdContext );
+		if ( opcode == WS_CONTINUATION )
+			opcode = node->ws_opcode;
 
-	memcpy( buffer, mdContext.digest, 16 );
-	buffer[ 16 ] = '\0';
+		/* Wait for the game to take what is already there. */
+		if ( length > (size_t) ( limit - buffer ) )
+			break;
 
-	sprintf( response,
-		"HTTP/1.1 101 WebSocket Protocol Handshake\r\n"
-		"Upgrade: WebSocket\r\n"
-		"Connection: Upgrade\r\n"
-		"Sec-WebSocket-Origin: %s\r\n"
-		"Sec-WebSocket-Location: ws://%s/menu\r\n"
-		"\r\n"
-		"%s",
-		origin,
-		host,
-		buffer );
+		node->ws_opcode = fin ? 0 : opcode;
 
-	wraplog( "Client %s/%d started WebSocket connection.",
-			 node->host, node->client.socket_fd );
+		for ( i = 0; i < length; i++ )
+			data[ i ] ^= f[ head + i % 4 ];
 
-	WRITE( node->client.socket_fd, response );
+		if ( opcode == WS_BINARY || node->framing == FRAME_BINARY )
+		{
+			memcpy( buffer, data, length );
+			buffer += length;
+		}
+		else
+		{
+			/* Anything beyond Latin-1, or cut off, becomes a question mark. */
+			for ( i = 0; i < length; i++ )
+			{
+				if ( data[ i ] < 0x80 )
+					*buffer++ = (char) data[ i ];
+				else if ( ( data[ i ] & 0xE0 ) == 0xC0 && i + 1 < length
+					   && ( data[ i + 1 ] & 0xC0 ) == 0x80 && data[ i ] < 0xC4 )
+				{
+					*buffer++ = (char) ( ( data[ i ] & 0x1F ) << 6 | ( data[ i + 1 ] & 0x3F ) );
+					i++;
+				}
+				else
+				{
+					*buffer++ = '?';
+
+					while ( i + 1 < length && ( data[ i + 1 ] & 0xC0 ) == 0x80 )
+						i++;
+				}
+			}
+		}
 
-	node->server.buffer[ 0 ] = node->server.prebuf[ 0 ] = '\0';
-	node->client.length = node->server.prelen = 0;
-	node->type = WEB_SOCKETS;
-	banner( node );
+		used += head + 4 + length;
+	}
+
+	*buffer = '\0';
+	node->server.length = (size_t) ( buffer - node->server.buffer );
+	node->server.prelen = prelen - used;
+	memmove( prebuf, prebuf + used, node->server.prelen );
+	prebuf[ node->server.prelen ] = '\0';
 
 	return 1;
 }
 
 
-static int ws_encode( NODE *node )
+/* Sends client.buffer as RFC 6455 frames, the header and the payload in one
+   call. A frame that went out in part is finished before anything else, and
+   queued control frames go out between frames. */
+static void ws_send( NODE *node )
 {
-	char *buffer = node->client.buffer;
-	char *prebuf = node->client.prebuf;
-	size_t *length = &node->client.length;
-	size_t *prelen = &node->client.prelen;
-	size_t i;
-	int wclen;
+	struct iovec iov[ 2 ];
+	ssize_t scount;
+	size_t count, n;
 
-	*buffer++ = 0x00;
-	for ( i = 0; i < *prelen; i++ )
+	for ( ;; )
 	{
-		wclen = wctomb( buffer, (unsigned char) prebuf[ i ] );
-		if ( wclen == -1 )
+		if ( !MID_FRAME( node ) )
 		{
-			wraplog( "wctomb returned -1" );
-			return 0;
+			node->head_off = 0;
+
+			if ( node->control_len > 0 )
+			{
+				memcpy( node->head, node->control, node->control_len );
+				node->head_len = node->control_len;
+				node->control_len = 0;
+			}
+			else if ( node->client.length > 0 )
+			{
+				node->head_len = ws_header( node->head, node->framing == FRAME_BINARY
+											? WS_BINARY : WS_TEXT, node->client.length );
+				node->frame_left = node->client.length;
+			}
+			else
+			{
+				node->head_len = 0;
+				return;
+			}
 		}
-		else if ( wclen == 0 )
+
+		iov[ 0 ].iov_base = node->head + node->head_off;
+		iov[ 0 ].iov_len = node->head_len - node->head_off;
+		iov[ 1 ].iov_base = node->client.buffer;
+		iov[ 1 ].iov_len = node->frame_left;
+
+		scount = peer_writev( node, iov, node->frame_left > 0 ? 2 : 1 );
+
+		if ( scount < 0 )
 		{
-			buffer++;
-			continue;
+			if ( errno == EWOULDBLOCK || errno == EAGAIN )
+				return;
+
+			wraperror( "ws_send (%s)", node->host );
+			drop_client( node );
+			return;
 		}
-		buffer += wclen;
-	}
-	*buffer++ = ~0;
-	*buffer   = '\0';
 
-	*length = (size_t) ( buffer - node->client.buffer );
+		count = (size_t) scount;
+		bytes_sent += count;
 
-	*prelen = 0;
-	prebuf[ 0 ] = '\0';
+		n = count < iov[ 0 ].iov_len ? count : iov[ 0 ].iov_len;
+		node->head_off += n;
+		count -= n;
 
-	return 1;
+		if ( count > 0 )
+		{
+			node->frame_left -= count;
+			node->client.length -= count;
+			memmove( node->client.buffer, node->client.buffer + count, node->client.length );
+			node->client.buffer[ node->client.length ] = '\0';
+		}
+
+		if ( MID_FRAME( node ) )
+			return;
+	}
 }
 
 
-static int ws_decode( NODE *node )
+/* writev() on the client socket, or the same through TLS one piece at a time */
+static ssize_t peer_writev( NODE *node, const struct iovec *iov, int count )
 {
-	char *prebuf = node->server.prebuf;
-	size_t *prelen = &node->server.prelen;
-	char *buffer = node->server.buffer;
-	size_t *length = &node->server.length;
-	char *msgstart = prebuf + 1;
-	char *ff;
-	int mbclen;
-	wchar_t mbc;
-	unsigned char ucmbc;
-
-	/* Regarding this ucmbc thing: casting to signed char gives undefined
-	   behavior while casting to unsigned char always works (ISO/IEC 9899:TC,
-	   6.3.1.3 Signed and unsigned integers). Therefore I cast to unsigned char
-	   before casting to char. Probably it would be better to change buffer's
-	   type to unsigned char, but I'm too lazy to think about it. */
-
-	while ( ( ff = memchr( prebuf, 0xFF, *prelen ) ) )
+#if defined( TLS )
+	if ( node->ssl )
 	{
-		mbtowc( (wchar_t *) NULL, NULL, 0 );
-		*ff = '\0';
-		while ( msgstart < ff )
+		ssize_t total = 0, w;
+		int i;
+
+		for ( i = 0; i < count; i++ )
 		{
-			mbclen = mbtowc( &mbc, msgstart, MB_LEN_MAX );
-			if ( mbclen < 0 )
-			{
-				wraplog( "mbtowc() returned %d", mbclen );
-				return 0;
-			}
-			else if ( mbclen == 0 )
-			{
-				*buffer++ = 0;
-				msgstart++;
-				continue;
-			}
+			w = tls_write( node->ssl, iov[ i ].iov_base, iov[ i ].iov_len );
 
-			ucmbc = (unsigned char) mbc;
-			*buffer++ = (char) mbc;
-			msgstart += mbclen;
+			if ( w < 0 )
+				return total > 0 ? total : w;
+
+			total += w;
+
+			if ( (size_t) w < iov[ i ].iov_len )
+				break;
 		}
-		msgstart++;
-	}
 
-	*length = (size_t) ( buffer - node->server.buffer );
-	*prelen = (size_t) ( prebuf + *prelen - msgstart );
-	
-	if ( *prelen == 0 )
-		prebuf[ 0 ] = '\0';
-	else
-		memmove( prebuf, ff + 1, *prelen - 1 );
+		return total;
+	}
+#endif
 
-	return 1;
+	return writev( node->client.socket_fd, iov, count );
 }
 
 
@@ -1002,8 +6191,31 @@ static void parse_options( int argc, char **argv )
 				"\tmp: mud port (%s)\n"
 				"\tmh: mud host (%s)\n"
 				"\tlp: listen port (%d)\n"
-				"\tcf: configuration file (none)\n\n",
-				default_port, default_host, listen_port );
+				"\tpd: another listen port, whose clients skip the menu, as port=key (none)\n"
+				"\tls: Unix socket to listen on too, for a front end on this host (none)\n"
+				"\tpp: 1 if clients come through a balancer sending a PROXY header (%d)\n"
+				"\tcf: configuration file (none)\n"
+				"\tit: idle timeout in seconds, 0 to disable (%lu)\n"
+				"\trg: seconds a dropped session waits to be resumed, 0 to disable (%lu)\n"
+				"\trb: bytes of game output replayed on resume (%lu)\n",
+				default_port, default_host, listen_port, expect_proxy, idle_timeout,
+				resume_grace, (unsigned long int) resume_ring );
+			printf( "\thc: seconds between backend health checks, 0 to disable (%lu)\n"
+				"\tbl: listen backlog (%d)\n"
+				"\tm:  connections at a time, 0 for no limit (%lu)\n"
+				"\tqs: clients waiting for a free connection beyond that (%lu)\n"
+				"\tsw: WebSocket spectators per session, 0 to disable (%lu)\n"
+				"\tmb: memory budget in megabytes, 0 for none (%lu)\n"
+				"\ttp: milliseconds a quiet client waits before being asked whether it\n"
+				"\t    talks telnet, 0 to never ask (%d, or 0 with -tc or -dr)\n",
+				health_interval, listen_backlog, max_connections, queue_size, spectator_limit,
+				(unsigned long int) ( memory_budget >> 20 ), DETECT_QUIET );
+			printf( "\tdr: directory of files served over HTTP, for the web client (none)\n"
+				"\two: other origins whose pages may resume by cookie, comma separated (none)\n"
+				"\trd: directory to record sessions to, for wlreplay (none)\n"
+				"\ttc: TLS certificate chain file, PEM (none)\n"
+				"\ttk: TLS private key file, PEM (the certificate file)\n"
+				"\ttl: port the edges in tunnel_from open tunnels to, see tunnel.h (none)\n\n" );
 			printf( "Example: %s -mh lac.pl -mp 4000 -lp 3998\n", argv[ 0 ] );
 			exit( 0 );
 		}
@@ -1026,9 +6238,61 @@ static void parse_options( int argc, char **argv )
 				printf( "Port can range from 1 to 65535.\n" );
 		}
 
+		else if ( !strcmp( option, "-pd" ) )
+		{
+			int port = atoi( parameter );
+			const char *key = strchr( parameter, '=' );
+
+			if ( port <= 0 || port >= 65535 || !key || !key[ 1 ] )
+				printf( "Expected port=key, such as 4001=dragon.\n" );
+			else if ( listener_count == MAX_LISTENERS )
+				printf( "No more than %d ports besides -lp.\n", MAX_LISTENERS );
+			else
+			{
+				listeners[ listener_count ].socket_fd = -1;
+				listeners[ listener_count ].port = (uint16_t) port;
+				listeners[ listener_count++ ].key = key + 1;
+			}
+		}
+
+		else if ( !strcmp( option, "-ls" ) )
+		{
+			if ( listener_count == MAX_LISTENERS )
+				printf( "No more than %d ports besides -lp.\n", MAX_LISTENERS );
+			else
+			{
+				listeners[ listener_count ].socket_fd = -1;
+				listeners[ listener_count++ ].path = parameter;
+			}
+		}
+
+		else if ( !strcmp( option, "-pp" ) )
+			expect_proxy = atoi( parameter ) != 0;
+
+		else if ( !strcmp( option, "-tl" ) )
+		{
+#if defined( TUNNEL )
+			int port = atoi( parameter );
+
+			if ( port <= 0 || port >= 65535 )
+				printf( "Port can range from 1 to 65535.\n" );
+			else if ( listener_count == MAX_LISTENERS )
+				printf( "No more than %d ports besides -lp.\n", MAX_LISTENERS );
+			else
+			{
+				listeners[ listener_count ].socket_fd = -1;
+				listeners[ listener_count ].port = (uint16_t) port;
+				listeners[ listener_count++ ].tunnel = 1;
+			}
+#else
+			printf( "This WhiteLantern was built without tunnels, see \"make tunnel\".\n" );
+			exit( 1 );
+#endif
+		}
+
 		else if ( !strcmp( option, "-cf" ) )
 		{
-			int line = ini_parse( parameter, parse_ini_entry );
+			int line = load_catalog( config_file = parameter );
 
 			if ( line != 0 )
 			{
@@ -1037,6 +6301,89 @@ static void parse_options( int argc, char **argv )
 			}
 		}
 
+		else if ( !strcmp( option, "-it" ) )
+			idle_timeout = strtoul( parameter, (char **) NULL, 10 );
+
+		else if ( !strcmp( option, "-rg" ) )
+			resume_grace = strtoul( parameter, (char **) NULL, 10 );
+
+		else if ( !strcmp( option, "-rb" ) )
+		{
+			resume_ring = strtoul( parameter, (char **) NULL, 10 );
+
+			if ( resume_ring < 1 )
+				resume_ring = 1;
+		}
+
+		else if ( !strcmp( option, "-bl" ) )
+		{
+			listen_backlog = atoi( parameter );
+
+			if ( listen_backlog < 1 )
+				listen_backlog = SOMAXCONN;
+		}
+
+		else if ( !strcmp( option, "-m" ) )
+			max_connections = strtoul( parameter, (char **) NULL, 10 );
+
+		else if ( !strcmp( option, "-qs" ) )
+			queue_size = strtoul( parameter, (char **) NULL, 10 );
+
+		else if ( !strcmp( option, "-mb" ) )
+			memory_budget = (size_t) strtoul( parameter, (char **) NULL, 10 ) << 20;
+
+		else if ( !strcmp( option, "-rd" ) )
+		{
+#if defined( RECORD )
+			record_dir = parameter;
+#else
+			printf( "This WhiteLantern was built without recording, see \"make record\".\n" );
+			exit( 1 );
+#endif
+		}
+
+		else if ( !strcmp( option, "-dr" ) )
+		{
+			if ( !webroot_set( parameter ) )
+				printf( "%s is not a directory.\n", parameter );
+		}
+
+		else if ( !strcmp( option, "-sw" ) )
+			spectator_limit = strtoul( parameter, (char **) NULL, 10 );
+
+		else if ( !strcmp( option, "-wo" ) )
+			web_origins = parameter;
+
+		else if ( !strcmp( option, "-hc" ) )
+			health_interval = strtoul( parameter, (char **) NULL, 10 );
+
+		else if ( !strcmp( option, "-tp" ) )
+		{
+			long int delay = atol( parameter );
+
+			if ( delay >= 0 && delay < DETECT_TIMEOUT * 1000L )
+				probe_delay = delay;
+			else
+				printf( "Probe delay can range from 0 to %d.\n", DETECT_TIMEOUT * 1000 - 1 );
+		}
+
+		else if ( !strcmp( option, "-tc" ) || !strcmp( option, "-tk" ) )
+		{
+#if defined( TLS )
+			if ( option[ 2 ] == 'c' )
+				tls_cert = parameter;
+			else
+				tls_key = parameter;
+#else
+			printf( "This WhiteLantern was built without TLS, see \"make tls\".\n" );
+			exit( 1 );
+#endif
+		}
+
+		/* Passed by begin_upgrade() to the process taking over */
+		else if ( !strcmp( option, "-uf" ) )
+			upgrade_fd = atoi( parameter );
+
 		else if ( !strcmp( option, "-mp" ) )
 			default_port = parameter;
 
@@ -1056,26 +6403,78 @@ static void parse_options( int argc, char **argv )
 
 static int parse_ini_entry( const char *section, const char *name, const char *value )
 {
-	MUD_ENTRY *new;
-	static const char *last_sect = NULL;
+	MUD_ENTRY *e;
+
+	if ( !strcmp( section, "access" ) )
+		return parse_access( name, value );
 
 	if ( strncmp( section, "host:", 5 ) )
 		return 1;
 
-	if ( last_sect != section )
+	if ( !loading->count || strcmp( section + 5, loading->entries[ loading->count - 1 ].key ) )
 	{
-		new = calloc( sizeof( MUD_ENTRY ), 1 );
-		new->next = mud_entries;
-		mud_entries = new;
-		last_sect = section;
+		if ( loading->count == loading->size )
+		{
+			loading->size = loading->size ? loading->size * 2 : 16;
+			loading->entries = realloc( loading->entries,
+										loading->size * sizeof( MUD_ENTRY ) );
+		}
+
+		e = &loading->entries[ loading->count++ ];
+		memset( e, 0, sizeof( MUD_ENTRY ) );
+		e->key = strdup( section + 5 );
 	}
 
+	e = &loading->entries[ loading->count - 1 ];
+
 	if ( !strcmp( name, "port" ) )
-		mud_entries->port = strdup( value );
+	{
+		free( e->port );
+		e->port = strdup( value );
+	}
 	else if ( !strcmp( name, "host" ) )
-		mud_entries->host = strdup( value );
+	{
+		/* Every host line adds addresses to the entry. */
+		if ( e->host )
+		{
+			char *hosts = malloc( strlen( e->host ) + strlen( value ) + 3 );
+
+			sprintf( hosts, "%s, %s", e->host, value );
+			free( e->host );
+			e->host = hosts;
+		}
+		else
+			e->host = strdup( value );
+	}
 	else if ( !strcmp( name, "name" ) )
-		mud_entries->name = strdup( value );
+	{
+		free( e->name );
+		e->name = strdup( value );
+	}
+	else if ( !strcmp( name, "pass_client" ) )
+		e->pass_client = !strcmp( value, "yes" );
+	else if ( !strcmp( name, "send_proxy" ) )
+		e->send_proxy = !strcmp( value, "yes" );
+	else if ( !strcmp( name, "source" ) )
+		return parse_sources( e, value );
+	else if ( !strcmp( name, "tunnel" ) )
+	{
+#if defined( TUNNEL )
+		const char *colon = strrchr( value, ':' );
+
+		if ( !colon || colon == value || !colon[ 1 ] )
+		{
+			wraplog( "Tunnel hub %s is not host:port.", value );
+			return 0;
+		}
+
+		free( e->tunnel );
+		e->tunnel = strdup( value );
+#else
+		wraplog( "This WhiteLantern was built without tunnels, see \"make tunnel\"." );
+		return 0;
+#endif
+	}
 	else
 		wraplog( "Invalid key \"%s\".", name );
 
@@ -1083,48 +6482,127 @@ static int parse_ini_entry( const char *section, const char *name, const char *v
 }
 
 
-/*
-** Designation:  StriStr
-**
-** Call syntax:  char *stristr(char *String, char *Pattern, int end)
-**
-** Description:  This function is an ANSI version of strstr() with
-**               case insensitivity.
-**
-** Return item:  char *pointer if Pattern is found in String, else NULL
-**
-** Rev History:  02/03/94  Fred Cole    Original
-**               07/04/95  Bob Stout    ANSI-fy
-**               16/07/97  Greg Thayer  Optimized
-**               09/01/03  Bob Stout    Bug fix (lines 40-41) per Fred Bulback
-**               16/12/10  Vigud@lac.pl int end, UPPER(), -const for String
-**
-** Hereby donated to public domain.
-*/
-static char *stristr( char *String, const char *Pattern, int end )
-{
-	const char *pptr;
-	char *sptr, *start;
-
-	for ( start = String; *start != '\0'; start++ )
-	{
-		for ( ; *start != '\0' && UPPER( *start ) != UPPER( *Pattern ); start++ )
-			;
+/* source = 192.0.2.10, 192.0.2.11, 2001:db8::10
+   Every source line adds addresses to the entry. */
+static int parse_sources( MUD_ENTRY *e, const char *value )
+{
+	char *list, *addr, *save;
+	SOURCE *s;
+	int ok = 1;
 
-		if ( '\0' == *start )
-			return NULL;
+	list = strdup( value );
 
-		pptr = Pattern;
-		sptr = start;
+	for ( addr = strtok_r( list, ", \t", &save ); addr; addr = strtok_r( NULL, ", \t", &save ) )
+	{
+		e->sources = realloc( e->sources, ( e->source_count + 1 ) * sizeof( SOURCE ) );
+		s = &e->sources[ e->source_count ];
+		memset( s, 0, sizeof( SOURCE ) );
 
-		while ( UPPER( *sptr ) == UPPER( *pptr ) )
+		if ( inet_pton( AF_INET, addr, &( (struct sockaddr_in *) &s->addr )->sin_addr ) == 1 )
+		{
+			s->addr.ss_family = AF_INET;
+			s->addrlen = sizeof( struct sockaddr_in );
+		}
+		else if ( inet_pton( AF_INET6, addr, &( (struct sockaddr_in6 *) &s->addr )->sin6_addr ) == 1 )
+		{
+			s->addr.ss_family = AF_INET6;
+			s->addrlen = sizeof( struct sockaddr_in6 );
+		}
+		else
 		{
-			sptr++;
-			pptr++;
+			wraplog( "Invalid address \"%s\".", addr );
+			ok = 0;
+			continue;
+		}
+
+		strncpy( s->name, addr, sizeof( s->name ) - 1 );
+		s->load = source_load( s );
+		e->source_count++;
+	}
 
-			if ( '\0' == *pptr )
-				return end ? sptr : start;
+	free( list );
+
+	return ok;
+}
+
+
+/* The load of a source address, counted since it was first configured */
+static SOURCE_LOAD *source_load( const SOURCE *source )
+{
+	static SOURCE_LOAD *loads;
+	SOURCE_LOAD *l;
+
+	for ( l = loads; l; l = l->next )
+		if ( l->addrlen == source->addrlen && !memcmp( &l->addr, &source->addr, l->addrlen ) )
+			return l;
+
+	l = calloc( 1, sizeof( SOURCE_LOAD ) );
+	memcpy( &l->addr, &source->addr, source->addrlen );
+	l->addrlen = source->addrlen;
+	l->next = loads;
+	loads = l;
+
+	return l;
+}
+
+
+/* [access]
+   deny = 192.0.2.0/24, 2001:db8::/32
+   allow = 192.0.2.7
+   default = allow
+   per_ip = 8, accept_rate = 2, accept_burst = 10
+   input_rate = 2048, input_burst = 8192 */
+static int parse_access( const char *name, const char *value )
+{
+	char *list, *cidr, *save;
+	int action, ok = 1;
+	ACL **acl = &loading->acl;
+
+	if ( !strcmp( name, "allow" ) || !strcmp( name, "deny" ) || !strcmp( name, "tunnel_from" ) )
+	{
+		action = name[ 0 ] == 'd' ? ACL_DENY : ACL_ALLOW;
+
+		if ( name[ 0 ] == 't' )
+			acl = &loading->tunnel_from;
+
+		if ( !*acl )
+			*acl = acl_new( );
+
+		list = strdup( value );
+
+		for ( cidr = strtok_r( list, ", \t", &save ); cidr; cidr = strtok_r( NULL, ", \t", &save ) )
+			if ( !acl_add( *acl, cidr, action ) )
+			{
+				wraplog( "Invalid address \"%s\".", cidr );
+				ok = 0;
+			}
+
+		free( list );
+		return ok;
+	}
+
+	if ( !strcmp( name, "default" ) )
+	{
+		if ( strcmp( value, "allow" ) && strcmp( value, "deny" ) )
+		{
+			wraplog( "The default can be allow or deny, not \"%s\".", value );
+			return 0;
 		}
+
+		loading->deny_default = !strcmp( value, "deny" );
 	}
-	return NULL;
+	else if ( !strcmp( name, "per_ip" ) )
+		loading->per_ip = strtoul( value, (char **) NULL, 10 );
+	else if ( !strcmp( name, "accept_rate" ) )
+		loading->accept_rate = strtoul( value, (char **) NULL, 10 );
+	else if ( !strcmp( name, "accept_burst" ) )
+		loading->accept_burst = strtoul( value, (char **) NULL, 10 );
+	else if ( !strcmp( name, "input_rate" ) )
+		loading->input_rate = strtoul( value, (char **) NULL, 10 );
+	else if ( !strcmp( name, "input_burst" ) )
+		loading->input_burst = strtoul( value, (char **) NULL, 10 );
+	else
+		wraplog( "Invalid key \"%s\".", name );
+
+	return 1;
 }
@@ -0,0 +1,317 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "acl.h"
+
+
+#define HOST_SLOTS	1024
+#define HOST_IDLE	60000	/* ms an unused host entry is kept */
+
+#define BIT( addr, n ) ( ( ( addr )[ ( n ) >> 3 ] >> ( 7 - ( ( n ) & 7 ) ) ) & 1 )
+
+
+struct acl_node_data
+{
+	ACL_NODE *child[ 2 ];
+	unsigned char prefix[ 16 ];	/* bits past length are zero */
+	unsigned int length;
+	int action;
+};
+
+
+static ACL_NODE *new_node( const unsigned char *prefix, unsigned int length, int action );
+static unsigned int common_bits( const unsigned char *a, const unsigned char *b,
+								 unsigned int from, unsigned int to );
+static void free_node( ACL_NODE *n );
+static unsigned int host_hash( const unsigned char *addr );
+
+
+static ACL_HOST *hosts[ HOST_SLOTS ];
+
+
+ACL *acl_new( void )
+{
+	return calloc( sizeof( ACL ), 1 );
+}
+
+
+/* Parses "192.0.2.0/24", "2001:db8::/32" or a bare address and adds it.
+   A prefix given twice keeps the action it was given last. Returns 0 if
+   the text is not an address. */
+int acl_add( ACL *acl, const char *cidr, int action )
+{
+	unsigned char prefix[ 16 ];
+	char text[ INET6_ADDRSTRLEN + 4 ], *slash;
+	unsigned long int length;
+	unsigned int common;
+	ACL_NODE **link, *n, *m;
+
+	if ( strlen( cidr ) >= sizeof( text ) )
+		return 0;
+
+	strcpy( text, cidr );
+
+	if ( ( slash = strchr( text, '/' ) ) )
+		*slash++ = '\0';
+
+	/* strtoul() would skip blanks and take a sign, "-1" for ULONG_MAX */
+	if ( slash && !isdigit( (unsigned char) slash[ 0 ] ) )
+		return 0;
+
+	memset( prefix, 0, sizeof( prefix ) );
+
+	if ( inet_pton( AF_INET, text, prefix + 12 ) == 1 )
+	{
+		prefix[ 10 ] = prefix[ 11 ] = 0xFF;
+		length = slash ? strtoul( slash, &slash, 10 ) : 32;
+
+		if ( length > 32 )
+			return 0;
+
+		length += 96;
+	}
+	else if ( inet_pton( AF_INET6, text, prefix ) == 1 )
+		length = slash ? strtoul( slash, &slash, 10 ) : 128;
+	else
+		return 0;
+
+	if ( length > 128 || ( slash && *slash ) )
+		return 0;
+
+	/* 10.1.2.3/8 means 10.0.0.0/8 */
+	if ( length % 8 )
+		prefix[ length / 8 ] &= (unsigned char) ( 0xFF << ( 8 - length % 8 ) );
+	if ( length < 128 )
+		memset( prefix + ( length + 7 ) / 8, 0, 16 - ( length + 7 ) / 8 );
+
+	acl->rules++;
+
+	for ( link = &acl->root; ; link = &n->child[ BIT( prefix, n->length ) ] )
+	{
+		if ( !( n = *link ) )
+		{
+			*link = new_node( prefix, (unsigned int) length, action );
+			return 1;
+		}
+
+		common = common_bits( n->prefix, prefix, 0,
+							  n->length < length ? n->length : (unsigned int) length );
+
+		if ( common == n->length && n->length == length )
+		{
+			n->action = action;
+			return 1;
+		}
+
+		if ( common < n->length )
+			break;
+	}
+
+	/* The new prefix parts ways with n, or is a prefix of it. */
+	if ( common == length )
+	{
+		m = new_node( prefix, (unsigned int) length, action );
+		m->child[ BIT( n->prefix, length ) ] = n;
+	}
+	else
+	{
+		m = new_node( prefix, common, ACL_NONE );
+		m->child[ BIT( n->prefix, common ) ] = n;
+		m->child[ BIT( prefix, common ) ] = new_node( prefix, (unsigned int) length, action );
+	}
+
+	*link = m;
+
+	return 1;
+}
+
+
+/* Longest prefix match. Every bit of the address is compared once. */
+int acl_lookup( const ACL *acl, const unsigned char *addr )
+{
+	const ACL_NODE *n;
+	unsigned int checked = 0;
+	int action = ACL_NONE;
+
+	for ( n = acl->root; n; n = n->child[ BIT( addr, n->length ) ] )
+	{
+		if ( common_bits( n->prefix, addr, checked, n->length ) < n->length )
+			break;
+
+		if ( n->action != ACL_NONE )
+			action = n->action;
+
+		if ( ( checked = n->length ) == 128 )
+			break;
+	}
+
+	return action;
+}
+
+
+void acl_free( ACL *acl )
+{
+	if ( !acl )
+		return;
+
+	free_node( acl->root );
+	free( acl );
+
+	return;
+}
+
+
+static ACL_NODE *new_node( const unsigned char *prefix, unsigned int length, int action )
+{
+	ACL_NODE *n = calloc( sizeof( ACL_NODE ), 1 );
+
+	memcpy( n->prefix, prefix, length / 8 );
+	if ( length % 8 )
+		n->prefix[ length / 8 ] = prefix[ length / 8 ]
+			& (unsigned char) ( 0xFF << ( 8 - length % 8 ) );
+
+	n->length = length;
+	n->action = action;
+
+	return n;
+}
+
+
+/* Number of leading bits a and b share, looking at bits from..to-1 only;
+   the ones before from are known to match. */
+static unsigned int common_bits( const unsigned char *a, const unsigned char *b,
+								 unsigned int from, unsigned int to )
+{
+	unsigned int i = from;
+	unsigned char x;
+
+	while ( i < to )
+	{
+		if ( !( i & 7 ) && i + 8 <= to && a[ i >> 3 ] == b[ i >> 3 ] )
+		{
+			i += 8;
+			continue;
+		}
+
+		x = (unsigned char) ( a[ i >> 3 ] ^ b[ i >> 3 ] );
+
+		if ( x & ( 0x80 >> ( i & 7 ) ) )
+			break;
+
+		i++;
+	}
+
+	return i;
+}
+
+
+static void free_node( ACL_NODE *n )
+{
+	if ( !n )
+		return;
+
+	free_node( n->child[ 0 ] );
+	free_node( n->child[ 1 ] );
+	free( n );
+
+	return;
+}
+
+
+/* Finds or creates the entry of an address. Entries nobody has used for
+   a while are dropped from the chain on the way. */
+ACL_HOST *acl_host( const unsigned char *addr, unsigned long int burst, unsigned long int now )
+{
+	ACL_HOST **link = &hosts[ host_hash( addr ) ], *h;
+
+	while ( ( h = *link ) )
+	{
+		if ( !memcmp( h->addr, addr, 16 ) )
+			return h;
+
+		if ( !h->count && now - h->accepts.stamp > HOST_IDLE )
+		{
+			*link = h->next;
+			free( h );
+			continue;
+		}
+
+		link = &h->next;
+	}
+
+	h = calloc( sizeof( ACL_HOST ), 1 );
+	memcpy( h->addr, addr, 16 );
+	bucket_fill( &h->accepts, burst, now );
+	h->next = hosts[ host_hash( addr ) ];
+	hosts[ host_hash( addr ) ] = h;
+
+	return h;
+}
+
+
+void acl_host_release( ACL_HOST *host )
+{
+	if ( host && host->count )
+		host->count--;
+
+	return;
+}
+
+
+void bucket_fill( BUCKET *b, unsigned long int burst, unsigned long int now )
+{
+	b->level = (long int) burst * 1000L;
+	b->stamp = now;
+
+	return;
+}
+
+
+/* rate is in tokens per second, so that many thousandths per millisecond */
+void bucket_refill( BUCKET *b, unsigned long int rate, unsigned long int burst, unsigned long int now )
+{
+	unsigned long int elapsed = now - b->stamp;
+
+	b->stamp = now;
+
+	if ( elapsed > 3600000UL )
+		elapsed = 3600000UL;
+
+	b->level += (long int) ( elapsed * rate );
+
+	if ( b->level > (long int) burst * 1000L )
+		b->level = (long int) burst * 1000L;
+
+	return;
+}
+
+
+static unsigned int host_hash( const unsigned char *addr )
+{
+	unsigned int h = 2166136261U;
+	int i;
+
+	for ( i = 0; i < 16; i++ )
+		h = ( h ^ addr[ i ] ) * 16777619U;
+
+	return h & ( HOST_SLOTS - 1 );
+}
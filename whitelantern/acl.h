@@ -0,0 +1,63 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* Admission control. Allow and deny lists live in a path-compressed binary
+   trie keyed by 128-bit addresses, IPv4 ones mapped into ::ffff:0:0/96, so
+   a lookup walks at most as many bits as the longest matching prefix has.
+   Per-address state (open connections and the accept token bucket) lives
+   in a small hash table shared by every configuration that gets loaded. */
+
+#define ACL_NONE	0
+#define ACL_ALLOW	1
+#define ACL_DENY	2
+
+typedef struct acl_data ACL;
+typedef struct acl_node_data ACL_NODE;
+typedef struct acl_host_data ACL_HOST;
+typedef struct bucket_data BUCKET;
+
+/* Token bucket; the level is kept in thousandths of a token so refilling
+   by the millisecond needs no floating point. */
+struct bucket_data
+{
+	long int level;
+	unsigned long int stamp;	/* timer_now() of the last refill */
+};
+
+struct acl_data
+{
+	ACL_NODE *root;
+	unsigned int rules;
+};
+
+struct acl_host_data
+{
+	ACL_HOST *next;
+	unsigned char addr[ 16 ];
+	unsigned int count;		/* open connections */
+	BUCKET accepts;
+};
+
+ACL *acl_new( void );
+int acl_add( ACL *acl, const char *cidr, int action );
+int acl_lookup( const ACL *acl, const unsigned char *addr );
+void acl_free( ACL *acl );
+ACL_HOST *acl_host( const unsigned char *addr, unsigned long int burst, unsigned long int now );
+void acl_host_release( ACL_HOST *host );
+void bucket_fill( BUCKET *b, unsigned long int burst, unsigned long int now );
+void bucket_refill( BUCKET *b, unsigned long int rate, unsigned long int burst, unsigned long int now );
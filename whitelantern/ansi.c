@@ -0,0 +1,292 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stddef.h>
+#include "ansi.h"
+
+
+enum
+{
+	GROUND,
+	ESCAPE,
+	INTERMEDIATE,	/* ESC followed by 0x20-0x2F */
+	CSI,
+	STRING,			/* OSC, DCS and the like, until BEL or ST */
+	STRING_ESCAPE
+};
+
+
+static void apply_sgr( ANSI *a );
+static unsigned int cube( unsigned int r, unsigned int g, unsigned int b );
+
+
+void ansi_init( ANSI *a )
+{
+	a->fg = a->bg = a->attr = 0;
+	a->state = GROUND;
+	a->params = a->private = 0;
+	a->param[ 0 ] = 0;
+
+	return;
+}
+
+
+/* Converts input until it runs out or the next character might not fit in
+   room; *used tells how much was taken. The output starts with a record
+   whenever it has any text, so that it can be framed on its own. */
+size_t ansi_spans( ANSI *a, char *out, size_t room, const char *in, size_t len, size_t *used )
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *) in;
+	const unsigned char *end = p + len;
+	char *o = out;
+	unsigned int fg = a->fg, bg = a->bg, attr = a->attr;
+	int record = 1;
+	unsigned int c, need;
+
+	for ( ; p < end; p++ )
+	{
+		c = *p;
+
+		switch ( a->state )
+		{
+			case GROUND:
+				if ( c == 0x1B )
+				{
+					a->state = ESCAPE;
+					continue;
+				}
+
+				if ( fg != a->fg || bg != a->bg || attr != a->attr )
+				{
+					fg = a->fg;
+					bg = a->bg;
+					attr = a->attr;
+					record = 1;
+				}
+
+				need = c < 0x80 ? 1 : 2;
+
+				if ( record )
+					need += ANSI_RECORD;
+
+				if ( need > room - (size_t) ( o - out ) )
+					goto full;
+
+				if ( record )
+				{
+					*o++ = 0x1E;
+					*o++ = hex[ fg >> 4 ];
+					*o++ = hex[ fg & 15 ];
+					*o++ = hex[ bg >> 4 ];
+					*o++ = hex[ bg & 15 ];
+					*o++ = hex[ attr >> 12 & 15 ];
+					*o++ = hex[ attr >> 8 & 15 ];
+					*o++ = hex[ attr >> 4 & 15 ];
+					*o++ = hex[ attr & 15 ];
+					record = 0;
+				}
+
+				if ( c < 0x80 )
+					*o++ = (char) c;
+				else
+				{
+					*o++ = (char) ( 0xC0 | c >> 6 );
+					*o++ = (char) ( 0x80 | ( c & 0x3F ) );
+				}
+				continue;
+
+			case ESCAPE:
+				if ( c == '[' )
+				{
+					a->state = CSI;
+					a->params = a->private = 0;
+					a->param[ 0 ] = 0;
+				}
+				else if ( c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_' )
+					a->state = STRING;
+				else if ( c >= 0x20 && c <= 0x2F )
+					a->state = INTERMEDIATE;
+				else if ( c != 0x1B )
+					a->state = GROUND;
+				continue;
+
+			case INTERMEDIATE:
+				if ( c == 0x1B )
+					a->state = ESCAPE;
+				else if ( c < 0x20 || c > 0x2F )
+					a->state = GROUND;
+				continue;
+
+			case CSI:
+				if ( c >= '0' && c <= '9' )
+				{
+					if ( a->param[ a->params ] < 6553 )
+						a->param[ a->params ] = a->param[ a->params ] * 10 + c - '0';
+				}
+				else if ( c == ';' || c == ':' )
+				{
+					if ( a->params < ANSI_MAX_PARAMS - 1 )
+						a->param[ ++a->params ] = 0;
+				}
+				else if ( c >= 0x20 && c <= 0x3F )
+					a->private = 1;
+				else if ( c >= 0x40 && c <= 0x7E )
+				{
+					if ( c == 'm' && !a->private )
+						apply_sgr( a );
+
+					a->state = GROUND;
+				}
+				else if ( c == 0x1B )
+					a->state = ESCAPE;
+				continue;
+
+			case STRING:
+				if ( c == 0x07 )
+					a->state = GROUND;
+				else if ( c == 0x1B )
+					a->state = STRING_ESCAPE;
+				continue;
+
+			default:
+				a->state = c == '\\' ? GROUND : STRING;
+				continue;
+		}
+	}
+
+full:
+	*used = (size_t) ( p - (const unsigned char *) in );
+
+	return (size_t) ( o - out );
+}
+
+
+static void apply_sgr( ANSI *a )
+{
+	unsigned int *param = a->param;
+	int n = a->params + 1, i;
+	unsigned int colour, which;
+
+	for ( i = 0; i < n; i++ )
+	{
+		switch ( param[ i ] )
+		{
+			case 0:  a->attr = 0; a->fg = a->bg = 0; break;
+			case 1:  a->attr |= ANSI_BOLD; break;
+			case 2:  a->attr |= ANSI_DIM; break;
+			case 3:  a->attr |= ANSI_ITALIC; break;
+			case 4:
+			case 21: a->attr |= ANSI_UNDERLINE; break;
+			case 5:
+			case 6:  a->attr |= ANSI_BLINK; break;
+			case 7:  a->attr |= ANSI_REVERSE; break;
+			case 8:  a->attr |= ANSI_HIDDEN; break;
+			case 9:  a->attr |= ANSI_STRIKE; break;
+			case 22: a->attr &= ~(unsigned int) ( ANSI_BOLD | ANSI_DIM ); break;
+			case 23: a->attr &= ~(unsigned int) ANSI_ITALIC; break;
+			case 24: a->attr &= ~(unsigned int) ANSI_UNDERLINE; break;
+			case 25: a->attr &= ~(unsigned int) ANSI_BLINK; break;
+			case 27: a->attr &= ~(unsigned int) ANSI_REVERSE; break;
+			case 28: a->attr &= ~(unsigned int) ANSI_HIDDEN; break;
+			case 29: a->attr &= ~(unsigned int) ANSI_STRIKE; break;
+			case 39: a->attr &= ~(unsigned int) ANSI_FG; a->fg = 0; break;
+			case 49: a->attr &= ~(unsigned int) ANSI_BG; a->bg = 0; break;
+
+			/* 38;5;n and 38;2;r;g;b, the same for 48; 58 is the
+			   underline colour, which is skipped */
+			case 38:
+			case 48:
+			case 58:
+				which = param[ i ];
+
+				if ( i + 2 < n && param[ i + 1 ] == 5 )
+				{
+					colour = param[ i + 2 ] & 255;
+					i += 2;
+				}
+				else if ( i + 4 < n && param[ i + 1 ] == 2 )
+				{
+					colour = cube( param[ i + 2 ], param[ i + 3 ], param[ i + 4 ] );
+					i += 4;
+				}
+				else
+					return;
+
+				if ( which == 38 )
+				{
+					a->fg = colour;
+					a->attr |= ANSI_FG;
+				}
+				else if ( which == 48 )
+				{
+					a->bg = colour;
+					a->attr |= ANSI_BG;
+				}
+				break;
+
+			default:
+				if ( param[ i ] >= 30 && param[ i ] <= 37 )
+				{
+					a->fg = param[ i ] - 30;
+					a->attr |= ANSI_FG;
+				}
+				else if ( param[ i ] >= 40 && param[ i ] <= 47 )
+				{
+					a->bg = param[ i ] - 40;
+					a->attr |= ANSI_BG;
+				}
+				else if ( param[ i ] >= 90 && param[ i ] <= 97 )
+				{
+					a->fg = param[ i ] - 90 + 8;
+					a->attr |= ANSI_FG;
+				}
+				else if ( param[ i ] >= 100 && param[ i ] <= 107 )
+				{
+					a->bg = param[ i ] - 100 + 8;
+					a->attr |= ANSI_BG;
+				}
+				break;
+		}
+	}
+
+	return;
+}
+
+
+/* The nearest colour of the 6x6x6 cube at 16-231 */
+static unsigned int cube( unsigned int r, unsigned int g, unsigned int b )
+{
+	static const unsigned int level[ 6 ] = { 0, 95, 135, 175, 215, 255 };
+	unsigned int rgb[ 3 ], i, j, best;
+
+	rgb[ 0 ] = r > 255 ? 255 : r;
+	rgb[ 1 ] = g > 255 ? 255 : g;
+	rgb[ 2 ] = b > 255 ? 255 : b;
+
+	for ( i = 0; i < 3; i++ )
+	{
+		for ( best = 0, j = 1; j < 6; j++ )
+			if ( rgb[ i ] + rgb[ i ] > level[ j - 1 ] + level[ j ] )
+				best = j;
+
+		rgb[ i ] = best;
+	}
+
+	return 16 + 36 * rgb[ 0 ] + 6 * rgb[ 1 ] + rgb[ 2 ];
+}
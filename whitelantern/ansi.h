@@ -0,0 +1,60 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* Incremental ANSI parser that turns game output into text and style runs,
+   so browsers need not parse escape sequences themselves. The state lives in
+   the ANSI structure, so a sequence may be split across reads; nothing is
+   allocated.
+
+   The output is UTF-8 text in which every run starts with a record: the
+   byte 0x1E followed by eight hex digits, foreground (2), background (2) and
+   the ANSI_* attribute bits (4). Colours are xterm's 256; 24-bit colours are
+   brought down to the 6x6x6 cube. Other escape sequences are dropped. */
+
+#define ANSI_MAX_PARAMS		16
+#define ANSI_RECORD			9		/* bytes of a style record */
+
+/* Worst case for len bytes of input */
+#define ANSI_SPANS_MAX( len ) ( 3 * ( len ) + ANSI_RECORD )
+
+#define ANSI_BOLD		0x001
+#define ANSI_DIM		0x002
+#define ANSI_ITALIC		0x004
+#define ANSI_UNDERLINE	0x008
+#define ANSI_BLINK		0x010
+#define ANSI_REVERSE	0x020
+#define ANSI_HIDDEN		0x040
+#define ANSI_STRIKE		0x080
+#define ANSI_FG			0x100	/* fg is set, otherwise the default colour */
+#define ANSI_BG			0x200	/* bg is set */
+
+typedef struct ansi_data ANSI;
+
+struct ansi_data
+{
+	unsigned int fg;
+	unsigned int bg;
+	unsigned int attr;
+	int state;
+	int params;		/* index of the parameter being read */
+	int private;	/* not a plain SGR sequence */
+	unsigned int param[ ANSI_MAX_PARAMS ];
+};
+
+void ansi_init( ANSI *a );
+size_t ansi_spans( ANSI *a, char *out, size_t room, const char *in, size_t len, size_t *used );
@@ -0,0 +1,1359 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "hpack.h"
+#include "http.h"
+#include "log.h"
+#include "proxy.h"
+#include "timer.h"
+#include "tls.h"
+#include "h2.h"
+
+
+#define FRAME_HEAD	9
+#define FRAME_MAX	16384	/* SETTINGS_MAX_FRAME_SIZE, the default, both ways */
+#define WINDOW		65535	/* initial window, the default, both ways */
+#define WINDOW_MAX	0x7FFFFFFFL
+#define BLOCK_MAX	65536	/* longest header block taken */
+#define OUT_HIGH	262144	/* bytes waiting to go out before streams stop being read */
+#define HEAD_MAX	HTTP_MAX_HEAD	/* longest response head taken from a node */
+#define READS		16		/* reads per wakeup, for TLS that buffers */
+#define LINGER		10		/* seconds a failed connection gets to take its GOAWAY */
+#define WS_KEY		"V2hpdGVMYW50ZXJuIGgyIQ=="	/* the node's answer to it goes nowhere */
+
+#if defined( TLS )
+# define TLS_PENDING( c ) ( ( c )->ssl && SSL_pending( (SSL *) ( c )->ssl ) > 0 )
+#else
+# define TLS_PENDING( c ) 0
+#endif
+
+enum FrameType
+{
+	F_DATA,
+	F_HEADERS,
+	F_PRIORITY,
+	F_RST_STREAM,
+	F_SETTINGS,
+	F_PUSH_PROMISE,
+	F_PING,
+	F_GOAWAY,
+	F_WINDOW_UPDATE,
+	F_CONTINUATION
+};
+
+#define END_STREAM	0x01
+#define ACK			0x01
+#define END_HEADERS	0x04
+#define PADDED		0x08
+#define PRIORITY	0x20
+
+enum ErrorCode
+{
+	E_NO_ERROR,
+	E_PROTOCOL,
+	E_INTERNAL,
+	E_FLOW_CONTROL,
+	E_SETTINGS_TIMEOUT,
+	E_STREAM_CLOSED,
+	E_FRAME_SIZE,
+	E_REFUSED_STREAM,
+	E_CANCEL,
+	E_COMPRESSION
+};
+
+enum Setting
+{
+	S_HEADER_TABLE_SIZE = 1,
+	S_ENABLE_PUSH,
+	S_MAX_CONCURRENT_STREAMS,
+	S_INITIAL_WINDOW_SIZE,
+	S_MAX_FRAME_SIZE,
+	S_MAX_HEADER_LIST_SIZE,
+	S_ENABLE_CONNECT_PROTOCOL = 8
+};
+
+typedef struct conn_data CONN;
+typedef struct stream_data STREAM;
+typedef struct request_data REQUEST;
+
+struct stream_data
+{
+	STREAM *next;
+	uint32_t id;
+	int fd;				/* our half of the node's socketpair */
+	long int window;	/* DATA the client still takes on it */
+	unsigned long int consumed;	/* taken by the node and not credited yet */
+	char *pending;		/* arrived while fd was full */
+	size_t pending_len;
+	char held[ HEAD_MAX ];	/* read from the node and not sent yet */
+	size_t held_len;
+	int websocket;		/* extended CONNECT, where 101 is answered as 200 */
+	int answered;		/* HEADERS went out */
+	int ended;			/* END_STREAM came from the client */
+	int eof;			/* the node is done */
+};
+
+struct conn_data
+{
+	CONN *next;
+	int fd;
+	void *ssl;			/* the SSL of a TLS connection */
+	char name[ INET6_ADDRSTRLEN ];
+	char *key;
+	struct sockaddr_in6 peer;
+	char origin[ PROXY_V1_MAX ];
+	HPACK hpack;
+	unsigned char in[ FRAME_HEAD + FRAME_MAX ];
+	size_t in_len;
+	char *out;			/* frames not written yet */
+	size_t out_len;
+	size_t out_size;
+	unsigned char *block;	/* header block so far, across CONTINUATIONs */
+	size_t block_len;
+	uint32_t block_id;	/* the stream it is for, 0 when none is open */
+	int block_end;		/* END_STREAM came with its HEADERS */
+	long int window;	/* DATA the client still takes on the connection */
+	long int initial;	/* its SETTINGS_INITIAL_WINDOW_SIZE */
+	size_t max_frame;	/* its SETTINGS_MAX_FRAME_SIZE */
+	unsigned long int consumed;	/* connection credit not handed back yet */
+	uint32_t last_id;	/* newest stream the client opened */
+	STREAM *streams;
+	unsigned int stream_count;
+	int draining;		/* no new streams; closes once the last one ends */
+	int failed;			/* closes once the GOAWAY is out */
+	TIMER idle;
+};
+
+/* The request a header block makes, as far as it matters here */
+struct request_data
+{
+	char method[ 16 ];
+	char protocol[ 16 ];
+	char path[ 2048 ];
+	char authority[ 256 ];
+	char fields[ HTTP_MAX_HEAD ];	/* the headers passed on, as HTTP/1.1 lines */
+	size_t fields_len;
+	char cookie[ HTTP_MAX_HEAD ];	/* crumbs joined again, RFC 9113 8.2.3 */
+	size_t cookie_len;
+	int bad;
+};
+
+
+static CONN *conns;
+static H2_REQUEST *on_request;
+
+
+static void free_conn( CONN *c );
+static void fail( CONN *c, int error, const char *why );
+static void idle_expired( void *data );
+static STREAM *find_stream( const CONN *c, uint32_t id );
+static void drop_stream( CONN *c, STREAM *s );
+static void frame( CONN *c, int type, int flags, uint32_t id, const void *data, size_t length );
+static void reset( CONN *c, uint32_t id, int error );
+static void window_update( CONN *c, uint32_t id, unsigned long int n );
+static void respond( CONN *c, uint32_t id, const char *status );
+static int read_conn( CONN *c );
+static int write_conn( CONN *c );
+static int parse_frames( CONN *c );
+static int handle_frame( CONN *c, int type, int flags, uint32_t id, unsigned char *data, size_t length );
+static int on_data( CONN *c, int flags, uint32_t id, const unsigned char *data, size_t length );
+static int on_settings( CONN *c, int flags, uint32_t id, const unsigned char *data, size_t length );
+static int on_window_update( CONN *c, uint32_t id, const unsigned char *data, size_t length );
+static int on_headers( CONN *c, int flags, uint32_t id, const unsigned char *data, size_t length );
+static int end_block( CONN *c );
+static int add_field( void *data, const char *name, size_t name_len, const char *value, size_t value_len );
+static void open_stream( CONN *c, uint32_t id, const REQUEST *req, int end );
+static void deliver( CONN *c, STREAM *s, const unsigned char *data, size_t length );
+static void credit( CONN *c, STREAM *s, size_t n );
+static void stream_io( CONN *c, STREAM *s, const fd_set *in, const fd_set *out );
+static int take_head( CONN *c, STREAM *s );
+static void send_held( CONN *c, STREAM *s );
+static ssize_t conn_read( CONN *c, void *buf, size_t length );
+static ssize_t conn_write( CONN *c, const void *buf, size_t length );
+static uint32_t get32( const unsigned char *p );
+static void grow( char **buf, size_t *size, size_t need );
+
+
+void h2_init( H2_REQUEST *request )
+{
+	on_request = request;
+
+	return;
+}
+
+
+/* Takes over a connection whose client sent the preface, with whatever
+   came after it. Our SETTINGS go out first, allowing extended CONNECT, and
+   the connection window is opened wide: each stream's own window is what
+   bounds what can pile up. */
+int h2_start( int fd, void *ssl, const char *key, const struct sockaddr_in6 *peer,
+			  const char *origin, const char *early, size_t length )
+{
+	static const unsigned char settings[] =
+	{
+		0, S_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_STREAMS,
+		0, S_ENABLE_CONNECT_PROTOCOL, 0, 0, 0, 1
+	};
+	CONN *c;
+	const char *name;
+
+	if ( length > sizeof( c->in ) )
+		return 0;
+
+	c = calloc( sizeof( CONN ), 1 );
+	c->fd = fd;
+	c->ssl = ssl;
+	c->key = key ? strdup( key ) : NULL;
+	c->peer = *peer;
+	strcpy( c->origin, origin );
+	hpack_init( &c->hpack );
+	c->window = c->initial = WINDOW;
+	c->max_frame = FRAME_MAX;
+
+	if ( !inet_ntop( AF_INET6, &peer->sin6_addr, c->name, sizeof( c->name ) ) )
+		strcpy( c->name, "?" );
+	name = strncmp( c->name, "::ffff:", 7 ) ? c->name : c->name + 7;
+	memmove( c->name, name, strlen( name ) + 1 );
+
+	memcpy( c->in, early, length );
+	c->in_len = length;
+
+	frame( c, F_SETTINGS, 0, 0, settings, sizeof( settings ) );
+	window_update( c, 0, (unsigned long int) H2_STREAMS * WINDOW );
+	timer_set( &c->idle, H2_IDLE * 1000UL, idle_expired, c );
+
+	c->next = conns;
+	conns = c;
+
+	if ( !parse_frames( c ) )
+		c->failed = 1;
+
+	return 1;
+}
+
+
+/* The listeners went to a new process: browsers are told to open their
+   next streams there, and the streams open now end here. */
+void h2_drain( void )
+{
+	unsigned char goaway[ 8 ];
+	CONN *c;
+
+	for ( c = conns; c; c = c->next )
+		if ( !c->draining && !c->failed )
+		{
+			goaway[ 0 ] = (unsigned char) ( c->last_id >> 24 );
+			goaway[ 1 ] = (unsigned char) ( c->last_id >> 16 );
+			goaway[ 2 ] = (unsigned char) ( c->last_id >> 8 );
+			goaway[ 3 ] = (unsigned char) c->last_id;
+			memset( goaway + 4, 0, 4 );
+			frame( c, F_GOAWAY, 0, 0, goaway, sizeof( goaway ) );
+			c->draining = 1;
+		}
+
+	return;
+}
+
+
+int h2_select( fd_set *in, fd_set *out, int maxdsc, int *pending )
+{
+	CONN *c;
+	STREAM *s;
+
+	for ( c = conns; c; c = c->next )
+	{
+		if ( maxdsc < c->fd )
+			maxdsc = c->fd;
+		if ( !c->failed )
+			FD_SET( c->fd, in );
+		if ( c->out_len )
+			FD_SET( c->fd, out );
+		if ( !c->failed && TLS_PENDING( c ) )
+			*pending = 1;
+
+		for ( s = c->streams; s; s = s->next )
+		{
+			if ( maxdsc < s->fd )
+				maxdsc = s->fd;
+			if ( !s->eof && !s->held_len
+			  && ( !s->answered
+				|| ( s->window > 0 && c->window > 0 && c->out_len < OUT_HIGH ) ) )
+				FD_SET( s->fd, in );
+			if ( s->pending_len )
+				FD_SET( s->fd, out );
+		}
+	}
+
+	return maxdsc;
+}
+
+
+void h2_io( const fd_set *in, const fd_set *out )
+{
+	CONN *c, *next_conn;
+	STREAM *s, *next_stream;
+
+	for ( c = conns; c; c = next_conn )
+	{
+		next_conn = c->next;
+
+		if ( !c->failed && ( FD_ISSET( c->fd, in ) || TLS_PENDING( c ) ) && !read_conn( c ) )
+		{
+			free_conn( c );
+			continue;
+		}
+
+		for ( s = c->streams; s; s = next_stream )
+		{
+			next_stream = s->next;
+			stream_io( c, s, in, out );
+		}
+
+		if ( c->consumed >= WINDOW / 2 )
+		{
+			window_update( c, 0, c->consumed );
+			c->consumed = 0;
+		}
+
+		if ( !write_conn( c ) )
+		{
+			free_conn( c );
+			continue;
+		}
+
+		if ( !c->out_len && ( c->failed || ( c->draining && !c->stream_count ) ) )
+			free_conn( c );
+	}
+
+	return;
+}
+
+
+static void free_conn( CONN *c )
+{
+	CONN *p;
+
+	while ( c->streams )
+		drop_stream( c, c->streams );
+
+	if ( conns == c )
+		conns = c->next;
+	else
+		for ( p = conns; p; p = p->next )
+			if ( p->next == c )
+			{
+				p->next = c->next;
+				break;
+			}
+
+	wraplog( "HTTP/2 connection from %s closed.", c->name );
+
+	timer_cancel( &c->idle );
+	hpack_free( &c->hpack );
+#if defined( TLS )
+	if ( c->ssl )
+		tls_close( (SSL *) c->ssl );
+#endif
+	close( c->fd );
+	free( c->key );
+	free( c->block );
+	free( c->out );
+	free( c );
+
+	return;
+}
+
+
+/* A connection error: the GOAWAY says why, then the connection goes as
+   soon as it is out, or after LINGER if the client does not take it. */
+static void fail( CONN *c, int error, const char *why )
+{
+	unsigned char goaway[ 8 ];
+
+	if ( c->failed )
+		return;
+
+	wraplog( "HTTP/2 connection from %s: %s.", c->name, why );
+
+	goaway[ 0 ] = (unsigned char) ( c->last_id >> 24 );
+	goaway[ 1 ] = (unsigned char) ( c->last_id >> 16 );
+	goaway[ 2 ] = (unsigned char) ( c->last_id >> 8 );
+	goaway[ 3 ] = (unsigned char) c->last_id;
+	goaway[ 4 ] = goaway[ 5 ] = goaway[ 6 ] = 0;
+	goaway[ 7 ] = (unsigned char) error;
+	frame( c, F_GOAWAY, 0, 0, goaway, sizeof( goaway ) );
+	c->failed = 1;
+	timer_set( &c->idle, LINGER * 1000UL, idle_expired, c );
+
+	return;
+}
+
+
+static void idle_expired( void *data )
+{
+	CONN *c = data;
+
+	if ( c->failed )
+		free_conn( c );
+	else
+		fail( c, E_NO_ERROR, "idle" );
+
+	return;
+}
+
+
+static STREAM *find_stream( const CONN *c, uint32_t id )
+{
+	STREAM *s;
+
+	for ( s = c->streams; s; s = s->next )
+		if ( s->id == id )
+			return s;
+
+	return NULL;
+}
+
+
+/* Closing our half is all the node needs to hear. */
+static void drop_stream( CONN *c, STREAM *s )
+{
+	STREAM *p;
+
+	close( s->fd );
+	free( s->pending );
+
+	if ( c->streams == s )
+		c->streams = s->next;
+	else
+		for ( p = c->streams; p; p = p->next )
+			if ( p->next == s )
+			{
+				p->next = s->next;
+				break;
+			}
+
+	if ( !--c->stream_count && !c->failed )
+		timer_set( &c->idle, H2_IDLE * 1000UL, idle_expired, c );
+
+	free( s );
+
+	return;
+}
+
+
+static void frame( CONN *c, int type, int flags, uint32_t id, const void *data, size_t length )
+{
+	unsigned char *h;
+
+	grow( &c->out, &c->out_size, c->out_len + FRAME_HEAD + length );
+	h = (unsigned char *) c->out + c->out_len;
+	h[ 0 ] = (unsigned char) ( length >> 16 );
+	h[ 1 ] = (unsigned char) ( length >> 8 );
+	h[ 2 ] = (unsigned char) length;
+	h[ 3 ] = (unsigned char) type;
+	h[ 4 ] = (unsigned char) flags;
+	h[ 5 ] = (unsigned char) ( ( id >> 24 ) & 0x7F );
+	h[ 6 ] = (unsigned char) ( id >> 16 );
+	h[ 7 ] = (unsigned char) ( id >> 8 );
+	h[ 8 ] = (unsigned char) id;
+
+	if ( length )
+		memcpy( h + FRAME_HEAD, data, length );
+
+	c->out_len += FRAME_HEAD + length;
+
+	return;
+}
+
+
+static void reset( CONN *c, uint32_t id, int error )
+{
+	unsigned char code[ 4 ] = { 0, 0, 0, 0 };
+
+	code[ 3 ] = (unsigned char) error;
+	frame( c, F_RST_STREAM, 0, id, code, sizeof( code ) );
+
+	return;
+}
+
+
+static void window_update( CONN *c, uint32_t id, unsigned long int n )
+{
+	unsigned char inc[ 4 ];
+
+	inc[ 0 ] = (unsigned char) ( ( n >> 24 ) & 0x7F );
+	inc[ 1 ] = (unsigned char) ( n >> 16 );
+	inc[ 2 ] = (unsigned char) ( n >> 8 );
+	inc[ 3 ] = (unsigned char) n;
+	frame( c, F_WINDOW_UPDATE, 0, id, inc, sizeof( inc ) );
+
+	return;
+}
+
+
+/* An answer of our own, without a body, for requests no node gets. */
+static void respond( CONN *c, uint32_t id, const char *status )
+{
+	unsigned char block[ 16 ];
+
+	frame( c, F_HEADERS, END_HEADERS | END_STREAM, id, block,
+		   hpack_field( block, ":status", status, strlen( status ) ) );
+
+	return;
+}
+
+
+static int read_conn( CONN *c )
+{
+	ssize_t n;
+	int i;
+
+	for ( i = 0; i < READS && !c->failed; i++ )
+	{
+		if ( ( n = conn_read( c, c->in + c->in_len, sizeof( c->in ) - c->in_len ) ) == 0 )
+			return 0;
+
+		if ( n < 0 )
+		{
+			if ( errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR )
+				return 1;
+
+			if ( errno != ECONNRESET )
+				wraperror( "HTTP/2 connection from %s", c->name );
+			return 0;
+		}
+
+		c->in_len += (size_t) n;
+
+		if ( !parse_frames( c ) )
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static int write_conn( CONN *c )
+{
+	ssize_t n;
+
+	if ( !c->out_len )
+		return 1;
+
+	if ( ( n = conn_write( c, c->out, c->out_len ) ) < 0 )
+	{
+		if ( errno == EWOULDBLOCK || errno == EAGAIN )
+			return 1;
+
+		if ( errno != EPIPE && errno != ECONNRESET )
+			wraperror( "HTTP/2 connection from %s", c->name );
+		return 0;
+	}
+
+	c->out_len -= (size_t) n;
+	memmove( c->out, c->out + n, c->out_len );
+
+	return 1;
+}
+
+
+/* Returns 0 when the connection is beyond saving; errors the client can
+   be told about leave it failed instead, to go once the GOAWAY is out. */
+static int parse_frames( CONN *c )
+{
+	size_t at = 0, length;
+	const unsigned char *h;
+
+	while ( !c->failed && c->in_len - at >= FRAME_HEAD )
+	{
+		h = c->in + at;
+		length = (size_t) h[ 0 ] << 16 | (size_t) h[ 1 ] << 8 | h[ 2 ];
+
+		if ( length > FRAME_MAX )
+		{
+			fail( c, E_FRAME_SIZE, "frame too long" );
+			break;
+		}
+
+		if ( c->in_len - at < FRAME_HEAD + length )
+			break;
+
+		if ( !handle_frame( c, h[ 3 ], h[ 4 ], get32( h + 5 ) & 0x7FFFFFFFUL,
+							c->in + at + FRAME_HEAD, length ) )
+			return 0;
+
+		at += FRAME_HEAD + length;
+	}
+
+	c->in_len -= at;
+	memmove( c->in, c->in + at, c->in_len );
+
+	return 1;
+}
+
+
+static int handle_frame( CONN *c, int type, int flags, uint32_t id, unsigned char *data, size_t length )
+{
+	STREAM *s;
+
+	/* Nothing may come between HEADERS and the CONTINUATIONs that end it. */
+	if ( c->block_id && ( type != F_CONTINUATION || id != c->block_id ) )
+	{
+		fail( c, E_PROTOCOL, "header block interrupted" );
+		return 1;
+	}
+
+	switch ( type )
+	{
+		case F_DATA:
+			return on_data( c, flags, id, data, length );
+
+		case F_HEADERS:
+			return on_headers( c, flags, id, data, length );
+
+		case F_CONTINUATION:
+			if ( !c->block_id )
+			{
+				fail( c, E_PROTOCOL, "stray CONTINUATION" );
+				return 1;
+			}
+			if ( c->block_len + length > BLOCK_MAX )
+			{
+				fail( c, E_PROTOCOL, "header block too long" );
+				return 1;
+			}
+			c->block = realloc( c->block, c->block_len + length );
+			memcpy( c->block + c->block_len, data, length );
+			c->block_len += length;
+			return !( flags & END_HEADERS ) || end_block( c );
+
+		case F_PRIORITY:
+			if ( length != 5 )
+				fail( c, E_FRAME_SIZE, "bad PRIORITY" );
+			return 1;
+
+		case F_RST_STREAM:
+			if ( length != 4 || !id )
+				fail( c, E_PROTOCOL, "bad RST_STREAM" );
+			else if ( ( s = find_stream( c, id ) ) )
+				drop_stream( c, s );
+			return 1;
+
+		case F_SETTINGS:
+			return on_settings( c, flags, id, data, length );
+
+		case F_PING:
+			if ( length != 8 || id )
+				fail( c, E_PROTOCOL, "bad PING" );
+			else if ( !( flags & ACK ) )
+				frame( c, F_PING, ACK, 0, data, length );
+			return 1;
+
+		case F_GOAWAY:
+			c->draining = 1;
+			return 1;
+
+		case F_WINDOW_UPDATE:
+			return on_window_update( c, id, data, length );
+
+		case F_PUSH_PROMISE:
+			fail( c, E_PROTOCOL, "PUSH_PROMISE from a client" );
+			return 1;
+	}
+
+	/* Unknown types are ignored, as extensions may add them. */
+	return 1;
+}
+
+
+/* The connection's credit goes back as DATA arrives, a stream's once its
+   node has taken it. */
+static int on_data( CONN *c, int flags, uint32_t id, const unsigned char *data, size_t length )
+{
+	STREAM *s = find_stream( c, id );
+	size_t pad = 0;
+
+	if ( !id || id > c->last_id )
+	{
+		fail( c, E_PROTOCOL, "DATA on an idle stream" );
+		return 1;
+	}
+
+	c->consumed += length;
+
+	if ( flags & PADDED )
+	{
+		if ( !length || ( pad = data[ 0 ] ) >= length )
+		{
+			fail( c, E_PROTOCOL, "bad padding" );
+			return 1;
+		}
+		data++;
+		length -= pad + 1;
+		pad++;
+	}
+
+	/* Frames still on their way to a stream we closed are let go. */
+	if ( !s )
+		return 1;
+
+	if ( s->ended )
+	{
+		reset( c, id, E_STREAM_CLOSED );
+		drop_stream( c, s );
+		return 1;
+	}
+
+	if ( s->websocket )
+		deliver( c, s, data, length );
+	else
+		pad += length;
+
+	credit( c, s, pad );
+
+	if ( flags & END_STREAM )
+	{
+		s->ended = 1;
+		if ( !s->pending_len && s->websocket )
+			shutdown( s->fd, SHUT_WR );
+	}
+
+	return 1;
+}
+
+
+static int on_settings( CONN *c, int flags, uint32_t id, const unsigned char *data, size_t length )
+{
+	unsigned long int value;
+	size_t i;
+	STREAM *s;
+
+	if ( id || length % 6 || ( ( flags & ACK ) && length ) )
+	{
+		fail( c, id ? E_PROTOCOL : E_FRAME_SIZE, "bad SETTINGS" );
+		return 1;
+	}
+
+	if ( flags & ACK )
+		return 1;
+
+	for ( i = 0; i < length; i += 6 )
+	{
+		value = get32( data + i + 2 );
+
+		switch ( data[ i ] << 8 | data[ i + 1 ] )
+		{
+			case S_INITIAL_WINDOW_SIZE:
+				if ( value > (unsigned long int) WINDOW_MAX )
+				{
+					fail( c, E_FLOW_CONTROL, "window too big" );
+					return 1;
+				}
+				for ( s = c->streams; s; s = s->next )
+					s->window += (long int) value - c->initial;
+				c->initial = (long int) value;
+				break;
+
+			case S_MAX_FRAME_SIZE:
+				if ( value < FRAME_MAX || value > 0xFFFFFFUL )
+				{
+					fail( c, E_PROTOCOL, "bad frame size" );
+					return 1;
+				}
+				/* Ours never get longer than that anyway. */
+				break;
+		}
+	}
+
+	frame( c, F_SETTINGS, ACK, 0, NULL, 0 );
+
+	return 1;
+}
+
+
+static int on_window_update( CONN *c, uint32_t id, const unsigned char *data, size_t length )
+{
+	unsigned long int n;
+	long int *window;
+	STREAM *s = NULL;
+
+	if ( length != 4 )
+	{
+		fail( c, E_FRAME_SIZE, "bad WINDOW_UPDATE" );
+		return 1;
+	}
+
+	n = get32( data ) & 0x7FFFFFFFUL;
+
+	if ( id && !( s = find_stream( c, id ) ) )
+		return 1;
+
+	window = s ? &s->window : &c->window;
+
+	if ( !n || *window > WINDOW_MAX - (long int) n )
+	{
+		if ( !s )
+		{
+			fail( c, n ? E_FLOW_CONTROL : E_PROTOCOL, "bad WINDOW_UPDATE" );
+			return 1;
+		}
+		reset( c, id, n ? E_FLOW_CONTROL : E_PROTOCOL );
+		drop_stream( c, s );
+		return 1;
+	}
+
+	*window += (long int) n;
+
+	return 1;
+}
+
+
+static int on_headers( CONN *c, int flags, uint32_t id, const unsigned char *data, size_t length )
+{
+	size_t skip = 0, pad = 0;
+
+	if ( !id || !( id & 1 ) )
+	{
+		fail( c, E_PROTOCOL, "bad stream for HEADERS" );
+		return 1;
+	}
+
+	if ( flags & PADDED )
+	{
+		if ( !length )
+		{
+			fail( c, E_PROTOCOL, "bad padding" );
+			return 1;
+		}
+		pad = data[ 0 ];
+		skip = 1;
+	}
+
+	if ( flags & PRIORITY )
+		skip += 5;
+
+	if ( skip + pad > length || length - skip - pad > BLOCK_MAX )
+	{
+		fail( c, E_PROTOCOL, "bad HEADERS" );
+		return 1;
+	}
+
+	length -= skip + pad;
+	c->block = realloc( c->block, length ? length : 1 );
+	memcpy( c->block, data + skip, length );
+	c->block_len = length;
+	c->block_id = id;
+	c->block_end = flags & END_STREAM;
+
+	return !( flags & END_HEADERS ) || end_block( c );
+}
+
+
+/* Every block is decoded, whatever it is for, to keep the table in step.
+   A new stream then gets a node; HEADERS on one already open can only be
+   trailers, which end it. */
+static int end_block( CONN *c )
+{
+	REQUEST req;
+	uint32_t id = c->block_id;
+	STREAM *s;
+
+	memset( &req, 0, sizeof( req ) );
+	c->block_id = 0;
+
+	if ( !hpack_decode( &c->hpack, c->block, c->block_len, add_field, &req ) )
+	{
+		fail( c, E_COMPRESSION, "cannot decode headers" );
+		return 1;
+	}
+
+	if ( id <= c->last_id )
+	{
+		if ( ( s = find_stream( c, id ) ) && c->block_end && !s->ended )
+		{
+			s->ended = 1;
+			if ( !s->pending_len && s->websocket )
+				shutdown( s->fd, SHUT_WR );
+		}
+		else if ( !s )
+			reset( c, id, E_STREAM_CLOSED );
+		return 1;
+	}
+
+	c->last_id = id;
+
+	if ( c->draining || c->failed || c->stream_count >= H2_STREAMS )
+	{
+		reset( c, id, E_REFUSED_STREAM );
+		return 1;
+	}
+
+	open_stream( c, id, &req, c->block_end );
+
+	return 1;
+}
+
+
+/* Pseudo-headers come first; of the rest, only the ones the node looks at
+   are passed on, which keeps its request head short. Anything that could
+   break out of an HTTP/1.1 line spoils the request, not the block. */
+static int add_field( void *data, const char *name, size_t name_len, const char *value, size_t value_len )
+{
+	static const char *const passed[] =
+	{
+		"origin", "sec-websocket-version", "sec-websocket-protocol",
+		"accept-encoding", "if-none-match", NULL
+	};
+	REQUEST *req = data;
+	char *dest = NULL;
+	size_t room = 0, i;
+
+	for ( i = 0; i < value_len; i++ )
+		if ( value[ i ] == '\r' || value[ i ] == '\n' || !value[ i ] )
+			req->bad = 1;
+
+	if ( name_len && name[ 0 ] == ':' )
+	{
+		if ( name_len == 7 && !memcmp( name, ":method", 7 ) )
+			dest = req->method, room = sizeof( req->method );
+		else if ( name_len == 9 && !memcmp( name, ":protocol", 9 ) )
+			dest = req->protocol, room = sizeof( req->protocol );
+		else if ( name_len == 5 && !memcmp( name, ":path", 5 ) )
+			dest = req->path, room = sizeof( req->path );
+		else if ( name_len == 10 && !memcmp( name, ":authority", 10 ) )
+			dest = req->authority, room = sizeof( req->authority );
+
+		if ( dest && value_len < room )
+			memcpy( dest, value, value_len );
+		else if ( dest )
+			req->bad = 1;
+
+		return 1;
+	}
+
+	if ( name_len == 4 && !memcmp( name, "host", 4 ) )
+	{
+		if ( !req->authority[ 0 ] && value_len < sizeof( req->authority ) )
+			memcpy( req->authority, value, value_len );
+		return 1;
+	}
+
+	if ( name_len == 6 && !memcmp( name, "cookie", 6 ) )
+	{
+		if ( req->cookie_len + value_len + 2 >= sizeof( req->cookie ) )
+			req->bad = 1;
+		else
+			req->cookie_len += (size_t) sprintf( req->cookie + req->cookie_len, "%s%.*s",
+				req->cookie_len ? "; " : "", (int) value_len, value );
+		return 1;
+	}
+
+	for ( i = 0; passed[ i ]; i++ )
+		if ( strlen( passed[ i ] ) == name_len && !memcmp( passed[ i ], name, name_len ) )
+			break;
+
+	if ( !passed[ i ] )
+		return 1;
+
+	if ( req->fields_len + name_len + value_len + 4 >= sizeof( req->fields ) )
+		req->bad = 1;
+	else
+		req->fields_len += (size_t) sprintf( req->fields + req->fields_len, "%.*s: %.*s\r\n",
+			(int) name_len, name, (int) value_len, value );
+
+	return 1;
+}
+
+
+/* The node gets the request as an HTTP/1.1 client would have sent it. A
+   WebSocket is asked for with a key of our own; the accept it comes back
+   with is not passed on, RFC 8441 has none. */
+static void open_stream( CONN *c, uint32_t id, const REQUEST *req, int end )
+{
+	char head[ 3 * HTTP_MAX_HEAD ];	/* the most a REQUEST makes, checked after */
+	STREAM *s;
+	int sv[ 2 ], websocket, n;
+
+	websocket = !strcmp( req->method, "CONNECT" ) && !strcmp( req->protocol, "websocket" );
+
+	if ( req->bad || req->path[ 0 ] != '/' || !req->authority[ 0 ] )
+	{
+		reset( c, id, E_PROTOCOL );
+		return;
+	}
+
+	if ( !websocket && strcmp( req->method, "GET" ) )
+	{
+		respond( c, id, "405" );
+		return;
+	}
+
+	if ( websocket )
+		n = sprintf( head,
+			"GET %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: " WS_KEY "\r\n"
+			"%s%s%s%s"
+			"\r\n",
+			req->path, req->authority, req->fields,
+			req->cookie_len ? "Cookie: " : "", req->cookie, req->cookie_len ? "\r\n" : "" );
+	else
+		n = sprintf( head,
+			"GET %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Connection: close\r\n"
+			"%s%s%s%s"
+			"\r\n",
+			req->path, req->authority, req->fields,
+			req->cookie_len ? "Cookie: " : "", req->cookie, req->cookie_len ? "\r\n" : "" );
+
+	if ( n > HTTP_MAX_HEAD )
+	{
+		respond( c, id, "431" );
+		return;
+	}
+
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+	{
+		wraperror( "HTTP/2 stream: socketpair" );
+		reset( c, id, E_REFUSED_STREAM );
+		return;
+	}
+
+	fcntl( sv[ 0 ], F_SETFL, O_NONBLOCK );
+	fcntl( sv[ 1 ], F_SETFL, O_NONBLOCK );
+	fcntl( sv[ 0 ], F_SETFD, FD_CLOEXEC );
+	fcntl( sv[ 1 ], F_SETFD, FD_CLOEXEC );
+
+	/* A fresh socketpair takes far more than one request head. */
+	if ( sv[ 0 ] >= FD_SETSIZE || write( sv[ 0 ], head, (size_t) n ) != n
+	  || !on_request( sv[ 1 ], c->key, &c->peer, c->origin ) )
+	{
+		if ( sv[ 0 ] >= FD_SETSIZE )
+			wraplog( "HTTP/2 stream: descriptor %d is too big for select().", sv[ 0 ] );
+		close( sv[ 0 ] );
+		close( sv[ 1 ] );
+		reset( c, id, E_REFUSED_STREAM );
+		return;
+	}
+
+	s = calloc( sizeof( STREAM ), 1 );
+	s->id = id;
+	s->fd = sv[ 0 ];
+	s->window = c->initial;
+	s->websocket = websocket;
+	s->ended = end;
+	s->next = c->streams;
+	c->streams = s;
+
+	if ( !c->stream_count++ )
+		timer_cancel( &c->idle );
+
+	if ( end && websocket )
+		shutdown( s->fd, SHUT_WR );
+
+	return;
+}
+
+
+/* Whatever the socketpair does not take now waits; the client never has
+   more than the window in flight, so that is all that can pile up. */
+static void deliver( CONN *c, STREAM *s, const unsigned char *data, size_t length )
+{
+	ssize_t w = 0;
+
+	if ( !s->pending_len && length && ( w = write( s->fd, data, length ) ) < 0 )
+	{
+		if ( errno != EWOULDBLOCK && errno != EAGAIN )
+		{
+			reset( c, s->id, E_CANCEL );
+			drop_stream( c, s );
+			return;
+		}
+
+		w = 0;
+	}
+
+	credit( c, s, (size_t) w );
+	data += w;
+	length -= (size_t) w;
+
+	if ( !length )
+		return;
+
+	if ( s->pending_len + length > WINDOW )
+	{
+		reset( c, s->id, E_FLOW_CONTROL );
+		drop_stream( c, s );
+		return;
+	}
+
+	s->pending = realloc( s->pending, s->pending_len + length );
+	memcpy( s->pending + s->pending_len, data, length );
+	s->pending_len += length;
+
+	return;
+}
+
+
+/* Credit goes back in batches of half a window, not a frame per write. */
+static void credit( CONN *c, STREAM *s, size_t n )
+{
+	if ( ( s->consumed += n ) < WINDOW / 2 )
+		return;
+
+	window_update( c, s->id, s->consumed );
+	s->consumed = 0;
+
+	return;
+}
+
+
+static void stream_io( CONN *c, STREAM *s, const fd_set *in, const fd_set *out )
+{
+	ssize_t n;
+
+	if ( s->pending_len && FD_ISSET( s->fd, out ) )
+	{
+		if ( ( n = write( s->fd, s->pending, s->pending_len ) ) < 0 )
+		{
+			if ( errno != EWOULDBLOCK && errno != EAGAIN )
+			{
+				reset( c, s->id, E_CANCEL );
+				drop_stream( c, s );
+				return;
+			}
+		}
+		else
+		{
+			s->pending_len -= (size_t) n;
+			memmove( s->pending, s->pending + n, s->pending_len );
+			credit( c, s, (size_t) n );
+
+			if ( !s->pending_len && s->ended )
+				shutdown( s->fd, SHUT_WR );
+		}
+	}
+
+	if ( !s->eof && !s->held_len && FD_ISSET( s->fd, in ) )
+	{
+		/* The head waits for all of it; after that, no more than the
+		   client will take. */
+		size_t want = sizeof( s->held ) - s->held_len;
+
+		if ( s->answered )
+		{
+			if ( (long int) want > s->window )
+				want = (size_t) s->window;
+			if ( (long int) want > c->window )
+				want = (size_t) c->window;
+			if ( want > c->max_frame )
+				want = c->max_frame;
+		}
+
+		if ( !want )
+			;
+		else if ( ( n = read( s->fd, s->held + s->held_len, want ) ) > 0 )
+			s->held_len += (size_t) n;
+		else if ( n == 0 || ( errno != EWOULDBLOCK && errno != EAGAIN ) )
+			s->eof = 1;
+	}
+
+	if ( !s->answered && !take_head( c, s ) )
+	{
+		drop_stream( c, s );
+		return;
+	}
+
+	if ( s->answered )
+		send_held( c, s );
+
+	if ( s->eof && !s->held_len && s->answered )
+	{
+		frame( c, F_DATA, END_STREAM, s->id, NULL, 0 );
+
+		/* The client need not send any more on it either. */
+		if ( !s->ended )
+			reset( c, s->id, E_NO_ERROR );
+
+		drop_stream( c, s );
+	}
+
+	return;
+}
+
+
+/* Turns the node's response head into HEADERS once it is all there, and
+   keeps what followed it to go out as DATA. The node shutting the stream
+   before that means it refused the request, or could not make sense of
+   it. Returns 0 once the stream is to go. */
+static int take_head( CONN *c, STREAM *s )
+{
+	unsigned char block[ HEAD_MAX + 64 ];
+	char *end, *line, *next, *colon, *p;
+	const char *status;
+	size_t n = 0, length;
+	char code[ 4 ];
+
+	for ( end = s->held; end + 4 <= s->held + s->held_len && memcmp( end, "\r\n\r\n", 4 ); end++ )
+		;
+
+	if ( end + 4 > s->held + s->held_len )
+	{
+		if ( s->held_len == sizeof( s->held ) || s->eof )
+		{
+			reset( c, s->id, s->held_len ? E_INTERNAL : E_REFUSED_STREAM );
+			return 0;
+		}
+		return 1;
+	}
+
+	if ( s->held_len < 12 || memcmp( s->held, "HTTP/1.", 7 )
+	  || !isdigit( (unsigned char) s->held[ 9 ] ) || !isdigit( (unsigned char) s->held[ 10 ] )
+	  || !isdigit( (unsigned char) s->held[ 11 ] ) )
+	{
+		reset( c, s->id, E_INTERNAL );
+		return 0;
+	}
+
+	memcpy( code, s->held + 9, 3 );
+	code[ 3 ] = '\0';
+	status = s->websocket && !strcmp( code, "101" ) ? "200" : code;
+	n = hpack_field( block, ":status", status, 3 );
+
+	/* Field names are lowercase in HTTP/2, and the ones about the
+	   connection have no business on a stream. */
+	/* Every line ends in a '\n' by the time end is found. */
+	for ( line = (char *) memchr( s->held, '\n', (size_t) ( end + 2 - s->held ) ) + 1;
+		  line < end + 2; line = next )
+	{
+		next = (char *) memchr( line, '\n', (size_t) ( end + 4 - line ) ) + 1;
+
+		if ( !( colon = memchr( line, ':', (size_t) ( next - line ) ) ) )
+			continue;
+
+		for ( p = line; p < colon; p++ )
+			*p = (char) ( *p >= 'A' && *p <= 'Z' ? *p + 'a' - 'A' : *p );
+		*colon = '\0';
+
+		if ( !strcmp( line, "connection" ) || !strcmp( line, "upgrade" )
+		  || !strcmp( line, "keep-alive" ) || !strcmp( line, "transfer-encoding" )
+		  || !strcmp( line, "sec-websocket-accept" ) )
+			continue;
+
+		for ( p = colon + 1; *p == ' '; p++ )
+			;
+		length = (size_t) ( next - p );
+		while ( length && ( p[ length - 1 ] == '\r' || p[ length - 1 ] == '\n' ) )
+			length--;
+
+		n += hpack_field( block + n, line, p, length );
+	}
+
+	frame( c, F_HEADERS, END_HEADERS, s->id, block, n );
+	s->answered = 1;
+
+	s->held_len -= (size_t) ( end + 4 - s->held );
+	memmove( s->held, end + 4, s->held_len );
+
+	return 1;
+}
+
+
+static void send_held( CONN *c, STREAM *s )
+{
+	size_t n, sent = 0;
+
+	while ( sent < s->held_len && s->window > 0 && c->window > 0 )
+	{
+		n = s->held_len - sent;
+		if ( (long int) n > s->window )
+			n = (size_t) s->window;
+		if ( (long int) n > c->window )
+			n = (size_t) c->window;
+		if ( n > c->max_frame )
+			n = c->max_frame;
+
+		frame( c, F_DATA, 0, s->id, s->held + sent, n );
+		s->window -= (long int) n;
+		c->window -= (long int) n;
+		sent += n;
+	}
+
+	s->held_len -= sent;
+	memmove( s->held, s->held + sent, s->held_len );
+
+	return;
+}
+
+
+static ssize_t conn_read( CONN *c, void *buf, size_t length )
+{
+#if defined( TLS )
+	if ( c->ssl )
+		return tls_read( (SSL *) c->ssl, buf, length );
+#endif
+
+	return read( c->fd, buf, length );
+}
+
+
+static ssize_t conn_write( CONN *c, const void *buf, size_t length )
+{
+#if defined( TLS )
+	if ( c->ssl )
+		return tls_write( (SSL *) c->ssl, buf, length );
+#endif
+
+	return write( c->fd, buf, length );
+}
+
+
+static uint32_t get32( const unsigned char *p )
+{
+	return (uint32_t) p[ 0 ] << 24 | (uint32_t) p[ 1 ] << 16 | (uint32_t) p[ 2 ] << 8 | p[ 3 ];
+}
+
+
+static void grow( char **buf, size_t *size, size_t need )
+{
+	if ( need <= *size )
+		return;
+
+	while ( *size < need )
+		*size = *size ? *size * 2 : 4096;
+
+	*buf = realloc( *buf, *size );
+
+	return;
+}
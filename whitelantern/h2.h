@@ -0,0 +1,51 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* HTTP/2 (RFC 9113) for browsers: in cleartext when a client opens with
+   the connection preface (h2c with prior knowledge), and over TLS when
+   ALPN settled on "h2". A stream is a WebSocket by extended CONNECT
+   (RFC 8441) or a GET for a file, so a player with several characters
+   and the page they play from share one connection and one handshake.
+
+   Each stream becomes a node of its own on one half of a socketpair. The
+   node is given the HTTP/1.1 request the stream stands for and answers it
+   as it would anyone; its answer goes back to the browser as HEADERS and
+   DATA. The node never sees a frame.
+
+   Flow control is per stream. DATA is credited back once the node has
+   taken it, and a node's output is read only while its stream has window,
+   so a tab that stops reading holds up its own game's socket and nothing
+   else on the connection. */
+
+#define H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN	24
+#define H2_STREAMS		16		/* open streams a connection may have */
+#define H2_IDLE			120		/* seconds a connection is kept without any */
+
+/* Called for each stream with the descriptor for its node, the entry the
+   client's port routes to, if any, and the address and PROXY line of the
+   connection. Returns 0 to refuse it; the descriptor is then closed for it. */
+typedef int H2_REQUEST( int fd, const char *key, const struct sockaddr_in6 *peer,
+						const char *origin );
+
+void h2_init( H2_REQUEST *request );
+int h2_start( int fd, void *ssl, const char *key, const struct sockaddr_in6 *peer,
+			  const char *origin, const char *early, size_t length );
+void h2_drain( void );
+int h2_select( fd_set *in, fd_set *out, int maxdsc, int *pending );
+void h2_io( const fd_set *in, const fd_set *out );
@@ -0,0 +1,204 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "handoff.h"
+
+
+struct handoff_header
+{
+	uint32_t kind;
+	uint32_t length;
+	uint32_t nfds;
+};
+
+
+static int write_all( int sock, const char *data, size_t length );
+static int read_all( int sock, char *data, size_t length );
+
+
+/* Returns 0 on failure with errno set. */
+int handoff_send( int sock, unsigned int kind, const int *fds, int nfds,
+				  const void *data, size_t length )
+{
+	struct handoff_header h;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[ CMSG_SPACE( HANDOFF_MAX_FDS * sizeof( int ) ) ];
+	ssize_t w;
+
+	if ( nfds < 0 || nfds > HANDOFF_MAX_FDS || length > UINT32_MAX )
+	{
+		errno = EINVAL;
+		return 0;
+	}
+
+	h.kind = (uint32_t) kind;
+	h.length = (uint32_t) length;
+	h.nfds = (uint32_t) nfds;
+
+	memset( &msg, 0, sizeof( msg ) );
+	iov.iov_base = &h;
+	iov.iov_len = sizeof( h );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	/* The descriptors ride on the first byte of the header. */
+	if ( nfds )
+	{
+		memset( control, 0, sizeof( control ) );
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE( (size_t) nfds * sizeof( int ) );
+		cmsg = CMSG_FIRSTHDR( &msg );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN( (size_t) nfds * sizeof( int ) );
+		memcpy( CMSG_DATA( cmsg ), fds, (size_t) nfds * sizeof( int ) );
+	}
+
+	while ( ( w = sendmsg( sock, &msg, 0 ) ) < 0 && errno == EINTR )
+		;
+
+	if ( w < 0 )
+		return 0;
+
+	if ( (size_t) w < sizeof( h ) && !write_all( sock, (char *) &h + w, sizeof( h ) - (size_t) w ) )
+		return 0;
+
+	return write_all( sock, data, length );
+}
+
+
+/* *data is allocated with malloc() and belongs to the caller. Returns 0
+   on failure or at the end of the stream. */
+int handoff_recv( int sock, unsigned int *kind, int *fds, int *nfds,
+				  void **data, size_t *length )
+{
+	struct handoff_header h;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[ CMSG_SPACE( HANDOFF_MAX_FDS * sizeof( int ) ) ];
+	ssize_t r;
+	size_t got;
+
+	memset( &msg, 0, sizeof( msg ) );
+	iov.iov_base = &h;
+	iov.iov_len = sizeof( h );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof( control );
+
+#if defined( MSG_CMSG_CLOEXEC )
+	while ( ( r = recvmsg( sock, &msg, MSG_CMSG_CLOEXEC ) ) < 0 && errno == EINTR )
+		;
+#else
+	while ( ( r = recvmsg( sock, &msg, 0 ) ) < 0 && errno == EINTR )
+		;
+#endif
+
+	if ( r <= 0 )
+		return 0;
+
+	*nfds = 0;
+
+	for ( cmsg = CMSG_FIRSTHDR( &msg ); cmsg; cmsg = CMSG_NXTHDR( &msg, cmsg ) )
+		if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+		{
+			got = ( cmsg->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+			memcpy( fds, CMSG_DATA( cmsg ), got * sizeof( int ) );
+			*nfds = (int) got;
+		}
+
+	if ( ( msg.msg_flags & MSG_CTRUNC )
+	  || ( (size_t) r < sizeof( h ) && !read_all( sock, (char *) &h + r, sizeof( h ) - (size_t) r ) )
+	  || h.nfds != (uint32_t) *nfds )
+	{
+		while ( *nfds > 0 )
+			close( fds[ --*nfds ] );
+		errno = EPROTO;
+		return 0;
+	}
+
+	*kind = h.kind;
+	*length = h.length;
+	*data = malloc( h.length + 1 );
+
+	if ( !read_all( sock, *data, h.length ) )
+	{
+		free( *data );
+		while ( *nfds > 0 )
+			close( fds[ --*nfds ] );
+		return 0;
+	}
+
+	return 1;
+}
+
+
+static int write_all( int sock, const char *data, size_t length )
+{
+	ssize_t w;
+
+	while ( length )
+	{
+		if ( ( w = write( sock, data, length ) ) < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+			return 0;
+		}
+
+		data += w;
+		length -= (size_t) w;
+	}
+
+	return 1;
+}
+
+
+static int read_all( int sock, char *data, size_t length )
+{
+	ssize_t r;
+
+	while ( length )
+	{
+		if ( ( r = read( sock, data, length ) ) <= 0 )
+		{
+			if ( r < 0 && errno == EINTR )
+				continue;
+			if ( r == 0 )
+				errno = EPIPE;
+			return 0;
+		}
+
+		data += r;
+		length -= (size_t) r;
+	}
+
+	return 1;
+}
@@ -0,0 +1,28 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* Messages between a running WhiteLantern and the one replacing it, over
+   a Unix stream socket. Each message is a kind, up to HANDOFF_MAX_FDS file
+   descriptors passed with SCM_RIGHTS, and a payload of any length. */
+
+#define HANDOFF_MAX_FDS	4
+
+int handoff_send( int sock, unsigned int kind, const int *fds, int nfds,
+				  const void *data, size_t length );
+int handoff_recv( int sock, unsigned int *kind, int *fds, int *nfds,
+				  void **data, size_t *length );
@@ -0,0 +1,508 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+
+
+#define STATIC_COUNT	61
+#define TREE_NODES		256		/* inner nodes of the Huffman code, 255 used */
+#define LEAF( sym )		( -1 - ( sym ) )
+
+
+static int decode_int( const unsigned char **p, const unsigned char *end, int prefix, size_t *value );
+static int decode_string( const unsigned char **p, const unsigned char *end, char *out, size_t *length );
+static int huffman_decode( const unsigned char *in, size_t length, char *out, size_t *out_len );
+static void build_tree( void );
+static int lookup( const HPACK *h, size_t index, const char **name, size_t *name_len,
+				   const char **value, size_t *value_len );
+static void insert( HPACK *h, const char *name, size_t name_len, const char *value, size_t value_len );
+static void evict( HPACK *h, size_t max );
+static size_t encode_int( unsigned char *out, int prefix, unsigned char first, size_t value );
+
+
+/* RFC 7541 appendix A */
+static const char *const static_table[ STATIC_COUNT ][ 2 ] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+
+/* RFC 7541 appendix B, by symbol: the code and its length in bits */
+static const uint32_t huffman_code[ 256 ] =
+{
+	0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+	0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+	0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+	0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+	0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+	0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+	0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+	0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+	0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+	0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+	0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+	0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+	0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+	0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+	0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+	0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+	0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+	0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+	0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+	0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+	0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+	0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+	0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+	0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+	0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+	0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+	0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+	0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+	0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+	0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+	0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+	0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+	0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+	0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+	0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+	0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+	0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+	0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+	0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+	0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+	0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+	0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee
+};
+
+static const unsigned char huffman_bits[ 256 ] =
+{
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+};
+
+
+/* Children of each inner node, LEAF( symbol ) where a code ends and 0
+   where none goes; the root is node 0 and never anyone's child. */
+static short tree[ TREE_NODES ][ 2 ];
+
+
+void hpack_init( HPACK *h )
+{
+	if ( !tree[ 0 ][ 0 ] )
+		build_tree( );
+
+	memset( h, 0, sizeof( HPACK ) );
+	h->max = HPACK_TABLE;
+
+	return;
+}
+
+
+void hpack_free( HPACK *h )
+{
+	evict( h, 0 );
+
+	return;
+}
+
+
+/* Decodes a whole header block, as HEADERS and its CONTINUATIONs carry it.
+   Returns 0 on anything malformed, after which the connection is lost: the
+   table no longer matches the peer's. */
+int hpack_decode( HPACK *h, const unsigned char *block, size_t length,
+				  HPACK_FIELD *field, void *data )
+{
+	const unsigned char *p = block, *end = block + length;
+	char name_buf[ HPACK_STRING ], value_buf[ HPACK_STRING ];
+	const char *name, *value;
+	size_t index, name_len, value_len;
+	int prefix, indexing;
+
+	while ( p < end )
+	{
+		/* Indexed field */
+		if ( *p & 0x80 )
+		{
+			if ( !decode_int( &p, end, 7, &index )
+			  || !lookup( h, index, &name, &name_len, &value, &value_len )
+			  || !field( data, name, name_len, value, value_len ) )
+				return 0;
+			continue;
+		}
+
+		/* Dynamic table size update; no bigger than what SETTINGS allowed. */
+		if ( ( *p & 0xE0 ) == 0x20 )
+		{
+			if ( !decode_int( &p, end, 5, &index ) || index > HPACK_TABLE )
+				return 0;
+			evict( h, h->max = index );
+			continue;
+		}
+
+		/* Literal, with incremental indexing or without (or never) */
+		indexing = ( *p & 0xC0 ) == 0x40;
+		prefix = indexing ? 6 : 4;
+
+		if ( !decode_int( &p, end, prefix, &index ) )
+			return 0;
+
+		if ( index )
+		{
+			/* Copied, as inserting this very field may evict where it came from. */
+			if ( !lookup( h, index, &name, &name_len, &value, &value_len ) )
+				return 0;
+			memcpy( name_buf, name, name_len );
+			name = name_buf;
+		}
+		else
+		{
+			if ( !decode_string( &p, end, name_buf, &name_len ) )
+				return 0;
+			name = name_buf;
+		}
+
+		if ( !decode_string( &p, end, value_buf, &value_len ) )
+			return 0;
+
+		if ( indexing )
+			insert( h, name, name_len, value_buf, value_len );
+
+		if ( !field( data, name, name_len, value_buf, value_len ) )
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/* A literal field that the peer is asked never to index, naming the static
+   table entry for the name when there is one. */
+size_t hpack_field( unsigned char *out, const char *name, const char *value, size_t value_len )
+{
+	size_t n, i, name_len = strlen( name );
+
+	for ( i = 0; i < STATIC_COUNT; i++ )
+		if ( !strcmp( static_table[ i ][ 0 ], name ) )
+			break;
+
+	if ( i < STATIC_COUNT )
+		n = encode_int( out, 4, 0x10, i + 1 );
+	else
+	{
+		out[ 0 ] = 0x10;
+		n = 1 + encode_int( out + 1, 7, 0, name_len );
+		memcpy( out + n, name, name_len );
+		n += name_len;
+	}
+
+	n += encode_int( out + n, 7, 0, value_len );
+	memcpy( out + n, value, value_len );
+
+	return n + value_len;
+}
+
+
+static int decode_int( const unsigned char **p, const unsigned char *end, int prefix, size_t *value )
+{
+	size_t mask = ( 1U << prefix ) - 1;
+	int shift = 0;
+
+	if ( *p >= end )
+		return 0;
+
+	if ( ( *value = *( *p )++ & mask ) < mask )
+		return 1;
+
+	do
+	{
+		if ( *p >= end || shift > 21 )
+			return 0;
+
+		*value += (size_t) ( **p & 0x7F ) << shift;
+		shift += 7;
+	}
+	while ( *( *p )++ & 0x80 );
+
+	return 1;
+}
+
+
+static int decode_string( const unsigned char **p, const unsigned char *end, char *out, size_t *length )
+{
+	int huffman = *p < end && ( **p & 0x80 );
+	size_t n;
+
+	if ( !decode_int( p, end, 7, &n ) || n > (size_t) ( end - *p ) )
+		return 0;
+
+	if ( huffman )
+	{
+		if ( !huffman_decode( *p, n, out, length ) )
+			return 0;
+	}
+	else
+	{
+		if ( n > HPACK_STRING )
+			return 0;
+		memcpy( out, *p, n );
+		*length = n;
+	}
+
+	*p += n;
+
+	return 1;
+}
+
+
+/* Walks the tree a bit at a time. What is left after the last symbol must
+   be fewer than eight bits, all ones: the start of EOS. */
+static int huffman_decode( const unsigned char *in, size_t length, char *out, size_t *out_len )
+{
+	size_t i, n = 0;
+	int bit, node = 0, depth = 0, ones = 1, next;
+
+	for ( i = 0; i < length; i++ )
+		for ( bit = 7; bit >= 0; bit-- )
+		{
+			next = tree[ node ][ ( in[ i ] >> bit ) & 1 ];
+			ones = ones && ( ( in[ i ] >> bit ) & 1 );
+			depth++;
+
+			if ( next > 0 )
+			{
+				node = next;
+				continue;
+			}
+
+			if ( !next || n == HPACK_STRING )
+				return 0;
+
+			out[ n++ ] = (char) LEAF( next );
+			node = depth = 0;
+			ones = 1;
+		}
+
+	*out_len = n;
+
+	return depth < 8 && ones;
+}
+
+
+static void build_tree( void )
+{
+	int sym, bit, node, used = 1;
+	short *child;
+
+	for ( sym = 0; sym < 256; sym++ )
+	{
+		node = 0;
+
+		for ( bit = huffman_bits[ sym ] - 1; bit >= 0; bit-- )
+		{
+			child = &tree[ node ][ ( huffman_code[ sym ] >> bit ) & 1 ];
+
+			if ( !bit )
+				*child = (short) LEAF( sym );
+			else
+			{
+				if ( !*child )
+					*child = (short) used++;
+				node = *child;
+			}
+		}
+	}
+
+	return;
+}
+
+
+/* Index 1 to 61 is the static table, the dynamic table follows newest
+   first. */
+static int lookup( const HPACK *h, size_t index, const char **name, size_t *name_len,
+				   const char **value, size_t *value_len )
+{
+	const HPACK_ENTRY *e;
+
+	if ( !index )
+		return 0;
+
+	if ( index <= STATIC_COUNT )
+	{
+		*name = static_table[ index - 1 ][ 0 ];
+		*value = static_table[ index - 1 ][ 1 ];
+		*name_len = strlen( *name );
+		*value_len = strlen( *value );
+		return 1;
+	}
+
+	if ( ( index -= STATIC_COUNT + 1 ) >= h->count )
+		return 0;
+
+	e = &h->entry[ ( h->first + index ) % HPACK_ENTRIES ];
+	*name = e->name;
+	*name_len = e->name_len;
+	*value = e->value;
+	*value_len = e->value_len;
+
+	return 1;
+}
+
+
+/* An entry bigger than the whole table empties it and is not kept. */
+static void insert( HPACK *h, const char *name, size_t name_len, const char *value, size_t value_len )
+{
+	size_t size = name_len + value_len + 32;
+	HPACK_ENTRY *e;
+
+	if ( size > h->max )
+	{
+		evict( h, 0 );
+		return;
+	}
+
+	evict( h, h->max - size );
+
+	h->first = ( h->first + HPACK_ENTRIES - 1 ) % HPACK_ENTRIES;
+	e = &h->entry[ h->first ];
+	e->name = malloc( name_len + value_len + 1 );
+	e->value = e->name + name_len;
+	e->name_len = name_len;
+	e->value_len = value_len;
+	memcpy( e->name, name, name_len );
+	memcpy( e->value, value, value_len );
+	h->count++;
+	h->size += size;
+
+	return;
+}
+
+
+/* Drops the oldest entries until the rest take no more than max. */
+static void evict( HPACK *h, size_t max )
+{
+	HPACK_ENTRY *e;
+
+	while ( h->count && h->size > max )
+	{
+		e = &h->entry[ ( h->first + --h->count ) % HPACK_ENTRIES ];
+		h->size -= e->name_len + e->value_len + 32;
+		free( e->name );
+		e->name = e->value = NULL;
+	}
+
+	return;
+}
+
+
+static size_t encode_int( unsigned char *out, int prefix, unsigned char first, size_t value )
+{
+	size_t mask = ( 1U << prefix ) - 1, n = 1;
+
+	if ( value < mask )
+	{
+		out[ 0 ] = (unsigned char) ( first | value );
+		return 1;
+	}
+
+	out[ 0 ] = (unsigned char) ( first | mask );
+
+	for ( value -= mask; value >= 0x80; value >>= 7 )
+		out[ n++ ] = (unsigned char) ( value | 0x80 );
+
+	out[ n++ ] = (unsigned char) value;
+
+	return n;
+}
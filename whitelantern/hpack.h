@@ -0,0 +1,60 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* HPACK (RFC 7541), the header compression of HTTP/2. The decoder keeps
+   the dynamic table a connection's requests build up. Responses go out as
+   literals that are never added to the peer's table, so encoding needs no
+   state at all. */
+
+#define HPACK_TABLE		4096	/* dynamic table size, the HTTP/2 default */
+#define HPACK_STRING	8192	/* longest name or value taken, once decoded */
+#define HPACK_ENTRIES	( HPACK_TABLE / 32 )	/* each costs 32 bytes besides its strings */
+
+typedef struct hpack_entry HPACK_ENTRY;
+typedef struct hpack_data HPACK;
+
+struct hpack_entry
+{
+	char *name;			/* one allocation, the value follows the name */
+	char *value;
+	size_t name_len;
+	size_t value_len;
+};
+
+struct hpack_data
+{
+	HPACK_ENTRY entry[ HPACK_ENTRIES ];	/* a ring, newest at first */
+	size_t first;
+	size_t count;
+	size_t size;		/* as RFC 7541 counts it */
+	size_t max;			/* set by the last size update */
+};
+
+/* Called for each field in the order they come. Returns 0 to give up on
+   the block. */
+typedef int HPACK_FIELD( void *data, const char *name, size_t name_len,
+						 const char *value, size_t value_len );
+
+void hpack_init( HPACK *h );
+void hpack_free( HPACK *h );
+int hpack_decode( HPACK *h, const unsigned char *block, size_t length,
+				  HPACK_FIELD *field, void *data );
+size_t hpack_field( unsigned char *out, const char *name, const char *value, size_t value_len );
+
+/* What hpack_field() may write at most */
+#define HPACK_FIELD_MAX( name_len, value_len )	( ( name_len ) + ( value_len ) + 12 )
@@ -0,0 +1,350 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "http.h"
+
+
+#define LOWER( c ) ( ( c ) >= 'A' && ( c ) <= 'Z' ? ( c ) + 'a' - 'A' : ( c ) )
+#define IS_CTL( c ) ( ( c ) < 32 || ( c ) == 127 )
+
+/* Header names are dispatched through a perfect hash over the name's length,
+   first and last character. http_init() fills the table and refuses to run if
+   a newly added name collides, in which case HEADER_HASH needs new factors. */
+#define HEADER_SLOTS 32
+#define HEADER_HASH( len, first, last ) \
+		( ( ( len ) + (size_t) LOWER( first ) + 7 * (size_t) LOWER( last ) ) & ( HEADER_SLOTS - 1 ) )
+
+
+enum ParserState
+{
+	S_METHOD,
+	S_PATH,
+	S_VERSION,
+	S_REQUEST_LF,
+	S_LINE,
+	S_NAME,
+	S_VALUE_LWS,
+	S_VALUE,
+	S_LF,
+	S_END_LF,
+	S_DONE
+};
+
+
+static void header_done( HTTP_REQUEST *req, const unsigned char *buf, size_t vstart, size_t vend );
+
+
+static const char *const header_names[ HTTP_HEADER_COUNT ] =
+{
+	"host",
+	"origin",
+	"upgrade",
+	"connection",
+	"sec-websocket-key1",
+	"sec-websocket-key2",
+	"cookie",
+	"sec-websocket-key",
+	"sec-websocket-version",
+	"sec-websocket-protocol",
+	"accept-encoding",
+	"if-none-match"
+};
+
+/* 0 is an empty slot, otherwise enum HttpHeader + 1 */
+static unsigned char header_slot[ HEADER_SLOTS ];
+
+
+int http_init( void )
+{
+	unsigned int i;
+	size_t len;
+	const char *name;
+
+	memset( header_slot, 0, sizeof( header_slot ) );
+
+	for ( i = 0; i < HTTP_HEADER_COUNT; i++ )
+	{
+		name = header_names[ i ];
+		len = strlen( name );
+
+		if ( header_slot[ HEADER_HASH( len, name[ 0 ], name[ len - 1 ] ) ] )
+			return 0;
+
+		header_slot[ HEADER_HASH( len, name[ 0 ], name[ len - 1 ] ) ]
+			= (unsigned char) ( i + 1 );
+	}
+
+	return 1;
+}
+
+
+void http_reset( HTTP_REQUEST *req )
+{
+	memset( req, 0, sizeof( HTTP_REQUEST ) );
+	req->state = S_METHOD;
+
+	return;
+}
+
+
+enum HttpResult http_parse( HTTP_REQUEST *req, const char *sbuf, size_t len )
+{
+	const unsigned char *buf = (const unsigned char *) sbuf;
+	size_t i;
+	unsigned char c;
+
+	if ( req->state == S_DONE )
+		return HTTP_COMPLETE;
+
+	if ( len > HTTP_MAX_HEAD )
+		len = HTTP_MAX_HEAD;
+
+	for ( i = req->offset; i < len; i++ )
+	{
+		c = buf[ i ];
+
+		switch ( req->state )
+		{
+			case S_METHOD:
+				if ( c == ' ' )
+				{
+					if ( i == req->start )
+						return HTTP_BAD;
+					req->method.offset = (unsigned short) req->start;
+					req->method.length = (unsigned short) ( i - req->start );
+					req->start = i + 1;
+					req->state = S_PATH;
+				}
+				else if ( IS_CTL( c ) )
+					return HTTP_BAD;
+				break;
+
+			case S_PATH:
+				if ( c == ' ' )
+				{
+					if ( i == req->start )
+						return HTTP_BAD;
+					req->path.offset = (unsigned short) req->start;
+					req->path.length = (unsigned short) ( i - req->start );
+					if ( req->query.offset )
+					{
+						req->query.length = (unsigned short) ( i - req->query.offset );
+						req->path.length = (unsigned short) ( req->query.offset - 1 - req->start );
+					}
+					req->start = i + 1;
+					req->state = S_VERSION;
+				}
+				else if ( c == '?' && !req->query.offset )
+					req->query.offset = (unsigned short) ( i + 1 );
+				else if ( IS_CTL( c ) )
+					return HTTP_BAD;
+				break;
+
+			case S_VERSION:
+				if ( c == '\r' )
+				{
+					req->version.offset = (unsigned short) req->start;
+					req->version.length = (unsigned short) ( i - req->start );
+					req->state = S_REQUEST_LF;
+				}
+				else if ( IS_CTL( c ) || c == ' ' )
+					return HTTP_BAD;
+				break;
+
+			case S_REQUEST_LF:
+			case S_LF:
+				if ( c != '\n' )
+					return HTTP_BAD;
+				if ( req->state == S_LF && ++req->headers > HTTP_MAX_HEADERS )
+					return HTTP_BAD;
+				req->state = S_LINE;
+				break;
+
+			case S_LINE:
+				if ( c == '\r' )
+				{
+					req->state = S_END_LF;
+					break;
+				}
+				if ( c == ':' || c == ' ' || c == '\t' || IS_CTL( c ) )
+					return HTTP_BAD;
+				req->start = i;
+				req->state = S_NAME;
+				break;
+
+			case S_NAME:
+				if ( c == ':' )
+				{
+					req->name.offset = (unsigned short) req->start;
+					req->name.length = (unsigned short) ( i - req->start );
+					req->state = S_VALUE_LWS;
+				}
+				else if ( c == ' ' || c == '\t' || IS_CTL( c ) )
+					return HTTP_BAD;
+				break;
+
+			case S_VALUE_LWS:
+				if ( c == ' ' || c == '\t' )
+					break;
+				req->start = i;
+				if ( c == '\r' )
+				{
+					header_done( req, buf, i, i );
+					req->state = S_LF;
+					break;
+				}
+				if ( IS_CTL( c ) )
+					return HTTP_BAD;
+				req->state = S_VALUE;
+				break;
+
+			case S_VALUE:
+				if ( c == '\r' )
+				{
+					header_done( req, buf, req->start, i );
+					req->state = S_LF;
+				}
+				else if ( IS_CTL( c ) && c != '\t' )
+					return HTTP_BAD;
+				break;
+
+			case S_END_LF:
+				if ( c != '\n' )
+					return HTTP_BAD;
+				req->offset = req->end = i + 1;
+				req->state = S_DONE;
+				return HTTP_COMPLETE;
+
+			default:
+				return HTTP_BAD;
+		}
+	}
+
+	req->offset = i;
+
+	return i >= HTTP_MAX_HEAD ? HTTP_BAD : HTTP_MORE;
+}
+
+
+static void header_done( HTTP_REQUEST *req, const unsigned char *buf, size_t vstart, size_t vend )
+{
+	const unsigned char *name = buf + req->name.offset;
+	size_t len = req->name.length;
+	const char *known;
+	unsigned int slot, i;
+
+	slot = header_slot[ HEADER_HASH( len, name[ 0 ], name[ len - 1 ] ) ];
+
+	if ( !slot-- )
+		return;
+
+	known = header_names[ slot ];
+
+	for ( i = 0; i < len; i++ )
+		if ( LOWER( name[ i ] ) != (unsigned char) known[ i ] )
+			return;
+
+	if ( known[ len ] != '\0' || req->field[ slot ].length )
+		return;
+
+	while ( vend > vstart && ( buf[ vend - 1 ] == ' ' || buf[ vend - 1 ] == '\t' ) )
+		vend--;
+
+	req->field[ slot ].offset = (unsigned short) vstart;
+	req->field[ slot ].length = (unsigned short) ( vend - vstart );
+
+	return;
+}
+
+
+int http_equals( const char *buf, const HTTP_FIELD *f, const char *s )
+{
+	size_t i;
+
+	for ( i = 0; i < f->length; i++ )
+		if ( s[ i ] == '\0' || LOWER( buf[ f->offset + i ] ) != LOWER( s[ i ] ) )
+			return 0;
+
+	return s[ i ] == '\0';
+}
+
+
+/* Comma separated list membership, as in "Connection: keep-alive, Upgrade".
+   Parameters after ';', such as q-values, are not looked at. */
+int http_has_token( const char *buf, const HTTP_FIELD *f, const char *token )
+{
+	HTTP_FIELD t;
+	size_t i = f->offset, end = (size_t) f->offset + f->length;
+
+	while ( i < end )
+	{
+		while ( i < end && ( buf[ i ] == ' ' || buf[ i ] == '\t' || buf[ i ] == ',' ) )
+			i++;
+
+		t.offset = (unsigned short) i;
+
+		while ( i < end && buf[ i ] != ',' && buf[ i ] != ';' )
+			i++;
+
+		t.length = (unsigned short) ( i - t.offset );
+
+		while ( i < end && buf[ i ] != ',' )
+			i++;
+
+		while ( t.length && ( buf[ t.offset + t.length - 1 ] == ' '
+						   || buf[ t.offset + t.length - 1 ] == '\t' ) )
+			t.length--;
+
+		if ( t.length && http_equals( buf, &t, token ) )
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* Finds name=value in a list separated by sep, as in a query string (sep
+   '&') or a Cookie header (sep ';'). */
+int http_param( const char *buf, const HTTP_FIELD *f, char sep, const char *name, HTTP_FIELD *value )
+{
+	size_t i = f->offset, end = (size_t) f->offset + f->length, n;
+	size_t nlen = strlen( name );
+
+	while ( i < end )
+	{
+		while ( i < end && ( buf[ i ] == ' ' || buf[ i ] == sep ) )
+			i++;
+
+		for ( n = i; n < end && buf[ n ] != sep; n++ )
+			;
+
+		if ( n - i > nlen && buf[ i + nlen ] == '='
+		  && !strncmp( buf + i, name, nlen ) )
+		{
+			value->offset = (unsigned short) ( i + nlen + 1 );
+			value->length = (unsigned short) ( n - i - nlen - 1 );
+			return 1;
+		}
+
+		i = n;
+	}
+
+	return 0;
+}
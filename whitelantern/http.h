@@ -0,0 +1,80 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* Incremental HTTP request head parser. The parser never modifies the buffer
+   it is given; it only records offsets into it, so the caller may keep on
+   appending to the same buffer between calls. Every byte is looked at once. */
+
+#define HTTP_MAX_HEAD		4096	/* request line and all headers */
+#define HTTP_MAX_HEADERS	32
+
+enum HttpResult
+{
+	HTTP_MORE,		/* need more bytes */
+	HTTP_COMPLETE,	/* saw the empty line ending the head */
+	HTTP_BAD		/* malformed or over limits */
+};
+
+/* Headers we care about. Everything else is tokenized and skipped. */
+enum HttpHeader
+{
+	HTTP_HOST,
+	HTTP_ORIGIN,
+	HTTP_UPGRADE,
+	HTTP_CONNECTION,
+	HTTP_SEC_WEBSOCKET_KEY1,
+	HTTP_SEC_WEBSOCKET_KEY2,
+	HTTP_COOKIE,
+	HTTP_SEC_WEBSOCKET_KEY,
+	HTTP_SEC_WEBSOCKET_VERSION,
+	HTTP_SEC_WEBSOCKET_PROTOCOL,
+	HTTP_ACCEPT_ENCODING,
+	HTTP_IF_NONE_MATCH,
+	HTTP_HEADER_COUNT
+};
+
+typedef struct http_field_data HTTP_FIELD;
+typedef struct http_request_data HTTP_REQUEST;
+
+struct http_field_data
+{
+	unsigned short offset;
+	unsigned short length;
+};
+
+struct http_request_data
+{
+	int state;
+	size_t offset;		/* next byte to look at */
+	size_t start;		/* start of the token being scanned */
+	size_t end;			/* offset just past the empty line, once complete */
+	unsigned int headers;
+	HTTP_FIELD name;	/* header name on the current line */
+	HTTP_FIELD method;
+	HTTP_FIELD path;	/* without the query */
+	HTTP_FIELD query;	/* after '?' */
+	HTTP_FIELD version;
+	HTTP_FIELD field[ HTTP_HEADER_COUNT ];
+};
+
+int http_init( void );
+void http_reset( HTTP_REQUEST *req );
+enum HttpResult http_parse( HTTP_REQUEST *req, const char *buf, size_t len );
+int http_equals( const char *buf, const HTTP_FIELD *f, const char *s );
+int http_has_token( const char *buf, const HTTP_FIELD *f, const char *token );
+int http_param( const char *buf, const HTTP_FIELD *f, char sep, const char *name, HTTP_FIELD *value );
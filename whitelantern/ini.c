@@ -37,8 +37,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "ini.h"
 
-#define MAX_LINE 200
-#define MAX_SECTION 50
+#define MAX_LINE 1024
+#define MAX_SECTION 256
 #define MAX_NAME 50
 
 /* Strip whitespace chars off end of given string, in place. Return s. */
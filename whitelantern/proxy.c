@@ -0,0 +1,208 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "proxy.h"
+
+
+static int address( const struct sockaddr *sa, char *out, unsigned int *port );
+static int parse_v1( const char *in, size_t len, struct sockaddr_in6 *src, struct sockaddr_in6 *dst );
+static int parse_v2( const unsigned char *in, size_t len, struct sockaddr_in6 *src,
+					 struct sockaddr_in6 *dst );
+static int v1_address( const char *text, unsigned int port, struct sockaddr_in6 *out );
+
+
+static const char v2_signature[] = "\r\n\r\n\0\r\nQUIT\n";	/* 12 bytes */
+
+
+/* Writes the header for a connection from src to dst, which are local
+   addresses as seen by the proxy, to out. Anything but a pair of the same
+   family comes out as UNKNOWN, which the server takes to mean "use the
+   connection's own addresses". Returns the length. */
+size_t proxy_v1( char *out, const struct sockaddr *src, const struct sockaddr *dst )
+{
+	char from[ INET6_ADDRSTRLEN ], to[ INET6_ADDRSTRLEN ];
+	unsigned int from_port, to_port;
+	int family = address( src, from, &from_port );
+
+	if ( !family || family != address( dst, to, &to_port ) )
+		return (size_t) sprintf( out, "PROXY UNKNOWN\r\n" );
+
+	return (size_t) sprintf( out, "PROXY %s %s %s %u %u\r\n",
+							 family == AF_INET ? "TCP4" : "TCP6",
+							 from, to, from_port, to_port );
+}
+
+
+/* Reads a header of either version off the front of in, the first len bytes
+   of the connection. IPv4 addresses come out mapped into IPv6. For LOCAL,
+   UNKNOWN and anything but TCP, src and dst get AF_UNSPEC: the connection
+   is the balancer's own, or says nothing useful. Returns the length of the
+   header, 0 if more of it is needed, or -1 if in does not start with one. */
+int proxy_parse( const char *in, size_t len, struct sockaddr_in6 *src, struct sockaddr_in6 *dst )
+{
+	size_t n = len < 12 ? len : 12;
+
+	memset( src, 0, sizeof( *src ) );
+	memset( dst, 0, sizeof( *dst ) );
+	src->sin6_family = dst->sin6_family = AF_UNSPEC;
+
+	if ( !memcmp( in, v2_signature, n ) )
+		return parse_v2( (const unsigned char *) in, len, src, dst );
+
+	n = len < 6 ? len : 6;
+
+	if ( !memcmp( in, "PROXY ", n ) )
+		return parse_v1( in, len, src, dst );
+
+	return -1;
+}
+
+
+/* "PROXY TCP4 192.0.2.7 198.51.100.1 51234 4000\r\n", or UNKNOWN with
+   anything after it. */
+static int parse_v1( const char *in, size_t len, struct sockaddr_in6 *src, struct sockaddr_in6 *dst )
+{
+	char line[ PROXY_V1_MAX ], proto[ 8 ], from[ 46 ], to[ 46 ];
+	unsigned int from_port, to_port;
+	const char *end;
+	size_t i;
+
+	for ( end = NULL, i = 0; i < len && i < PROXY_V1_MAX; i++ )
+		if ( in[ i ] == '\n' )
+		{
+			end = in + i;
+			break;
+		}
+
+	if ( !end )
+		return len < PROXY_V1_MAX ? 0 : -1;
+
+	if ( end == in || end[ -1 ] != '\r' )
+		return -1;
+
+	memcpy( line, in, (size_t) ( end - in ) - 1 );
+	line[ end - in - 1 ] = '\0';
+
+	if ( !strncmp( line, "PROXY UNKNOWN", 13 ) )
+		return (int) ( end - in ) + 1;
+
+	if ( sscanf( line, "PROXY %7s %45s %45s %u %u", proto, from, to, &from_port, &to_port ) != 5
+	  || ( strcmp( proto, "TCP4" ) && strcmp( proto, "TCP6" ) )
+	  || !v1_address( from, from_port, src ) || !v1_address( to, to_port, dst ) )
+		return -1;
+
+	return (int) ( end - in ) + 1;
+}
+
+
+static int v1_address( const char *text, unsigned int port, struct sockaddr_in6 *out )
+{
+	struct in_addr in4;
+
+	if ( port > 65535 )
+		return 0;
+
+	out->sin6_family = AF_INET6;
+	out->sin6_port = htons( (uint16_t) port );
+
+	if ( inet_pton( AF_INET6, text, &out->sin6_addr ) == 1 )
+		return 1;
+
+	if ( inet_pton( AF_INET, text, &in4 ) != 1 )
+		return 0;
+
+	out->sin6_addr.s6_addr[ 10 ] = out->sin6_addr.s6_addr[ 11 ] = 0xFF;
+	memcpy( out->sin6_addr.s6_addr + 12, &in4, 4 );
+
+	return 1;
+}
+
+
+/* The signature, version and command, family and protocol, the length of
+   what follows, then the addresses and any TLVs, which we skip. */
+static int parse_v2( const unsigned char *in, size_t len, struct sockaddr_in6 *src,
+					 struct sockaddr_in6 *dst )
+{
+	size_t length;
+
+	if ( len < 16 )
+		return len > 12 && ( in[ 12 ] & 0xF0 ) != 0x20 ? -1 : 0;
+
+	length = 16 + ( (size_t) in[ 14 ] << 8 | in[ 15 ] );
+
+	if ( ( in[ 12 ] & 0xF0 ) != 0x20 || ( in[ 12 ] & 0x0F ) > 1 || length > PROXY_MAX )
+		return -1;
+
+	if ( len < length )
+		return 0;
+
+	/* LOCAL: the balancer checking on us. */
+	if ( ( in[ 12 ] & 0x0F ) == 0 )
+		return (int) length;
+
+	if ( in[ 13 ] == 0x11 && length >= 16 + 12 )
+	{
+		src->sin6_family = dst->sin6_family = AF_INET6;
+		src->sin6_addr.s6_addr[ 10 ] = src->sin6_addr.s6_addr[ 11 ] = 0xFF;
+		dst->sin6_addr.s6_addr[ 10 ] = dst->sin6_addr.s6_addr[ 11 ] = 0xFF;
+		memcpy( src->sin6_addr.s6_addr + 12, in + 16, 4 );
+		memcpy( dst->sin6_addr.s6_addr + 12, in + 20, 4 );
+		memcpy( &src->sin6_port, in + 24, 2 );
+		memcpy( &dst->sin6_port, in + 26, 2 );
+	}
+	else if ( in[ 13 ] == 0x21 && length >= 16 + 36 )
+	{
+		src->sin6_family = dst->sin6_family = AF_INET6;
+		memcpy( &src->sin6_addr, in + 16, 16 );
+		memcpy( &dst->sin6_addr, in + 32, 16 );
+		memcpy( &src->sin6_port, in + 48, 2 );
+		memcpy( &dst->sin6_port, in + 50, 2 );
+	}
+
+	return (int) length;
+}
+
+
+/* IPv4 clients of an IPv6 socket are told apart as TCP4. Returns the
+   family, or 0 for one the protocol has no word for. */
+static int address( const struct sockaddr *sa, char *out, unsigned int *port )
+{
+	const struct sockaddr_in *in4 = (const struct sockaddr_in *) sa;
+	const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) sa;
+
+	if ( sa->sa_family == AF_INET )
+	{
+		*port = ntohs( in4->sin_port );
+		return inet_ntop( AF_INET, &in4->sin_addr, out, INET6_ADDRSTRLEN ) ? AF_INET : 0;
+	}
+
+	if ( sa->sa_family != AF_INET6 )
+		return 0;
+
+	*port = ntohs( in6->sin6_port );
+
+	if ( IN6_IS_ADDR_V4MAPPED( &in6->sin6_addr ) )
+		return inet_ntop( AF_INET, in6->sin6_addr.s6_addr + 12, out, INET6_ADDRSTRLEN ) ? AF_INET : 0;
+
+	return inet_ntop( AF_INET6, &in6->sin6_addr, out, INET6_ADDRSTRLEN ) ? AF_INET6 : 0;
+}
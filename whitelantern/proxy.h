@@ -0,0 +1,28 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* The PROXY protocol (HAProxy), which tells a server behind a proxy where
+   a connection really came from. Version 1 is one line of text ahead of
+   everything else on the stream, version 2 the same in binary. We send
+   version 1 to games and take either from a balancer in front of us. */
+
+#define PROXY_V1_MAX	108		/* longest header, CRLF included */
+#define PROXY_MAX		512		/* longest v2 header we take, TLVs included */
+
+size_t proxy_v1( char *out, const struct sockaddr *src, const struct sockaddr *dst );
+int proxy_parse( const char *in, size_t len, struct sockaddr_in6 *src, struct sockaddr_in6 *dst );
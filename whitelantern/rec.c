@@ -0,0 +1,275 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#if defined( RECORD )
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "timer.h"
+#include "rec.h"
+
+
+/* Worst case for deflating a block, with room to spare */
+#define PACKED_MAX ( REC_BLOCK + REC_BLOCK / 8 + 64 )
+
+
+struct rec_reader_data
+{
+	FILE *file;
+	size_t used;
+	size_t length;
+	unsigned char block[ REC_BLOCK ];
+};
+
+
+static int flush_block( RECORDER *r );
+static void put32( unsigned char *p, unsigned long int v );
+static unsigned long int get32( const unsigned char *p );
+
+
+/* One buffer for deflating, as only one block is ever being written */
+static unsigned char packed[ 8 + PACKED_MAX ];
+static unsigned long int files_opened;
+
+
+/* Creates the file for a connection accepted just now. Returns NULL with
+   errno set if it cannot. */
+RECORDER *rec_open( const char *dir, const char *host )
+{
+	RECORDER *r;
+	struct timeval tv;
+	char name[ 1024 ], accept[ 96 ];
+	int fd;
+
+	gettimeofday( &tv, NULL );
+
+	if ( strlen( dir ) > sizeof( name ) - 80 )
+	{
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	sprintf( name, "%s/%lu-%lu-%lu.wlr", dir, (unsigned long int) tv.tv_sec,
+			 (unsigned long int) getpid( ), ++files_opened );
+
+	if ( ( fd = open( name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0640 ) ) < 0 )
+		return NULL;
+
+	if ( write( fd, "WLR1", 4 ) != 4 )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	r = malloc( sizeof( RECORDER ) );
+	r->fd = fd;
+	r->started = timer_now( );
+	r->used = 0;
+
+	sprintf( accept, "%lu%03lu %.40s", (unsigned long int) tv.tv_sec,
+			 (unsigned long int) tv.tv_usec / 1000, host );
+	rec_write( r, REC_ACCEPT, accept, strlen( accept ) );
+
+	return r;
+}
+
+
+/* Returns 0 if the file could not be written; the recorder should then be
+   closed. */
+int rec_write( RECORDER *r, int kind, const char *data, size_t length )
+{
+	unsigned char *p;
+	size_t part;
+
+	/* A long read becomes several records of the same kind and time. */
+	do
+	{
+		part = length > REC_BLOCK - REC_HEAD ? REC_BLOCK - REC_HEAD : length;
+
+		if ( r->used + REC_HEAD + part > REC_BLOCK && !flush_block( r ) )
+			return 0;
+
+		p = r->block + r->used;
+		put32( p, timer_now( ) - r->started );
+		p[ 4 ] = (unsigned char) kind;
+		p[ 5 ] = (unsigned char) ( part >> 8 );
+		p[ 6 ] = (unsigned char) part;
+		memcpy( p + REC_HEAD, data, part );
+		r->used += REC_HEAD + part;
+		data += part;
+		length -= part;
+	}
+	while ( length );
+
+	return 1;
+}
+
+
+/* Writes what is left and lets go of the file. Returns 0 if that failed. */
+int rec_close( RECORDER *r )
+{
+	int ok;
+
+	if ( !r )
+		return 1;
+
+	ok = rec_write( r, REC_END, "", 0 ) && flush_block( r );
+	close( r->fd );
+	free( r );
+
+	return ok;
+}
+
+
+REC_READER *rec_reader( const char *file )
+{
+	REC_READER *r;
+	char magic[ 4 ];
+	FILE *f;
+
+	if ( !( f = fopen( file, "rb" ) ) )
+		return NULL;
+
+	if ( fread( magic, 4, 1, f ) != 1 || memcmp( magic, "WLR1", 4 ) )
+	{
+		fclose( f );
+		errno = EINVAL;
+		return NULL;
+	}
+
+	r = malloc( sizeof( REC_READER ) );
+	r->file = f;
+	r->used = r->length = 0;
+
+	return r;
+}
+
+
+/* Returns 1 with the next record, whose data stays good until the next
+   call, 0 at the end of the file and -1 if the file is damaged. */
+int rec_next( REC_READER *r, REC_RECORD *record )
+{
+	const unsigned char *p;
+	unsigned long int raw, size;
+	uLongf length;
+
+	while ( r->used == r->length )
+	{
+		if ( fread( packed, 8, 1, r->file ) != 1 )
+			return 0;
+
+		raw = get32( packed );
+		size = get32( packed + 4 );
+		length = REC_BLOCK;
+
+		if ( raw > REC_BLOCK || size > PACKED_MAX
+		  || fread( packed + 8, size, 1, r->file ) != 1
+		  || uncompress( r->block, &length, packed + 8, size ) != Z_OK
+		  || length != raw )
+			return -1;
+
+		r->used = 0;
+		r->length = length;
+	}
+
+	p = r->block + r->used;
+
+	if ( r->length - r->used < REC_HEAD
+	  || r->length - r->used - REC_HEAD < ( (size_t) p[ 5 ] << 8 | p[ 6 ] ) )
+		return -1;
+
+	record->time = get32( p );
+	record->kind = p[ 4 ];
+	record->length = (size_t) p[ 5 ] << 8 | p[ 6 ];
+	record->data = (const char *) p + REC_HEAD;
+	r->used += REC_HEAD + record->length;
+
+	return 1;
+}
+
+
+void rec_reader_close( REC_READER *r )
+{
+	fclose( r->file );
+	free( r );
+
+	return;
+}
+
+
+static int flush_block( RECORDER *r )
+{
+	uLongf length = PACKED_MAX;
+	size_t done;
+	ssize_t w;
+
+	if ( !r->used )
+		return 1;
+
+	if ( compress2( packed + 8, &length, r->block, r->used, Z_BEST_SPEED ) != Z_OK )
+		return 0;
+
+	put32( packed, r->used );
+	put32( packed + 4, length );
+	r->used = 0;
+
+	for ( done = 0; done < 8 + length; done += (size_t) w )
+	{
+		if ( ( w = write( r->fd, packed + done, 8 + length - done ) ) >= 0 )
+			continue;
+
+		if ( errno != EINTR )
+			return 0;
+
+		w = 0;
+	}
+
+	return 1;
+}
+
+
+static void put32( unsigned char *p, unsigned long int v )
+{
+	p[ 0 ] = (unsigned char) ( v >> 24 );
+	p[ 1 ] = (unsigned char) ( v >> 16 );
+	p[ 2 ] = (unsigned char) ( v >> 8 );
+	p[ 3 ] = (unsigned char) v;
+
+	return;
+}
+
+
+static unsigned long int get32( const unsigned char *p )
+{
+	return (unsigned long int) p[ 0 ] << 24 | (unsigned long int) p[ 1 ] << 16
+		 | (unsigned long int) p[ 2 ] << 8 | p[ 3 ];
+}
+
+#else
+
+/* ISO C does not allow an empty translation unit. */
+extern int rec_disabled;
+
+#endif
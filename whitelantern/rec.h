@@ -0,0 +1,69 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* Session recording, compiled in with -DRECORD ("make record"). What the
+   client and the game send the proxy is kept, with the time it arrived, in
+   one append-only file per connection, for wlreplay to play back. Records
+   are gathered in a block and the block is deflated when it fills, so the
+   main loop pays for one write() per REC_BLOCK bytes of traffic.
+
+   A file is "WLR1" followed by blocks: the raw length and the packed length
+   (4 bytes each, big-endian), then the deflated records. A record is the
+   time in milliseconds since the connection was accepted (4 bytes), its
+   kind (1), the length of its data (2) and the data. */
+
+#define REC_BLOCK		32768
+#define REC_HEAD		7
+
+enum RecKind
+{
+	REC_ACCEPT = 'A',	/* "<wall clock ms> <host>" */
+	REC_CLIENT = 'C',	/* bytes from the client */
+	REC_SERVER = 'S',	/* bytes from the game */
+	REC_GAME   = 'G',	/* connected to the game; the entry key, or host for -mh */
+	REC_END    = 'E'
+};
+
+typedef struct recorder_data RECORDER;
+typedef struct rec_reader_data REC_READER;
+typedef struct rec_record_data REC_RECORD;
+
+struct recorder_data
+{
+	int fd;
+	unsigned long int started;	/* timer_now() */
+	size_t used;
+	unsigned char block[ REC_BLOCK ];
+};
+
+struct rec_record_data
+{
+	unsigned long int time;
+	int kind;
+	size_t length;
+	const char *data;
+};
+
+#if defined( RECORD )
+RECORDER *rec_open( const char *dir, const char *host );
+int rec_write( RECORDER *r, int kind, const char *data, size_t length );
+int rec_close( RECORDER *r );
+REC_READER *rec_reader( const char *file );
+int rec_next( REC_READER *r, REC_RECORD *record );
+void rec_reader_close( REC_READER *r );
+#endif
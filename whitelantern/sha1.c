@@ -0,0 +1,155 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "sha1.h"
+
+
+#define ROL( x, n ) ( ( ( x ) << ( n ) ) | ( ( x ) >> ( 32 - ( n ) ) ) )
+
+
+static void transform( uint32_t state[ 5 ], const unsigned char block[ 64 ] );
+
+
+void sha1_init( SHA1_CTX *ctx )
+{
+	ctx->state[ 0 ] = 0x67452301UL;
+	ctx->state[ 1 ] = 0xEFCDAB89UL;
+	ctx->state[ 2 ] = 0x98BADCFEUL;
+	ctx->state[ 3 ] = 0x10325476UL;
+	ctx->state[ 4 ] = 0xC3D2E1F0UL;
+	ctx->count[ 0 ] = ctx->count[ 1 ] = 0;
+
+	return;
+}
+
+
+void sha1_update( SHA1_CTX *ctx, const void *data, size_t length )
+{
+	const unsigned char *p = data;
+	size_t used = ( ctx->count[ 0 ] >> 3 ) & 63, chunk;
+	uint32_t bits = (uint32_t) ( length << 3 );
+
+	if ( ( ctx->count[ 0 ] += bits ) < bits )
+		ctx->count[ 1 ]++;
+	ctx->count[ 1 ] += (uint32_t) ( length >> 29 );
+
+	while ( length )
+	{
+		chunk = 64 - used < length ? 64 - used : length;
+		memcpy( ctx->buffer + used, p, chunk );
+		used += chunk;
+		p += chunk;
+		length -= chunk;
+
+		if ( used == 64 )
+		{
+			transform( ctx->state, ctx->buffer );
+			used = 0;
+		}
+	}
+
+	return;
+}
+
+
+void sha1_final( SHA1_CTX *ctx, unsigned char digest[ SHA1_DIGEST_LENGTH ] )
+{
+	unsigned char length[ 8 ];
+	int i;
+
+	for ( i = 0; i < 4; i++ )
+	{
+		length[ i ] = (unsigned char) ( ctx->count[ 1 ] >> ( 24 - 8 * i ) );
+		length[ i + 4 ] = (unsigned char) ( ctx->count[ 0 ] >> ( 24 - 8 * i ) );
+	}
+
+	sha1_update( ctx, "\x80", 1 );
+
+	while ( ( ( ctx->count[ 0 ] >> 3 ) & 63 ) != 56 )
+		sha1_update( ctx, "", 1 );
+
+	sha1_update( ctx, length, 8 );
+
+	for ( i = 0; i < SHA1_DIGEST_LENGTH; i++ )
+		digest[ i ] = (unsigned char) ( ctx->state[ i >> 2 ] >> ( 24 - 8 * ( i & 3 ) ) );
+
+	memset( ctx, 0, sizeof( SHA1_CTX ) );
+
+	return;
+}
+
+
+static void transform( uint32_t state[ 5 ], const unsigned char block[ 64 ] )
+{
+	uint32_t w[ 80 ], a, b, c, d, e, f, k, t;
+	int i;
+
+	for ( i = 0; i < 16; i++ )
+		w[ i ] = (uint32_t) block[ 4 * i ] << 24 | (uint32_t) block[ 4 * i + 1 ] << 16
+			   | (uint32_t) block[ 4 * i + 2 ] << 8 | (uint32_t) block[ 4 * i + 3 ];
+
+	for ( ; i < 80; i++ )
+		w[ i ] = ROL( w[ i - 3 ] ^ w[ i - 8 ] ^ w[ i - 14 ] ^ w[ i - 16 ], 1 );
+
+	a = state[ 0 ];
+	b = state[ 1 ];
+	c = state[ 2 ];
+	d = state[ 3 ];
+	e = state[ 4 ];
+
+	for ( i = 0; i < 80; i++ )
+	{
+		if ( i < 20 )
+		{
+			f = ( b & c ) | ( ~b & d );
+			k = 0x5A827999UL;
+		}
+		else if ( i < 40 )
+		{
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1UL;
+		}
+		else if ( i < 60 )
+		{
+			f = ( b & c ) | ( b & d ) | ( c & d );
+			k = 0x8F1BBCDCUL;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6UL;
+		}
+
+		t = ROL( a, 5 ) + f + e + k + w[ i ];
+		e = d;
+		d = c;
+		c = ROL( b, 30 );
+		b = a;
+		a = t;
+	}
+
+	state[ 0 ] += a;
+	state[ 1 ] += b;
+	state[ 2 ] += c;
+	state[ 3 ] += d;
+	state[ 4 ] += e;
+
+	return;
+}
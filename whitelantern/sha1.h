@@ -0,0 +1,37 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* SHA-1 (FIPS 180-4), which RFC 6455 uses for Sec-WebSocket-Accept. It is
+   no good for anything that needs to be secure, and nothing here does. */
+
+#include <stdint.h>
+
+#define SHA1_DIGEST_LENGTH	20
+
+typedef struct sha1_data SHA1_CTX;
+
+struct sha1_data
+{
+	uint32_t state[ 5 ];
+	uint32_t count[ 2 ];	/* bits, low word first */
+	unsigned char buffer[ 64 ];
+};
+
+void sha1_init( SHA1_CTX *ctx );
+void sha1_update( SHA1_CTX *ctx, const void *data, size_t length );
+void sha1_final( SHA1_CTX *ctx, unsigned char digest[ SHA1_DIGEST_LENGTH ] );
@@ -0,0 +1,209 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stddef.h>
+#include <time.h>
+#include "timer.h"
+
+
+#define WHEEL_MASK ( TIMER_WHEEL_SIZE - 1 )
+#define MAX_TICKS ( ( 1UL << ( TIMER_LEVELS * TIMER_WHEEL_BITS ) ) - 1 )
+
+
+static void internal_add( TIMER *t );
+static unsigned int cascade( int level );
+
+
+/* Slot heads are sentinels of circular lists; an unarmed timer has next NULL */
+static TIMER wheel[ TIMER_LEVELS ][ TIMER_WHEEL_SIZE ];
+static unsigned long int jiffies;	/* next tick to process */
+static unsigned long int base;		/* timer_now() at tick 0 */
+static unsigned long int pending;
+
+
+void timer_init( void )
+{
+	int level, i;
+
+	for ( level = 0; level < TIMER_LEVELS; level++ )
+		for ( i = 0; i < TIMER_WHEEL_SIZE; i++ )
+			wheel[ level ][ i ].next = wheel[ level ][ i ].prev = &wheel[ level ][ i ];
+
+	base = timer_now( );
+	jiffies = 0;
+	pending = 0;
+
+	return;
+}
+
+
+unsigned long int timer_now( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return (unsigned long int) ts.tv_sec * 1000UL
+		 + (unsigned long int) ts.tv_nsec / 1000000UL;
+}
+
+
+void timer_set( TIMER *t, unsigned long int msec, void ( *expire )( void *data ), void *data )
+{
+	unsigned long int ticks = ( msec + TIMER_TICK - 1 ) / TIMER_TICK;
+
+	timer_cancel( t );
+
+	if ( ticks > MAX_TICKS )
+		ticks = MAX_TICKS;
+
+	/* Time spent since the last timer_run() counts towards this timeout. */
+	t->expires = ( timer_now( ) - base ) / TIMER_TICK + ( ticks ? ticks : 1 );
+	t->expire = expire;
+	t->data = data;
+	internal_add( t );
+	pending++;
+
+	return;
+}
+
+
+void timer_cancel( TIMER *t )
+{
+	if ( !t->next )
+		return;
+
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	pending--;
+
+	return;
+}
+
+
+int timer_pending( const TIMER *t )
+{
+	return t->next != NULL;
+}
+
+
+static void internal_add( TIMER *t )
+{
+	unsigned long int delta;
+	TIMER *head;
+	int level;
+
+	if ( t->expires < jiffies )
+		t->expires = jiffies;
+
+	delta = t->expires - jiffies;
+
+	if ( delta > MAX_TICKS )
+		t->expires = jiffies + ( delta = MAX_TICKS );
+
+	for ( level = 0; level < TIMER_LEVELS - 1; level++ )
+		if ( delta < 1UL << ( ( level + 1 ) * TIMER_WHEEL_BITS ) )
+			break;
+
+	head = &wheel[ level ][ ( t->expires >> ( level * TIMER_WHEEL_BITS ) ) & WHEEL_MASK ];
+
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+
+	return;
+}
+
+
+/* Move everything from the current slot of a higher level down the wheel.
+   Returns the slot index so the caller knows whether to cascade further. */
+static unsigned int cascade( int level )
+{
+	unsigned int idx = ( jiffies >> ( level * TIMER_WHEEL_BITS ) ) & WHEEL_MASK;
+	TIMER *head = &wheel[ level ][ idx ];
+	TIMER *t, *next;
+
+	t = head->next;
+	head->next = head->prev = head;
+
+	for ( ; t != head; t = next )
+	{
+		next = t->next;
+		internal_add( t );
+	}
+
+	return idx;
+}
+
+
+void timer_run( void )
+{
+	unsigned long int now = ( timer_now( ) - base ) / TIMER_TICK;
+	unsigned int idx;
+	int level;
+	TIMER *head, *t;
+
+	while ( jiffies <= now )
+	{
+		idx = jiffies & WHEEL_MASK;
+
+		if ( !idx )
+			for ( level = 1; level < TIMER_LEVELS && !cascade( level ); level++ )
+				;
+
+		jiffies++;
+		head = &wheel[ 0 ][ idx ];
+
+		/* The callback may arm or cancel any timer, this one included. */
+		while ( ( t = head->next ) != head )
+		{
+			timer_cancel( t );
+			t->expire( t->data );
+		}
+	}
+
+	return;
+}
+
+
+/* Milliseconds until timer_run() has something to do, or -1 if nothing is
+   armed. Looks at no more than one turn of the lowest level. */
+long int timer_next( void )
+{
+	unsigned long int i, now;
+	long int msec;
+
+	if ( !pending )
+		return -1;
+
+	for ( i = 0; i < TIMER_WHEEL_SIZE; i++ )
+		if ( wheel[ 0 ][ ( jiffies + i ) & WHEEL_MASK ].next
+		  != &wheel[ 0 ][ ( jiffies + i ) & WHEEL_MASK ] )
+			break;
+
+	/* Nothing on the lowest level: wake up for the next cascade. */
+	if ( i == TIMER_WHEEL_SIZE )
+		i = ( TIMER_WHEEL_SIZE - ( jiffies & WHEEL_MASK ) ) & WHEEL_MASK;
+
+	now = timer_now( ) - base;
+	msec = (long int) ( ( jiffies + i ) * TIMER_TICK ) - (long int) now;
+
+	return msec > 0 ? msec : 0;
+}
@@ -0,0 +1,46 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* Hierarchical timer wheel on the monotonic clock. Timers are embedded in
+   the structures that own them, so arming and cancelling never allocates and
+   costs O(1). Four levels of 64 slots at 10 ms per tick cover about 46 hours;
+   longer timeouts are clamped to that. */
+
+#define TIMER_TICK			10		/* milliseconds */
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE	( 1 << TIMER_WHEEL_BITS )
+#define TIMER_LEVELS		4
+
+typedef struct timer_data TIMER;
+
+struct timer_data
+{
+	TIMER *next;
+	TIMER *prev;
+	unsigned long int expires;	/* in ticks */
+	void ( *expire )( void *data );
+	void *data;
+};
+
+void timer_init( void );
+unsigned long int timer_now( void );
+void timer_set( TIMER *t, unsigned long int msec, void ( *expire )( void *data ), void *data );
+void timer_cancel( TIMER *t );
+int timer_pending( const TIMER *t );
+void timer_run( void );
+long int timer_next( void );
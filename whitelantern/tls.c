@@ -0,0 +1,250 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#if defined( TLS )
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <openssl/err.h>
+#include "log.h"
+#include "tls.h"
+
+
+static int select_alpn( SSL *ssl, const unsigned char **out, unsigned char *outlen,
+						const unsigned char *in, unsigned int inlen, void *arg );
+static void log_errors( const char *what );
+
+
+SSL_CTX *tls_init( const char *cert, const char *key )
+{
+	SSL_CTX *ctx = SSL_CTX_new( TLS_server_method( ) );
+
+	if ( !ctx )
+	{
+		log_errors( "tls_init: SSL_CTX_new" );
+		return NULL;
+	}
+
+	SSL_CTX_set_min_proto_version( ctx, TLS1_2_VERSION );
+
+	/* empty_buffer() moves what is left to the front of the buffer after a
+	   short write, so the retry comes from a different address. */
+	SSL_CTX_set_mode( ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+						 | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+						 | SSL_MODE_RELEASE_BUFFERS );
+	SSL_CTX_set_options( ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION );
+	SSL_CTX_set_alpn_select_cb( ctx, select_alpn, NULL );
+
+#if defined( SSL_OP_IGNORE_UNEXPECTED_EOF )
+	/* A player closing the browser tab is not worth an error in the log. */
+	SSL_CTX_set_options( ctx, SSL_OP_IGNORE_UNEXPECTED_EOF );
+#endif
+
+	if ( SSL_CTX_use_certificate_chain_file( ctx, cert ) != 1
+	  || SSL_CTX_use_PrivateKey_file( ctx, key, SSL_FILETYPE_PEM ) != 1
+	  || SSL_CTX_check_private_key( ctx ) != 1 )
+	{
+		log_errors( "tls_init" );
+		SSL_CTX_free( ctx );
+		return NULL;
+	}
+
+	return ctx;
+}
+
+
+SSL *tls_new( SSL_CTX *ctx, int fd )
+{
+	SSL *ssl = SSL_new( ctx );
+
+	if ( !ssl )
+	{
+		log_errors( "tls_new: SSL_new" );
+		return NULL;
+	}
+
+	SSL_set_fd( ssl, fd );
+	SSL_set_accept_state( ssl );
+
+	return ssl;
+}
+
+
+enum TlsResult tls_accept( SSL *ssl )
+{
+	int r;
+
+	ERR_clear_error( );
+
+	if ( ( r = SSL_accept( ssl ) ) == 1 )
+		return TLS_DONE;
+
+	switch ( SSL_get_error( ssl, r ) )
+	{
+		case SSL_ERROR_WANT_READ:
+			return TLS_WANT_READ;
+
+		case SSL_ERROR_WANT_WRITE:
+			return TLS_WANT_WRITE;
+
+		default:
+			log_errors( "tls_accept" );
+			return TLS_ERROR;
+	}
+}
+
+
+/* Which directions the kernel took over, as TLS_KTLS_* bits */
+int tls_ktls( SSL *ssl )
+{
+	int bits = 0;
+
+	if ( BIO_get_ktls_send( SSL_get_wbio( ssl ) ) )
+		bits |= TLS_KTLS_SEND;
+
+	if ( BIO_get_ktls_recv( SSL_get_rbio( ssl ) ) )
+		bits |= TLS_KTLS_RECV;
+
+	return bits;
+}
+
+
+/* Behaves like read(2): 0 at the end of the stream, -1 with errno set to
+   EAGAIN when the socket has nothing for us yet. */
+ssize_t tls_read( SSL *ssl, void *buf, size_t len )
+{
+	int r;
+
+	if ( !len )
+		return 0;
+
+	ERR_clear_error( );
+
+	if ( ( r = SSL_read( ssl, buf, len > INT_MAX ? INT_MAX : (int) len ) ) > 0 )
+		return r;
+
+	switch ( SSL_get_error( ssl, r ) )
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+
+		case SSL_ERROR_SYSCALL:
+			if ( errno )
+				return -1;
+			return 0;
+
+		default:
+			log_errors( "tls_read" );
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+
+ssize_t tls_write( SSL *ssl, const void *buf, size_t len )
+{
+	int r;
+
+	if ( !len )
+		return 0;
+
+	ERR_clear_error( );
+
+	if ( ( r = SSL_write( ssl, buf, len > INT_MAX ? INT_MAX : (int) len ) ) > 0 )
+		return r;
+
+	switch ( SSL_get_error( ssl, r ) )
+	{
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+
+		case SSL_ERROR_SYSCALL:
+			if ( !errno )
+				errno = EPIPE;
+			return -1;
+
+		default:
+			log_errors( "tls_write" );
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+
+/* Sends close_notify if the socket takes it right away, then lets go. */
+void tls_close( SSL *ssl )
+{
+	if ( SSL_is_init_finished( ssl ) )
+		SSL_shutdown( ssl );
+
+	SSL_free( ssl );
+
+	return;
+}
+
+
+/* Browsers that can get HTTP/2 (h2.h), and clients that ask for nothing
+   get no answer and speak whatever they speak. */
+static int select_alpn( SSL *ssl, const unsigned char **out, unsigned char *outlen,
+						const unsigned char *in, unsigned int inlen, void *arg )
+{
+	static const unsigned char ours[] = "\x02h2\x08http/1.1";
+	unsigned char *chosen;
+
+	(void) ssl;
+	(void) arg;
+
+	if ( SSL_select_next_proto( &chosen, outlen, ours, sizeof( ours ) - 1, in, inlen )
+		 != OPENSSL_NPN_NEGOTIATED )
+		return SSL_TLSEXT_ERR_NOACK;
+
+	*out = chosen;
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
+
+static void log_errors( const char *what )
+{
+	unsigned long int e;
+	char buf[ 256 ];
+
+	while ( ( e = ERR_get_error( ) ) != 0 )
+	{
+		ERR_error_string_n( e, buf, sizeof( buf ) );
+		wraplog( "%s: %s", what, buf );
+	}
+
+	return;
+}
+
+#else
+
+/* ISO C does not allow an empty translation unit. */
+extern int tls_disabled;
+
+#endif
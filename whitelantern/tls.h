@@ -0,0 +1,46 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* TLS termination on top of OpenSSL, compiled in with -DTLS ("make tls").
+   The handshake runs in user space on the non-blocking socket; when the
+   kernel and OpenSSL agree on the cipher, record encryption is then handed
+   to kernel TLS, and reads and writes on the session cost no more than
+   they do in plaintext. */
+
+#if defined( TLS )
+# include <openssl/ssl.h>
+
+enum TlsResult
+{
+	TLS_DONE,
+	TLS_WANT_READ,
+	TLS_WANT_WRITE,
+	TLS_ERROR
+};
+
+#define TLS_KTLS_SEND	1
+#define TLS_KTLS_RECV	2
+
+SSL_CTX *tls_init( const char *cert, const char *key );
+SSL *tls_new( SSL_CTX *ctx, int fd );
+enum TlsResult tls_accept( SSL *ssl );
+int tls_ktls( SSL *ssl );
+ssize_t tls_read( SSL *ssl, void *buf, size_t len );
+ssize_t tls_write( SSL *ssl, const void *buf, size_t len );
+void tls_close( SSL *ssl );
+#endif
@@ -0,0 +1,855 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#if defined( TUNNEL )
+
+#if defined( __linux__ ) && !defined( _GNU_SOURCE )
+# define _GNU_SOURCE	/* getnameinfo() under -ansi */
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <zlib.h>
+#include "log.h"
+#include "tunnel.h"
+
+
+#define LINK_MAGIC	"WLT1"
+#define MAGIC_LEN	4
+#define FRAME_HEAD	7
+#define INFLATED	( 65535 + FRAME_HEAD )	/* room for the longest frame */
+#define LINK_HIGH	262144	/* bytes waiting to go out before streams stop being read */
+#define READ_CHUNK	16384
+#define OPEN_MAX	512		/* longest T_OPEN taken */
+#define ACCEPT_MAX	16		/* links taken off the backlog per wakeup */
+
+enum FrameType
+{
+	T_OPEN   = 'O',	/* the entry key, a NUL and the PROXY line of the client */
+	T_DATA   = 'D',
+	T_WINDOW = 'W',	/* 4 bytes of credit handed back */
+	T_CLOSE  = 'C',	/* the sender's half is gone */
+	T_GOAWAY = 'G'	/* no more streams on this link; it closes once empty */
+};
+
+typedef struct link_data LINK;
+typedef struct stream_data STREAM;
+
+struct stream_data
+{
+	STREAM *next;
+	uint32_t id;
+	int fd;				/* the tunnel's half of the socketpair */
+	unsigned long int window;	/* bytes the far end can still take */
+	unsigned long int consumed;	/* written to fd and not credited yet */
+	char *pending;		/* arrived while fd was full */
+	size_t pending_len;
+	int closing;		/* the far end is gone; close once pending is out */
+};
+
+struct link_data
+{
+	LINK *next;
+	char *name;			/* host:port of the hub, or the edge's address */
+	int edge;			/* we connected out, and open the streams */
+	int fd;
+	int connecting;
+	int draining;
+	size_t magic;		/* bytes of the far end's LINK_MAGIC seen so far */
+	z_stream zin;
+	z_stream zout;
+	char *plain;		/* frames not deflated yet */
+	size_t plain_len;
+	size_t plain_size;
+	char *out;			/* deflated, not written yet */
+	size_t out_len;
+	size_t out_size;
+	char *in;			/* inflated, not parsed yet */
+	size_t in_len;
+	STREAM *streams;
+	unsigned long int stream_count;
+	uint32_t next_id;
+};
+
+
+static LINK *links;
+static TUNNEL_ACCEPT *on_accept;
+static TUNNEL_PEER *on_peer;
+
+
+static LINK *new_link( int fd, const char *name, int edge );
+static void free_link( LINK *l );
+static int connect_hub( const char *hub, const struct sockaddr *addr, socklen_t addrlen );
+static int stream_pair( int *mine, int *theirs );
+static STREAM *new_stream( LINK *l, uint32_t id, int fd );
+static STREAM *find_stream( const LINK *l, uint32_t id );
+static void drop_stream( LINK *l, STREAM *s, int tell );
+static void frame( LINK *l, int type, uint32_t id, const char *data, size_t length );
+static void grow( char **buf, size_t *size, size_t need );
+static int flush_link( LINK *l );
+static int write_link( LINK *l );
+static int read_link( LINK *l );
+static int parse_frames( LINK *l );
+static int handle_frame( LINK *l, int type, uint32_t id, const char *data, size_t length );
+static void deliver( LINK *l, STREAM *s, const char *data, size_t length );
+static void credit( LINK *l, STREAM *s, size_t n );
+static void stream_io( LINK *l, STREAM *s, const fd_set *in, const fd_set *out );
+
+
+void tunnel_init( TUNNEL_ACCEPT *accept, TUNNEL_PEER *peer )
+{
+	on_accept = accept;
+	on_peer = peer;
+
+	return;
+}
+
+
+/* A hub takes links from edges on the listener. */
+void tunnel_accept( int listener )
+{
+	struct sockaddr_storage sa;
+	socklen_t len;
+	char host[ NI_MAXHOST ];
+	int fd, i;
+
+	for ( i = 0; i < ACCEPT_MAX; i++ )
+	{
+		len = sizeof( sa );
+
+		if ( ( fd = accept( listener, (struct sockaddr *) &sa, &len ) ) < 0 )
+		{
+			if ( errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR )
+				wraperror( "tunnel_accept: accept" );
+			return;
+		}
+
+		if ( fd >= FD_SETSIZE )
+		{
+			wraplog( "Refused a tunnel link: descriptor %d is too big for select().", fd );
+			close( fd );
+			continue;
+		}
+
+		fcntl( fd, F_SETFL, O_NONBLOCK );
+
+		if ( getnameinfo( (struct sockaddr *) &sa, len, host, sizeof( host ), NULL, 0,
+						  NI_NUMERICHOST ) )
+			strcpy( host, "?" );
+
+		if ( !on_peer || !on_peer( host ) )
+		{
+			close( fd );
+			continue;
+		}
+
+		new_link( fd, host, 0 );
+		wraplog( "Tunnel link from %s.", host );
+	}
+
+	return;
+}
+
+
+/* Opens a stream to the entry called key at the hub, over the link with
+   the fewest streams, until there are TUNNEL_LINKS of them. New links go
+   to addr, which the caller has resolved. Returns the descriptor for the
+   node, or -1. */
+int tunnel_open( const char *hub, const struct sockaddr *addr, socklen_t addrlen,
+				 const char *key, const char *origin )
+{
+	char payload[ OPEN_MAX ];
+	LINK *l, *best = NULL;
+	STREAM *s;
+	size_t key_len = strlen( key ), length;
+	int count = 0, fd, mine, theirs;
+
+	for ( l = links; l; l = l->next )
+		if ( l->edge && !l->draining && !strcmp( l->name, hub ) )
+		{
+			count++;
+			if ( !best || l->stream_count < best->stream_count )
+				best = l;
+		}
+
+	if ( !best || ( count < TUNNEL_LINKS && best->stream_count ) )
+		if ( ( fd = connect_hub( hub, addr, addrlen ) ) >= 0 )
+			best = new_link( fd, hub, 1 );
+
+	length = key_len + 1 + strlen( origin );
+
+	if ( !best || length > sizeof( payload ) || !stream_pair( &mine, &theirs ) )
+		return -1;
+
+	memcpy( payload, key, key_len + 1 );
+	memcpy( payload + key_len + 1, origin, length - key_len - 1 );
+
+	s = new_stream( best, best->next_id++, mine );
+	frame( best, T_OPEN, s->id, payload, length );
+
+	return theirs;
+}
+
+
+/* Sent by a hub that has handed its listeners over: the edges open no more
+   streams here, and each link closes once its last one ends. */
+void tunnel_drain( void )
+{
+	LINK *l;
+
+	for ( l = links; l; l = l->next )
+		if ( !l->edge && !l->draining )
+		{
+			frame( l, T_GOAWAY, 0, NULL, 0 );
+			l->draining = 1;
+		}
+
+	return;
+}
+
+
+int tunnel_select( fd_set *in, fd_set *out, int maxdsc )
+{
+	LINK *l;
+	STREAM *s;
+
+	for ( l = links; l; l = l->next )
+	{
+		if ( maxdsc < l->fd )
+			maxdsc = l->fd;
+		if ( !l->connecting )
+			FD_SET( l->fd, in );
+		if ( l->connecting || l->out_len || l->plain_len )
+			FD_SET( l->fd, out );
+
+		for ( s = l->streams; s; s = s->next )
+		{
+			if ( maxdsc < s->fd )
+				maxdsc = s->fd;
+			if ( s->window && !s->closing && l->out_len < LINK_HIGH )
+				FD_SET( s->fd, in );
+			if ( s->pending_len )
+				FD_SET( s->fd, out );
+		}
+	}
+
+	return maxdsc;
+}
+
+
+void tunnel_io( const fd_set *in, const fd_set *out )
+{
+	LINK *l, *next_link;
+	STREAM *s, *next_stream;
+	int error;
+	socklen_t len;
+
+	for ( l = links; l; l = next_link )
+	{
+		next_link = l->next;
+
+		if ( l->connecting && FD_ISSET( l->fd, out ) )
+		{
+			error = 0;
+			len = sizeof( error );
+
+			if ( getsockopt( l->fd, SOL_SOCKET, SO_ERROR, &error, &len ) < 0 )
+				error = errno;
+
+			if ( error )
+			{
+				errno = error;
+				wraperror( "Tunnel to %s failed", l->name );
+				free_link( l );
+				continue;
+			}
+
+			l->connecting = 0;
+			wraplog( "Tunnel to %s is up.", l->name );
+		}
+
+		if ( !l->connecting && FD_ISSET( l->fd, in ) && !read_link( l ) )
+		{
+			free_link( l );
+			continue;
+		}
+
+		for ( s = l->streams; s; s = next_stream )
+		{
+			next_stream = s->next;
+			stream_io( l, s, in, out );
+		}
+
+		if ( !flush_link( l ) || ( !l->connecting && !write_link( l ) ) )
+		{
+			free_link( l );
+			continue;
+		}
+
+		if ( l->draining && !l->stream_count && !l->out_len && !l->connecting )
+		{
+			wraplog( "Tunnel link %s drained.", l->name );
+			free_link( l );
+		}
+	}
+
+	return;
+}
+
+
+/* Moves bytes between a stream's socketpair and the link. */
+static void stream_io( LINK *l, STREAM *s, const fd_set *in, const fd_set *out )
+{
+	char buf[ READ_CHUNK ];
+	ssize_t n;
+	size_t want;
+
+	if ( s->pending_len && FD_ISSET( s->fd, out ) )
+	{
+		if ( ( n = write( s->fd, s->pending, s->pending_len ) ) < 0 )
+		{
+			if ( errno != EWOULDBLOCK && errno != EAGAIN )
+			{
+				drop_stream( l, s, !s->closing );
+				return;
+			}
+		}
+		else
+		{
+			s->pending_len -= (size_t) n;
+			memmove( s->pending, s->pending + n, s->pending_len );
+			credit( l, s, (size_t) n );
+		}
+	}
+
+	if ( s->closing )
+	{
+		if ( !s->pending_len )
+			drop_stream( l, s, 0 );
+		return;
+	}
+
+	if ( !s->window || !FD_ISSET( s->fd, in ) )
+		return;
+
+	want = s->window < sizeof( buf ) ? (size_t) s->window : sizeof( buf );
+
+	if ( ( n = read( s->fd, buf, want ) ) > 0 )
+	{
+		frame( l, T_DATA, s->id, buf, (size_t) n );
+		s->window -= (unsigned long int) n;
+		return;
+	}
+
+	if ( n < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN ) )
+		return;
+
+	drop_stream( l, s, 1 );
+
+	return;
+}
+
+
+static LINK *new_link( int fd, const char *name, int edge )
+{
+	LINK *l = calloc( sizeof( LINK ), 1 );
+
+	l->fd = fd;
+	l->name = strdup( name );
+	l->edge = edge;
+	l->connecting = edge;
+	l->next_id = 1;
+	l->in = malloc( INFLATED );
+	deflateInit( &l->zout, Z_DEFAULT_COMPRESSION );
+	inflateInit( &l->zin );
+
+	grow( &l->out, &l->out_size, MAGIC_LEN );
+	memcpy( l->out, LINK_MAGIC, MAGIC_LEN );
+	l->out_len = MAGIC_LEN;
+
+	l->next = links;
+	links = l;
+
+	return l;
+}
+
+
+/* Its streams end with it, and the nodes behind them see the game hang up. */
+static void free_link( LINK *l )
+{
+	LINK *p;
+
+	while ( l->streams )
+		drop_stream( l, l->streams, 0 );
+
+	close( l->fd );
+	deflateEnd( &l->zout );
+	inflateEnd( &l->zin );
+	free( l->name );
+	free( l->plain );
+	free( l->out );
+	free( l->in );
+
+	if ( links == l )
+		links = l->next;
+	else
+		for ( p = links; p; p = p->next )
+			if ( p->next == l )
+			{
+				p->next = l->next;
+				break;
+			}
+
+	free( l );
+
+	return;
+}
+
+
+/* hub names the link in log lines. */
+static int connect_hub( const char *hub, const struct sockaddr *addr, socklen_t addrlen )
+{
+	int fd;
+
+	if ( ( fd = socket( addr->sa_family, SOCK_STREAM, 0 ) ) < 0 || fd >= FD_SETSIZE )
+	{
+		wraperror( "Tunnel to %s: socket", hub );
+		if ( fd >= 0 )
+			close( fd );
+		return -1;
+	}
+
+	fcntl( fd, F_SETFL, O_NONBLOCK );
+
+	if ( connect( fd, addr, addrlen ) < 0 && errno != EINPROGRESS )
+	{
+		wraperror( "Tunnel to %s failed", hub );
+		close( fd );
+		fd = -1;
+	}
+
+	return fd;
+}
+
+
+static int stream_pair( int *mine, int *theirs )
+{
+	int sv[ 2 ];
+
+	if ( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) < 0 )
+	{
+		wraperror( "stream_pair: socketpair" );
+		return 0;
+	}
+
+	if ( sv[ 0 ] >= FD_SETSIZE || sv[ 1 ] >= FD_SETSIZE )
+	{
+		wraplog( "stream_pair: descriptor %d is too big for select().", sv[ 1 ] );
+		close( sv[ 0 ] );
+		close( sv[ 1 ] );
+		return 0;
+	}
+
+	fcntl( sv[ 0 ], F_SETFL, O_NONBLOCK );
+	fcntl( sv[ 1 ], F_SETFL, O_NONBLOCK );
+	fcntl( sv[ 0 ], F_SETFD, FD_CLOEXEC );
+	fcntl( sv[ 1 ], F_SETFD, FD_CLOEXEC );
+	*mine = sv[ 0 ];
+	*theirs = sv[ 1 ];
+
+	return 1;
+}
+
+
+static STREAM *new_stream( LINK *l, uint32_t id, int fd )
+{
+	STREAM *s = calloc( sizeof( STREAM ), 1 );
+
+	s->id = id;
+	s->fd = fd;
+	s->window = TUNNEL_WINDOW;
+	s->next = l->streams;
+	l->streams = s;
+	l->stream_count++;
+
+	return s;
+}
+
+
+static STREAM *find_stream( const LINK *l, uint32_t id )
+{
+	STREAM *s;
+
+	for ( s = l->streams; s; s = s->next )
+		if ( s->id == id )
+			return s;
+
+	return NULL;
+}
+
+
+static void drop_stream( LINK *l, STREAM *s, int tell )
+{
+	STREAM *p;
+
+	if ( tell )
+		frame( l, T_CLOSE, s->id, NULL, 0 );
+
+	close( s->fd );
+	free( s->pending );
+
+	if ( l->streams == s )
+		l->streams = s->next;
+	else
+		for ( p = l->streams; p; p = p->next )
+			if ( p->next == s )
+			{
+				p->next = s->next;
+				break;
+			}
+
+	l->stream_count--;
+	free( s );
+
+	return;
+}
+
+
+/* Frames wait in plain until flush_link() deflates the lot. */
+static void frame( LINK *l, int type, uint32_t id, const char *data, size_t length )
+{
+	unsigned char *h;
+
+	grow( &l->plain, &l->plain_size, l->plain_len + FRAME_HEAD + length );
+	h = (unsigned char *) l->plain + l->plain_len;
+	h[ 0 ] = (unsigned char) type;
+	h[ 1 ] = (unsigned char) ( id >> 24 );
+	h[ 2 ] = (unsigned char) ( id >> 16 );
+	h[ 3 ] = (unsigned char) ( id >> 8 );
+	h[ 4 ] = (unsigned char) id;
+	h[ 5 ] = (unsigned char) ( length >> 8 );
+	h[ 6 ] = (unsigned char) length;
+
+	if ( length )
+		memcpy( h + FRAME_HEAD, data, length );
+
+	l->plain_len += FRAME_HEAD + length;
+
+	return;
+}
+
+
+static void grow( char **buf, size_t *size, size_t need )
+{
+	if ( need <= *size )
+		return;
+
+	while ( *size < need )
+		*size = *size ? *size * 2 : 4096;
+
+	*buf = realloc( *buf, *size );
+
+	return;
+}
+
+
+/* One sync flush per round of the main loop, whatever it framed, keeps the
+   deflate dictionary shared by every stream on the link. */
+static int flush_link( LINK *l )
+{
+	int z;
+
+	if ( !l->plain_len )
+		return 1;
+
+	l->zout.next_in = (Bytef *) l->plain;
+	l->zout.avail_in = (uInt) l->plain_len;
+
+	do
+	{
+		grow( &l->out, &l->out_size, l->out_len + l->plain_len / 2 + 64 );
+		l->zout.next_out = (Bytef *) l->out + l->out_len;
+		l->zout.avail_out = (uInt) ( l->out_size - l->out_len );
+		z = deflate( &l->zout, Z_SYNC_FLUSH );
+		l->out_len = l->out_size - l->zout.avail_out;
+
+		if ( z != Z_OK && z != Z_BUF_ERROR )
+		{
+			wraplog( "Tunnel link %s: deflate failed.", l->name );
+			return 0;
+		}
+	}
+	while ( l->zout.avail_out == 0 );
+
+	l->plain_len = 0;
+
+	return 1;
+}
+
+
+static int write_link( LINK *l )
+{
+	ssize_t n;
+
+	if ( !l->out_len )
+		return 1;
+
+	if ( ( n = write( l->fd, l->out, l->out_len ) ) < 0 )
+	{
+		if ( errno == EWOULDBLOCK || errno == EAGAIN )
+			return 1;
+
+		wraperror( "Tunnel link %s", l->name );
+		return 0;
+	}
+
+	l->out_len -= (size_t) n;
+	memmove( l->out, l->out + n, l->out_len );
+
+	return 1;
+}
+
+
+static int read_link( LINK *l )
+{
+	char raw[ READ_CHUNK ];
+	char *p = raw;
+	ssize_t r = read( l->fd, raw, sizeof( raw ) );
+	size_t n;
+	int z;
+
+	if ( r == 0 )
+	{
+		wraplog( "Tunnel link %s closed.", l->name );
+		return 0;
+	}
+
+	if ( r < 0 )
+	{
+		if ( errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR )
+			return 1;
+
+		wraperror( "Tunnel link %s", l->name );
+		return 0;
+	}
+
+	for ( n = (size_t) r; l->magic < MAGIC_LEN && n; n--, p++ )
+		if ( *p != LINK_MAGIC[ l->magic++ ] )
+		{
+			wraplog( "Tunnel link %s does not speak " LINK_MAGIC ".", l->name );
+			return 0;
+		}
+
+	l->zin.next_in = (Bytef *) p;
+	l->zin.avail_in = (uInt) n;
+
+	do
+	{
+		l->zin.next_out = (Bytef *) l->in + l->in_len;
+		l->zin.avail_out = (uInt) ( INFLATED - l->in_len );
+		z = inflate( &l->zin, Z_NO_FLUSH );
+		l->in_len = INFLATED - l->zin.avail_out;
+
+		if ( z != Z_OK && z != Z_BUF_ERROR )
+		{
+			wraplog( "Tunnel link %s: inflate failed.", l->name );
+			return 0;
+		}
+
+		if ( !parse_frames( l ) )
+			return 0;
+	}
+	while ( l->zin.avail_in > 0 || l->zin.avail_out == 0 );
+
+	return 1;
+}
+
+
+static int parse_frames( LINK *l )
+{
+	const unsigned char *h;
+	size_t at = 0, length;
+	uint32_t id;
+
+	while ( l->in_len - at >= FRAME_HEAD )
+	{
+		h = (const unsigned char *) l->in + at;
+		id = (uint32_t) h[ 1 ] << 24 | (uint32_t) h[ 2 ] << 16 | (uint32_t) h[ 3 ] << 8 | h[ 4 ];
+		length = (size_t) h[ 5 ] << 8 | h[ 6 ];
+
+		if ( l->in_len - at < FRAME_HEAD + length )
+			break;
+
+		if ( !handle_frame( l, h[ 0 ], id, l->in + at + FRAME_HEAD, length ) )
+		{
+			wraplog( "Tunnel link %s: bad frame %c for stream %lu.",
+					 l->name, h[ 0 ], (unsigned long int) id );
+			return 0;
+		}
+
+		at += FRAME_HEAD + length;
+	}
+
+	l->in_len -= at;
+	memmove( l->in, l->in + at, l->in_len );
+
+	return 1;
+}
+
+
+/* Frames for streams already gone are dropped; they were on their way
+   when it went. Returns 0 for ones that make no sense at all. */
+static int handle_frame( LINK *l, int type, uint32_t id, const char *data, size_t length )
+{
+	char open[ OPEN_MAX + 1 ];
+	const char *origin;
+	STREAM *s = find_stream( l, id );
+	int mine, theirs;
+
+	switch ( type )
+	{
+		case T_DATA:
+			if ( s && !s->closing )
+				deliver( l, s, data, length );
+			return 1;
+
+		case T_WINDOW:
+			if ( length != 4 )
+				return 0;
+			if ( s )
+				s->window += (unsigned long int) (unsigned char) data[ 0 ] << 24
+						   | (unsigned long int) (unsigned char) data[ 1 ] << 16
+						   | (unsigned long int) (unsigned char) data[ 2 ] << 8
+						   | (unsigned char) data[ 3 ];
+			return 1;
+
+		case T_CLOSE:
+			if ( s )
+			{
+				s->closing = 1;
+				if ( !s->pending_len )
+					drop_stream( l, s, 0 );
+			}
+			return 1;
+
+		case T_GOAWAY:
+			if ( l->edge )
+				l->draining = 1;
+			return l->edge;
+
+		case T_OPEN:
+			if ( l->edge || s || length > OPEN_MAX )
+				return 0;
+
+			memcpy( open, data, length );
+			open[ length ] = '\0';
+			origin = strlen( open ) < length ? open + strlen( open ) + 1 : "";
+
+			if ( l->draining || !on_accept || !stream_pair( &mine, &theirs ) )
+			{
+				frame( l, T_CLOSE, id, NULL, 0 );
+				return 1;
+			}
+
+			s = new_stream( l, id, mine );
+
+			if ( !on_accept( theirs, open, origin ) )
+			{
+				close( theirs );
+				drop_stream( l, s, 1 );
+			}
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/* Whatever the socketpair does not take now waits; the far end never has
+   more than the window in flight, so that is all that can pile up. */
+static void deliver( LINK *l, STREAM *s, const char *data, size_t length )
+{
+	ssize_t w = 0;
+
+	if ( !s->pending_len && ( w = write( s->fd, data, length ) ) < 0 )
+	{
+		if ( errno != EWOULDBLOCK && errno != EAGAIN )
+		{
+			drop_stream( l, s, 1 );
+			return;
+		}
+
+		w = 0;
+	}
+
+	credit( l, s, (size_t) w );
+	data += w;
+	length -= (size_t) w;
+
+	if ( !length )
+		return;
+
+	if ( s->pending_len + length > TUNNEL_WINDOW )
+	{
+		wraplog( "Tunnel link %s overran the window of stream %lu.",
+				 l->name, (unsigned long int) s->id );
+		drop_stream( l, s, 1 );
+		return;
+	}
+
+	s->pending = realloc( s->pending, s->pending_len + length );
+	memcpy( s->pending + s->pending_len, data, length );
+	s->pending_len += length;
+
+	return;
+}
+
+
+/* Credit goes back in batches of half a window, not a frame per write. */
+static void credit( LINK *l, STREAM *s, size_t n )
+{
+	char c[ 4 ];
+
+	if ( ( s->consumed += n ) < TUNNEL_WINDOW / 2 )
+		return;
+
+	c[ 0 ] = (char) ( s->consumed >> 24 );
+	c[ 1 ] = (char) ( s->consumed >> 16 );
+	c[ 2 ] = (char) ( s->consumed >> 8 );
+	c[ 3 ] = (char) s->consumed;
+	frame( l, T_WINDOW, s->id, c, 4 );
+	s->consumed = 0;
+
+	return;
+}
+
+#else
+
+/* ISO C does not allow an empty translation unit. */
+extern int tunnel_disabled;
+
+#endif
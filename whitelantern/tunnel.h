@@ -0,0 +1,60 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* Tunnels between WhiteLanterns, compiled in with -DTUNNEL ("make tunnel").
+   An edge proxy near the players carries its sessions to a hub next to the
+   MUDs over a few persistent TCP links. Each direction of a link is "WLT1"
+   and then one zlib stream, flushed whenever the main loop has written
+   something into it. Inside are frames: a type, a stream number and the
+   length of the data (1, 4 and 2 bytes, big-endian), then the data.
+
+   A stream may have TUNNEL_WINDOW bytes in flight each way. The receiving
+   end hands the credit back in WINDOW frames as it gets rid of them, and a
+   stream out of credit is not read from until then, so one busy session
+   cannot fill the link for the others.
+
+   Each end of a stream is one half of a socketpair. The node on the other
+   half reads and writes it like any socket and never sees a frame.
+
+   A hub believes the client address an edge sends with each stream, so it
+   takes links only from the addresses it is told to trust. Links are not
+   encrypted: run them over a private network, a VPN or a TLS wrapper such
+   as stunnel, never in the clear across the Internet. */
+
+#define TUNNEL_LINKS	2		/* links an edge keeps to each hub */
+#define TUNNEL_WINDOW	65536	/* bytes a stream may have in flight each way */
+#define TUNNEL_FRAME	16384	/* most data in one frame */
+
+#if defined( TUNNEL )
+/* Called at a hub for each stream an edge opens, with the descriptor for
+   the node, the entry it asked for and the PROXY line of its client.
+   Returns 0 to refuse it; the descriptor is then closed for it. */
+typedef int TUNNEL_ACCEPT( int fd, const char *key, const char *origin );
+
+/* Called at a hub for each link an edge opens, with its numeric address.
+   Returns 0 to refuse it. */
+typedef int TUNNEL_PEER( const char *host );
+
+void tunnel_init( TUNNEL_ACCEPT *accept, TUNNEL_PEER *peer );
+void tunnel_accept( int listener );
+int tunnel_open( const char *hub, const struct sockaddr *addr, socklen_t addrlen,
+				 const char *key, const char *origin );
+void tunnel_drain( void );
+int tunnel_select( fd_set *in, fd_set *out, int maxdsc );
+void tunnel_io( const fd_set *in, const fd_set *out );
+#endif
@@ -0,0 +1,308 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "webroot.h"
+
+
+#define NAME_MAX_LENGTH 1024
+
+
+static WEB_FILE *lookup( const char *name, const char *type, const char *encoding );
+static const char *content_type( const char *name );
+static int unhex( char c );
+
+
+static char *root;
+static size_t root_length;
+static WEB_FILE *cache;
+static size_t cached;
+
+static const struct
+{
+	const char *extension;
+	const char *type;
+} types[] =
+{
+	{ ".html",	"text/html; charset=utf-8" },
+	{ ".htm",	"text/html; charset=utf-8" },
+	{ ".js",	"text/javascript; charset=utf-8" },
+	{ ".mjs",	"text/javascript; charset=utf-8" },
+	{ ".css",	"text/css; charset=utf-8" },
+	{ ".json",	"application/json" },
+	{ ".map",	"application/json" },
+	{ ".webmanifest", "application/manifest+json" },
+	{ ".txt",	"text/plain; charset=utf-8" },
+	{ ".svg",	"image/svg+xml" },
+	{ ".png",	"image/png" },
+	{ ".jpg",	"image/jpeg" },
+	{ ".jpeg",	"image/jpeg" },
+	{ ".gif",	"image/gif" },
+	{ ".webp",	"image/webp" },
+	{ ".ico",	"image/x-icon" },
+	{ ".wasm",	"application/wasm" },
+	{ ".woff2",	"font/woff2" },
+	{ ".woff",	"font/woff" },
+	{ ".ogg",	"audio/ogg" },
+	{ ".mp3",	"audio/mpeg" }
+};
+
+
+/* Returns 0 if dir is not a directory. */
+int webroot_set( const char *dir )
+{
+	struct stat st;
+
+	if ( stat( dir, &st ) < 0 || !S_ISDIR( st.st_mode ) )
+		return 0;
+
+	free( root );
+	root = strdup( dir );
+	root_length = strlen( root );
+
+	while ( root_length > 1 && root[ root_length - 1 ] == '/' )
+		root[ --root_length ] = '\0';
+
+	return 1;
+}
+
+
+int webroot_active( void )
+{
+	return root != NULL;
+}
+
+
+/* Finds the file for a request path, taking a reference the caller gives
+   back with webroot_release(). encodings says which precompressed variants
+   the client takes. Returns NULL with *status set to 400 or 404 when there
+   is nothing to send. */
+WEB_FILE *webroot_find( const char *path, size_t length, int encodings, int *status )
+{
+	char name[ NAME_MAX_LENGTH ];
+	const char *type;
+	WEB_FILE *file;
+	size_t n = root_length, i;
+	int c;
+
+	*status = 404;
+
+	if ( !root )
+		return NULL;
+
+	if ( !length || path[ 0 ] != '/' )
+	{
+		*status = 400;
+		return NULL;
+	}
+
+	memcpy( name, root, root_length );
+
+	for ( i = 0; i < length; i++ )
+	{
+		c = (unsigned char) path[ i ];
+
+		if ( c == '%' )
+		{
+			if ( i + 2 >= length || unhex( path[ i + 1 ] ) < 0 || unhex( path[ i + 2 ] ) < 0 )
+			{
+				*status = 400;
+				return NULL;
+			}
+
+			c = unhex( path[ i + 1 ] ) << 4 | unhex( path[ i + 2 ] );
+			i += 2;
+		}
+
+		if ( c == '\0' || c == '\\' )
+		{
+			*status = 400;
+			return NULL;
+		}
+
+		/* Room for "index.html" and a ".br" */
+		if ( n + 14 >= sizeof( name ) )
+			return NULL;
+
+		name[ n++ ] = (char) c;
+	}
+
+	name[ n ] = '\0';
+
+	/* Nothing above the root, and no dot files such as .git */
+	if ( strstr( name + root_length, "/." ) )
+		return NULL;
+
+	if ( name[ n - 1 ] == '/' )
+	{
+		strcpy( name + n, "index.html" );
+		n += 10;
+	}
+
+	type = content_type( name );
+
+	if ( encodings & WEB_BR )
+	{
+		strcpy( name + n, ".br" );
+
+		if ( ( file = lookup( name, type, "br" ) ) )
+			return file;
+	}
+
+	if ( encodings & WEB_GZIP )
+	{
+		strcpy( name + n, ".gz" );
+
+		if ( ( file = lookup( name, type, "gzip" ) ) )
+			return file;
+	}
+
+	name[ n ] = '\0';
+
+	return lookup( name, type, NULL );
+}
+
+
+void webroot_release( WEB_FILE *file )
+{
+	if ( !file || --file->refs )
+		return;
+
+	cached -= file->size;
+	free( file->data );
+	free( file->name );
+	free( file );
+
+	return;
+}
+
+
+size_t webroot_cached( void )
+{
+	return cached;
+}
+
+
+/* A cached file is good as long as stat() says it has not changed. */
+static WEB_FILE *lookup( const char *name, const char *type, const char *encoding )
+{
+	WEB_FILE *file, **prev;
+	struct stat st;
+	char *data;
+	size_t got;
+	ssize_t r;
+	int fd;
+
+	if ( stat( name, &st ) < 0 || !S_ISREG( st.st_mode ) )
+		return NULL;
+
+	for ( prev = &cache; ( file = *prev ); prev = &file->next )
+	{
+		if ( strcmp( file->name, name ) )
+			continue;
+
+		if ( file->size == (size_t) st.st_size && file->mtime == st.st_mtime
+		  && file->inode == st.st_ino )
+		{
+			file->refs++;
+			return file;
+		}
+
+		*prev = file->next;
+		webroot_release( file );
+		break;
+	}
+
+	if ( ( fd = open( name, O_RDONLY ) ) < 0 )
+		return NULL;
+
+	if ( fstat( fd, &st ) < 0 )
+	{
+		close( fd );
+		return NULL;
+	}
+
+	/* Read rather than mapped: a file cut short on disk while it is being
+	   sent must not take the process down with SIGBUS. */
+	data = malloc( (size_t) st.st_size + 1 );
+
+	for ( got = 0; got < (size_t) st.st_size; got += (size_t) r )
+		if ( ( r = read( fd, data + got, (size_t) st.st_size - got ) ) <= 0 )
+			break;
+
+	close( fd );
+
+	if ( got < (size_t) st.st_size )
+	{
+		free( data );
+		return NULL;
+	}
+
+	file = calloc( sizeof( WEB_FILE ), 1 );
+	file->refs = 2;
+	file->name = strdup( name );
+	file->data = data;
+	file->size = (size_t) st.st_size;
+	file->mtime = st.st_mtime;
+	file->inode = st.st_ino;
+	file->type = type;
+	file->encoding = encoding;
+	sprintf( file->etag, "\"%lx-%lx%s%s\"", (unsigned long int) st.st_size,
+			 (unsigned long int) st.st_mtime, encoding ? "-" : "", encoding ? encoding : "" );
+
+	file->next = cache;
+	cache = file;
+	cached += file->size;
+
+	return file;
+}
+
+
+static const char *content_type( const char *name )
+{
+	size_t n = strlen( name ), e, i;
+
+	for ( i = 0; i < sizeof( types ) / sizeof( types[ 0 ] ); i++ )
+	{
+		e = strlen( types[ i ].extension );
+
+		if ( n > e && !strcmp( name + n - e, types[ i ].extension ) )
+			return types[ i ].type;
+	}
+
+	return "application/octet-stream";
+}
+
+
+static int unhex( char c )
+{
+	if ( c >= '0' && c <= '9' )
+		return c - '0';
+	if ( c >= 'a' && c <= 'f' )
+		return c - 'a' + 10;
+	if ( c >= 'A' && c <= 'F' )
+		return c - 'A' + 10;
+
+	return -1;
+}
@@ -0,0 +1,49 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* Files served over HTTP from a document root, for the web client. Files are
+   read into memory the first time they are asked for and shared by every
+   connection sending them; a file that changes on disk is read again and
+   the old copy goes away once the last connection sending it is done.
+   Precompressed "name.br" and "name.gz" next to a file are preferred when
+   the client takes them. */
+
+#define WEB_GZIP	1
+#define WEB_BR		2
+
+typedef struct web_file_data WEB_FILE;
+
+struct web_file_data
+{
+	WEB_FILE *next;
+	unsigned int refs;		/* the cache's own, plus one per sender */
+	char *name;				/* on disk */
+	char *data;
+	size_t size;
+	time_t mtime;
+	ino_t inode;
+	const char *type;		/* Content-Type */
+	const char *encoding;	/* Content-Encoding, or NULL */
+	char etag[ 48 ];		/* with the quotes */
+};
+
+int webroot_set( const char *dir );
+int webroot_active( void );
+WEB_FILE *webroot_find( const char *path, size_t length, int encodings, int *status );
+void webroot_release( WEB_FILE *file );
+size_t webroot_cached( void );
@@ -0,0 +1,680 @@
+/*
+   WhiteLantern
+
+   Copyright 2010 Vigud@lac.pl, Lam@lac.pl
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+
+/* wlreplay: plays recordings made with "WhiteLantern -rd" back through a
+   running proxy. Each recorded connection becomes a client connecting to
+   the proxy and sending what the real client sent, when it sent it; the
+   game side is played by a listener of our own (-m), which the proxy's
+   game entries should point at. Game connections are paired with sessions
+   in the order the recorded sessions reached their game.
+
+   Built with "make record". */
+
+#if !defined( RECORD )
+# error wlreplay needs zlib, build it with "make record".
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "timer.h"
+#include "rec.h"
+
+#define MAX_SESSIONS	( FD_SETSIZE / 2 - 8 )
+#define IDLE_LIMIT		10000	/* milliseconds without progress before giving up */
+#define DETECT_WAIT		2000	/* WhiteLantern's DETECT_TIMEOUT, in milliseconds */
+#define MAX_UNPAIRED	16		/* game connections ahead of their sessions */
+
+typedef struct event_data EVENT;
+typedef struct buffer_data BUFFER;
+typedef struct session_data SESSION;
+
+struct event_data
+{
+	unsigned long int time;
+	int kind;
+	size_t length;
+	char *data;
+};
+
+struct buffer_data
+{
+	char *data;
+	size_t length;
+	size_t size;
+};
+
+struct session_data
+{
+	const char *file;
+	EVENT *events;
+	size_t count;
+	size_t next;			/* event to play next */
+	double accepted;		/* wall clock ms from REC_ACCEPT */
+	unsigned long int offset;	/* from the first recorded session */
+	int started;
+	int proxy;				/* our client socket, or -1 */
+	int mud;				/* the proxy's game connection, or -1 */
+	int wants_mud;			/* reached its game, not paired yet */
+	int quiet;				/* the client waited to be spoken to */
+	int heard;				/* and the proxy has spoken */
+	int done;
+	BUFFER to_proxy;
+	BUFFER to_mud;
+};
+
+static int load( SESSION *s, const char *file );
+static int play( void );
+static unsigned long int at( const SESSION *s, unsigned long int time );
+static int due( const SESSION *s, unsigned long int time );
+static int held( const SESSION *s );
+static int played( const SESSION *s );
+static void start( SESSION *s );
+static void pair( SESSION *s, int fd );
+static void finish( SESSION *s );
+static int drain( int fd, BUFFER *b );
+static void append( BUFFER *b, const char *data, size_t length );
+static int listen_on( int port );
+static void usage( void );
+
+static SESSION sessions[ MAX_SESSIONS ];
+static int session_count;
+static struct addrinfo *proxy_addr;
+static int mud_listen = -1;
+static double speed = 1.0;
+static unsigned long int began;
+static unsigned long int max_late;
+static unsigned long int bytes_sent;
+static unsigned long int bytes_recv;
+static int accepted_fds[ MAX_UNPAIRED ];	/* game connections not paired yet */
+static int accepted_count;
+static SESSION *waiting[ MAX_SESSIONS ];		/* sessions not paired yet */
+static int waiting_count;
+
+
+int main( int argc, char **argv )
+{
+	struct addrinfo hints;
+	const char *host = "127.0.0.1", *port = "8017";
+	unsigned long int elapsed;
+	double first = 0;
+	int i, mud_port = 4000, ok;
+
+	for ( i = 1; i < argc && argv[ i ][ 0 ] == '-'; i += 2 )
+	{
+		if ( i + 1 >= argc )
+			usage( );
+		else if ( !strcmp( argv[ i ], "-p" ) )
+			port = argv[ i + 1 ];
+		else if ( !strcmp( argv[ i ], "-h" ) )
+			host = argv[ i + 1 ];
+		else if ( !strcmp( argv[ i ], "-m" ) )
+			mud_port = atoi( argv[ i + 1 ] );
+		else if ( !strcmp( argv[ i ], "-s" ) )
+			speed = atof( argv[ i + 1 ] );
+		else
+			usage( );
+	}
+
+	if ( i == argc || speed < 0 || mud_port <= 0 || mud_port > 65535 )
+		usage( );
+
+	for ( ; i < argc; i++ )
+	{
+		if ( session_count == MAX_SESSIONS )
+		{
+			fprintf( stderr, "wlreplay: only %d sessions at a time.\n", MAX_SESSIONS );
+			return 1;
+		}
+
+		if ( !load( &sessions[ session_count ], argv[ i ] ) )
+			return 1;
+
+		if ( !session_count || sessions[ session_count ].accepted < first )
+			first = sessions[ session_count ].accepted;
+
+		session_count++;
+	}
+
+	for ( i = 0; i < session_count; i++ )
+		sessions[ i ].offset = (unsigned long int) ( sessions[ i ].accepted - first );
+
+	memset( &hints, 0, sizeof( hints ) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ( getaddrinfo( host, port, &hints, &proxy_addr ) )
+	{
+		fprintf( stderr, "wlreplay: cannot resolve %s:%s.\n", host, port );
+		return 1;
+	}
+
+	if ( ( mud_listen = listen_on( mud_port ) ) < 0 )
+		return 1;
+
+	signal( SIGPIPE, SIG_IGN );
+	timer_init( );
+	began = timer_now( );
+	ok = play( );
+	elapsed = timer_now( ) - began;
+
+	printf( "Sessions: %d, bytes sent: %lu, received: %lu.\n", session_count,
+			bytes_sent, bytes_recv );
+	printf( "Elapsed: %lu.%03lu s", elapsed / 1000, elapsed % 1000 );
+
+	if ( speed > 0 )
+		printf( ", at most %lu ms late.\n", max_late );
+	else
+		printf( ".\n" );
+
+	freeaddrinfo( proxy_addr );
+
+	return ok ? 0 : 2;
+}
+
+
+static void usage( void )
+{
+	fprintf( stderr, "Usage: wlreplay [-p proxy port] [-h proxy host] [-m game port] "
+			 "[-s speed] file.wlr...\n"
+			 "\tp: port WhiteLantern listens on (8017)\n"
+			 "\th: host WhiteLantern runs on (127.0.0.1)\n"
+			 "\tm: port to play the game on, as WhiteLantern's entries have it (4000)\n"
+			 "\ts: 2 plays twice as fast, 0 as fast as it goes (1)\n" );
+	exit( 1 );
+}
+
+
+/* Reads a whole recording; they are small next to what they stand for. */
+static int load( SESSION *s, const char *file )
+{
+	REC_READER *r;
+	REC_RECORD record;
+	size_t size = 0;
+	int n, spoke = 0;
+
+	if ( !( r = rec_reader( file ) ) )
+	{
+		perror( file );
+		return 0;
+	}
+
+	memset( s, 0, sizeof( *s ) );
+	s->file = file;
+	s->proxy = s->mud = -1;
+
+	while ( ( n = rec_next( r, &record ) ) > 0 )
+	{
+		if ( record.kind == REC_ACCEPT )
+		{
+			s->accepted = strtod( record.data, NULL );
+			continue;
+		}
+
+		if ( s->count == size )
+		{
+			size = size ? size * 2 : 64;
+			s->events = realloc( s->events, size * sizeof( EVENT ) );
+		}
+
+		s->events[ s->count ].time = record.time;
+		s->events[ s->count ].kind = record.kind;
+		s->events[ s->count ].length = record.length;
+		s->events[ s->count ].data = malloc( record.length + 1 );
+		memcpy( s->events[ s->count ].data, record.data, record.length );
+		s->count++;
+
+		/* A telnet client that kept quiet until the menu showed must do so
+		   here too, or the proxy takes it for something else. */
+		if ( record.kind == REC_CLIENT && !spoke )
+		{
+			s->quiet = record.time >= DETECT_WAIT;
+			spoke = 1;
+		}
+
+		if ( record.kind == REC_END )
+			break;
+	}
+
+	rec_reader_close( r );
+
+	if ( n < 0 )
+	{
+		fprintf( stderr, "wlreplay: %s is damaged.\n", file );
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/* When something recorded at this time should happen, in timer_now() terms */
+static unsigned long int at( const SESSION *s, unsigned long int time )
+{
+	if ( speed <= 0 )
+		return began;
+
+	return began + (unsigned long int) ( ( (double) s->offset + (double) time ) / speed );
+}
+
+
+static int due( const SESSION *s, unsigned long int time )
+{
+	unsigned long int when = at( s, time ), now = timer_now( );
+
+	if ( when > now )
+		return 0;
+
+	if ( now - when > max_late )
+		max_late = now - when;
+
+	return 1;
+}
+
+
+static int play( void )
+{
+	fd_set in_set, out_set;
+	struct timeval tv;
+	unsigned long int now, progress = timer_now( ), next;
+	char buf[ 16384 ];
+	ssize_t n;
+	int i, fd, top, left;
+	SESSION *s;
+
+	for ( ;; )
+	{
+		FD_ZERO( &in_set );
+		FD_ZERO( &out_set );
+		FD_SET( mud_listen, &in_set );
+		top = mud_listen;
+
+		for ( i = 0; i < accepted_count; i++ )
+		{
+			FD_SET( accepted_fds[ i ], &in_set );
+
+			if ( accepted_fds[ i ] > top )
+				top = accepted_fds[ i ];
+		}
+		left = 0;
+		now = timer_now( );
+		next = now + 1000;
+
+		for ( i = 0; i < session_count; i++ )
+		{
+			s = &sessions[ i ];
+
+			if ( s->done )
+				continue;
+
+			left++;
+
+			if ( !s->started && due( s, 0 ) )
+				start( s );
+
+			while ( s->started && s->next < s->count && due( s, s->events[ s->next ].time ) )
+			{
+				EVENT *e = &s->events[ s->next ];
+
+				if ( held( s ) )
+					break;
+
+				s->next++;
+
+				if ( e->kind == REC_CLIENT && s->proxy >= 0 )
+					append( &s->to_proxy, e->data, e->length );
+				else if ( e->kind == REC_SERVER )
+					append( &s->to_mud, e->data, e->length );
+				else if ( e->kind == REC_GAME )
+				{
+					if ( accepted_count )
+					{
+						pair( s, accepted_fds[ 0 ] );
+						memmove( accepted_fds, accepted_fds + 1,
+								 (size_t) --accepted_count * sizeof( int ) );
+					}
+					else
+					{
+						s->wants_mud = 1;
+						waiting[ waiting_count++ ] = s;
+					}
+				}
+
+				progress = now;
+			}
+
+			/* Waiting for the clock is not being stuck. */
+			if ( !s->started )
+			{
+				next = at( s, 0 ) < next ? at( s, 0 ) : next;
+				progress = now;
+			}
+			else if ( s->next < s->count && !held( s ) )
+			{
+				next = at( s, s->events[ s->next ].time ) < next
+					 ? at( s, s->events[ s->next ].time ) : next;
+				progress = now;
+			}
+
+			if ( played( s ) )
+			{
+				finish( s );
+				continue;
+			}
+
+			if ( s->proxy >= 0 )
+			{
+				FD_SET( s->proxy, &in_set );
+
+				if ( s->to_proxy.length )
+					FD_SET( s->proxy, &out_set );
+
+				if ( s->proxy > top )
+					top = s->proxy;
+			}
+
+			if ( s->mud >= 0 )
+			{
+				FD_SET( s->mud, &in_set );
+
+				if ( s->to_mud.length )
+					FD_SET( s->mud, &out_set );
+
+				if ( s->mud > top )
+					top = s->mud;
+			}
+		}
+
+		if ( !left )
+			return 1;
+
+		if ( now - progress > IDLE_LIMIT )
+		{
+			fprintf( stderr, "wlreplay: nothing happened for %d s, %d sessions unfinished.\n",
+					 IDLE_LIMIT / 1000, left );
+			return 0;
+		}
+
+		tv.tv_sec = 0;
+		tv.tv_usec = next > now ? (long int) ( next - now ) * 1000L : 0L;
+
+		if ( tv.tv_usec >= 1000000L )
+			tv.tv_usec = 999999L;
+
+		if ( select( top + 1, &in_set, &out_set, NULL, &tv ) < 0 )
+		{
+			if ( errno == EINTR )
+				continue;
+
+			perror( "wlreplay: select" );
+			return 0;
+		}
+
+		now = timer_now( );
+
+		/* Health checks connect and hang up; they must not be taken for sessions. */
+		for ( i = 0; i < accepted_count; i++ )
+		{
+			if ( !FD_ISSET( accepted_fds[ i ], &in_set ) )
+				continue;
+
+			if ( ( n = read( accepted_fds[ i ], buf, sizeof( buf ) ) ) > 0 )
+				bytes_recv += (unsigned long int) n;
+			else if ( !n || errno != EAGAIN )
+			{
+				close( accepted_fds[ i ] );
+				accepted_count--;
+				memmove( accepted_fds + i, accepted_fds + i + 1,
+						 (size_t) ( accepted_count - i ) * sizeof( int ) );
+				i--;
+			}
+		}
+
+		if ( FD_ISSET( mud_listen, &in_set )
+		  && ( fd = accept( mud_listen, NULL, NULL ) ) >= 0 )
+		{
+			fcntl( fd, F_SETFL, O_NONBLOCK );
+			progress = now;
+
+			if ( waiting_count )
+			{
+				pair( waiting[ 0 ], fd );
+				memmove( waiting, waiting + 1, (size_t) --waiting_count * sizeof( SESSION * ) );
+			}
+			else if ( accepted_count < MAX_UNPAIRED )
+				accepted_fds[ accepted_count++ ] = fd;
+			else
+				close( fd );
+		}
+
+		for ( i = 0; i < session_count; i++ )
+		{
+			s = &sessions[ i ];
+
+			if ( s->proxy >= 0 && FD_ISSET( s->proxy, &out_set ) )
+			{
+				if ( drain( s->proxy, &s->to_proxy ) )
+					progress = now;
+				else
+				{
+					close( s->proxy );
+					s->proxy = -1;
+					s->to_proxy.length = 0;
+				}
+			}
+
+			if ( s->mud >= 0 && FD_ISSET( s->mud, &out_set ) )
+			{
+				if ( drain( s->mud, &s->to_mud ) )
+					progress = now;
+				else
+				{
+					close( s->mud );
+					s->mud = -1;
+					s->to_mud.length = 0;
+				}
+			}
+
+			if ( s->proxy >= 0 && FD_ISSET( s->proxy, &in_set ) )
+			{
+				if ( ( n = read( s->proxy, buf, sizeof( buf ) ) ) > 0 )
+				{
+					bytes_recv += (unsigned long int) n;
+					progress = now;
+					s->heard = 1;
+				}
+				else if ( !n || errno != EAGAIN )
+				{
+					close( s->proxy );
+					s->proxy = -1;
+					s->to_proxy.length = 0;
+				}
+			}
+
+			if ( s->mud >= 0 && FD_ISSET( s->mud, &in_set ) )
+			{
+				if ( ( n = read( s->mud, buf, sizeof( buf ) ) ) > 0 )
+				{
+					bytes_recv += (unsigned long int) n;
+					progress = now;
+				}
+				else if ( !n || errno != EAGAIN )
+				{
+					/* The proxy hung up on the game; nothing more can go there. */
+					close( s->mud );
+					s->mud = -1;
+					s->to_mud.length = 0;
+				}
+			}
+
+			/* With both connections gone there is nothing left to play. */
+			if ( !s->done && ( played( s ) || ( s->started && s->proxy < 0 && s->mud < 0 ) ) )
+				finish( s );
+		}
+	}
+}
+
+
+/* The next event waits for the proxy to speak first. */
+static int held( const SESSION *s )
+{
+	return s->events[ s->next ].kind == REC_CLIENT && s->quiet && !s->heard && s->proxy >= 0;
+}
+
+
+/* Everything went out, to a game connection too if there was to be one. */
+static int played( const SESSION *s )
+{
+	return s->started && s->next == s->count && !s->to_proxy.length
+		&& ( s->mud < 0 ? !s->wants_mud : !s->to_mud.length );
+}
+
+
+static void start( SESSION *s )
+{
+	struct addrinfo *a;
+
+	s->started = 1;
+
+	for ( a = proxy_addr; a; a = a->ai_next )
+	{
+		if ( ( s->proxy = socket( a->ai_family, a->ai_socktype, a->ai_protocol ) ) < 0 )
+			continue;
+
+		fcntl( s->proxy, F_SETFL, O_NONBLOCK );
+
+		if ( !connect( s->proxy, a->ai_addr, a->ai_addrlen ) || errno == EINPROGRESS )
+			return;
+
+		close( s->proxy );
+		s->proxy = -1;
+	}
+
+	fprintf( stderr, "wlreplay: %s: cannot connect to the proxy.\n", s->file );
+
+	return;
+}
+
+
+static void pair( SESSION *s, int fd )
+{
+	s->wants_mud = 0;
+	s->mud = fd;
+
+	return;
+}
+
+
+static void finish( SESSION *s )
+{
+	size_t i;
+	int j;
+
+	for ( j = 0; j < waiting_count; j++ )
+		if ( waiting[ j ] == s )
+			memmove( waiting + j, waiting + j + 1,
+					 (size_t) ( --waiting_count - j ) * sizeof( SESSION * ) );
+
+	if ( s->proxy >= 0 )
+		close( s->proxy );
+
+	if ( s->mud >= 0 )
+		close( s->mud );
+
+	for ( i = 0; i < s->count; i++ )
+		free( s->events[ i ].data );
+
+	free( s->events );
+	free( s->to_proxy.data );
+	free( s->to_mud.data );
+	s->events = NULL;
+	s->proxy = s->mud = -1;
+	s->done = 1;
+
+	return;
+}
+
+
+/* Returns 0 once the socket is of no more use. */
+static int drain( int fd, BUFFER *b )
+{
+	ssize_t n = write( fd, b->data, b->length );
+
+	if ( n < 0 )
+		return errno == EAGAIN || errno == EINTR;
+
+	bytes_sent += (unsigned long int) n;
+	b->length -= (size_t) n;
+	memmove( b->data, b->data + n, b->length );
+
+	return 1;
+}
+
+
+static void append( BUFFER *b, const char *data, size_t length )
+{
+	if ( b->length + length > b->size )
+	{
+		b->size = ( b->length + length ) * 2;
+		b->data = realloc( b->data, b->size );
+	}
+
+	memcpy( b->data + b->length, data, length );
+	b->length += length;
+
+	return;
+}
+
+
+static int listen_on( int port )
+{
+	struct sockaddr_in6 sa;
+	int fd, one = 1;
+
+	if ( ( fd = socket( AF_INET6, SOCK_STREAM, 0 ) ) < 0 )
+	{
+		perror( "wlreplay: socket" );
+		return -1;
+	}
+
+	setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one ) );
+	memset( &sa, 0, sizeof( sa ) );
+	sa.sin6_family = AF_INET6;
+	sa.sin6_addr = in6addr_any;
+	sa.sin6_port = htons( (unsigned short int) port );
+
+	if ( bind( fd, (struct sockaddr *) &sa, sizeof( sa ) ) < 0 || listen( fd, 64 ) < 0 )
+	{
+		perror( "wlreplay: game port" );
+		close( fd );
+		return -1;
+	}
+
+	fcntl( fd, F_SETFL, O_NONBLOCK );
+
+	return fd;
+}